@@ -3,6 +3,7 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <string.h>
+#include <utility>
 #include <vector>
 
 #include <arch/dma_structs.hpp>
@@ -67,10 +68,17 @@ enum {
 	DEVICE_NEEDS_RESET = 64
 };
 
+// Feature bits that are handled by virtio_core::Queue.
+enum {
+	VIRTIO_RING_F_INDIRECT_DESC = 28,
+	VIRTIO_RING_F_EVENT_IDX = 29
+};
+
 enum {
 	// Bits of the spec::Descriptor::flags field.
 	VIRTQ_DESC_F_NEXT = 1, // descriptor is part of a chain
 	VIRTQ_DESC_F_WRITE = 2, // buffer is written by device
+	VIRTQ_DESC_F_INDIRECT = 4, // buffer contains a table of descriptors
 
 	// Bits of the spec::UsedRing::flags field.
 	VIRTQ_USED_F_NO_NOTIFY = 1 // no need to notify the device
@@ -158,6 +166,7 @@ struct Transport {
 
 	virtual bool checkDeviceFeature(unsigned int feature) = 0;
 	virtual void acknowledgeDriverFeature(unsigned int feature) = 0;
+	virtual bool checkDriverFeature(unsigned int feature) = 0;
 	virtual void finalizeFeatures() = 0;
 
 	virtual void claimQueues(unsigned int max_index) = 0;
@@ -237,7 +246,12 @@ struct Handle {
 
 	void setupLink(Handle other);
 
+	// Turns this descriptor into a reference to an indirect descriptor table.
+	void setupIndirect(uintptr_t physical, size_t num_descriptors);
+
 private:
+	friend struct IndirectChain;
+
 	Queue *_queue;
 	size_t _tableIndex;
 };
@@ -277,22 +291,69 @@ private:
 	Handle _back;
 };
 
+// Helper class to create descriptor chains that occupy only a single descriptor
+// of the virtq. Only available if VIRTIO_RING_F_INDIRECT_DESC was negotiated.
+struct IndirectChain {
+	IndirectChain(Handle head);
+
+	IndirectChain(const IndirectChain &) = delete;
+
+	IndirectChain &operator= (const IndirectChain &) = delete;
+
+	Handle front() {
+		return _head;
+	}
+
+	size_t size() {
+		return _size;
+	}
+
+	// Appends a descriptor for a buffer that is contiguous in physical memory.
+	void append(HostToDeviceType, uintptr_t physical, size_t length);
+	void append(DeviceToHostType, uintptr_t physical, size_t length);
+
+	// Note the remarks on Handle::setupBuffer().
+	void append(HostToDeviceType, arch::dma_buffer_view view);
+	void append(DeviceToHostType, arch::dma_buffer_view view);
+
+private:
+	void _append(uintptr_t physical, size_t length, uint16_t flags);
+
+	Handle _head;
+	spec::Descriptor *_table;
+	uintptr_t _tablePhysical;
+	size_t _size = 0;
+};
+
 // Helper functions that obtain descriptor from a queue as needed.
 async::result<void> scatterGather(HostToDeviceType, Chain &chain, Queue *queue,
 		arch::dma_buffer_view view);
 async::result<void> scatterGather(DeviceToHostType, Chain &chain, Queue *queue,
 		arch::dma_buffer_view view);
 
+// Variants for indirect chains. These merge physically contiguous pages.
+void scatterGather(HostToDeviceType, IndirectChain &chain, arch::dma_buffer_view view);
+void scatterGather(DeviceToHostType, IndirectChain &chain, arch::dma_buffer_view view);
+
 struct Request {
 	void (*complete)(Request *);
+
+	// Number of bytes that the device wrote to the descriptor chain.
+	// Set by Queue::processInterrupt() before complete() is called.
+	uint32_t written = 0;
 };
 
 // Represents a single virtq.
 struct Queue {
 	friend struct Handle;
+	friend struct IndirectChain;
+
+	// Maximal number of descriptors in an indirect descriptor table.
+	static constexpr size_t maxIndirectDescriptors = 128;
 
 	Queue(unsigned int queue_index, size_t queue_size, spec::Descriptor *table,
-			spec::AvailableRing *available, spec::UsedRing *used);
+			spec::AvailableRing *available, spec::UsedRing *used,
+			bool indirect_descriptors, bool event_index);
 protected:
 	~Queue() = default;
 
@@ -306,8 +367,15 @@ public:
 		return _queueSize;
 	}
 
+	// Returns true if IndirectChain can be used with this virtq.
+	bool supportsIndirect() {
+		return _indirectDescriptors;
+	}
+
 	// Allocates a single descriptor.
 	// The descriptor is automatically freed when the device returns it.
+	// If no descriptors are available, this notifies the device about
+	// all descriptors that were posted but not yet notified.
 	async::result<Handle> obtainDescriptor();
 
 	// Posts a descriptor to the virtq's available ring.
@@ -315,6 +383,9 @@ public:
 			void (*complete)(Request *));
 
 	// Notifies the device that new descriptors have been posted.
+	// With VIRTIO_RING_F_EVENT_IDX, the notification is skipped if the device
+	// did not ask for it (e.g., because it is still processing earlier descriptors).
+	// Hence, callers can batch multiple postDescriptor() calls into a single notify().
 	void notify();
 
 	async::result<void> submitDescriptor(Handle descriptor) {
@@ -341,6 +412,9 @@ protected:
 	virtual void notifyTransport() = 0;
 
 private:
+	// Returns the indirect descriptor table that belongs to a descriptor.
+	std::pair<spec::Descriptor *, uintptr_t> _indirectTable(size_t table_index);
+
 	// Index of this queue as part of its owning device.
 	unsigned int _queueIndex;
 
@@ -363,6 +437,17 @@ private:
 
 	// Keeps track of which entries in the used ring have already been processed.
 	uint16_t _progressHead;
+
+	// Negotiated features.
+	bool _indirectDescriptors;
+	bool _eventIndex;
+
+	// Value of the available ring's head index at the time of the last notification.
+	uint16_t _notifiedHead;
+
+	// Indirect descriptor tables (allocated on first use) and their physical addresses.
+	std::vector<spec::Descriptor *> _indirectTables;
+	std::vector<uintptr_t> _indirectPhysicals;
 };
 
 } // namespace virtio_core
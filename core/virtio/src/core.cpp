@@ -2,9 +2,11 @@
 #include <assert.h>
 #include <iostream>
 #include <optional>
+#include <tuple>
 
 #include <core/virtio/core.hpp>
 #include <fafnir/dsl.hpp>
+#include <helix/memory.hpp>
 #include <protocols/kernlet/compiler.hpp>
 
 namespace virtio_core {
@@ -92,6 +94,7 @@ struct LegacyPciTransport : Transport {
 
 	bool checkDeviceFeature(unsigned int feature) override;
 	void acknowledgeDriverFeature(unsigned int feature) override;
+	bool checkDriverFeature(unsigned int feature) override;
 	void finalizeFeatures() override;
 
 	void claimQueues(unsigned int max_index) override;
@@ -112,7 +115,8 @@ private:
 struct LegacyPciQueue final : Queue {
 	LegacyPciQueue(LegacyPciTransport *transport,
 			unsigned int queue_index, size_t queue_size,
-			spec::Descriptor *table, spec::AvailableRing *available, spec::UsedRing *used);
+			spec::Descriptor *table, spec::AvailableRing *available, spec::UsedRing *used,
+			bool indirect_descriptors, bool event_index);
 
 protected:
 	void notifyTransport() override;
@@ -153,6 +157,12 @@ void LegacyPciTransport::acknowledgeDriverFeature(unsigned int feature) {
 	_legacySpace.store(PCI_L_DRIVER_FEATURES, current | (1 << feature));
 }
 
+bool LegacyPciTransport::checkDriverFeature(unsigned int feature) {
+	if(feature >= 32)
+		return false;
+	return _legacySpace.load(PCI_L_DRIVER_FEATURES) & (1 << feature);
+}
+
 void LegacyPciTransport::finalizeFeatures() {
 	// Does nothing for now.
 }
@@ -199,7 +209,9 @@ Queue *LegacyPciTransport::setupQueue(unsigned int queue_index) {
 	auto available = reinterpret_cast<spec::AvailableRing *>((char *)window + available_offset);
 	auto used = reinterpret_cast<spec::UsedRing *>((char *)window + used_offset);
 	_queues[queue_index] = std::make_unique<LegacyPciQueue>(this, queue_index, queue_size,
-			table, available, used);
+			table, available, used,
+			checkDriverFeature(VIRTIO_RING_F_INDIRECT_DESC),
+			checkDriverFeature(VIRTIO_RING_F_EVENT_IDX));
 
 	// Hand the queue to the device.
 	uintptr_t table_physical;
@@ -250,8 +262,10 @@ async::detached LegacyPciTransport::_processIrqs() {
 
 LegacyPciQueue::LegacyPciQueue(LegacyPciTransport *transport,
 		unsigned int queue_index, size_t queue_size,
-		spec::Descriptor *table, spec::AvailableRing *available, spec::UsedRing *used)
-: Queue{queue_index, queue_size, table, available, used}, _transport{transport} { }
+		spec::Descriptor *table, spec::AvailableRing *available, spec::UsedRing *used,
+		bool indirect_descriptors, bool event_index)
+: Queue{queue_index, queue_size, table, available, used,
+		indirect_descriptors, event_index}, _transport{transport} { }
 
 void LegacyPciQueue::notifyTransport() {
 	_transport->_legacySpace.store(PCI_L_QUEUE_NOTIFY, queueIndex());
@@ -289,6 +303,7 @@ struct StandardPciTransport : Transport {
 
 	bool checkDeviceFeature(unsigned int feature) override;
 	void acknowledgeDriverFeature(unsigned int feature) override;
+	bool checkDriverFeature(unsigned int feature) override;
 	void finalizeFeatures() override;
 
 	void claimQueues(unsigned int max_index) override;
@@ -323,6 +338,7 @@ struct StandardPciQueue final : Queue {
 	StandardPciQueue(StandardPciTransport *transport,
 			unsigned int queue_index, size_t queue_size,
 			spec::Descriptor *table, spec::AvailableRing *available, spec::UsedRing *used,
+			bool indirect_descriptors, bool event_index,
 			arch::scalar_register<uint16_t> notify_register);
 
 protected:
@@ -370,6 +386,11 @@ void StandardPciTransport::acknowledgeDriverFeature(unsigned int feature) {
 	_commonSpace().store(PCI_DRIVER_FEATURE_WINDOW, current | bit);
 }
 
+bool StandardPciTransport::checkDriverFeature(unsigned int feature) {
+	_commonSpace().store(PCI_DRIVER_FEATURE_SELECT, feature >> 5);
+	return _commonSpace().load(PCI_DRIVER_FEATURE_WINDOW) & (uint32_t(1) << (feature & 31));
+}
+
 void StandardPciTransport::finalizeFeatures() {
 	assert(checkDeviceFeature(32));
 	acknowledgeDriverFeature(32);
@@ -423,6 +444,8 @@ Queue *StandardPciTransport::setupQueue(unsigned int queue_index) {
 	auto used = reinterpret_cast<spec::UsedRing *>((char *)window + used_offset);
 	_queues[queue_index] = std::make_unique<StandardPciQueue>(this, queue_index, queue_size,
 			table, available, used,
+			checkDriverFeature(VIRTIO_RING_F_INDIRECT_DESC),
+			checkDriverFeature(VIRTIO_RING_F_EVENT_IDX),
 			arch::scalar_register<uint16_t>{_notifyMultiplier * notify_index});
 
 	// Hand the queue to the device.
@@ -579,8 +602,10 @@ async::detached StandardPciTransport::_processQueueMsi() {
 StandardPciQueue::StandardPciQueue(StandardPciTransport *transport,
 		unsigned int queue_index, size_t queue_size,
 		spec::Descriptor *table, spec::AvailableRing *available, spec::UsedRing *used,
+		bool indirect_descriptors, bool event_index,
 		arch::scalar_register<uint16_t> notify_register)
-: Queue{queue_index, queue_size, table, available, used},
+: Queue{queue_index, queue_size, table, available, used,
+		indirect_descriptors, event_index},
 		_transport{transport}, _notifyRegister{notify_register} { }
 
 void StandardPciQueue::notifyTransport() {
@@ -732,6 +757,112 @@ void Handle::setupLink(Handle other) {
 	descriptor->flags.store(descriptor->flags.load() | VIRTQ_DESC_F_NEXT);
 }
 
+void Handle::setupIndirect(uintptr_t physical, size_t num_descriptors) {
+	auto descriptor = _queue->_table + _tableIndex;
+	descriptor->address.store(physical);
+	descriptor->length.store(num_descriptors * sizeof(spec::Descriptor));
+	descriptor->flags.store(VIRTQ_DESC_F_INDIRECT);
+}
+
+// --------------------------------------------------------
+// IndirectChain
+// --------------------------------------------------------
+
+IndirectChain::IndirectChain(Handle head)
+: _head{head} {
+	assert(_head._queue->supportsIndirect());
+	std::tie(_table, _tablePhysical) = _head._queue->_indirectTable(_head._tableIndex);
+}
+
+void IndirectChain::append(HostToDeviceType, uintptr_t physical, size_t length) {
+	_append(physical, length, 0);
+}
+
+void IndirectChain::append(DeviceToHostType, uintptr_t physical, size_t length) {
+	_append(physical, length, VIRTQ_DESC_F_WRITE);
+}
+
+void IndirectChain::append(HostToDeviceType, arch::dma_buffer_view view) {
+	uintptr_t physical;
+	HEL_CHECK(helPointerPhysical(view.data(), &physical));
+	_append(physical, view.size(), 0);
+}
+
+void IndirectChain::append(DeviceToHostType, arch::dma_buffer_view view) {
+	uintptr_t physical;
+	HEL_CHECK(helPointerPhysical(view.data(), &physical));
+	_append(physical, view.size(), VIRTQ_DESC_F_WRITE);
+}
+
+void IndirectChain::_append(uintptr_t physical, size_t length, uint16_t flags) {
+	assert(length);
+	assert(_size < Queue::maxIndirectDescriptors);
+
+	if(_size) {
+		auto previous = _table + (_size - 1);
+		previous->next.store(_size);
+		previous->flags.store(previous->flags.load() | VIRTQ_DESC_F_NEXT);
+	}
+
+	auto descriptor = _table + _size;
+	descriptor->address.store(physical);
+	descriptor->length.store(length);
+	descriptor->flags.store(flags);
+	descriptor->next.store(0);
+	_size++;
+
+	_head.setupIndirect(_tablePhysical, _size);
+}
+
+namespace {
+
+void scatterGatherIndirect(IndirectChain &chain, arch::dma_buffer_view view, bool to_host) {
+	constexpr size_t page_size = 0x1000;
+	if(!view.size())
+		return;
+
+	// Resolve all pages at once; this is much cheaper than one syscall per page.
+	auto address = reinterpret_cast<uintptr_t>(view.data());
+	auto misalign = address & (page_size - 1);
+	size_t num_pages = (misalign + view.size() + page_size - 1) / page_size;
+	std::vector<uintptr_t> physicals(num_pages);
+	helix::rangeToPhysical(address & ~(page_size - 1), num_pages, physicals.data());
+
+	uintptr_t run_physical = physicals[0] + misalign;
+	size_t run_length = std::min(view.size(), page_size - misalign);
+	size_t offset = run_length;
+	for(size_t i = 1; i < num_pages; i++) {
+		auto chunk = std::min(view.size() - offset, page_size);
+		if(physicals[i] == run_physical + run_length) {
+			run_length += chunk;
+		}else{
+			if(to_host)
+				chain.append(deviceToHost, run_physical, run_length);
+			else
+				chain.append(hostToDevice, run_physical, run_length);
+			run_physical = physicals[i];
+			run_length = chunk;
+		}
+		offset += chunk;
+	}
+	assert(offset == view.size());
+
+	if(to_host)
+		chain.append(deviceToHost, run_physical, run_length);
+	else
+		chain.append(hostToDevice, run_physical, run_length);
+}
+
+} // anonymous namespace
+
+void scatterGather(HostToDeviceType, IndirectChain &chain, arch::dma_buffer_view view) {
+	scatterGatherIndirect(chain, view, false);
+}
+
+void scatterGather(DeviceToHostType, IndirectChain &chain, arch::dma_buffer_view view) {
+	scatterGatherIndirect(chain, view, true);
+}
+
 async::result<void> scatterGather(HostToDeviceType, Chain &chain, Queue *queue,
 		arch::dma_buffer_view view) {
 	constexpr size_t page_size = 0x1000;
@@ -763,8 +894,11 @@ async::result<void> scatterGather(DeviceToHostType, Chain &chain, Queue *queue,
 // --------------------------------------------------------
 
 Queue::Queue(unsigned int queue_index, size_t queue_size, spec::Descriptor *table,
-		spec::AvailableRing *available, spec::UsedRing *used)
-: _queueIndex{queue_index}, _queueSize{queue_size}, _progressHead{0} {
+		spec::AvailableRing *available, spec::UsedRing *used,
+		bool indirect_descriptors, bool event_index)
+: _queueIndex{queue_index}, _queueSize{queue_size}, _progressHead{0},
+		_indirectDescriptors{indirect_descriptors}, _eventIndex{event_index},
+		_notifiedHead{0} {
 	// Construct the hardware state.
 	_table = new (table) spec::Descriptor[_queueSize];
 	_availableRing = new (available) spec::AvailableRing;
@@ -791,11 +925,49 @@ Queue::Queue(unsigned int queue_index, size_t queue_size, spec::Descriptor *tabl
 	for(size_t i = 0; i < _queueSize; i++)
 		_descriptorStack.push_back(i);
 	_activeRequests.resize(_queueSize);
+	if(_indirectDescriptors) {
+		_indirectTables.resize(_queueSize, nullptr);
+		_indirectPhysicals.resize(_queueSize, 0);
+	}
+}
+
+std::pair<spec::Descriptor *, uintptr_t> Queue::_indirectTable(size_t table_index) {
+	constexpr size_t page_size = 0x1000;
+	constexpr size_t table_size = maxIndirectDescriptors * sizeof(spec::Descriptor);
+	constexpr size_t tables_per_page = page_size / table_size;
+	static_assert(tables_per_page >= 1);
+
+	// Tables are allocated one page at a time and never freed.
+	if(!_indirectTables[table_index]) {
+		auto first = table_index & ~(tables_per_page - 1);
+
+		HelHandle memory;
+		void *window;
+		HEL_CHECK(helAllocateMemory(page_size, 0, nullptr, &memory));
+		HEL_CHECK(helMapMemory(memory, kHelNullHandle, nullptr,
+				0, page_size, kHelMapProtRead | kHelMapProtWrite, &window));
+		HEL_CHECK(helCloseDescriptor(kHelThisUniverse, memory));
+
+		uintptr_t physical;
+		HEL_CHECK(helPointerPhysical(window, &physical));
+
+		for(size_t i = 0; i < tables_per_page && first + i < _queueSize; i++) {
+			_indirectTables[first + i] = new (reinterpret_cast<char *>(window) + i * table_size)
+					spec::Descriptor[maxIndirectDescriptors];
+			_indirectPhysicals[first + i] = physical + i * table_size;
+		}
+	}
+
+	return {_indirectTables[table_index], _indirectPhysicals[table_index]};
 }
 
 async::result<Handle> Queue::obtainDescriptor() {
 	while(true) {
 		if(_descriptorStack.empty()) {
+			// Descriptors that were posted but not notified yet might
+			// never complete otherwise.
+			if(_availableRing->headIndex.load() != _notifiedHead)
+				notify();
 			co_await _descriptorDoorbell.async_wait();
 			continue;
 		}
@@ -829,6 +1001,21 @@ void Queue::postDescriptor(Handle handle, Request *request,
 }
 
 void Queue::notify() {
+	auto head = _availableRing->headIndex.load();
+	auto previous = _notifiedHead;
+	_notifiedHead = head;
+
+	if(_eventIndex) {
+		// The index store must be visible before we read the device's event index.
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+		// Notify only if the device's event index lies in [previous, head).
+		auto event = _usedExtra->eventIndex.load();
+		if(static_cast<uint16_t>(head - event - 1) < static_cast<uint16_t>(head - previous))
+			notifyTransport();
+		return;
+	}
+
 	asm volatile ( "" : : : "memory" );
 	if(!(_usedRing->flags.load() & VIRTQ_USED_F_NO_NOTIFY))
 		notifyTransport();
@@ -838,8 +1025,21 @@ void Queue::processInterrupt() {
 	while(true) {
 		auto used_head = _usedRing->headIndex.load();
 
-		if((_progressHead & 0xFFFF) == used_head)
-			break;
+		if((_progressHead & 0xFFFF) == used_head) {
+			if(!_eventIndex)
+				break;
+
+			// Ask for an interrupt on the next used descriptor. The device only
+			// interrupts once it crosses this index, so completions that arrive
+			// while we are still draining the ring do not raise further IRQs.
+			_availableExtra->eventIndex.store(_progressHead);
+			__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+			// Recheck to avoid missing completions that raced with the store above.
+			if(_usedRing->headIndex.load() == (_progressHead & 0xFFFF))
+				break;
+			continue;
+		}
 
 		asm volatile ( "" : : : "memory" );
 
@@ -853,6 +1053,7 @@ void Queue::processInterrupt() {
 		_activeRequests[table_index] = nullptr;
 
 		// Free all descriptors in the descriptor chain.
+		// Indirect chains only occupy a single descriptor (without VIRTQ_DESC_F_NEXT).
 		auto chain_index = table_index;
 		while(_table[chain_index].flags.load() & VIRTQ_DESC_F_NEXT) {
 			auto successor = _table[chain_index].next.load();
@@ -863,6 +1064,7 @@ void Queue::processInterrupt() {
 		_descriptorDoorbell.raise();
 
 		// Call the completion handler.
+		request->written = _usedRing->elements[ring_index].written.load();
 		request->complete(request);
 
 		_progressHead++;
@@ -15,8 +15,8 @@ Command::Command(uint64_t sector, size_t numSectors, size_t numBytes, void *buff
 		CommandType type) : sector_{sector}, numSectors_{numSectors}, numBytes_{numBytes},
 	buffer_{buffer}, type_{type}, event_{} {
 
-	// TODO: Requests larger than 64k need to be split
-	assert(numBytes < 65536);
+	// Larger requests are split by libblockfs, see Port::maxTransferSectors().
+	assert(numBytes <= 65536);
 
 	if (logCommands) {
 		printf("block/ahci: queueing %zu byte %s to %p at sector %" PRIu64 "\n",
@@ -33,7 +33,7 @@ void Command::notifyCompletion() {
 	event_.raise();
 }
 
-void Command::prepare(commandTable& table, commandHeader& header) {
+void Command::prepare(commandTable& table, commandHeader& header, bool ncq, size_t tag) {
 	auto tablePhys = helix::ptrToPhysical(&table);
 	assert(tablePhys < std::numeric_limits<uint32_t>::max() &&
 			numSectors_ < std::numeric_limits<uint16_t>::max());
@@ -72,10 +72,29 @@ void Command::prepare(commandTable& table, commandHeader& header) {
 		case CommandType::identify:
 			table.commandFis.command = 0xEC; // IDENTIFY DEVICE
 			break;
+		case CommandType::readNcqErrorLog:
+			table.commandFis.command = 0x2F; // READ LOG EXT
+			table.commandFis.lba0 = 0x10; // Log address: NCQ Command Error
+			table.commandFis.lba1 = 0; // Page number
+			table.commandFis.devHead = 0;
+			table.commandFis.sectorCount = 1; // Number of 512-byte log pages
+			break;
 		default:
 			assert(!"unknown command type");
 	}
 
+	if (ncq && (type_ == CommandType::read || type_ == CommandType::write)) {
+		assert(tag < limits::maxCmdSlots);
+
+		// READ/WRITE FPDMA QUEUED move the sector count to the features field
+		// and carry the tag in bits 7:3 of the count field (ACS-3 7.20, 7.61).
+		table.commandFis.command = type_ == CommandType::read ? 0x60 : 0x61;
+		table.commandFis.features = numSectors_ & 0xFF;
+		table.commandFis.featuresUpper = (numSectors_ >> 8) & 0xFF;
+		table.commandFis.sectorCount = static_cast<uint16_t>(tag << 3);
+		table.commandFis.devHead = 1 << 6; // LBA bit; FUA is bit 7
+	}
+
 	if (logCommands) {
 		printf("block/ahci: submitting %zu byte %s to %p at sector %" PRIu64 "\n",
 				numBytes_, cmdTypeToString(type_), buffer_, sector_);
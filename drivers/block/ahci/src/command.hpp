@@ -7,7 +7,8 @@
 enum class CommandType {
 	read,
 	write,
-	identify
+	identify,
+	readNcqErrorLog
 };
 
 struct Command {
@@ -22,9 +23,33 @@ public:
 		assert(type == CommandType::identify);
 	}
 
-	void prepare(commandTable& table, commandHeader& header);
+	Command(ncqErrorLog *buffer, CommandType type)
+		: Command(0, 0, sizeof(ncqErrorLog), reinterpret_cast<void *>(buffer), type) {
+		assert(type == CommandType::readNcqErrorLog);
+	}
+
+	// If ncq is true, read and write commands are issued as FPDMA QUEUED with the given tag.
+	void prepare(commandTable& table, commandHeader& header, bool ncq = false, size_t tag = 0);
 	void notifyCompletion(); 
 
+	// Marks the command as failed. The caller still needs to call notifyCompletion().
+	void setFailed() {
+		failed_ = true;
+	}
+
+	bool failed() const {
+		return failed_;
+	}
+
+	CommandType getType() const {
+		return type_;
+	}
+
+	// Counts the number of times this command was retried due to an error.
+	unsigned int bumpRetries() {
+		return ++retries_;
+	}
+
 	auto getFuture() {
 		return event_.wait();
 	}
@@ -38,6 +63,8 @@ private:
 	size_t numBytes_;
 	void *buffer_;
 	CommandType type_;
+	bool failed_ = false;
+	unsigned int retries_ = 0;
 	async::oneshot_event event_;
 };
 
@@ -49,6 +76,8 @@ constexpr const char *cmdTypeToString(CommandType type) {
 			return "write";
 		case CommandType::identify:
 			return "identify";
+		case CommandType::readNcqErrorLog:
+			return "read NCQ error log";
 		default:
 			assert(!"unknown command type");
 	}
@@ -1,4 +1,6 @@
 #include <inttypes.h>
+#include <stdexcept>
+#include <vector>
 
 #include <helix/memory.hpp>
 #include <helix/timer.hpp>
@@ -15,7 +17,9 @@ namespace regs {
 	constexpr arch::scalar_register<uint32_t> commandAndStatus{0x18};
 	constexpr arch::scalar_register<uint32_t> tfd{0x20};
 	constexpr arch::scalar_register<uint32_t> status{0x28};
+	constexpr arch::scalar_register<uint32_t> sControl{0x2C};
 	constexpr arch::scalar_register<uint32_t> sErr{0x30};
+	constexpr arch::scalar_register<uint32_t> sActive{0x34};
 	constexpr arch::scalar_register<uint32_t> commandIssue{0x38};
 }
 
@@ -35,24 +39,33 @@ namespace flags {
 		constexpr int hostDataError   = 1 << 28;
 		constexpr int ifFatalError    = 1 << 27;
 		constexpr int ifNonFatalError = 1 << 26;
+		constexpr int setDeviceBits   = 1 << 3;
 		constexpr int d2hFis          = 1;
+
+		constexpr int anyError = taskFileError | hostFatalError | hostDataError | ifFatalError;
 	}
 
 	namespace tfd {
 		constexpr int bsy = 1 << 7;
 		constexpr int drq = 1 << 3;
+		constexpr int err = 1;
 	}
 }
 
 namespace {
 	constexpr size_t sectorSize = 512;
 	constexpr bool logCommands  = false;
+
+	// Number of times a failing command is retried before it is reported as failed.
+	constexpr unsigned int maxRetries = 3;
 }
 
 // TODO: We can use a more appropriate block size, but this breaks other parts of the OS.
-Port::Port(int64_t parentId, int portIndex, size_t numCommandSlots, bool staggeredSpinUp, arch::mem_space regs)
+Port::Port(int64_t parentId, int portIndex, size_t numCommandSlots, bool staggeredSpinUp,
+		bool hbaSupportsNcq, arch::mem_space regs)
 	: BlockDevice{::sectorSize, parentId},  regs_{regs}, numCommandSlots_{numCommandSlots},
-	commandsInFlight_{0}, portIndex_{portIndex}, staggeredSpinUp_{staggeredSpinUp} {
+	commandsInFlight_{0}, portIndex_{portIndex}, staggeredSpinUp_{staggeredSpinUp},
+	hbaSupportsNcq_{hbaSupportsNcq} {
 
 }
 
@@ -149,13 +162,7 @@ async::detached Port::run() {
 
 	arch::dma_object<identifyDevice> identify{nullptr};
 	Command cmd = Command(identify.data(), CommandType::identify);
-	cmd.prepare(commandTables_[slot], commandList_->slots[slot]);
-
-	regs_.store(regs::commandIssue, 1 << slot);
-
-	// Just poll for completion for simplicity
-	auto success = co_await helix::kindaBusyWait(500'000'000,
-			[&](){ return !(regs_.load(regs::commandIssue) & (1 << slot)); });
+	auto success = co_await issuePolled_(cmd, slot);
 	assert(success);
 
 	assert(identify->supportsLba48());
@@ -163,9 +170,16 @@ async::detached Port::run() {
 	auto sectorCount = identify->maxLBA48;
 	auto model = identify->getModel();
 
+	// With NCQ, the tag of a command is its slot index; the device limits the number of tags.
+	if (hbaSupportsNcq_ && identify->supportsNcq()) {
+		useNcq_ = true;
+		numCommandSlots_ = std::min(numCommandSlots_, identify->getQueueDepth());
+	}
+
 	printf("block/ahci: Started port %d, model %s, logical sector size %zu, "
-			"physical sector size %zu, sector count %" PRIu64 "\n",
-			portIndex_, model.c_str(), logicalSize, physicalSize, sectorCount);
+			"physical sector size %zu, sector count %" PRIu64 ", NCQ %s (depth %zu)\n",
+			portIndex_, model.c_str(), logicalSize, physicalSize, sectorCount,
+			useNcq_ ? "yes" : "no", numCommandSlots_);
 	assert(logicalSize == 512 && "block/ahci: logical sector size > 512 is not supported");
 
 	// Clear errors
@@ -177,6 +191,7 @@ async::detached Port::run() {
 	auto ie = regs_.load(regs::interruptEnable);
 	regs_.store(regs::interruptEnable, ie
 			| flags::is::d2hFis
+			| flags::is::setDeviceBits
 			| flags::is::taskFileError
 			| flags::is::hostDataError
 			| flags::is::hostFatalError
@@ -190,7 +205,7 @@ async::detached Port::run() {
 }
 
 async::result<size_t> Port::findFreeSlot_() {
-	while (commandsInFlight_ >= numCommandSlots_) {
+	while (recovering_ || commandsInFlight_ >= numCommandSlots_) {
 		if (logCommands) {
 			printf("block/ahci: submission queue full, waiting...\n");
 		}
@@ -214,12 +229,21 @@ async::result<size_t> Port::findFreeSlot_() {
 void Port::handleIrq() {
 	auto is = regs_.load(regs::interruptStatus);
 
-	// Check errors
-	// TODO: Make this more robust (log non-fatal errors, try to recover, print more state etc.)
-	if (is & (flags::is::hostFatalError | flags::is::ifFatalError)) {
-		printf("\e[31mblock/ahci: Port %d encountered fatal error, PxIS = %u, PxSERR = %u\e[39m\n",
-				portIndex_, is, regs_.load(regs::sErr));
-		abort();
+	// Recovery polls for its own commands and sorts out the in-flight ones.
+	if (recovering_) {
+		regs_.store(regs::interruptStatus, is);
+		return;
+	}
+
+	if (is & flags::is::ifNonFatalError) {
+		printf("block/ahci: Port %d encountered non-fatal interface error, PxSERR = %x\n",
+				portIndex_, regs_.load(regs::sErr));
+	}
+
+	if (is & flags::is::anyError) {
+		regs_.store(regs::interruptStatus, is);
+		recoverFromError_(is);
+		return;
 	}
 
 	if (logCommands) {
@@ -228,9 +252,10 @@ void Port::handleIrq() {
 				regs_.load(regs::commandIssue), regs_.load(regs::commandAndStatus));
 	}
 
-	// Notify all completed commands
+	// Notify all completed commands. NCQ commands are only done once
+	// the device clears their PxSACT bit (via a Set Device Bits FIS).
 	auto numCompleted = 0;
-	auto cmdActiveMask = regs_.load(regs::commandIssue);
+	auto cmdActiveMask = regs_.load(regs::commandIssue) | regs_.load(regs::sActive);
 	for (size_t i = 0; i < numCommandSlots_; i++) {
 		if (submittedCmds_[i] && !(cmdActiveMask & (1 << i))) {
 			Command *cmd = std::exchange(submittedCmds_[i], nullptr);
@@ -263,31 +288,185 @@ async::detached Port::submitPendingLoop_() {
 async::result<void> Port::submitCommand_(Command *cmd) {
 	auto slot = co_await findFreeSlot_();
 	assert(!(regs_.load(regs::commandIssue) & (1 << slot)));
+	assert(!(regs_.load(regs::sActive) & (1 << slot)));
 	assert(!submittedCmds_[slot]);
 
 	// Setup command table and FIS
-	cmd->prepare(commandTables_[slot], commandList_->slots[slot]);
+	cmd->prepare(commandTables_[slot], commandList_->slots[slot], useNcq_, slot);
 
-	// Issue command
+	// Issue command. For NCQ, PxSACT must be set before PxCI (AHCI 1.3.1, 5.3.2).
 	submittedCmds_[slot] = cmd;
 	commandsInFlight_++;
+	if (useNcq_)
+		regs_.store(regs::sActive, 1 << slot);
 	regs_.store(regs::commandIssue, 1 << slot);
 
 	co_return;
 }
 
-async::result<void> Port::readSectors(uint64_t sector, void *buffer, size_t numSectors) {
-	Command cmd{sector, numSectors, numSectors * sectorSize,
-			buffer, CommandType::read};
+// Issues a non-queued command and polls for its completion.
+// Only used during initialization and error recovery when no other commands are running.
+async::result<bool> Port::issuePolled_(Command &cmd, size_t slot) {
+	cmd.prepare(commandTables_[slot], commandList_->slots[slot]);
+	regs_.store(regs::commandIssue, 1 << slot);
+
+	auto success = co_await helix::kindaBusyWait(500'000'000, [&](){
+		return !(regs_.load(regs::commandIssue) & (1 << slot))
+				|| (regs_.load(regs::interruptStatus) & flags::is::taskFileError); });
+	if (!success || (regs_.load(regs::tfd) & flags::tfd::err)) {
+		printf("\e[31mblock/ahci: Port %d failed polled %s, PxTFD = %x\e[39m\n",
+				portIndex_, cmdTypeToString(cmd.getType()), regs_.load(regs::tfd));
+		co_return false;
+	}
+	co_return true;
+}
+
+async::result<bool> Port::stop_() {
+	auto cas = regs_.load(regs::commandAndStatus);
+	regs_.store(regs::commandAndStatus, cas & ~flags::cmd::start);
+
+	// Clearing PxCMD.ST also clears PxCI and PxSACT once PxCMD.CR is clear.
+	co_return co_await helix::kindaBusyWait(500'000'000, [&](){
+		return !(regs_.load(regs::commandAndStatus) & flags::cmd::cmdListRunning); });
+}
+
+async::result<bool> Port::start_() {
+	auto success = co_await helix::kindaBusyWait(1'000'000'000, [&](){
+		auto tfd = regs_.load(regs::tfd);
+		return !(tfd & flags::tfd::bsy) && !(tfd & flags::tfd::drq); });
+	if (!success)
+		co_return false;
+
+	auto cas = regs_.load(regs::commandAndStatus);
+	regs_.store(regs::commandAndStatus, cas | flags::cmd::start);
+	co_return true;
+}
+
+// Resets the link (AHCI 1.3.1, 10.4.2). The port must be stopped.
+async::result<void> Port::comReset_() {
+	printf("block/ahci: Port %d performing COMRESET\n", portIndex_);
+
+	auto sctl = regs_.load(regs::sControl);
+	regs_.store(regs::sControl, (sctl & ~0xF) | 1);
+	co_await helix::sleepFor(1'000'000); // At least 1ms.
+	regs_.store(regs::sControl, sctl & ~0xF);
+
+	auto success = co_await helix::kindaBusyWait(1'000'000'000, [&](){
+		return (regs_.load(regs::status) & 0xF) == 3; });
+	if (!success)
+		printf("\e[31mblock/ahci: Port %d did not come back after COMRESET\e[39m\n", portIndex_);
+
+	regs_.store(regs::sErr, ~0);
+}
+
+async::detached Port::recoverFromError_(uint32_t is) {
+	recovering_ = true;
+
+	auto ci = regs_.load(regs::commandIssue);
+	auto sact = regs_.load(regs::sActive);
+	auto cas = regs_.load(regs::commandAndStatus);
+	auto activeMask = ci | sact;
+
+	printf("\e[31mblock/ahci: Port %d encountered error, PxIS = %x, PxTFD = %x, PxSERR = %x, "
+			"PxCI = %x, PxSACT = %x\e[39m\n", portIndex_, is, regs_.load(regs::tfd),
+			regs_.load(regs::sErr), ci, sact);
+
+	// Stop the command engine and clear the error state.
+	bool stopped = co_await stop_();
+	regs_.store(regs::sErr, ~0);
+	regs_.store(regs::interruptStatus, ~0);
+
+	// The device needs a reset if it is still busy or the HBA gave up.
+	auto tfd = regs_.load(regs::tfd);
+	if (!stopped || (tfd & (flags::tfd::bsy | flags::tfd::drq))
+			|| (is & (flags::is::hostFatalError | flags::is::ifFatalError))) {
+		if (!stopped) {
+			// Clearing FRE and ST forces the HBA to stop (AHCI 1.3.1, 10.4.2).
+			regs_.store(regs::commandAndStatus,
+					regs_.load(regs::commandAndStatus) & ~flags::cmd::fisReceiveEnable);
+		}
+		co_await comReset_();
+		regs_.store(regs::commandAndStatus,
+				regs_.load(regs::commandAndStatus) | flags::cmd::fisReceiveEnable);
+	}
+
+	bool started = co_await start_();
+	if (!started)
+		printf("\e[31mblock/ahci: Port %d failed to restart, failing all commands\e[39m\n",
+				portIndex_);
+
+	// Determine which command caused the error. Reading the NCQ error log also
+	// makes the device abort all outstanding NCQ commands (SATA 3.2, 13.6.3.2).
+	uint32_t failedMask = 0;
+	if (started && (is & flags::is::taskFileError)) {
+		if (useNcq_) {
+			arch::dma_object<ncqErrorLog> log{nullptr};
+			Command logCmd{log.data(), CommandType::readNcqErrorLog};
+			if ((co_await issuePolled_(logCmd, 0)) && !log->isNonQueued()) {
+				failedMask = 1 << log->getTag();
+				printf("block/ahci: Port %d NCQ error on tag %zu, status %x, error %x\n",
+						portIndex_, log->getTag(), log->status, log->error);
+			}
+		} else {
+			failedMask = 1 << ((cas >> 8) & 0x1F); // PxCMD.CCS
+		}
+	}
+
+	// Without more information, blame all commands that were in flight.
+	if (!failedMask)
+		failedMask = activeMask;
+
+	regs_.store(regs::sErr, ~0);
+	regs_.store(regs::interruptStatus, ~0);
+
+	// Complete finished commands, retry the others.
+	std::vector<Command *> retry;
+	for (size_t i = 0; i < numCommandSlots_; i++) {
+		Command *cmd = std::exchange(submittedCmds_[i], nullptr);
+		if (!cmd)
+			continue;
+		commandsInFlight_--;
+
+		if (!(activeMask & (1 << i))) {
+			cmd->notifyCompletion();
+		} else if (!started || ((failedMask & (1 << i)) && cmd->bumpRetries() > maxRetries)) {
+			cmd->setFailed();
+			cmd->notifyCompletion();
+		} else {
+			retry.push_back(cmd);
+		}
+	}
+	assert(!commandsInFlight_);
+
+	// If the port did not come back, keep it blocked.
+	if (!started)
+		co_return;
+
+	recovering_ = false;
+	for (auto cmd : retry)
+		pendingCmdQueue_.put(cmd);
+	freeSlotDoorbell_.raise();
+}
+
+async::result<void> Port::transfer_(uint64_t sector, void *buffer, size_t numSectors,
+		CommandType type) {
+	Command cmd{sector, numSectors, numSectors * sectorSize, buffer, type};
 	pendingCmdQueue_.put(&cmd);
 	co_await cmd.getFuture();
+
+	if (cmd.failed()) {
+		printf("\e[31mblock/ahci: Port %d failed to %s %zu sectors at sector %" PRIu64 "\e[39m\n",
+				portIndex_, cmdTypeToString(type), numSectors, sector);
+		throw std::runtime_error("block/ahci: I/O error");
+	}
+}
+
+async::result<void> Port::readSectors(uint64_t sector, void *buffer, size_t numSectors) {
+	co_await transfer_(sector, buffer, numSectors, CommandType::read);
 }
 
 async::result<void> Port::writeSectors(uint64_t sector, const void *buffer, size_t numSectors) {
-	Command cmd{sector, numSectors, numSectors * sectorSize,
-			const_cast<void *>(buffer), CommandType::write};
-	pendingCmdQueue_.put(&cmd);
-	co_await cmd.getFuture();
+	co_await transfer_(sector, const_cast<void *>(buffer), numSectors, CommandType::write);
 }
 
 async::result<size_t> Port::getSize() {
@@ -16,7 +16,7 @@
 class Port : public blockfs::BlockDevice {
 public:
 	Port(int64_t parentId, int index, size_t numCommandSlots, bool staggeredSpinUp,
-			arch::mem_space regs);
+			bool hbaSupportsNcq, arch::mem_space regs);
 
 public:
 	async::result<bool> init();
@@ -27,14 +27,29 @@ public:
 	async::result<void> writeSectors(uint64_t sector, const void *buf, size_t numSectors) override;
 	async::result<size_t> getSize() override;
 
+	size_t queueDepth() override {
+		return numCommandSlots_;
+	}
+
+	// Bounded by the number of PRDT entries.
+	size_t maxTransferSectors() override {
+		return (commandTable::prdtEntries - 1) * 0x1000 / sectorSize;
+	}
+
 	int getIndex() const { return portIndex_; }
 
 private:
 	async::result<size_t> findFreeSlot_();
 	async::detached submitPendingLoop_();
 	async::result<void> submitCommand_(Command *cmd);
-	void start_();
-	void stop_();
+	async::result<bool> issuePolled_(Command &cmd, size_t slot);
+	async::result<void> transfer_(uint64_t sector, void *buf, size_t numSectors, CommandType type);
+
+	// Error recovery as described in AHCI 1.3.1, 6.2.2.
+	async::detached recoverFromError_(uint32_t is);
+	async::result<void> comReset_();
+	async::result<bool> start_();
+	async::result<bool> stop_();
 
 private:
 	// Mapping is owned by Controller
@@ -63,4 +78,11 @@ private:
 	size_t commandsInFlight_;
 	int portIndex_;
 	bool staggeredSpinUp_;
+	bool hbaSupportsNcq_;
+
+	// True if read and write commands are issued as FPDMA QUEUED.
+	bool useNcq_ = false;
+
+	// Set while the port is being recovered; no commands are issued in the meantime.
+	bool recovering_ = false;
 };
@@ -86,7 +86,10 @@ static_assert(sizeof(commandTable) == 128 + 16 * commandTable::prdtEntries);
 struct identifyDevice {
 	uint16_t _junkA[27];
 	uint16_t model[20];
-	uint16_t _junkB[36];
+	uint16_t _junkB[28];
+	uint16_t queueDepth;
+	uint16_t sataCapabilities;
+	uint16_t _junkG[6];
 	uint16_t capabilities;
 	uint16_t _junkC[16];
 	uint64_t maxLBA48;
@@ -139,5 +142,33 @@ struct identifyDevice {
 	bool supportsLba48() const {
 		return capabilities & (1 << 10);
 	}
+
+	bool supportsNcq() const {
+		return sataCapabilities != 0xFFFF && (sataCapabilities & (1 << 8));
+	}
+
+	// Maximal number of outstanding NCQ commands.
+	size_t getQueueDepth() const {
+		return (queueDepth & 0x1F) + 1;
+	}
 };
 static_assert(sizeof(identifyDevice) == 512);
+
+// NCQ Command Error log (log address 10h), see ACS-3 9.13.
+struct ncqErrorLog {
+	uint8_t tagInfo;
+	uint8_t _reservedA;
+	uint8_t status;
+	uint8_t error;
+	uint8_t _junkA[508];
+
+	// True if the error was not caused by a queued command.
+	bool isNonQueued() const {
+		return tagInfo & (1 << 7);
+	}
+
+	size_t getTag() const {
+		return tagInfo & 0x1F;
+	}
+};
+static_assert(sizeof(ncqErrorLog) == 512);
@@ -1,80 +1,140 @@
 #include <arch/bit.hpp>
 #include <helix/memory.hpp>
+#include <string.h>
 #include <unistd.h>
 
 #include "command.hpp"
 
-void Command::setupBuffer(arch::dma_buffer_view view) {
-	using arch::convert_endian;
-	using arch::endian;
-
-	static size_t pageSize = getpagesize();
+namespace {
+	size_t pageSize = getpagesize();
+}
 
-	uintptr_t virtStart = reinterpret_cast<uintptr_t>(view.data());
-	auto offset = virtStart % pageSize;
+PrpListPool::Page PrpListPool::allocate() {
+	if (!freePages_.empty()) {
+		auto page = std::move(freePages_.back());
+		freePages_.pop_back();
+		return page;
+	}
 
-	if (offset + view.size() <= pageSize * 2) {
-		// Inline
-		command_.common.dataPtr.prp1 = convert_endian<endian::little, endian::native>(
-			helix::ptrToPhysical(view.data()));
+	auto entries = arch::dma_array<uint64_t>{nullptr, pageSize >> 3};
+	auto physical = helix::ptrToPhysical(entries.data());
+	return Page{std::move(entries), physical};
+}
 
-		auto firstPrpLen = pageSize - offset;
-		if (view.size() > firstPrpLen) {
-			command_.common.dataPtr.prp2 = convert_endian<endian::little, endian::native>(
-				helix::ptrToPhysical(view.subview(firstPrpLen).data()));
-		}
+void PrpListPool::free(Page page) {
+	freePages_.push_back(std::move(page));
+}
 
+void Command::prepareDataPointer(PrpListPool &pool, bool useSgl) {
+	if (!view_.size())
 		return;
-	}
 
-	uintptr_t prp1, prp2;
-	auto size = view.size();
+	uintptr_t virtStart = reinterpret_cast<uintptr_t>(view_.data());
+	auto offset = virtStart % pageSize;
+	size_t numPages = (offset + view_.size() + pageSize - 1) / pageSize;
 
-	prp1 = helix::addressToPhysical(virtStart);
+	// Resolve all physical addresses at once.
+	pool.physicals.resize(numPages);
+	helix::rangeToPhysical(virtStart, numPages, pool.physicals.data());
 
-	if (offset + view.size() <= pageSize) {
-		command_.readWrite.dataPtr.prp1 = convert_endian<endian::little, endian::native>(prp1);
-		command_.readWrite.dataPtr.prp2 = 0;
+	if (useSgl && setupSgl(pool, numPages, offset))
 		return;
-	}
-	size -= pageSize - offset;
-	virtStart += pageSize - offset;
+	setupPrps(pool, numPages, offset);
+}
 
-	if (size <= pageSize) {
-		command_.readWrite.dataPtr.prp1 = convert_endian<endian::little, endian::native>(prp1);
-		command_.readWrite.dataPtr.prp2 = convert_endian<endian::little, endian::native>(
-			helix::addressToPhysical(virtStart));
-		return;
+void Command::releaseLists(PrpListPool &pool) {
+	for (auto &page : lists_)
+		pool.free(std::move(page));
+	lists_.clear();
+}
+
+bool Command::setupSgl(PrpListPool &pool, size_t numPages, size_t offset) {
+	using arch::convert_endian;
+	using arch::endian;
+
+	auto &physicals = pool.physicals;
+	auto makeDescriptor = [] (uint64_t address, uint32_t length, uint8_t type) {
+		spec::SglDescriptor desc{};
+		desc.address = convert_endian<endian::little, endian::native>(address);
+		desc.length = convert_endian<endian::little, endian::native>(length);
+		desc.identifier = type << 4;
+		return desc;
+	};
+
+	// Merge physically contiguous pages into a single data block.
+	size_t maxDescriptors = pageSize / sizeof(spec::SglDescriptor);
+	std::vector<spec::SglDescriptor> blocks;
+	uint64_t blockStart = physicals[0] + offset;
+	uint64_t blockEnd = blockStart + std::min(view_.size(), pageSize - offset);
+	size_t remaining = view_.size() - (blockEnd - blockStart);
+	for (size_t i = 1; i < numPages; i++) {
+		auto chunk = std::min(remaining, pageSize);
+		if (physicals[i] != blockEnd) {
+			if (blocks.size() + 1 == maxDescriptors)
+				return false;
+			blocks.push_back(makeDescriptor(blockStart, blockEnd - blockStart, spec::kSglDataBlock));
+			blockStart = physicals[i];
+			blockEnd = blockStart;
+		}
+		blockEnd += chunk;
+		remaining -= chunk;
+	}
+	blocks.push_back(makeDescriptor(blockStart, blockEnd - blockStart, spec::kSglDataBlock));
+
+	spec::SglDescriptor desc;
+	if (blocks.size() == 1) {
+		desc = blocks[0];
+	} else {
+		auto page = pool.allocate();
+		memcpy(page.entries.data(), blocks.data(), blocks.size() * sizeof(spec::SglDescriptor));
+		desc = makeDescriptor(page.physical, blocks.size() * sizeof(spec::SglDescriptor),
+				spec::kSglLastSegment);
+		lists_.push_back(std::move(page));
 	}
 
-	auto prpObj = arch::dma_array<uint64_t>{nullptr, pageSize >> 3};
-	auto *prpList = prpObj.data();
+	memcpy(&command_.common.dataPtr, &desc, sizeof(spec::SglDescriptor));
+	command_.common.flags |= spec::kPsdtSgl;
+	return true;
+}
 
-	prp2 = helix::ptrToPhysical(prpList);
-	prpLists.push_back(std::move(prpObj));
+void Command::setupPrps(PrpListPool &pool, size_t numPages, size_t offset) {
+	using arch::convert_endian;
+	using arch::endian;
 
-	int i = 0;
-	for (;;) {
-		if (i == pageSize >> 3) {
-			auto *oldPrpList = prpList;
-			prpObj = arch::dma_array<uint64_t>{nullptr, pageSize >> 3};
-			prpList = prpObj.data();
-			prpLists.push_back(std::move(prpObj));
+	auto &physicals = pool.physicals;
+	command_.common.dataPtr.prp1 = convert_endian<endian::little, endian::native>(
+		physicals[0] + offset);
 
-			prpList[0] = oldPrpList[i - 1];
-			oldPrpList[i - 1] = convert_endian<endian::little, endian::native>(
-				helix::ptrToPhysical(prpList));
-			i = 1;
+	if (numPages == 1) {
+		command_.common.dataPtr.prp2 = 0;
+		return;
+	}
+	if (numPages == 2) {
+		command_.common.dataPtr.prp2 = convert_endian<endian::little, endian::native>(
+			physicals[1]);
+		return;
+	}
+
+	// PRP lists contain all pages except for the first one.
+	// If a list is full, its last entry points to the next list.
+	size_t entriesPerList = pageSize >> 3;
+	auto page = pool.allocate();
+	command_.common.dataPtr.prp2 = convert_endian<endian::little, endian::native>(
+		page.physical);
+	auto *prpList = page.entries.data();
+	lists_.push_back(std::move(page));
+
+	size_t i = 0;
+	for (size_t k = 1; k < numPages; k++) {
+		if (i == entriesPerList - 1 && k != numPages - 1) {
+			auto next = pool.allocate();
+			prpList[i] = convert_endian<endian::little, endian::native>(
+				(uint64_t)next.physical);
+			prpList = next.entries.data();
+			lists_.push_back(std::move(next));
+			i = 0;
 		}
 		prpList[i++] = convert_endian<endian::little, endian::native>(
-			helix::addressToPhysical(virtStart));
-		virtStart += pageSize;
-
-		if (size <= pageSize)
-			break;
-		size -= pageSize;
+			(uint64_t)physicals[k]);
 	}
-
-	command_.readWrite.dataPtr.prp1 = convert_endian<endian::little, endian::native>(prp1);
-	command_.readWrite.dataPtr.prp2 = convert_endian<endian::little, endian::native>(prp2);
 }
@@ -7,6 +7,25 @@
 
 #include "spec.hpp"
 
+// Pool of pages that hold PRP lists or SGL segments.
+// Pages are reused across commands such that large transfers do not need to
+// allocate DMA memory (and resolve its physical address) on every submission.
+struct PrpListPool {
+	struct Page {
+		arch::dma_array<uint64_t> entries;
+		uintptr_t physical;
+	};
+
+	Page allocate();
+	void free(Page page);
+
+	// Scratch space for the physical addresses of a buffer.
+	std::vector<uintptr_t> physicals;
+
+private:
+	std::vector<Page> freePages_;
+};
+
 struct Command {
 	using Result = std::pair<uint16_t, spec::CompletionEntry::Result>;
 
@@ -14,7 +33,15 @@ struct Command {
 		return command_;
 	}
 
-	void setupBuffer(arch::dma_buffer_view view);
+	// Only records the buffer; the data pointer is filled in by prepareDataPointer().
+	void setupBuffer(arch::dma_buffer_view view) {
+		view_ = view;
+	}
+
+	// Called by the queue right before the command is submitted.
+	void prepareDataPointer(PrpListPool &pool, bool useSgl);
+	// Called by the queue once the command completed.
+	void releaseLists(PrpListPool &pool);
 
 	async::future<Result, frg::stl_allocator> getFuture() {
 		return promise_.get_future();
@@ -25,7 +52,11 @@ struct Command {
 	}
 
 private:
+	bool setupSgl(PrpListPool &pool, size_t numPages, size_t offset);
+	void setupPrps(PrpListPool &pool, size_t numPages, size_t offset);
+
 	spec::Command command_;
 	async::promise<Result, frg::stl_allocator> promise_;
-	std::vector<arch::dma_array<uint64_t>> prpLists;
+	arch::dma_buffer_view view_{nullptr, nullptr, 0};
+	std::vector<PrpListPool::Page> lists_;
 };
@@ -1,3 +1,7 @@
+#include <algorithm>
+#include <iostream>
+#include <thread>
+
 #include <arch/bit.hpp>
 #include <helix/timer.hpp>
 
@@ -17,6 +21,7 @@ namespace flags {
 	namespace cap {
 		constexpr arch::field<uint64_t, uint16_t> mqes{0, 16};
 		constexpr arch::field<uint64_t, uint8_t> dstrd{32, 4};
+		constexpr arch::field<uint64_t, uint8_t> mpsmin{48, 4};
 	} // namespace cap
 
 	namespace vs {
@@ -37,15 +42,17 @@ namespace flags {
 } // namespace flags
 
 Controller::Controller(int64_t parentId, protocols::hw::Device hwDevice, helix::Mapping hbaRegs,
-					   helix::UniqueDescriptor, helix::UniqueDescriptor irq)
+					   helix::UniqueDescriptor, helix::UniqueDescriptor irq, unsigned int numMsis)
 	: hwDevice_{std::move(hwDevice)}, regsMapping_{std::move(hbaRegs)},
-	  regs_{regsMapping_.get()}, irq_{std::move(irq)}, parentId_{parentId} {
+	  regs_{regsMapping_.get()}, numMsis_{numMsis}, parentId_{parentId} {
+	irqs_.push_back(std::move(irq));
 }
 
 async::detached Controller::run() {
-	co_await hwDevice_.enableBusIrq();
+	if (!numMsis_)
+		co_await hwDevice_.enableBusIrq();
 
-	handleIrqs();
+	handleIrqs(0);
 
 	co_await reset();
 	co_await scanNamespaces();
@@ -54,23 +61,27 @@ async::detached Controller::run() {
 		ns->run();
 }
 
-async::detached Controller::handleIrqs() {
-	irqSequence_ = 0;
+async::detached Controller::handleIrqs(unsigned int vector) {
+	// irqs_ may grow while this coroutine runs; do not keep references into it.
+	helix::BorrowedDescriptor irq{irqs_[vector]};
+	uint64_t sequence = 0;
 
 	while (true) {
-		auto await = co_await helix_ng::awaitEvent(irq_, irqSequence_);
+		auto await = co_await helix_ng::awaitEvent(irq, sequence);
 		HEL_CHECK(await.error());
-		irqSequence_ = await.sequence();
+		sequence = await.sequence();
 
 		int found = 0;
 		for (auto &q : activeQueues_) {
-			found |= q->handleIrq();
+			if (q->getIrqVector() == vector)
+				found |= q->handleIrq();
 		}
 
-		if (found) {
-			HEL_CHECK(helAcknowledgeIrq(irq_.getHandle(), kHelAckAcknowledge, irqSequence_));
+		// MSIs are never shared, hence there is no need to NACK them.
+		if (found || numMsis_) {
+			HEL_CHECK(helAcknowledgeIrq(irq.getHandle(), kHelAckAcknowledge, sequence));
 		} else {
-			HEL_CHECK(helAcknowledgeIrq(irq_.getHandle(), kHelAckNack, irqSequence_));
+			HEL_CHECK(helAcknowledgeIrq(irq.getHandle(), kHelAckNack, sequence));
 		}
 	}
 }
@@ -104,6 +115,7 @@ async::result<void> Controller::reset() {
 
 	queueDepth_ = std::min((cap & flags::cap::mqes) + 1, IO_QUEUE_DEPTH);
 	dbStride_ = 1 << (cap & flags::cap::dstrd);
+	minPageSize_ = size_t(1) << (12 + (cap & flags::cap::mpsmin));
 
 	version_ = regs_.load(regs::vs);
 
@@ -122,15 +134,59 @@ async::result<void> Controller::reset() {
 
 	co_await enable();
 
-	auto ioQ = std::make_unique<Queue>(1, queueDepth_, regs_.subspace(doorbellsOffset + 1 * 8 * dbStride_));
-	ioQ->init();
+	// Create one I/O queue pair per CPU such that the device can process
+	// commands in parallel. Each queue gets its own MSI-X vector (if enough vectors
+	// are available); vector 0 is shared with the admin queue.
+	unsigned int wantedQueues = std::clamp(std::thread::hardware_concurrency(),
+			1u, MAX_IO_QUEUES);
+	if (numMsis_)
+		wantedQueues = std::min(wantedQueues, numMsis_);
+	auto numQueues = co_await negotiateIoQueues(wantedQueues);
+
+	for (unsigned int i = 1; i < std::min(numQueues + 1, numMsis_); i++) {
+		irqs_.push_back(co_await hwDevice_.installMsi(i));
+		handleIrqs(i);
+	}
+
+	for (unsigned int qid = 1; qid <= numQueues; qid++) {
+		auto ioQ = std::make_unique<Queue>(qid, queueDepth_,
+				regs_.subspace(doorbellsOffset + qid * 8 * dbStride_), qid % irqs_.size());
+		ioQ->init();
 
-	if (co_await setupIoQueue(ioQ.get())) {
+		if (!(co_await setupIoQueue(ioQ.get())))
+			break;
 		ioQ->run();
 		activeQueues_.push_back(std::move(ioQ));
 	}
 
 	assert(activeQueues_.size() >= 2 && "At least need one IO queue");
+	std::cout << "block/nvme: Using " << activeQueues_.size() - 1 << " I/O queues with "
+			<< irqs_.size() << " IRQ(s)" << std::endl;
+}
+
+async::result<unsigned int> Controller::negotiateIoQueues(unsigned int wanted) {
+	using arch::convert_endian;
+	using arch::endian;
+
+	auto &adminQ = activeQueues_.front();
+	auto cmd = std::make_unique<Command>();
+	auto &cmdBuf = cmd->getCommandBuffer().features;
+
+	// Both counts are zero-based.
+	cmdBuf.opcode = spec::kSetFeatures;
+	cmdBuf.fid = convert_endian<endian::little, endian::native>((uint32_t)spec::kNumberOfQueues);
+	cmdBuf.dword11 = convert_endian<endian::little, endian::native>(
+			((wanted - 1) << 16) | (wanted - 1));
+
+	auto res = co_await adminQ->submitCommand(std::move(cmd));
+	if (res.first != 0)
+		co_return 1;
+
+	// The controller may allocate more or fewer queues than we asked for.
+	auto allocated = convert_endian<endian::little>(res.second.u32);
+	unsigned int numSqs = (allocated & 0xFFFF) + 1;
+	unsigned int numCqs = (allocated >> 16) + 1;
+	co_return std::min({wanted, numSqs, numCqs});
 }
 
 async::result<bool> Controller::setupIoQueue(Queue *q) {
@@ -160,7 +216,7 @@ async::result<Command::Result> Controller::createCQ(Queue *q) {
 	cmdBuf.cqid = convert_endian<endian::little, endian::native>((uint16_t)q->getQueueId());
 	cmdBuf.qSize = convert_endian<endian::little, endian::native>((uint16_t)q->getQueueDepth() - 1);
 	cmdBuf.cqFlags = convert_endian<endian::little, endian::native>((uint16_t)flags);
-	cmdBuf.irqVector = 0; // TODO: set to MSI vector
+	cmdBuf.irqVector = convert_endian<endian::little, endian::native>((uint16_t)q->getIrqVector());
 
 	return adminQ->submitCommand(std::move(cmd));
 }
@@ -241,6 +297,21 @@ async::result<void> Controller::scanNamespaces() {
 
 	nn = convert_endian<endian::little>(idCtrl.nn);
 
+	// MDTS is a power of two in units of the minimum memory page size; zero means no limit.
+	if (idCtrl.mdts) {
+		maxTransferBytes_ = minPageSize_ << idCtrl.mdts;
+		std::cout << "block/nvme: Maximum transfer size is " << maxTransferBytes_
+			<< " bytes" << std::endl;
+	}
+
+	// PRPs already require dword aligned buffers, hence both kinds of SGL support work for us.
+	auto sgls = convert_endian<endian::little>(idCtrl.sgls) & spec::kSglSupportMask;
+	if (sgls == spec::kSglSupported || sgls == spec::kSglSupportedDwordAligned) {
+		std::cout << "block/nvme: Controller supports SGLs" << std::endl;
+		for (size_t i = 1; i < activeQueues_.size(); i++)
+			activeQueues_[i]->setUseSgl(true);
+	}
+
 	if (version_ >= flags::vs::version(1, 1, 0)) {
 		auto nsList = arch::dma_array<uint32_t>{nullptr, 1024};
 		int numLists = (nn + 1023) >> 10;
@@ -289,7 +360,10 @@ async::result<void> Controller::createNamespace(unsigned int nsid) {
 }
 
 async::result<Command::Result> Controller::submitIoCommand(std::unique_ptr<Command> cmd) {
-	auto &ioQ = activeQueues_.back();
+	// The driver runs on a single thread, so we cannot pick the queue of the current CPU.
+	// Instead, spread the commands evenly over all I/O queues.
+	auto &ioQ = activeQueues_[1 + nextIoQueue_];
+	nextIoQueue_ = (nextIoQueue_ + 1) % (activeQueues_.size() - 1);
 
 	return ioQ->submitCommand(std::move(cmd));
 }
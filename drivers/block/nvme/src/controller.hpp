@@ -10,7 +10,7 @@
 
 struct Controller {
 	Controller(int64_t parentId, protocols::hw::Device hwDevice, helix::Mapping hbaRegs,
-			   helix::UniqueDescriptor ahciBar, helix::UniqueDescriptor irq);
+			   helix::UniqueDescriptor ahciBar, helix::UniqueDescriptor irq, unsigned int numMsis);
 
 	async::detached run();
 
@@ -19,14 +19,28 @@ struct Controller {
 	inline int64_t getParentId() const {
 		return parentId_;
 	}
+
+	// Number of commands that can be outstanding on all I/O queues together.
+	inline size_t getIoQueueCapacity() const {
+		return (activeQueues_.size() - 1) * (queueDepth_ - 1);
+	}
+
+	// Maximum number of bytes that a single command may transfer (or 0 if there is no limit).
+	inline size_t getMaxTransferBytes() const {
+		return maxTransferBytes_;
+	}
 private:
 	static constexpr int IO_QUEUE_DEPTH = 1024;
+	static constexpr unsigned int MAX_IO_QUEUES = 64;
 
 	protocols::hw::Device hwDevice_;
 	helix::Mapping regsMapping_;
 	arch::mem_space regs_;
-	helix::UniqueDescriptor irq_;
+	// IRQ 0 is either the legacy IRQ or MSI-X vector 0; further entries are MSI-X vectors.
+	std::vector<helix::UniqueDescriptor> irqs_;
+	unsigned int numMsis_;
 
+	// activeQueues_[0] is the admin queue, all other queues are I/O queues.
 	std::vector<std::unique_ptr<Queue>> activeQueues_;
 	std::vector<std::unique_ptr<Namespace>> activeNamespaces_;
 
@@ -34,8 +48,12 @@ private:
 	unsigned int queueDepth_;
 	uint32_t dbStride_;
 	uint32_t version_;
+	// Minimum memory page size of the controller (CAP.MPSMIN) in bytes.
+	size_t minPageSize_;
+	size_t maxTransferBytes_ = 0;
 
-	uint64_t irqSequence_;
+	// Index of the I/O queue that receives the next command.
+	size_t nextIoQueue_ = 0;
 
 	async::result<void> reset();
 	async::result<void> scanNamespaces();
@@ -44,6 +62,7 @@ private:
 	async::result<void> enable();
 	async::result<void> disable();
 
+	async::result<unsigned int> negotiateIoQueues(unsigned int wanted);
 	async::result<bool> setupIoQueue(Queue *q);
 	async::result<Command::Result> createCQ(Queue *q);
 	async::result<Command::Result> createSQ(Queue *q);
@@ -54,5 +73,5 @@ private:
 
 	async::result<void> createNamespace(unsigned int nsid);
 
-	async::detached handleIrqs();
+	async::detached handleIrqs(unsigned int vector);
 };
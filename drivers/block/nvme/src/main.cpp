@@ -14,12 +14,19 @@ async::detached bindController(mbus::Entity entity) {
 	auto &barInfo = info.barInfo[0];
 	assert(barInfo.ioType == protocols::hw::IoType::kIoTypeMemory);
 	auto bar0 = co_await device.accessBar(0);
-	auto irq = co_await device.accessIrq();
+
+	helix::UniqueDescriptor irq;
+	if (info.numMsis) {
+		co_await device.enableMsi();
+		irq = co_await device.installMsi(0);
+	} else {
+		irq = co_await device.accessIrq();
+	}
 
 	helix::Mapping mapping{bar0, barInfo.offset, barInfo.length};
 
 	auto controller = std::make_unique<Controller>(entity.getId(), std::move(device), std::move(mapping),
-			   std::move(bar0), std::move(irq));
+			   std::move(bar0), std::move(irq), info.numMsis);
 	controller->run();
 	globalControllers.push_back(std::move(controller));
 }
@@ -1,3 +1,5 @@
+#include <algorithm>
+
 #include <arch/bit.hpp>
 
 #include "namespace.hpp"
@@ -46,6 +48,18 @@ async::result<void> Namespace::writeSectors(uint64_t sector, const void *buffer,
 	co_await controller_->submitIoCommand(std::move(cmd));
 }
 
+size_t Namespace::queueDepth() {
+	return controller_->getIoQueueCapacity();
+}
+
+size_t Namespace::maxTransferSectors() {
+	// The length field of read and write commands has 16 bits.
+	auto bytes = size_t(1) << 20;
+	if (auto mdts = controller_->getMaxTransferBytes(); mdts)
+		bytes = std::min(bytes, mdts);
+	return std::min(size_t(0x10000), bytes >> lbaShift_);
+}
+
 async::result<size_t> Namespace::getSize() {
 	std::cout << "nvme: Namespace::getSize() is a stub!" << std::endl;
 	co_return 1;
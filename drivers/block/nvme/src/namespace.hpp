@@ -14,6 +14,9 @@ struct Namespace : blockfs::BlockDevice {
 	async::result<void> writeSectors(uint64_t sector, const void *buf, size_t numSectors) override;
 	async::result<size_t> getSize() override;
 
+	size_t queueDepth() override;
+	size_t maxTransferSectors() override;
+
 private:
 	Controller *controller_;
 	unsigned int nsid_;
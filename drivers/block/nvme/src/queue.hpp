@@ -9,7 +9,8 @@
 #include "spec.hpp"
 
 struct Queue {
-	Queue(unsigned int index, unsigned int depth, arch::mem_space doorbells);
+	Queue(unsigned int index, unsigned int depth, arch::mem_space doorbells,
+			unsigned int irqVector = 0);
 
 	void init();
 	async::detached run();
@@ -20,6 +21,9 @@ struct Queue {
 	unsigned int getQueueDepth() const {
 		return depth_;
 	}
+	unsigned int getIrqVector() const {
+		return irqVector_;
+	}
 
 	uintptr_t getCqPhysAddr() const {
 		return cqPhys_;
@@ -28,6 +32,11 @@ struct Queue {
 		return sqPhys_;
 	}
 
+	// SGLs are only used for I/O commands and only if the controller supports them.
+	void setUseSgl(bool useSgl) {
+		useSgl_ = useSgl;
+	}
+
 	async::result<Command::Result> submitCommand(std::unique_ptr<Command> cmd);
 
 	int handleIrq();
@@ -35,6 +44,7 @@ struct Queue {
 private:
 	unsigned int qid_;
 	unsigned int depth_;
+	unsigned int irqVector_;
 	arch::mem_space doorbells_;
 	spec::CompletionEntry *cqes_;
 	void *sqCmds_;
@@ -43,6 +53,9 @@ private:
 	uint16_t sqTail_;
 	uint16_t cqHead_;
 	uint8_t cqPhase_;
+	bool useSgl_ = false;
+
+	PrpListPool prpListPool_;
 
 	async::queue<std::unique_ptr<Command>, frg::stl_allocator> pendingCmdQueue_;
 
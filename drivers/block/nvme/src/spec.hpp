@@ -13,6 +13,11 @@ enum AdminOpcode {
 	kDeleteCQ = 0x4,
 	kCreateCQ = 0x5,
 	kIdentify = 0x6,
+	kSetFeatures = 0x9,
+};
+
+enum FeatureId {
+	kNumberOfQueues = 0x7,
 };
 
 enum CommandFlags {
@@ -20,6 +25,22 @@ enum CommandFlags {
 	kCQIrqEnabled = 1 << 1,
 };
 
+enum CommandPsdt {
+	kPsdtPrp = 0 << 6,
+	kPsdtSgl = 1 << 6,
+};
+
+enum SglDescriptorType {
+	kSglDataBlock = 0x0,
+	kSglLastSegment = 0x3,
+};
+
+enum SglSupport {
+	kSglSupportMask = 0x3,
+	kSglSupported = 0x1,
+	kSglSupportedDwordAligned = 0x2,
+};
+
 enum IdentifyCNS {
 	kIdentifyNamespace = 0x00,
 	kIdentifyController = 0x01,
@@ -183,6 +204,14 @@ struct DataPointer {
 };
 static_assert(sizeof(DataPointer) == 16);
 
+struct SglDescriptor {
+	uint64_t address;
+	uint32_t length;
+	uint8_t __reserved[3];
+	uint8_t identifier;
+};
+static_assert(sizeof(SglDescriptor) == 16);
+
 struct CommonCommand {
 	uint8_t opcode;
 	uint8_t flags;
@@ -258,12 +287,25 @@ struct IdentifyCommand {
 	uint32_t __reserved11[5];
 };
 
+struct FeaturesCommand {
+	uint8_t opcode;
+	uint8_t flags;
+	uint16_t commandId;
+	uint32_t nsid;
+	uint64_t __reserved2[2];
+	DataPointer dataPtr;
+	uint32_t fid;
+	uint32_t dword11;
+	uint32_t __reserved12[4];
+};
+
 union Command {
 	CommonCommand common;
 	ReadWriteCommand readWrite;
 	CreateCQCommand createCQ;
 	CreateSQCommand createSQ;
 	IdentifyCommand identify;
+	FeaturesCommand features;
 };
 static_assert(sizeof(Command) == 64);
 
@@ -1,6 +1,8 @@
 
 #include <stdlib.h>
+#include <algorithm>
 #include <iostream>
+#include <thread>
 
 #include "block.hpp"
 
@@ -22,95 +24,140 @@ UserRequest::UserRequest(bool write_, uint64_t sector_, void *buffer_, size_t nu
 
 Device::Device(std::unique_ptr<virtio_core::Transport> transport, int64_t parent_id)
 : blockfs::BlockDevice{512, parent_id}, _transport{std::move(transport)},
-		_requestQueue{nullptr}, _size{0} { }
+		_nextQueue{0}, _maxSectors{0}, _size{0} { }
 
 void Device::runDevice() {
+	if(_transport->checkDeviceFeature(virtio_core::VIRTIO_RING_F_INDIRECT_DESC))
+		_transport->acknowledgeDriverFeature(virtio_core::VIRTIO_RING_F_INDIRECT_DESC);
+	if(_transport->checkDeviceFeature(virtio_core::VIRTIO_RING_F_EVENT_IDX))
+		_transport->acknowledgeDriverFeature(virtio_core::VIRTIO_RING_F_EVENT_IDX);
+
+	// Use one virtq per CPU if the device supports that many.
+	unsigned int num_queues = 1;
+	if(_transport->checkDeviceFeature(VIRTIO_BLK_F_MQ)) {
+		_transport->acknowledgeDriverFeature(VIRTIO_BLK_F_MQ);
+		unsigned int max_queues = std::max(std::thread::hardware_concurrency(), 1u);
+		num_queues = std::clamp(static_cast<unsigned int>(
+				_transport->space().load(spec::regs::numQueues)), 1u, max_queues);
+	}
+
 	_transport->finalizeFeatures();
-	_transport->claimQueues(1);
-	_requestQueue = _transport->setupQueue(0);
+	_transport->claimQueues(num_queues);
+	for(unsigned int i = 0; i < num_queues; i++) {
+		auto queue = std::make_unique<RequestQueue>();
+		queue->virtq = _transport->setupQueue(i);
+		_queues.push_back(std::move(queue));
+	}
+	std::cout << "virtio: Using " << num_queues << " request queue(s)" << std::endl;
 
 	auto size = static_cast<uint64_t>(_transport->space().load(spec::regs::capacity[0]))
 			| (static_cast<uint64_t>(_transport->space().load(spec::regs::capacity[1])) << 32);
 	std::cout << "virtio: Disk size: " << size << " sectors" << std::endl;
 	_size = size;
 
+	// Limit to ensure that we don't monopolize the device.
+	// With indirect descriptors, a request only takes up a single ring slot.
+	// Each request needs two descriptors for header and status byte;
+	// an unaligned buffer can touch one more page than its size suggests.
+	auto virtq = _queues.front()->virtq;
+	if(virtq->supportsIndirect()) {
+		_maxSectors = (virtio_core::Queue::maxIndirectDescriptors - 3) * (0x1000 / 512);
+	}else{
+		_maxSectors = virtq->numDescriptors() / 4;
+	}
+	assert(_maxSectors >= 1);
+
 	_transport->runDevice();
 
 	// perform device specific setup
-	virtRequestBuffer = new VirtRequest[_requestQueue->numDescriptors()];
-	statusBuffer = new uint8_t[_requestQueue->numDescriptors()];
+	for(auto &queue : _queues) {
+		queue->virtRequestBuffer = new VirtRequest[queue->virtq->numDescriptors()];
+		queue->statusBuffer = new uint8_t[queue->virtq->numDescriptors()];
 
-	// natural alignment makes sure that request headers do not cross page boundaries
-	assert((uintptr_t)virtRequestBuffer % sizeof(VirtRequest) == 0);
+		// natural alignment makes sure that request headers do not cross page boundaries
+		assert((uintptr_t)queue->virtRequestBuffer % sizeof(VirtRequest) == 0);
 
-	// setup an interrupt for the device
-	_processRequests();
+		_processRequests(queue.get());
+	}
 
 	blockfs::runDevice(this);
 }
 
 async::result<void> Device::readSectors(uint64_t sector,
 		void *buffer, size_t num_sectors) {
-	// Natural alignment makes sure a sector does not cross a page boundary.
-	assert(!((uintptr_t)buffer % 512));
 //	printf("readSectors(%lu, %lu)\n", sector, num_sectors);
-
-	// Limit to ensure that we don't monopolize the device.
-	auto max_sectors = _requestQueue->numDescriptors() / 4;
-	assert(max_sectors >= 1);
-
-	for(size_t progress = 0; progress < num_sectors; progress += max_sectors) {
-		auto request = new UserRequest(false, sector + progress,
-				(char *)buffer + 512 * progress,
-				std::min(num_sectors - progress, max_sectors));
-		_pendingQueue.push(request);
-		_pendingDoorbell.raise();
-		co_await request->event.wait();
-		delete request;
-	}
+	co_await _transfer(false, sector, buffer, num_sectors);
 }
 
 async::result<void> Device::writeSectors(uint64_t sector,
 		const void *buffer, size_t num_sectors) {
-	// Natural alignment makes sure a sector does not cross a page boundary.
-	assert(!((uintptr_t)buffer % 512));
 //	printf("writeSectors(%lu, %lu)\n", sector, num_sectors);
-
-	// Limit to ensure that we don't monopolize the device.
-	auto max_sectors = _requestQueue->numDescriptors() / 4;
-	assert(max_sectors >= 1);
-
-	for(size_t progress = 0; progress < num_sectors; progress += max_sectors) {
-		auto request = new UserRequest(true, sector + progress,
-				(char *)buffer + 512 * progress,
-				std::min(num_sectors - progress, max_sectors));
-		_pendingQueue.push(request);
-		_pendingDoorbell.raise();
-		co_await request->event.wait();
-		delete request;
-	}
+	co_await _transfer(true, sector, const_cast<void *>(buffer), num_sectors);
 }
 
 async::result<size_t> Device::getSize() {
 	co_return _size * 512;
 }
 
-async::detached Device::_processRequests() {
+size_t Device::queueDepth() {
+	// Without indirect descriptors, a request takes up to _maxSectors + 2 descriptors.
+	size_t depth = 0;
+	for(auto &queue : _queues) {
+		if(queue->virtq->supportsIndirect()) {
+			depth += queue->virtq->numDescriptors();
+		}else{
+			depth += std::max(queue->virtq->numDescriptors() / (_maxSectors + 2), size_t(1));
+		}
+	}
+	return depth;
+}
+
+async::result<void> Device::_transfer(bool write, uint64_t sector,
+		void *buffer, size_t num_sectors) {
+	// Natural alignment makes sure a sector does not cross a page boundary.
+	assert(!((uintptr_t)buffer % 512));
+
+	// Keep at most one request of this transfer in flight per virtq.
+	std::vector<std::unique_ptr<UserRequest>> requests;
+	size_t progress = 0;
+	while(progress < num_sectors) {
+		requests.clear();
+		for(size_t i = 0; i < _queues.size() && progress < num_sectors; i++) {
+			auto chunk = std::min(num_sectors - progress, _maxSectors);
+			auto request = std::make_unique<UserRequest>(write, sector + progress,
+					(char *)buffer + 512 * progress, chunk);
+
+			auto queue = _queues[_nextQueue].get();
+			_nextQueue = (_nextQueue + 1) % _queues.size();
+			queue->pendingQueue.push(request.get());
+			queue->pendingDoorbell.raise();
+
+			requests.push_back(std::move(request));
+			progress += chunk;
+		}
+
+		for(auto &request : requests)
+			co_await request->event.wait();
+	}
+}
+
+async::detached Device::_processRequests(RequestQueue *queue) {
+	auto virtq = queue->virtq;
+
 	while(true) {
-		if(_pendingQueue.empty()) {
-			co_await _pendingDoorbell.async_wait();
+		if(queue->pendingQueue.empty()) {
+			co_await queue->pendingDoorbell.async_wait();
 			continue;
 		}
 
-		auto request = _pendingQueue.front();
-		_pendingQueue.pop();
+		auto request = queue->pendingQueue.front();
+		queue->pendingQueue.pop();
 		assert(request->numSectors);
 
-		// Setup the descriptor for the request header.
-		virtio_core::Chain chain;
-		chain.append(co_await _requestQueue->obtainDescriptor());
+		// Setup the request header.
+		auto head = co_await virtq->obtainDescriptor();
 
-		VirtRequest *header = &virtRequestBuffer[chain.front().tableIndex()];
+		VirtRequest *header = &queue->virtRequestBuffer[head.tableIndex()];
 		if(request->write) {
 			header->type = VIRTIO_BLK_T_OUT;
 		}else{
@@ -119,32 +166,50 @@ async::detached Device::_processRequests() {
 		header->reserved = 0;
 		header->sector = request->sector;
 
-		chain.setupBuffer(virtio_core::hostToDevice, arch::dma_buffer_view{nullptr,
-				header, sizeof(VirtRequest)});
+		arch::dma_buffer_view header_view{nullptr, header, sizeof(VirtRequest)};
+		arch::dma_buffer_view data_view{nullptr, request->buffer, 512 * request->numSectors};
+		arch::dma_buffer_view status_view{nullptr, &queue->statusBuffer[head.tableIndex()], 1};
 
-		// Setup descriptors for the transfered data.
-		for(size_t i = 0; i < request->numSectors; i++) {
-			chain.append(co_await _requestQueue->obtainDescriptor());
+		if(virtq->supportsIndirect()) {
+			// The whole request occupies a single descriptor of the virtq.
+			virtio_core::IndirectChain chain{head};
+			chain.append(virtio_core::hostToDevice, header_view);
 			if(request->write) {
-				chain.setupBuffer(virtio_core::hostToDevice, arch::dma_buffer_view{nullptr,
-						(char *)request->buffer + 512 * i, 512});
+				virtio_core::scatterGather(virtio_core::hostToDevice, chain, data_view);
 			}else{
-				chain.setupBuffer(virtio_core::deviceToHost, arch::dma_buffer_view{nullptr,
-						(char *)request->buffer + 512 * i, 512});
+				virtio_core::scatterGather(virtio_core::deviceToHost, chain, data_view);
+			}
+			chain.append(virtio_core::deviceToHost, status_view);
+
+			if(logInitiateRetire)
+				std::cout << "Submitting " << (chain.size() - 2)
+						<< " indirect data descriptors" << std::endl;
+		}else{
+			virtio_core::Chain chain;
+			chain.append(head);
+			chain.setupBuffer(virtio_core::hostToDevice, header_view);
+
+			// Setup descriptors for the transfered data.
+			for(size_t i = 0; i < request->numSectors; i++) {
+				chain.append(co_await virtq->obtainDescriptor());
+				if(request->write) {
+					chain.setupBuffer(virtio_core::hostToDevice, data_view.subview(512 * i, 512));
+				}else{
+					chain.setupBuffer(virtio_core::deviceToHost, data_view.subview(512 * i, 512));
+				}
 			}
-		}
 
-		if(logInitiateRetire)
-			std::cout << "Submitting " << request->numSectors
-					<< " data descriptors" << std::endl;
+			if(logInitiateRetire)
+				std::cout << "Submitting " << request->numSectors
+						<< " data descriptors" << std::endl;
 
-		// Setup a descriptor for the status byte.
-		chain.append(co_await _requestQueue->obtainDescriptor());
-		chain.setupBuffer(virtio_core::deviceToHost, arch::dma_buffer_view{nullptr,
-				&statusBuffer[chain.front().tableIndex()], 1});
+			// Setup a descriptor for the status byte.
+			chain.append(co_await virtq->obtainDescriptor());
+			chain.setupBuffer(virtio_core::deviceToHost, status_view);
+		}
 
 		// Submit the request to the device
-		_requestQueue->postDescriptor(chain.front(), request,
+		virtq->postDescriptor(head, request,
 				[] (virtio_core::Request *base_request) {
 			auto request = static_cast<UserRequest *>(base_request);
 			if(logInitiateRetire)
@@ -152,7 +217,11 @@ async::detached Device::_processRequests() {
 						<< " data descriptors" << std::endl;
 			request->event.raise();
 		});
-		_requestQueue->notify();
+
+		// Batch notifications: only kick the device once the pending queue is drained.
+		// Queue::obtainDescriptor() notifies on its own before it blocks.
+		if(queue->pendingQueue.empty())
+			virtq->notify();
 	}
 }
 
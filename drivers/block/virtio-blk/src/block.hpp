@@ -1,5 +1,7 @@
 
+#include <memory>
 #include <queue>
+#include <vector>
 
 #include <blockfs.hpp>
 #include <core/virtio/core.hpp>
@@ -24,10 +26,15 @@ enum {
 	VIRTIO_BLK_T_OUT = 1
 };
 
+enum {
+	VIRTIO_BLK_F_MQ = 12
+};
+
 namespace spec::regs {
 	inline constexpr arch::scalar_register<uint32_t> capacity[] = {
 			arch::scalar_register<uint32_t>{0},
 			arch::scalar_register<uint32_t>{4}};
+	inline constexpr arch::scalar_register<uint16_t> numQueues{34};
 }
 
 struct Device;
@@ -64,23 +71,44 @@ struct Device : blockfs::BlockDevice {
 
 	async::result<size_t> getSize() override;
 
+	size_t queueDepth() override;
+
+	size_t maxTransferSectors() override {
+		return _maxSectors;
+	}
+
 private:
-	// Submits requests from _pendingQueue to the device.
-	async::detached _processRequests();
+	// Submission state of a single virtq.
+	struct RequestQueue {
+		virtio_core::Queue *virtq;
+
+		// Stores UserRequest objects that have not been submitted yet.
+		std::queue<UserRequest *> pendingQueue;
+		async::recurring_event pendingDoorbell;
+
+		// these two buffer store virtio-block request header and status bytes
+		// they are indexed by the index of the request's first descriptor
+		VirtRequest *virtRequestBuffer;
+		uint8_t *statusBuffer;
+	};
+
+	// Splits a transfer into requests and distributes them over all virtqs.
+	async::result<void> _transfer(bool write, uint64_t sector,
+			void *buffer, size_t num_sectors);
+
+	// Submits requests from the pending queue to the device.
+	async::detached _processRequests(RequestQueue *queue);
 
 	std::unique_ptr<virtio_core::Transport> _transport;
 
-	// The single virtq of this device.
-	virtio_core::Queue *_requestQueue;
+	// One entry per virtq (more than one if VIRTIO_BLK_F_MQ is negotiated).
+	std::vector<std::unique_ptr<RequestQueue>> _queues;
 
-	// Stores UserRequest objects that have not been submitted yet.
-	std::queue<UserRequest *> _pendingQueue;
-	async::recurring_event _pendingDoorbell;
+	// Requests are distributed round-robin over all virtqs.
+	size_t _nextQueue;
 
-	// these two buffer store virtio-block request header and status bytes
-	// they are indexed by the index of the request's first descriptor
-	VirtRequest *virtRequestBuffer;
-	uint8_t *statusBuffer;
+	// Maximal number of sectors per request.
+	size_t _maxSectors;
 
 	// The size of the disk
 	size_t _size;
@@ -1,6 +1,8 @@
 
 #include <stdint.h>
 #include <iostream>
+#include <map>
+#include <tuple>
 #include <vector>
 #include <fafnir/language.h>
 #include <lewis/elf/object.hpp>
@@ -15,6 +17,48 @@ struct Binding {
 	size_t disp;
 };
 
+// Items on the fafnir operand stack are only materialized into lewis values
+// once they are consumed. This allows us to fold constants (including constant
+// offsets that are added to bindings) and to drop unused items without
+// emitting any code for them.
+struct Operand {
+	enum class Kind {
+		value,
+		constant,
+		binding
+	};
+
+	static Operand ofValue(lewis::Value *value) {
+		Operand op;
+		op.kind = Kind::value;
+		op.value = value;
+		return op;
+	}
+
+	static Operand ofConstant(uint32_t constant) {
+		Operand op;
+		op.kind = Kind::constant;
+		op.constant = constant;
+		return op;
+	}
+
+	static Operand ofBinding(size_t index) {
+		Operand op;
+		op.kind = Kind::binding;
+		op.binding = index;
+		return op;
+	}
+
+	Kind kind = Kind::value;
+	lewis::Value *value = nullptr;
+	size_t binding = 0;
+	// For Kind::binding, this is added to the value of the binding.
+	uint32_t constant = 0;
+};
+
+// Identifies an MMIO read by its intrinsic, base binding and offset.
+using ReadKey = std::tuple<std::string, size_t, Operand::Kind, size_t, uint32_t>;
+
 struct Scope {
 	lewis::BasicBlock *insertBb = nullptr;
 	lewis::Value *instance = nullptr;
@@ -30,11 +74,92 @@ struct Compilation {
 	std::vector<Binding> bindings;
 
 	lewis::Function fn;
-	std::vector<lewis::Value *> opstack;
+	std::vector<Operand> opstack;
 	std::vector<Scope *> activeScopes;
 	std::vector<Ite> activeBlocks;
+
+	// Values that are available in cacheBb. Reset whenever we move to another BB.
+	lewis::BasicBlock *cacheBb = nullptr;
+	std::map<size_t, lewis::Value *> bindingCache;
+	std::map<ReadKey, lewis::Value *> readCache;
+
+	// Statistics of the optimizations that we performed.
+	int numFolded = 0;
+	int numDropped = 0;
+	int numFusedReads = 0;
 };
 
+namespace {
+
+void enterBlock(Compilation *comp, Scope *scope) {
+	if(comp->cacheBb == scope->insertBb)
+		return;
+	comp->cacheBb = scope->insertBb;
+	comp->bindingCache.clear();
+	comp->readCache.clear();
+}
+
+lewis::Value *loadBinding(Compilation *comp, Scope *scope, size_t index) {
+	enterBlock(comp, scope);
+	auto it = comp->bindingCache.find(index);
+	if(it != comp->bindingCache.end())
+		return it->second;
+
+	auto inst = scope->insertBb->insertNewInstruction<lewis::LoadOffsetInstruction>(
+			scope->instance, comp->bindings[index].disp);
+	auto result = inst->result.setNew<lewis::LocalValue>();
+	if(comp->bindings[index].type == BindType::offset) {
+		result->setType(lewis::globalInt32Type());
+	}else if(comp->bindings[index].type == BindType::memoryView) {
+		result->setType(lewis::globalPointerType());
+	}else if(comp->bindings[index].type == BindType::bitsetEvent) {
+		result->setType(lewis::globalPointerType());
+	}else assert(!"Unexpected binding type");
+	comp->bindingCache.insert({index, result});
+	return result;
+}
+
+lewis::Value *loadConstant(Scope *scope, uint32_t constant) {
+	auto inst = scope->insertBb->insertNewInstruction<lewis::LoadConstInstruction>(constant);
+	auto result = inst->result.setNew<lewis::LocalValue>();
+	result->setType(lewis::globalInt32Type());
+	return result;
+}
+
+// Emits the lewis instructions that are necessary to compute an operand.
+lewis::Value *materialize(Compilation *comp, Scope *scope, const Operand &op) {
+	if(op.kind == Operand::Kind::value)
+		return op.value;
+	if(op.kind == Operand::Kind::constant)
+		return loadConstant(scope, op.constant);
+
+	assert(op.kind == Operand::Kind::binding);
+	auto value = loadBinding(comp, scope, op.binding);
+	if(!op.constant)
+		return value;
+
+	auto inst = scope->insertBb->insertNewInstruction<lewis::BinaryMathInstruction>(
+			lewis::BinaryMathOpcode::add, value, loadConstant(scope, op.constant));
+	auto result = inst->result.setNew<lewis::LocalValue>();
+	result->setType(lewis::globalInt32Type());
+	return result;
+}
+
+bool isOffsetBinding(Compilation *comp, const Operand &op) {
+	return op.kind == Operand::Kind::binding
+			&& comp->bindings[op.binding].type == BindType::offset;
+}
+
+// Reads that only depend on bindings and constants can be fused with earlier reads
+// of the same register in the same BB. Any other intrinsic (e.g., MMIO writes) is
+// treated as a barrier; fafnir programs must not rely on read side effects otherwise.
+bool isFusableRead(const std::string &function, int nargs, int nrvs) {
+	return (function == "__mmio_read8" || function == "__mmio_read32")
+			&& nargs == 2 && nrvs == 1;
+}
+
+} // anonymous namespace
+
 std::vector<uint8_t> compileFafnir(const uint8_t *code, size_t size,
 		const std::vector<BindType> &bind_types) {
 	Compilation compilation;
@@ -88,48 +213,29 @@ std::vector<uint8_t> compileFafnir(const uint8_t *code, size_t size,
 			assert(comp->opstack.size() > index);
 			comp->opstack.push_back(comp->opstack[comp->opstack.size() - index - 1]);
 		}else if(opcode == FNR_OP_DROP) {
+			assert(comp->opstack.size());
+			if(comp->opstack.back().kind != Operand::Kind::value)
+				comp->numDropped++;
 			comp->opstack.pop_back();
 		}else if(opcode == FNR_OP_LITERAL) {
 			auto operand = extractUint();
-
-			auto inst = scope->insertBb->insertNewInstruction<lewis::LoadConstInstruction>(operand);
-			auto result = inst->result.setNew<lewis::LocalValue>();
-			result->setType(lewis::globalInt32Type());
-			comp->opstack.push_back(result);
+			comp->opstack.push_back(Operand::ofConstant(operand));
 		}else if(opcode == FNR_OP_BINDING) {
 			auto index = extractUint();
 			assert(index < comp->bindings.size());
-
-			if(comp->bindings[index].type == BindType::offset) {
-				auto inst = scope->insertBb->insertNewInstruction<lewis::LoadOffsetInstruction>(
-						scope->instance, comp->bindings[index].disp);
-				auto result = inst->result.setNew<lewis::LocalValue>();
-				result->setType(lewis::globalInt32Type());
-				comp->opstack.push_back(result);
-			}else if(comp->bindings[index].type == BindType::memoryView) {
-				auto inst = scope->insertBb->insertNewInstruction<lewis::LoadOffsetInstruction>(
-						scope->instance, comp->bindings[index].disp);
-				auto result = inst->result.setNew<lewis::LocalValue>();
-				result->setType(lewis::globalPointerType());
-				comp->opstack.push_back(result);
-			}else if(comp->bindings[index].type == BindType::bitsetEvent) {
-				auto inst = scope->insertBb->insertNewInstruction<lewis::LoadOffsetInstruction>(
-						scope->instance, comp->bindings[index].disp);
-				auto result = inst->result.setNew<lewis::LocalValue>();
-				result->setType(lewis::globalPointerType());
-				comp->opstack.push_back(result);
-			}else assert(!"Unexpected binding type");
+			comp->opstack.push_back(Operand::ofBinding(index));
 		}else if(opcode == FNR_OP_S_DEFINE) {
 			assert(comp->opstack.size());
 			auto operand = comp->opstack.back();
 			comp->opstack.pop_back();
 
-			scope->sstack.push_back(operand);
+			// sstack values are passed to other BBs through phis, hence they need to be values.
+			scope->sstack.push_back(materialize(comp, scope, operand));
 		}else if(opcode == FNR_OP_S_VALUE) {
 			auto index = extractUint();
 			assert(index < scope->sstack.size());
 
-			comp->opstack.push_back(scope->sstack[index]);
+			comp->opstack.push_back(Operand::ofValue(scope->sstack[index]));
 		}else if(opcode == FNR_OP_CHECK_IF) {
 			assert(comp->opstack.empty());
 			comp->activeBlocks.push_back(Ite{});
@@ -143,7 +249,7 @@ std::vector<uint8_t> compileFafnir(const uint8_t *code, size_t size,
 			comp->opstack.pop_back();
 
 			auto branch = outer->insertBb->setBranch(std::make_unique<lewis::ConditionalBranch>());
-			branch->operand = operand;
+			branch->operand = materialize(comp, outer, operand);
 
 			// Setup the scope with a new BB.
 			auto inner = new Scope;
@@ -269,7 +375,7 @@ std::vector<uint8_t> compileFafnir(const uint8_t *code, size_t size,
 
 				auto value = phi->value.setNew<lewis::LocalValue>();
 				value->setType(lewis::globalInt32Type());
-				comp->opstack.push_back(value);
+				comp->opstack.push_back(Operand::ofValue(value));
 			}
 
 			comp->activeBlocks.pop_back();
@@ -280,11 +386,18 @@ std::vector<uint8_t> compileFafnir(const uint8_t *code, size_t size,
 			auto left = comp->opstack.back();
 			comp->opstack.pop_back();
 
+			if(left.kind == Operand::Kind::constant && right.kind == Operand::Kind::constant) {
+				comp->opstack.push_back(Operand::ofConstant(left.constant & right.constant));
+				comp->numFolded++;
+				continue;
+			}
+
 			auto inst = scope->insertBb->insertNewInstruction<lewis::BinaryMathInstruction>(
-					lewis::BinaryMathOpcode::bitwiseAnd, left, right);
+					lewis::BinaryMathOpcode::bitwiseAnd,
+					materialize(comp, scope, left), materialize(comp, scope, right));
 			auto result = inst->result.setNew<lewis::LocalValue>();
 			result->setType(lewis::globalInt32Type());
-			comp->opstack.push_back(result);
+			comp->opstack.push_back(Operand::ofValue(result));
 		}else if(opcode == FNR_OP_ADD) {
 			assert(comp->opstack.size() >= 2);
 			auto right = comp->opstack.back();
@@ -292,29 +405,73 @@ std::vector<uint8_t> compileFafnir(const uint8_t *code, size_t size,
 			auto left = comp->opstack.back();
 			comp->opstack.pop_back();
 
+			if(left.kind == Operand::Kind::constant && right.kind == Operand::Kind::constant) {
+				comp->opstack.push_back(Operand::ofConstant(left.constant + right.constant));
+				comp->numFolded++;
+				continue;
+			}
+			if(isOffsetBinding(comp, left) && right.kind == Operand::Kind::constant) {
+				left.constant += right.constant;
+				comp->opstack.push_back(left);
+				comp->numFolded++;
+				continue;
+			}
+			if(left.kind == Operand::Kind::constant && isOffsetBinding(comp, right)) {
+				right.constant += left.constant;
+				comp->opstack.push_back(right);
+				comp->numFolded++;
+				continue;
+			}
+
 			auto inst = scope->insertBb->insertNewInstruction<lewis::BinaryMathInstruction>(
-					lewis::BinaryMathOpcode::add, left, right);
+					lewis::BinaryMathOpcode::add,
+					materialize(comp, scope, left), materialize(comp, scope, right));
 			auto result = inst->result.setNew<lewis::LocalValue>();
 			result->setType(lewis::globalInt32Type());
-			comp->opstack.push_back(result);
+			comp->opstack.push_back(Operand::ofValue(result));
 		}else if(opcode == FNR_OP_INTRIN) {
 			int nargs = extractUint();
 			int nrvs = extractUint();
 			auto function = extractString();
 			assert(comp->opstack.size() >= static_cast<size_t>(nargs));
 
+			enterBlock(comp, scope);
+			std::vector<Operand> args{comp->opstack.end() - nargs, comp->opstack.end()};
+			comp->opstack.resize(comp->opstack.size() - nargs);
+
+			bool fusable = isFusableRead(function, nargs, nrvs)
+					&& args[0].kind == Operand::Kind::binding && !args[0].constant
+					&& args[1].kind != Operand::Kind::value;
+			ReadKey key;
+			if(fusable) {
+				key = {function, args[0].binding, args[1].kind, args[1].binding, args[1].constant};
+				auto it = comp->readCache.find(key);
+				if(it != comp->readCache.end()) {
+					comp->opstack.push_back(Operand::ofValue(it->second));
+					comp->numFusedReads++;
+					continue;
+				}
+			}else{
+				// Other intrinsics may have side effects; do not fuse reads across them.
+				comp->readCache.clear();
+			}
+
+			std::vector<lewis::Value *> values;
+			for(int i = 0; i < nargs; i++)
+				values.push_back(materialize(comp, scope, args[i]));
+
 			auto inst = scope->insertBb->insertNewInstruction<lewis::InvokeInstruction>(
 					std::move(function), nargs, nrvs);
-			for(int i = nargs - 1; i >= 0; i--) {
-				inst->operand(i) = comp->opstack.back();
-				comp->opstack.pop_back();
-			}
+			for(int i = 0; i < nargs; i++)
+				inst->operand(i) = values[i];
 
 			for(int i = 0; i < nrvs; i++) {
 				auto result = inst->result(i).setNew<lewis::LocalValue>();
 				result->setType(lewis::globalInt32Type());
-				comp->opstack.push_back(result);
+				comp->opstack.push_back(Operand::ofValue(result));
 			}
+			if(fusable)
+				comp->readCache.insert({key, comp->opstack.back().value});
 		}else{
 			std::cerr << "FNR opcode: " << opcode << std::endl;
 			assert(!"Unexpected fafnir opcode");
@@ -325,11 +482,16 @@ std::vector<uint8_t> compileFafnir(const uint8_t *code, size_t size,
 	Scope *final_scope = comp->activeScopes.back();
 
 	assert(comp->opstack.size() == 1);
+	auto rv = materialize(comp, final_scope, comp->opstack.back());
     auto branch = final_scope->insertBb->setBranch(std::make_unique<lewis::FunctionReturnBranch>(1));
-	branch->operand(0) = comp->opstack.back();
+	branch->operand(0) = rv;
 	comp->opstack.pop_back();
 	assert(comp->opstack.empty());
 
+	std::cout << "kernletcc: Folded " << comp->numFolded << " operations, dropped "
+			<< comp->numDropped << " stack items, fused "
+			<< comp->numFusedReads << " MMIO reads" << std::endl;
+
 	// Lower to x86_64 and emit machine code.
 	std::cout << "kernletcc: Invoking lewis for compilation" << std::endl;
 	for(auto bb : comp->fn.blocks()) {
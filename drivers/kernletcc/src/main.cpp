@@ -2,6 +2,8 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <iostream>
+#include <string>
+#include <unordered_map>
 
 #include <async/oneshot-event.hpp>
 #include <helix/memory.hpp>
@@ -78,6 +80,26 @@ async::result<helix::UniqueDescriptor> upload(const void *elf, size_t size,
 	co_return pull_kernlet.descriptor();
 }
 
+// ----------------------------------------------------------------------------
+// Cache of compiled kernlets.
+// ----------------------------------------------------------------------------
+
+// Drivers upload the same kernlets each time they are started. Since the kernel
+// objects are immutable, we can hand out the same object for identical programs.
+// The cache is keyed by the full content (bind types + fafnir code), hence
+// hash collisions are resolved by std::unordered_map.
+std::unordered_map<std::string, helix::UniqueDescriptor> kernletCache;
+
+std::string makeCacheKey(const void *code, size_t size,
+		const std::vector<BindType> &bind_types) {
+	std::string key;
+	key.push_back(static_cast<char>(bind_types.size()));
+	for(auto bt : bind_types)
+		key.push_back(static_cast<char>(bt));
+	key.append(reinterpret_cast<const char *>(code), size);
+	return key;
+}
+
 // ----------------------------------------------------------------------------
 // kernletcc mbus interface.
 // ----------------------------------------------------------------------------
@@ -117,21 +139,29 @@ async::detached serveCompiler(helix::UniqueLane lane) {
 				bind_types.push_back(bt);
 			}
 
-			auto elf = compileFafnir(reinterpret_cast<const uint8_t *>(recv_code.data()),
-					recv_code.length(), bind_types);
-
-			if(dumpHex) {
-				for(size_t i = 0; i < elf.size(); i++) {
-					printf("%02x", elf[i]);
-					if((i % 32) == 31)
-						putchar('\n');
-					else if((i % 8) == 7)
-						putchar(' ');
+			auto key = makeCacheKey(recv_code.data(), recv_code.length(), bind_types);
+			auto it = kernletCache.find(key);
+			if(it == kernletCache.end()) {
+				auto elf = compileFafnir(reinterpret_cast<const uint8_t *>(recv_code.data()),
+						recv_code.length(), bind_types);
+
+				if(dumpHex) {
+					for(size_t i = 0; i < elf.size(); i++) {
+						printf("%02x", elf[i]);
+						if((i % 32) == 31)
+							putchar('\n');
+						else if((i % 8) == 7)
+							putchar(' ');
+					}
+					putchar('\n');
 				}
-				putchar('\n');
-			}
 
-			auto object = co_await upload(elf.data(), elf.size(), bind_types);
+				auto object = co_await upload(elf.data(), elf.size(), bind_types);
+				it = kernletCache.insert({std::move(key), std::move(object)}).first;
+			}else{
+				std::cout << "kernletcc: Using cached kernlet" << std::endl;
+			}
+			helix::BorrowedDescriptor object{it->second};
 
 			managarm::kernlet::SvrResponse resp;
 			resp.set_error(managarm::kernlet::Error::SUCCESS);
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <async/result.hpp>
+#include <stddef.h>
 #include <stdint.h>
 
 namespace blockfs {
@@ -19,6 +20,23 @@ struct BlockDevice {
 
 	virtual async::result<size_t> getSize() = 0;
 
+	// Maximal number of requests that the driver processes concurrently.
+	// libblockfs never has more requests in flight than this.
+	virtual size_t queueDepth() {
+		return 1;
+	}
+
+	// Maximal number of sectors per request. Larger requests are split
+	// and merged requests never exceed this limit.
+	virtual size_t maxTransferSectors() {
+		return 0x10000 / sectorSize;
+	}
+
+	// While a device is plugged, requests are queued but not dispatched.
+	// This gives the request queue a chance to merge them. Calls nest.
+	virtual void plug() { }
+	virtual void unplug() { }
+
 	size_t size;
 	const size_t sectorSize;
 	const int64_t parentId;
@@ -22,6 +22,215 @@ namespace {
 
 	constexpr int pageShift = 12;
 	constexpr size_t pageSize = size_t{1} << pageShift;
+
+	// Number of blocks that are reserved for files that are appended to.
+	constexpr size_t reservationBlocks = 256;
+
+	// Returns the first bit in [bit, limit) that is set (or clear), or limit if there is none.
+	size_t scanBitmap(const uint64_t *words, size_t bit, size_t limit, bool set) {
+		while(bit < limit) {
+			auto word = set ? words[bit / 64] : ~words[bit / 64];
+			word >>= bit % 64;
+			if(word)
+				return std::min(bit + __builtin_ctzll(word), limit);
+			bit = (bit / 64 + 1) * 64;
+		}
+		return limit;
+	}
+
+	void setBits(uint64_t *words, size_t bit, size_t count) {
+		while(count) {
+			auto n = std::min(count, 64 - bit % 64);
+			auto mask = (n == 64 ? ~uint64_t(0) : (uint64_t(1) << n) - 1) << (bit % 64);
+			assert(!(words[bit / 64] & mask));
+			words[bit / 64] |= mask;
+			bit += n;
+			count -= n;
+		}
+	}
+
+	void clearBits(uint64_t *words, size_t bit, size_t count) {
+		while(count) {
+			auto n = std::min(count, 64 - bit % 64);
+			auto mask = (n == 64 ? ~uint64_t(0) : (uint64_t(1) << n) - 1) << (bit % 64);
+			assert((words[bit / 64] & mask) == mask);
+			words[bit / 64] &= ~mask;
+			bit += n;
+			count -= n;
+		}
+	}
+}
+
+// --------------------------------------------------------
+// Directory hashing
+// --------------------------------------------------------
+
+// These functions follow the reference implementation in fs/ext4/hash.c of Linux.
+
+namespace {
+	uint32_t rotateLeft(uint32_t x, int s) {
+		return (x << s) | (x >> (32 - s));
+	}
+
+	void teaTransform(uint32_t *buf, const uint32_t *in) {
+		uint32_t sum = 0;
+		uint32_t b0 = buf[0], b1 = buf[1];
+		uint32_t a = in[0], b = in[1], c = in[2], d = in[3];
+
+		for(int n = 0; n < 16; n++) {
+			sum += 0x9E3779B9;
+			b0 += ((b1 << 4) + a) ^ (b1 + sum) ^ ((b1 >> 5) + b);
+			b1 += ((b0 << 4) + c) ^ (b0 + sum) ^ ((b0 >> 5) + d);
+		}
+
+		buf[0] += b0;
+		buf[1] += b1;
+	}
+
+	void halfMd4Transform(uint32_t *buf, const uint32_t *in) {
+		auto f = [] (uint32_t x, uint32_t y, uint32_t z) { return z ^ (x & (y ^ z)); };
+		auto g = [] (uint32_t x, uint32_t y, uint32_t z) { return (x & y) + ((x ^ y) & z); };
+		auto h = [] (uint32_t x, uint32_t y, uint32_t z) { return x ^ y ^ z; };
+		auto round = [] (auto fn, uint32_t &a, uint32_t b, uint32_t c, uint32_t d,
+				uint32_t x, int s) {
+			a = rotateLeft(a + fn(b, c, d) + x, s);
+		};
+		constexpr uint32_t k2 = 0x5A827999;
+		constexpr uint32_t k3 = 0x6ED9EBA1;
+
+		uint32_t a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+
+		round(f, a, b, c, d, in[0], 3);
+		round(f, d, a, b, c, in[1], 7);
+		round(f, c, d, a, b, in[2], 11);
+		round(f, b, c, d, a, in[3], 19);
+		round(f, a, b, c, d, in[4], 3);
+		round(f, d, a, b, c, in[5], 7);
+		round(f, c, d, a, b, in[6], 11);
+		round(f, b, c, d, a, in[7], 19);
+
+		round(g, a, b, c, d, in[1] + k2, 3);
+		round(g, d, a, b, c, in[3] + k2, 5);
+		round(g, c, d, a, b, in[5] + k2, 9);
+		round(g, b, c, d, a, in[7] + k2, 13);
+		round(g, a, b, c, d, in[0] + k2, 3);
+		round(g, d, a, b, c, in[2] + k2, 5);
+		round(g, c, d, a, b, in[4] + k2, 9);
+		round(g, b, c, d, a, in[6] + k2, 13);
+
+		round(h, a, b, c, d, in[3] + k3, 3);
+		round(h, d, a, b, c, in[7] + k3, 9);
+		round(h, c, d, a, b, in[2] + k3, 11);
+		round(h, b, c, d, a, in[6] + k3, 15);
+		round(h, a, b, c, d, in[1] + k3, 3);
+		round(h, d, a, b, c, in[5] + k3, 9);
+		round(h, c, d, a, b, in[0] + k3, 11);
+		round(h, b, c, d, a, in[4] + k3, 15);
+
+		buf[0] += a;
+		buf[1] += b;
+		buf[2] += c;
+		buf[3] += d;
+	}
+
+	// The character type determines the sign extension of non-ASCII names.
+	template<typename Char>
+	uint32_t legacyHash(const char *name, size_t length) {
+		uint32_t hash0 = 0x12A3FE2D, hash1 = 0x37ABE8F9;
+		auto p = reinterpret_cast<const Char *>(name);
+		for(size_t i = 0; i < length; i++) {
+			uint32_t hash = hash1 + (hash0 ^ static_cast<uint32_t>(int{p[i]} * 7152373));
+			if(hash & 0x80000000)
+				hash -= 0x7FFFFFFF;
+			hash1 = hash0;
+			hash0 = hash;
+		}
+		return hash0 << 1;
+	}
+
+	template<typename Char>
+	void nameToBuffer(const char *name, size_t length, uint32_t *buf, int num) {
+		auto p = reinterpret_cast<const Char *>(name);
+		uint32_t pad = static_cast<uint32_t>(length) | (static_cast<uint32_t>(length) << 8);
+		pad |= pad << 16;
+
+		uint32_t val = pad;
+		length = std::min(length, static_cast<size_t>(num) * 4);
+		for(size_t i = 0; i < length; i++) {
+			val = static_cast<uint32_t>(int{p[i]}) + (val << 8);
+			if((i % 4) == 3) {
+				*buf++ = val;
+				val = pad;
+				num--;
+			}
+		}
+		if(--num >= 0)
+			*buf++ = val;
+		while(--num >= 0)
+			*buf++ = pad;
+	}
+
+	template<typename Char>
+	uint32_t halfMd4Hash(uint32_t *buf, const char *name, size_t length) {
+		uint32_t in[8];
+		for(size_t i = 0; i < length; i += 32) {
+			nameToBuffer<Char>(name + i, length - i, in, 8);
+			halfMd4Transform(buf, in);
+		}
+		return buf[1];
+	}
+
+	template<typename Char>
+	uint32_t teaHash(uint32_t *buf, const char *name, size_t length) {
+		uint32_t in[4];
+		for(size_t i = 0; i < length; i += 16) {
+			nameToBuffer<Char>(name + i, length - i, in, 4);
+			teaTransform(buf, in);
+		}
+		return buf[0];
+	}
+
+	FileType toFileType(uint8_t type) {
+		switch(type) {
+		case EXT2_FT_REG_FILE:
+			return kTypeRegular;
+		case EXT2_FT_DIR:
+			return kTypeDirectory;
+		case EXT2_FT_SYMLINK:
+			return kTypeSymlink;
+		default:
+			return kTypeNone;
+		}
+	}
+
+	size_t entrySize(size_t name_length) {
+		return (sizeof(DiskDirEntry) + name_length + 3) & ~size_t(3);
+	}
+}
+
+uint32_t hashDirName(int version, const uint32_t *seed, const char *name, size_t length) {
+	uint32_t buf[4] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476};
+	if(seed[0] || seed[1] || seed[2] || seed[3])
+		memcpy(buf, seed, sizeof(buf));
+
+	uint32_t hash;
+	switch(version) {
+	case DX_HASH_LEGACY: hash = legacyHash<signed char>(name, length); break;
+	case DX_HASH_LEGACY_UNSIGNED: hash = legacyHash<unsigned char>(name, length); break;
+	case DX_HASH_HALF_MD4: hash = halfMd4Hash<signed char>(buf, name, length); break;
+	case DX_HASH_HALF_MD4_UNSIGNED: hash = halfMd4Hash<unsigned char>(buf, name, length); break;
+	case DX_HASH_TEA: hash = teaHash<signed char>(buf, name, length); break;
+	case DX_HASH_TEA_UNSIGNED: hash = teaHash<unsigned char>(buf, name, length); break;
+	default:
+		assert(!"unexpected hash version");
+		abort();
+	}
+
+	// The largest hash value is reserved as an end-of-directory marker.
+	hash &= ~uint32_t(1);
+	if(hash == 0xFFFFFFFE)
+		hash = 0xFFFFFFFC;
+	return hash;
 }
 
 // --------------------------------------------------------
@@ -31,19 +240,105 @@ namespace {
 Inode::Inode(FileSystem &fs, uint32_t number)
 : fs(fs), number(number), isReady(false) { }
 
+Inode::~Inode() {
+	fs.releaseReservation(this);
+}
+
 void Inode::setFileSize(size_t size) {
 	assert(!(size & ~uint64_t(0xFFFFFFFF)));
 	diskInode()->size = size;
 }
 
-async::result<frg::expected<protocols::fs::Error, std::optional<DirEntry>>>
-Inode::findEntry(std::string name) {
-	co_await readyJump.wait();
+DiskDirEntry *Inode::findInBlock(size_t begin, size_t end, const std::string &name,
+		DiskDirEntry **previous) {
+	auto base = reinterpret_cast<char *>(fileMapping.get());
 
-	if(fileType != kTypeDirectory)
-		co_return protocols::fs::Error::notDirectory;
-	assert(fileMapping.size() == fileSize());
+	*previous = nullptr;
+	uintptr_t offset = begin;
+	while(offset < end) {
+		assert(!(offset & 3));
+		assert(offset + sizeof(DiskDirEntry) <= end);
+		auto disk_entry = reinterpret_cast<DiskDirEntry *>(base + offset);
+		assert(disk_entry->recordLength);
+
+		if(disk_entry->inode
+				&& name.length() == disk_entry->nameLength
+				&& !memcmp(disk_entry->name, name.data(), name.length()))
+			return disk_entry;
+
+		offset += disk_entry->recordLength;
+		*previous = disk_entry;
+	}
+	assert(offset == end);
+
+	return nullptr;
+}
+
+std::optional<std::pair<size_t, size_t>> Inode::findSlot(size_t begin, size_t end,
+		size_t required) {
+	auto base = reinterpret_cast<char *>(fileMapping.get());
+
+	uintptr_t offset = begin;
+	while(offset < end) {
+		assert(!(offset & 3));
+		assert(offset + sizeof(DiskDirEntry) <= end);
+		auto previous_entry = reinterpret_cast<DiskDirEntry *>(base + offset);
+		assert(previous_entry->recordLength);
 
+		// Unused records can be taken over entirely (except for checksum entries).
+		if(!previous_entry->inode) {
+			if(previous_entry->fileType != EXT4_FT_DIR_CSUM
+					&& previous_entry->recordLength >= required)
+				return std::pair<size_t, size_t>{offset, previous_entry->recordLength};
+			offset += previous_entry->recordLength;
+			continue;
+		}
+
+		// Calculate available space after we contract previous_entry.
+		auto contracted = entrySize(previous_entry->nameLength);
+		assert(previous_entry->recordLength >= contracted);
+		auto available = previous_entry->recordLength - contracted;
+
+		// Check whether we can shrink previous_entry and insert a new entry after it.
+		if(available >= required) {
+			previous_entry->recordLength = contracted;
+			return std::pair<size_t, size_t>{offset + contracted, available};
+		}
+
+		offset += previous_entry->recordLength;
+	}
+	assert(offset == end);
+
+	return std::nullopt;
+}
+
+void Inode::rewriteBlock(size_t block, const std::vector<DiskDirEntry *> &entries) {
+	// The entries may point into the block itself, so we assemble it in a separate buffer.
+	std::vector<char> buffer(fs.blockSize);
+	DiskDirEntry *last = nullptr;
+	size_t offset = 0;
+	for(auto entry : entries) {
+		auto size = entrySize(entry->nameLength);
+		assert(offset + size <= fs.blockSize);
+		auto copy = reinterpret_cast<DiskDirEntry *>(buffer.data() + offset);
+		memcpy(copy, entry, sizeof(DiskDirEntry) + entry->nameLength);
+		copy->recordLength = size;
+		offset += size;
+		last = copy;
+	}
+
+	// The last record extends to the end of the block.
+	if(last) {
+		last->recordLength += fs.blockSize - offset;
+	}else{
+		reinterpret_cast<DiskDirEntry *>(buffer.data())->recordLength = fs.blockSize;
+	}
+
+	memcpy(reinterpret_cast<char *>(fileMapping.get()) + block * fs.blockSize,
+			buffer.data(), fs.blockSize);
+}
+
+async::result<helix::UniqueDescriptor> Inode::lockDirectory() {
 	helix::LockMemoryView lock_memory;
 	auto map_size = (fileSize() + 0xFFF) & ~size_t(0xFFF);
 	auto &&submit = helix::submitLockMemoryView(helix::BorrowedDescriptor(frontalMemory),
@@ -52,6 +347,370 @@ Inode::findEntry(std::string name) {
 	co_await submit.async_wait();
 	HEL_CHECK(lock_memory.error());
 
+	co_return lock_memory.descriptor();
+}
+
+async::result<size_t> Inode::growDirectory() {
+	assert(!(fileSize() & (fs.blockSize - 1)));
+	auto block = fileSize() >> fs.blockShift;
+	auto newSize = fileSize() + fs.blockSize;
+	setFileSize(newSize);
+	co_await fs.assignDataBlocks(this, block, 1);
+	HEL_CHECK(helResizeMemory(backingMemory, (newSize + 0xFFF) & ~size_t(0xFFF)));
+	fileMapping = helix::Mapping{helix::BorrowedDescriptor{frontalMemory},
+			0, newSize,
+			kHelMapProtRead | kHelMapProtWrite | kHelMapDontRequireBacking};
+
+	// Initialize the block with a single unused record.
+	auto lock = co_await lockDirectory();
+	auto disk_entry = reinterpret_cast<DiskDirEntry *>(
+			reinterpret_cast<char *>(fileMapping.get()) + block * fs.blockSize);
+	memset(disk_entry, 0, sizeof(DiskDirEntry));
+	disk_entry->recordLength = fs.blockSize;
+
+	co_return block;
+}
+
+DiskDxRootInfo *Inode::dxRootInfo() {
+	// The root info follows the "." and ".." entries.
+	return reinterpret_cast<DiskDxRootInfo *>(
+			reinterpret_cast<char *>(fileMapping.get()) + 24);
+}
+
+DiskDxEntry *Inode::dxEntries(size_t block) {
+	auto base = reinterpret_cast<char *>(fileMapping.get()) + block * fs.blockSize;
+	if(!block)
+		return reinterpret_cast<DiskDxEntry *>(base + 24 + dxRootInfo()->infoLength);
+	return reinterpret_cast<DiskDxEntry *>(base + sizeof(DiskDirEntry));
+}
+
+std::optional<uint32_t> Inode::dxHash(const std::string &name) {
+	auto info = dxRootInfo();
+	if(fileSize() < 2 * fs.blockSize || info->reservedZero
+			|| info->hashVersion > DX_HASH_TEA
+			|| info->infoLength != sizeof(DiskDxRootInfo)
+			|| info->indirectLevels > 1)
+		return std::nullopt;
+
+	int version = info->hashVersion;
+	if(fs.unsignedHash)
+		version += DX_HASH_LEGACY_UNSIGNED;
+	return hashDirName(version, fs.hashSeed, name.data(), name.size());
+}
+
+std::optional<size_t> Inode::dxProbe(uint32_t hash, std::vector<DxFrame> &path) {
+	auto num_blocks = fileSize() >> fs.blockShift;
+
+	path.clear();
+	size_t block = 0;
+	for(size_t level = 0; level <= dxRootInfo()->indirectLevels; level++) {
+		auto entries = dxEntries(block);
+		auto count_limit = reinterpret_cast<DiskDxCountLimit *>(entries);
+		auto max_limit = (fs.blockSize - (reinterpret_cast<char *>(entries)
+				- reinterpret_cast<char *>(fileMapping.get()) - block * fs.blockSize))
+				/ sizeof(DiskDxEntry);
+		if(!count_limit->count || count_limit->count > count_limit->limit
+				|| count_limit->limit > max_limit)
+			return std::nullopt;
+
+		// Find the last entry whose hash is not larger than the hash that we are looking for.
+		size_t lo = 1;
+		size_t hi = count_limit->count;
+		while(lo < hi) {
+			auto mid = (lo + hi) / 2;
+			if(entries[mid].hash > hash) {
+				hi = mid;
+			}else{
+				lo = mid + 1;
+			}
+		}
+		path.push_back({block, lo - 1});
+
+		block = entries[lo - 1].block & 0x0FFFFFFF;
+		if(!block || block >= num_blocks)
+			return std::nullopt;
+	}
+
+	return block;
+}
+
+std::optional<size_t> Inode::dxNextLeaf(uint32_t hash, std::vector<DxFrame> &path) {
+	auto num_blocks = fileSize() >> fs.blockShift;
+
+	// Find the deepest node that has another entry after the current one.
+	size_t level = path.size();
+	while(true) {
+		if(!level)
+			return std::nullopt;
+		level--;
+		auto count_limit = reinterpret_cast<DiskDxCountLimit *>(dxEntries(path[level].block));
+		if(path[level].position + 1 < count_limit->count)
+			break;
+	}
+
+	// Names with the same hash can only continue in the next block if its hash matches.
+	auto entries = dxEntries(path[level].block);
+	path[level].position++;
+	if((entries[path[level].position].hash & ~uint32_t(1)) != hash)
+		return std::nullopt;
+
+	// Descend to the leftmost leaf below that entry.
+	auto block = entries[path[level].position].block & 0x0FFFFFFF;
+	for(level++; level < path.size(); level++) {
+		if(!block || block >= num_blocks)
+			return std::nullopt;
+		path[level] = {block, 0};
+		block = dxEntries(block)[0].block & 0x0FFFFFFF;
+	}
+	if(!block || block >= num_blocks)
+		return std::nullopt;
+
+	return block;
+}
+
+void Inode::dxInsert(size_t block, size_t position, uint32_t hash, size_t target) {
+	auto entries = dxEntries(block);
+	auto count_limit = reinterpret_cast<DiskDxCountLimit *>(entries);
+	assert(position >= 1 && position <= count_limit->count);
+	assert(count_limit->count < count_limit->limit);
+
+	memmove(entries + position + 1, entries + position,
+			(count_limit->count - position) * sizeof(DiskDxEntry));
+	entries[position].hash = hash;
+	entries[position].block = target;
+	count_limit->count++;
+}
+
+bool Inode::dxLookup(const std::string &name, DiskDirEntry **entry, DiskDirEntry **previous) {
+	auto hash = dxHash(name);
+	if(!hash)
+		return false;
+
+	std::vector<DxFrame> path;
+	auto leaf = dxProbe(*hash, path);
+	if(!leaf)
+		return false;
+
+	*entry = nullptr;
+	while(leaf) {
+		auto begin = *leaf << fs.blockShift;
+		*entry = findInBlock(begin, begin + fs.blockSize, name, previous);
+		if(*entry)
+			break;
+		leaf = dxNextLeaf(*hash, path);
+	}
+	return true;
+}
+
+async::result<std::optional<std::pair<size_t, size_t>>>
+Inode::dxFindSlot(const std::string &name, size_t required) {
+	auto count_limit = [&] (size_t block) {
+		return reinterpret_cast<DiskDxCountLimit *>(dxEntries(block));
+	};
+
+	auto hash = dxHash(name);
+	std::vector<DxFrame> path;
+	std::optional<size_t> leaf;
+	if(hash)
+		leaf = dxProbe(*hash, path);
+	if(!leaf) {
+		co_await dxDrop();
+		co_return std::nullopt;
+	}
+
+	auto begin = *leaf << fs.blockShift;
+	if(auto slot = findSlot(begin, begin + fs.blockSize, required); slot)
+		co_return slot;
+
+	// The leaf is full and has to be split. Check that its index node can take another entry.
+	bool split_index = count_limit(path.back().block)->count
+			== count_limit(path.back().block)->limit;
+	if(split_index && path.size() > 1
+			&& count_limit(path.front().block)->count == count_limit(path.front().block)->limit) {
+		// TODO: Support more than one level of index nodes.
+		co_await dxDrop();
+		co_return std::nullopt;
+	}
+
+	// Allocate all blocks before modifying the index such that it is never inconsistent.
+	size_t new_node = 0;
+	if(split_index)
+		new_node = co_await growDirectory();
+	auto new_leaf = co_await growDirectory();
+	auto lock = co_await lockDirectory();
+	auto base = reinterpret_cast<char *>(fileMapping.get());
+
+	if(split_index) {
+		// growDirectory() already set up the empty record at the start of the node.
+		auto new_entries = dxEntries(new_node);
+		auto node_limit = (fs.blockSize - sizeof(DiskDirEntry)) / sizeof(DiskDxEntry);
+
+		if(path.size() == 1) {
+			// Move all entries of the root to the new node; this adds a level to the tree.
+			auto root_entries = dxEntries(0);
+			memcpy(new_entries, root_entries, count_limit(0)->count * sizeof(DiskDxEntry));
+			count_limit(new_node)->limit = node_limit;
+			count_limit(0)->count = 1;
+			root_entries[0].block = new_node;
+			dxRootInfo()->indirectLevels = 1;
+
+			path.back().block = new_node;
+			path.insert(path.begin(), DxFrame{0, 0});
+		}else{
+			// Move the upper half of the node to the new node.
+			auto &bottom = path.back();
+			auto entries = dxEntries(bottom.block);
+			size_t count = count_limit(bottom.block)->count;
+			size_t half = count / 2;
+			auto split_hash = entries[half].hash;
+			memcpy(new_entries, entries + half, (count - half) * sizeof(DiskDxEntry));
+			count_limit(new_node)->limit = node_limit;
+			count_limit(new_node)->count = count - half;
+			count_limit(bottom.block)->count = half;
+			dxInsert(path.front().block, path.front().position + 1, split_hash, new_node);
+
+			if(bottom.position >= half) {
+				bottom.block = new_node;
+				bottom.position -= half;
+			}
+		}
+	}
+
+	// Sort the entries of the leaf by hash and move the upper half to the new leaf.
+	struct HashedEntry {
+		uint32_t hash;
+		DiskDirEntry *entry;
+	};
+	std::vector<HashedEntry> hashed;
+	size_t total = 0;
+	begin = *leaf << fs.blockShift;
+	for(size_t offset = begin; offset < begin + fs.blockSize; ) {
+		auto disk_entry = reinterpret_cast<DiskDirEntry *>(base + offset);
+		if(disk_entry->inode) {
+			hashed.push_back({*dxHash(std::string(disk_entry->name, disk_entry->nameLength)),
+					disk_entry});
+			total += entrySize(disk_entry->nameLength);
+		}
+		offset += disk_entry->recordLength;
+	}
+	std::stable_sort(hashed.begin(), hashed.end(), [] (const auto &a, const auto &b) {
+		return a.hash < b.hash;
+	});
+
+	if(hashed.size() < 2) {
+		co_await dxDrop();
+		co_return std::nullopt;
+	}
+
+	// Split by size such that both halves end up with a similar amount of free space.
+	size_t split = hashed.size() - 1;
+	size_t moved = entrySize(hashed[split].entry->nameLength);
+	while(split > 1 && moved + entrySize(hashed[split - 1].entry->nameLength) <= total / 2) {
+		split--;
+		moved += entrySize(hashed[split].entry->nameLength);
+	}
+
+	// If the hash continues in the new leaf, lookups need to visit both leaves.
+	auto split_hash = hashed[split].hash;
+	if(hashed[split - 1].hash == split_hash)
+		split_hash |= 1;
+
+	std::vector<DiskDirEntry *> lower;
+	std::vector<DiskDirEntry *> upper;
+	for(size_t i = 0; i < hashed.size(); i++)
+		(i < split ? lower : upper).push_back(hashed[i].entry);
+	rewriteBlock(new_leaf, upper);
+	rewriteBlock(*leaf, lower);
+	dxInsert(path.back().block, path.back().position + 1, split_hash, new_leaf);
+
+	auto target = (*hash >= split_hash) ? new_leaf : *leaf;
+	begin = target << fs.blockShift;
+	auto slot = findSlot(begin, begin + fs.blockSize, required);
+	if(!slot) {
+		co_await dxDrop();
+		co_return std::nullopt;
+	}
+	co_return slot;
+}
+
+async::result<bool> Inode::dxCreateIndex() {
+	auto dot_dot = reinterpret_cast<DiskDirEntry *>(
+			reinterpret_cast<char *>(fileMapping.get()) + 12);
+	if(fileSize() != fs.blockSize
+			|| reinterpret_cast<DiskDirEntry *>(fileMapping.get())->recordLength != 12
+			|| dot_dot->nameLength != 2 || memcmp(dot_dot->name, "..", 2))
+		co_return false;
+
+	auto new_leaf = co_await growDirectory();
+	auto lock = co_await lockDirectory();
+	auto base = reinterpret_cast<char *>(fileMapping.get());
+	dot_dot = reinterpret_cast<DiskDirEntry *>(base + 12);
+
+	// Move all entries except for "." and ".." to the new leaf.
+	std::vector<DiskDirEntry *> moved;
+	for(size_t offset = 12 + dot_dot->recordLength; offset < fs.blockSize; ) {
+		auto disk_entry = reinterpret_cast<DiskDirEntry *>(base + offset);
+		if(disk_entry->inode)
+			moved.push_back(disk_entry);
+		offset += disk_entry->recordLength;
+	}
+	rewriteBlock(new_leaf, moved);
+
+	// Turn the remainder of block 0 into the root of the index.
+	dot_dot->recordLength = fs.blockSize - 12;
+	auto info = dxRootInfo();
+	memset(info, 0, sizeof(DiskDxRootInfo));
+	info->hashVersion = fs.defaultHashVersion;
+	info->infoLength = sizeof(DiskDxRootInfo);
+
+	auto entries = dxEntries(0);
+	auto count_limit = reinterpret_cast<DiskDxCountLimit *>(entries);
+	count_limit->limit = (fs.blockSize - 24 - sizeof(DiskDxRootInfo)) / sizeof(DiskDxEntry);
+	count_limit->count = 1;
+	entries[0].block = new_leaf;
+
+	diskInode()->flags |= EXT2_INDEX_FL;
+	auto syncInode = co_await helix_ng::synchronizeSpace(
+			helix::BorrowedDescriptor{kHelNullHandle},
+			diskMapping.get(), fs.inodeSize);
+	HEL_CHECK(syncInode.error());
+
+	co_return true;
+}
+
+async::result<void> Inode::dxDrop() {
+	// Index nodes look like unused records, so the directory remains valid without the index.
+	std::cout << "ext2fs: Dropping unsupported directory index of inode "
+			<< number << std::endl;
+	diskInode()->flags &= ~EXT2_INDEX_FL;
+	auto syncInode = co_await helix_ng::synchronizeSpace(
+			helix::BorrowedDescriptor{kHelNullHandle},
+			diskMapping.get(), fs.inodeSize);
+	HEL_CHECK(syncInode.error());
+}
+
+std::optional<DirEntry> Inode::lookupEntry(const std::string &name) {
+	if(nameCacheValid) {
+		auto it = nameCache.find(name);
+		if(it == nameCache.end())
+			return std::nullopt;
+		return it->second;
+	}
+
+	if(usesIndex()) {
+		DiskDirEntry *disk_entry;
+		DiskDirEntry *previous_entry;
+		if(dxLookup(name, &disk_entry, &previous_entry)) {
+			if(!disk_entry)
+				return std::nullopt;
+			return DirEntry{disk_entry->inode, toFileType(disk_entry->fileType)};
+		}
+		// Otherwise, fall back to a linear search.
+	}
+
+	// Large directories without an index are scanned once to populate the name cache.
+	bool populate = !usesIndex() && fileSize() >= nameCacheThreshold;
+
 	// Read the directory structure.
 	uintptr_t offset = 0;
 	while(offset < fileSize()) {
@@ -61,31 +720,47 @@ Inode::findEntry(std::string name) {
 				reinterpret_cast<char *>(fileMapping.get()) + offset);
 		assert(disk_entry->recordLength);
 
-		if(disk_entry->inode
+		if(populate && disk_entry->inode) {
+			nameCache.emplace(std::string(disk_entry->name, disk_entry->nameLength),
+					DirEntry{disk_entry->inode, toFileType(disk_entry->fileType)});
+		}else if(disk_entry->inode
 				&& name.length() == disk_entry->nameLength
 				&& !memcmp(disk_entry->name, name.data(), name.length())) {
-			DirEntry entry;
-			entry.inode = disk_entry->inode;
-
-			switch(disk_entry->fileType) {
-			case EXT2_FT_REG_FILE:
-				entry.fileType = kTypeRegular; break;
-			case EXT2_FT_DIR:
-				entry.fileType = kTypeDirectory; break;
-			case EXT2_FT_SYMLINK:
-				entry.fileType = kTypeSymlink; break;
-			default:
-				entry.fileType = kTypeNone;
-			}
-
-			co_return entry;
+			return DirEntry{disk_entry->inode, toFileType(disk_entry->fileType)};
 		}
 
 		offset += disk_entry->recordLength;
 	}
 	assert(offset == fileSize());
 
-	co_return std::nullopt;
+	if(populate) {
+		nameCacheValid = true;
+		return lookupEntry(name);
+	}
+
+	return std::nullopt;
+}
+
+async::result<frg::expected<protocols::fs::Error, std::optional<DirEntry>>>
+Inode::findEntry(std::string name) {
+	co_await readyJump.wait();
+
+	if(fileType != kTypeDirectory)
+		co_return protocols::fs::Error::notDirectory;
+	assert(fileMapping.size() == fileSize());
+
+	co_await dirMutex.async_lock();
+
+	std::optional<DirEntry> entry;
+	if(nameCacheValid) {
+		entry = lookupEntry(name);
+	}else{
+		auto lock = co_await lockDirectory();
+		entry = lookupEntry(name);
+	}
+
+	dirMutex.unlock();
+	co_return entry;
 }
 
 async::result<std::optional<DirEntry>>
@@ -98,112 +773,96 @@ Inode::link(std::string name, int64_t ino, blockfs::FileType type) {
 	assert(fileType == kTypeDirectory);
 	assert(fileMapping.size() == fileSize());
 
-	// Lock the mapping into memory before calling this function.
-	auto appendDirEntry = [&](size_t offset, size_t length)
-			-> async::result<std::optional<DirEntry>> {
-		auto diskEntry = reinterpret_cast<DiskDirEntry *>(
-				reinterpret_cast<char *>(fileMapping.get()) + offset);
-		memset(diskEntry, 0, sizeof(DiskDirEntry));
-		diskEntry->inode = ino;
-		diskEntry->recordLength = length;
-		diskEntry->nameLength = name.length();
-		switch (type) {
-			case kTypeRegular:
-				diskEntry->fileType = EXT2_FT_REG_FILE;
-				break;
-			case kTypeDirectory:
-				diskEntry->fileType = EXT2_FT_DIR;
-				break;
-			case kTypeSymlink:
-				diskEntry->fileType = EXT2_FT_SYMLINK;
-				break;
-			default:
-				throw std::runtime_error("unexpected type");
-		}
-		memcpy(diskEntry->name, name.data(), name.length() + 1);
-
-		// Flush the data to disk.
-		// TODO: It would be enough to flush only one or two pages here.
-		auto syncDir = co_await helix_ng::synchronizeSpace(
-				helix::BorrowedDescriptor{kHelNullHandle}, fileMapping.get(), fileSize());
-		HEL_CHECK(syncDir.error());
-
-		// Increment the target's link count.
-		auto target = fs.accessInode(ino);
-		co_await target->readyJump.wait();
-		target->diskInode()->linksCount++;
-
-		// Flush the target inode to disk.
-		auto syncInode = co_await helix_ng::synchronizeSpace(
-				helix::BorrowedDescriptor{kHelNullHandle},
-				target->diskMapping.get(), fs.inodeSize);
-		HEL_CHECK(syncInode.error());
-
-		DirEntry entry;
-		entry.inode = ino;
-		entry.fileType = type;
-		co_return entry;
-	};
+	uint8_t disk_type;
+	switch (type) {
+		case kTypeRegular:
+			disk_type = EXT2_FT_REG_FILE;
+			break;
+		case kTypeDirectory:
+			disk_type = EXT2_FT_DIR;
+			break;
+		case kTypeSymlink:
+			disk_type = EXT2_FT_SYMLINK;
+			break;
+		default:
+			throw std::runtime_error("unexpected type");
+	}
 
-	helix::LockMemoryView lock_memory;
-	auto map_size = (fileSize() + 0xFFF) & ~size_t(0xFFF);
-	auto &&submit = helix::submitLockMemoryView(helix::BorrowedDescriptor(frontalMemory),
-			&lock_memory,
-			0, map_size, helix::Dispatcher::global());
-	co_await submit.async_wait();
-	HEL_CHECK(lock_memory.error());
+	co_await dirMutex.async_lock();
 
 	// Space required for the new directory entry.
 	// We use name.size() + 1 for the entry name length to account for the null terminator
-	auto required = (sizeof(DiskDirEntry) + name.size() + 1 + 3) & ~size_t(3);
+	auto required = entrySize(name.size() + 1);
 
-	// Walk the directory structure.
-	uintptr_t offset = 0;
-	while(offset < fileSize()) {
-		assert(!(offset & 3));
-		assert(offset + sizeof(DiskDirEntry) <= fileSize());
-		auto previous_entry = reinterpret_cast<DiskDirEntry *>(
-				reinterpret_cast<char *>(fileMapping.get()) + offset);
-		assert(previous_entry->recordLength);
-
-		// Calculate available space after we contract previous_entry.
-		auto contracted = (sizeof(DiskDirEntry) + previous_entry->nameLength + 3) & ~size_t(3);
-		assert(previous_entry->recordLength >= contracted);
-		auto available = previous_entry->recordLength - contracted;
+	// Find a record that is large enough for the entry.
+	std::optional<std::pair<size_t, size_t>> slot;
+	{
+		auto lock = co_await lockDirectory();
 
-		// Check whether we can shrink previous_entry and insert a new entry after it.
-		if(available >= required) {
-			// Update the existing dentry.
-			previous_entry->recordLength = contracted;
+		if(usesIndex())
+			slot = co_await dxFindSlot(name, required);
+		if(!slot && !usesIndex())
+			slot = findSlot(0, fileSize(), required);
 
-			co_return co_await appendDirEntry(offset + contracted, available);
+		// Directories are indexed once they outgrow their first block.
+		if(!slot && fs.dirIndexEnabled && !usesIndex() && fileSize() == fs.blockSize) {
+			if(co_await dxCreateIndex())
+				slot = co_await dxFindSlot(name, required);
 		}
-
-		offset += previous_entry->recordLength;
 	}
-	assert(offset == fileSize());
 
-	// If we made it this far, we ran out of space in the directory. Resize it.
-	auto blockOffset = (offset & ~(fs.blockSize - 1)) >> fs.blockShift;
-	auto newSize = (offset + fs.blockSize + 0xFFF) & ~size_t(0xFFF);
-	setFileSize(newSize);
-	co_await fs.assignDataBlocks(this, blockOffset, 1);
-	HEL_CHECK(helResizeMemory(backingMemory, newSize));
-	fileMapping = helix::Mapping{helix::BorrowedDescriptor{frontalMemory},
-			0, newSize,
-			kHelMapProtRead | kHelMapProtWrite | kHelMapDontRequireBacking};
-
-	// Now append the entry that we couldn't add before.
-	{
-		helix::LockMemoryView lock_memory;
-		auto &&submit = helix::submitLockMemoryView(helix::BorrowedDescriptor(frontalMemory),
-				&lock_memory,
-				0, newSize, helix::Dispatcher::global());
-		co_await submit.async_wait();
-		HEL_CHECK(lock_memory.error());
+	if(!slot) {
+		// If we made it this far, we ran out of space in the directory. Resize it.
+		auto offset = fileSize();
+		auto blockOffset = (offset & ~(fs.blockSize - 1)) >> fs.blockShift;
+		auto newSize = (offset + fs.blockSize + 0xFFF) & ~size_t(0xFFF);
+		setFileSize(newSize);
+		co_await fs.assignDataBlocks(this, blockOffset, 1);
+		HEL_CHECK(helResizeMemory(backingMemory, newSize));
+		fileMapping = helix::Mapping{helix::BorrowedDescriptor{frontalMemory},
+				0, newSize,
+				kHelMapProtRead | kHelMapProtWrite | kHelMapDontRequireBacking};
 
-		co_return co_await appendDirEntry(offset, fileSize() - offset);
+		slot = std::pair<size_t, size_t>{offset, fileSize() - offset};
 	}
+
+	auto lock = co_await lockDirectory();
+
+	auto diskEntry = reinterpret_cast<DiskDirEntry *>(
+			reinterpret_cast<char *>(fileMapping.get()) + slot->first);
+	memset(diskEntry, 0, sizeof(DiskDirEntry));
+	diskEntry->inode = ino;
+	diskEntry->recordLength = slot->second;
+	diskEntry->nameLength = name.length();
+	diskEntry->fileType = disk_type;
+	memcpy(diskEntry->name, name.data(), name.length() + 1);
+
+	DirEntry entry;
+	entry.inode = ino;
+	entry.fileType = type;
+	if(nameCacheValid)
+		nameCache[name] = entry;
+
+	// Flush the data to disk.
+	// TODO: It would be enough to flush only one or two pages here.
+	auto syncDir = co_await helix_ng::synchronizeSpace(
+			helix::BorrowedDescriptor{kHelNullHandle}, fileMapping.get(), fileSize());
+	HEL_CHECK(syncDir.error());
+
+	dirMutex.unlock();
+
+	// Increment the target's link count.
+	auto target = fs.accessInode(ino);
+	co_await target->readyJump.wait();
+	target->diskInode()->linksCount++;
+
+	// Flush the target inode to disk.
+	auto syncInode = co_await helix_ng::synchronizeSpace(
+			helix::BorrowedDescriptor{kHelNullHandle},
+			target->diskMapping.get(), fs.inodeSize);
+	HEL_CHECK(syncInode.error());
+
+	co_return entry;
 }
 
 async::result<frg::expected<protocols::fs::Error>> Inode::unlink(std::string name) {
@@ -215,56 +874,80 @@ async::result<frg::expected<protocols::fs::Error>> Inode::unlink(std::string nam
 		co_return protocols::fs::Error::notDirectory;
 	assert(fileMapping.size() == fileSize());
 
-	helix::LockMemoryView lock_memory;
-	auto map_size = (fileSize() + 0xFFF) & ~size_t(0xFFF);
-	auto &&submit = helix::submitLockMemoryView(helix::BorrowedDescriptor(frontalMemory),
-			&lock_memory,
-			0, map_size, helix::Dispatcher::global());
-	co_await submit.async_wait();
-	HEL_CHECK(lock_memory.error());
+	co_await dirMutex.async_lock();
+	auto lock = co_await lockDirectory();
 
-	// Read the directory structure.
+	DiskDirEntry *disk_entry = nullptr;
 	DiskDirEntry *previous_entry = nullptr;
-	uintptr_t offset = 0;
-	while(offset < fileSize()) {
-		assert(!(offset & 3));
-		assert(offset + sizeof(DiskDirEntry) <= fileSize());
-		auto disk_entry = reinterpret_cast<DiskDirEntry *>(
-				reinterpret_cast<char *>(fileMapping.get()) + offset);
-		assert(disk_entry->recordLength);
+	if(nameCacheValid && !nameCache.count(name)) {
+		// The name does not exist.
+	}else if(!usesIndex() || !dxLookup(name, &disk_entry, &previous_entry)) {
+		// Read the directory structure.
+		uintptr_t offset = 0;
+		while(offset < fileSize()) {
+			assert(!(offset & 3));
+			assert(offset + sizeof(DiskDirEntry) <= fileSize());
+			auto current_entry = reinterpret_cast<DiskDirEntry *>(
+					reinterpret_cast<char *>(fileMapping.get()) + offset);
+			assert(current_entry->recordLength);
+
+			// Records are only merged within a block.
+			if(!(offset & (fs.blockSize - 1)))
+				previous_entry = nullptr;
+
+			if(current_entry->inode
+					&& name.length() == current_entry->nameLength
+					&& !memcmp(current_entry->name, name.data(), name.length())) {
+				disk_entry = current_entry;
+				break;
+			}
 
-		if(disk_entry->inode
-				&& name.length() == disk_entry->nameLength
-				&& !memcmp(disk_entry->name, name.data(), name.length())) {
-			// The directory should start with "." and "..". As those entries are never deleted,
-			// we can assume that a previous entry exists.
-			assert(previous_entry);
-			previous_entry->recordLength += disk_entry->recordLength;
-
-			// Flush the data to disk.
-			// TODO: It would be enough to flush only one or two pages here.
-			auto syncDir = co_await helix_ng::synchronizeSpace(
-					helix::BorrowedDescriptor{kHelNullHandle}, fileMapping.get(), fileSize());
-			HEL_CHECK(syncDir.error());
-
-			// Decrement the inode's link count
-			auto target = fs.accessInode(disk_entry->inode);
-			co_await target->readyJump.wait();
-			target->diskInode()->linksCount--;
-			auto syncInode = co_await helix_ng::synchronizeSpace(
-					helix::BorrowedDescriptor{kHelNullHandle},
-					target->diskMapping.get(), fs.inodeSize);
-			HEL_CHECK(syncInode.error());
-
-			co_return {};
+			offset += current_entry->recordLength;
+			previous_entry = current_entry;
 		}
+	}
+
+	if(!disk_entry) {
+		dirMutex.unlock();
+		co_return protocols::fs::Error::fileNotFound;
+	}
+
+	// The first record of a block cannot be merged into its predecessor; mark it as unused instead.
+	// Note that "." and ".." are never deleted.
+	auto ino = disk_entry->inode;
+	if(previous_entry) {
+		previous_entry->recordLength += disk_entry->recordLength;
+	}else{
+		disk_entry->inode = 0;
+	}
+	if(nameCacheValid)
+		nameCache.erase(name);
+
+	// Flush the data to disk.
+	// TODO: It would be enough to flush only one or two pages here.
+	auto syncDir = co_await helix_ng::synchronizeSpace(
+			helix::BorrowedDescriptor{kHelNullHandle}, fileMapping.get(), fileSize());
+	HEL_CHECK(syncDir.error());
+
+	dirMutex.unlock();
+
+	// Decrement the inode's link count
+	auto target = fs.accessInode(ino);
+	co_await target->readyJump.wait();
+	target->diskInode()->linksCount--;
+	auto syncInode = co_await helix_ng::synchronizeSpace(
+			helix::BorrowedDescriptor{kHelNullHandle},
+			target->diskMapping.get(), fs.inodeSize);
+	HEL_CHECK(syncInode.error());
 
-		offset += disk_entry->recordLength;
-		previous_entry = disk_entry;
-	}
-	assert(offset == fileSize());
+	// If the file is still open, its blocks are freed when it is closed (see ~OpenFile()).
+	// The inode itself stays allocated: clients may still refer to it by its number,
+	// so the number must not be reused while the Inode is alive.
+	if(!target->diskInode()->linksCount && !target->openFiles
+			&& target->fileType == kTypeRegular)
+		co_await fs.truncate(target.get(), 0);
 
-	co_return protocols::fs::Error::fileNotFound;
+	co_return {};
 }
 
 async::result<std::optional<DirEntry>> Inode::mkdir(std::string name) {
@@ -272,7 +955,7 @@ async::result<std::optional<DirEntry>> Inode::mkdir(std::string name) {
 
 	co_await readyJump.wait();
 
-	auto dirNode = co_await fs.createDirectory();
+	auto dirNode = co_await fs.createDirectory(number);
 	co_await dirNode->readyJump.wait();
 
 	co_await fs.assignDataBlocks(dirNode.get(), 0, 1);
@@ -341,7 +1024,7 @@ async::result<std::optional<DirEntry>> Inode::symlink(std::string name, std::str
 
 	co_await readyJump.wait();
 
-	auto newNode = co_await fs.createSymlink();
+	auto newNode = co_await fs.createSymlink(number);
 	co_await newNode->readyJump.wait();
 
 	assert(target.size() <= 60); // TODO: implement this case!
@@ -398,11 +1081,13 @@ async::result<protocols::fs::Error> Inode::utimensat(uint64_t atime_sec, uint64_
 // FileSystem
 // --------------------------------------------------------
 
-FileSystem::FileSystem(BlockDevice *device)
-: device(device) {
+FileSystem::FileSystem(BlockDevice *device, ConcurrencyLimit *manage_limit)
+: device(device), extentsEnabled(false), dirIndexEnabled(false), readOnly(false),
+		unsignedHash(false), defaultHashVersion(DX_HASH_HALF_MD4), hashSeed{},
+		manageLimit(manage_limit) {
 }
 
-async::result<void> FileSystem::init() {
+async::result<bool> FileSystem::init() {
 	std::vector<uint8_t> buffer(1024);
 	co_await device->readSectors(2, buffer.data(), 2);
 
@@ -410,6 +1095,21 @@ async::result<void> FileSystem::init() {
 	memcpy(&sb, buffer.data(), sizeof(DiskSuperblock));
 	assert(sb.magic == 0xEF53);
 
+	// In particular, we do not support 64-bit group descriptors and journal recovery.
+	if(sb.featureIncompat & ~supportedIncompat) {
+		std::cout << "\e[31m" "ext2fs: Unsupported r/w-required features 0x" << std::hex
+				<< (sb.featureIncompat & ~supportedIncompat) << std::dec
+				<< ", refusing to mount" "\e[39m" << std::endl;
+		co_return false;
+	}
+	// Writes would not update metadata checksums, group descriptor checksums etc.
+	if(sb.featureRoCompat & ~supportedRoCompat) {
+		std::cout << "\e[33m" "ext2fs: Unsupported w-required features 0x" << std::hex
+				<< (sb.featureRoCompat & ~supportedRoCompat) << std::dec
+				<< ", mounting read-only" "\e[39m" << std::endl;
+		readOnly = true;
+	}
+
 	inodeSize = sb.inodeSize;
 	blockShift = 10 + sb.logBlockSize;
 	blockSize = 1024 << sb.logBlockSize;
@@ -419,7 +1119,14 @@ async::result<void> FileSystem::init() {
 	inodesPerGroup = sb.inodesPerGroup;
 	blocksCount = sb.blocksCount;
 	inodesCount = sb.inodesCount;
+	firstDataBlock = sb.firstDataBlock;
 	numBlockGroups = (sb.blocksCount + (sb.blocksPerGroup - 1)) / sb.blocksPerGroup;
+	extentsEnabled = sb.featureIncompat & EXT4_FEATURE_INCOMPAT_EXTENTS;
+	dirIndexEnabled = sb.featureCompat & EXT3_FEATURE_COMPAT_DIR_INDEX;
+	unsignedHash = sb.flags & EXT2_FLAGS_UNSIGNED_HASH;
+	if(sb.defHashVersion <= DX_HASH_TEA)
+		defaultHashVersion = sb.defHashVersion;
+	memcpy(hashSeed, sb.hashSeed, sizeof(hashSeed));
 
 	if(logSuperblock) {
 		std::cout << "ext2fs: Revision is: " << sb.revLevel << std::endl;
@@ -434,6 +1141,8 @@ async::result<void> FileSystem::init() {
 		std::cout << "ext2fs: There are " << numBlockGroups << " block groups" << std::endl;
 		std::cout << "ext2fs:     Blocks per group: " << blocksPerGroup << std::endl;
 		std::cout << "ext2fs:     Inodes per group: " << inodesPerGroup << std::endl;
+		if(extentsEnabled)
+			std::cout << "ext2fs: Extents are enabled" << std::endl;
 	}
 
 	blockGroupDescriptorBuffer.resize((numBlockGroups * sizeof(DiskGroupDesc) + 511) & ~size_t(511));
@@ -456,6 +1165,15 @@ async::result<void> FileSystem::init() {
 	manageBlockBitmap(helix::UniqueDescriptor{block_bitmap_backing});
 	manageInodeBitmap(helix::UniqueDescriptor{inode_bitmap_backing});
 
+	blockBitmapMapping = helix::Mapping{blockBitmap,
+			0, numBlockGroups << blockPagesShift,
+			kHelMapProtRead | kHelMapProtWrite | kHelMapDontRequireBacking};
+	inodeBitmapMapping = helix::Mapping{inodeBitmap,
+			0, numBlockGroups << blockPagesShift,
+			kHelMapProtRead | kHelMapProtWrite | kHelMapDontRequireBacking};
+	blockBitmapLocks.resize(numBlockGroups);
+	inodeBitmapLocks.resize(numBlockGroups);
+
 	// Create a memory bundle to manage the inode table.
 	assert(!((inodesPerGroup * inodeSize) & 0xFFF));
 	HelHandle inode_table_frontal;
@@ -466,7 +1184,7 @@ async::result<void> FileSystem::init() {
 
 	manageInodeTable(helix::UniqueDescriptor{inode_table_backing});
 
-	co_return;
+	co_return true;
 }
 
 async::detached FileSystem::manageBlockBitmap(helix::UniqueDescriptor memory) {
@@ -477,32 +1195,34 @@ async::detached FileSystem::manageBlockBitmap(helix::UniqueDescriptor memory) {
 		co_await submit_manage.async_wait();
 		HEL_CHECK(manage.error());
 
-		auto bg_idx = manage.offset() >> blockPagesShift;
-		auto block = bgdt[bg_idx].blockBitmap;
-		assert(block);
-
 		assert(!(manage.offset() & ((1 << blockPagesShift) - 1))
 				&& "TODO: propery support multi-page blocks");
-		assert(manage.length() == (1 << blockPagesShift)
+		assert(!(manage.length() & ((1 << blockPagesShift) - 1))
 				&& "TODO: propery support multi-page blocks");
 
-		if(manage.type() == kHelManageInitialize) {
-			helix::Mapping bitmap_map{memory,
-					static_cast<ptrdiff_t>(manage.offset()), manage.length()};
-			co_await device->readSectors(block * sectorsPerBlock,
-					bitmap_map.get(), sectorsPerBlock);
-			HEL_CHECK(helUpdateMemory(memory.getHandle(), kHelManageInitialize,
-					manage.offset(), manage.length()));
-		}else{
-			assert(manage.type() == kHelManageWriteback);
-
-			helix::Mapping bitmap_map{memory,
-					static_cast<ptrdiff_t>(manage.offset()), manage.length()};
-			co_await device->writeSectors(block * sectorsPerBlock,
-					bitmap_map.get(), sectorsPerBlock);
-			HEL_CHECK(helUpdateMemory(memory.getHandle(), kHelManageWriteback,
-					manage.offset(), manage.length()));
+		// The kernel may fuse the bitmaps of adjacent block groups into a single request.
+		helix::Mapping bitmap_map{memory,
+				static_cast<ptrdiff_t>(manage.offset()), manage.length()};
+		for(size_t progress = 0; progress < manage.length();
+				progress += size_t{1} << blockPagesShift) {
+			auto bg_idx = (manage.offset() + progress) >> blockPagesShift;
+			auto block = bgdt[bg_idx].blockBitmap;
+			assert(block);
+
+			auto window = reinterpret_cast<std::byte *>(bitmap_map.get()) + progress;
+			if(manage.type() == kHelManageInitialize) {
+				co_await device->readSectors(block * sectorsPerBlock,
+						window, sectorsPerBlock);
+			}else{
+				assert(manage.type() == kHelManageWriteback);
+				if(!readOnly)
+					co_await device->writeSectors(block * sectorsPerBlock,
+							window, sectorsPerBlock);
+			}
 		}
+
+		HEL_CHECK(helUpdateMemory(memory.getHandle(), manage.type(),
+				manage.offset(), manage.length()));
 	}
 }
 
@@ -514,32 +1234,34 @@ async::detached FileSystem::manageInodeBitmap(helix::UniqueDescriptor memory) {
 		co_await submit_manage.async_wait();
 		HEL_CHECK(manage.error());
 
-		auto bg_idx = manage.offset() >> blockPagesShift;
-		auto block = bgdt[bg_idx].inodeBitmap;
-		assert(block);
-
 		assert(!(manage.offset() & ((1 << blockPagesShift) - 1))
 				&& "TODO: propery support multi-page blocks");
-		assert(manage.length() == (1 << blockPagesShift)
+		assert(!(manage.length() & ((1 << blockPagesShift) - 1))
 				&& "TODO: propery support multi-page blocks");
 
-		if(manage.type() == kHelManageInitialize) {
-			helix::Mapping bitmap_map{memory,
-					static_cast<ptrdiff_t>(manage.offset()), manage.length()};
-			co_await device->readSectors(block * sectorsPerBlock,
-					bitmap_map.get(), sectorsPerBlock);
-			HEL_CHECK(helUpdateMemory(memory.getHandle(), kHelManageInitialize,
-					manage.offset(), manage.length()));
-		}else{
-			assert(manage.type() == kHelManageWriteback);
-
-			helix::Mapping bitmap_map{memory,
-					static_cast<ptrdiff_t>(manage.offset()), manage.length()};
-			co_await device->writeSectors(block * sectorsPerBlock,
-					bitmap_map.get(), sectorsPerBlock);
-			HEL_CHECK(helUpdateMemory(memory.getHandle(), kHelManageWriteback,
-					manage.offset(), manage.length()));
+		// The kernel may fuse the bitmaps of adjacent block groups into a single request.
+		helix::Mapping bitmap_map{memory,
+				static_cast<ptrdiff_t>(manage.offset()), manage.length()};
+		for(size_t progress = 0; progress < manage.length();
+				progress += size_t{1} << blockPagesShift) {
+			auto bg_idx = (manage.offset() + progress) >> blockPagesShift;
+			auto block = bgdt[bg_idx].inodeBitmap;
+			assert(block);
+
+			auto window = reinterpret_cast<std::byte *>(bitmap_map.get()) + progress;
+			if(manage.type() == kHelManageInitialize) {
+				co_await device->readSectors(block * sectorsPerBlock,
+						window, sectorsPerBlock);
+			}else{
+				assert(manage.type() == kHelManageWriteback);
+				if(!readOnly)
+					co_await device->writeSectors(block * sectorsPerBlock,
+							window, sectorsPerBlock);
+			}
 		}
+
+		HEL_CHECK(helUpdateMemory(memory.getHandle(), manage.type(),
+				manage.offset(), manage.length()));
 	}
 }
 
@@ -553,30 +1275,36 @@ async::detached FileSystem::manageInodeTable(helix::UniqueDescriptor memory) {
 
 		// TODO: Make sure that we do not read/write past the end of the table.
 		assert(!((inodesPerGroup * inodeSize) & (blockSize - 1)));
-
-		// TODO: Use shifts instead of division.
-		auto bg_idx = manage.offset() / (inodesPerGroup * inodeSize);
-		auto bg_offset = manage.offset() % (inodesPerGroup * inodeSize);
-		auto block = bgdt[bg_idx].inodeTable;
-		assert(block);
-
-		if(manage.type() == kHelManageInitialize) {
-			helix::Mapping table_map{memory,
-					static_cast<ptrdiff_t>(manage.offset()), manage.length()};
-			co_await device->readSectors(block * sectorsPerBlock + bg_offset / 512,
-					table_map.get(), manage.length() / 512);
-			HEL_CHECK(helUpdateMemory(memory.getHandle(), kHelManageInitialize,
-					manage.offset(), manage.length()));
-		}else{
-			assert(manage.type() == kHelManageWriteback);
-
-			helix::Mapping table_map{memory,
-					static_cast<ptrdiff_t>(manage.offset()), manage.length()};
-			co_await device->writeSectors(block * sectorsPerBlock + bg_offset / 512,
-					table_map.get(), manage.length() / 512);
-			HEL_CHECK(helUpdateMemory(memory.getHandle(), kHelManageWriteback,
-					manage.offset(), manage.length()));
+		size_t table_size = inodesPerGroup * inodeSize;
+
+		// Fused requests can span multiple block groups; the tables of different
+		// groups are not contiguous on disk, so split the request at group boundaries.
+		helix::Mapping table_map{memory,
+				static_cast<ptrdiff_t>(manage.offset()), manage.length()};
+		size_t progress = 0;
+		while(progress < manage.length()) {
+			// TODO: Use shifts instead of division.
+			auto bg_idx = (manage.offset() + progress) / table_size;
+			auto bg_offset = (manage.offset() + progress) % table_size;
+			auto chunk = std::min(manage.length() - progress, table_size - bg_offset);
+			auto block = bgdt[bg_idx].inodeTable;
+			assert(block);
+
+			auto window = reinterpret_cast<std::byte *>(table_map.get()) + progress;
+			if(manage.type() == kHelManageInitialize) {
+				co_await device->readSectors(block * sectorsPerBlock + bg_offset / 512,
+						window, chunk / 512);
+			}else{
+				assert(manage.type() == kHelManageWriteback);
+				if(!readOnly)
+					co_await device->writeSectors(block * sectorsPerBlock + bg_offset / 512,
+							window, chunk / 512);
+			}
+			progress += chunk;
 		}
+
+		HEL_CHECK(helUpdateMemory(memory.getHandle(), manage.type(),
+				manage.offset(), manage.length()));
 	}
 }
 
@@ -598,8 +1326,8 @@ auto FileSystem::accessInode(uint32_t number) -> std::shared_ptr<Inode> {
 	return new_inode;
 }
 
-async::result<std::shared_ptr<Inode>> FileSystem::createRegular() {
-	auto ino = co_await allocateInode();
+async::result<std::shared_ptr<Inode>> FileSystem::createRegular(uint32_t parent) {
+	auto ino = co_await allocateInode(parent, false);
 	assert(ino);
 
 	// Lock and map the inode table.
@@ -622,6 +1350,8 @@ async::result<std::shared_ptr<Inode>> FileSystem::createRegular() {
 	memset(disk_inode, 0, inodeSize);
 	disk_inode->mode = EXT2_S_IFREG;
 	disk_inode->generation = generation + 1;
+	if(extentsEnabled)
+		initExtentRoot(disk_inode);
 	struct timespec time;
 	// TODO: Move to CLOCK_REALTIME when supported
 	clock_gettime(CLOCK_MONOTONIC, &time);
@@ -632,8 +1362,8 @@ async::result<std::shared_ptr<Inode>> FileSystem::createRegular() {
 	co_return accessInode(ino);
 }
 
-async::result<std::shared_ptr<Inode>> FileSystem::createDirectory() {
-	auto ino = co_await allocateInode();
+async::result<std::shared_ptr<Inode>> FileSystem::createDirectory(uint32_t parent) {
+	auto ino = co_await allocateInode(parent, true);
 	assert(ino);
 
 	// Lock and map the inode table.
@@ -656,6 +1386,8 @@ async::result<std::shared_ptr<Inode>> FileSystem::createDirectory() {
 	memset(disk_inode, 0, inodeSize);
 	disk_inode->mode = EXT2_S_IFDIR;
 	disk_inode->generation = generation + 1;
+	if(extentsEnabled)
+		initExtentRoot(disk_inode);
 	struct timespec time;
 	// TODO: Move to CLOCK_REALTIME when supported
 	clock_gettime(CLOCK_MONOTONIC, &time);
@@ -671,8 +1403,8 @@ async::result<std::shared_ptr<Inode>> FileSystem::createDirectory() {
 	co_return accessInode(ino);
 }
 
-async::result<std::shared_ptr<Inode>> FileSystem::createSymlink() {
-	auto ino = co_await allocateInode();
+async::result<std::shared_ptr<Inode>> FileSystem::createSymlink(uint32_t parent) {
+	auto ino = co_await allocateInode(parent, false);
 	assert(ino);
 
 	// Lock and map the inode table.
@@ -786,6 +1518,9 @@ async::detached FileSystem::initiateInode(std::shared_ptr<Inode> inode) {
 	inode->uid = disk_inode->uid;
 	inode->gid = disk_inode->gid;
 
+	if(disk_inode->flags & EXT4_EXTENTS_FL)
+		co_await loadExtentTree(inode.get());
+
 	// Allocate a page cache for the file.
 	auto cache_size = (inode->fileSize() + 0xFFF) & ~size_t(0xFFF);
 	HEL_CHECK(helCreateManagedMemory(cache_size, kHelManagedReadahead,
@@ -824,38 +1559,48 @@ async::detached FileSystem::manageFileData(std::shared_ptr<Inode> inode) {
 		HEL_CHECK(manage.error());
 		assert(manage.offset() + manage.length() <= ((inode->fileSize() + 0xFFF) & ~size_t(0xFFF)));
 
-		if(manage.type() == kHelManageInitialize) {
-			helix::Mapping file_map{helix::BorrowedDescriptor{inode->backingMemory},
-					static_cast<ptrdiff_t>(manage.offset()), manage.length(), kHelMapProtWrite};
+		// Process requests concurrently such that readahead keeps the device busy.
+		co_await inode->manageLimit.acquire();
+		co_await manageLimit->acquire();
+		handleFileData(inode, manage.type(), manage.offset(), manage.length());
+	}
+}
 
-			assert(!(manage.offset() % inode->fs.blockSize));
-			size_t backed_size = std::min(manage.length(), inode->fileSize() - manage.offset());
-			size_t num_blocks = (backed_size + (inode->fs.blockSize - 1)) / inode->fs.blockSize;
+async::detached FileSystem::handleFileData(std::shared_ptr<Inode> inode,
+		int type, uintptr_t offset, size_t length) {
+	if(type == kHelManageInitialize) {
+		helix::Mapping file_map{helix::BorrowedDescriptor{inode->backingMemory},
+				static_cast<ptrdiff_t>(offset), length, kHelMapProtWrite};
 
-			assert(num_blocks * inode->fs.blockSize <= manage.length());
-			co_await inode->fs.readDataBlocks(inode, manage.offset() / inode->fs.blockSize,
-					num_blocks, file_map.get());
+		assert(!(offset % blockSize));
+		size_t backed_size = std::min(length, inode->fileSize() - offset);
+		size_t num_blocks = (backed_size + (blockSize - 1)) / blockSize;
 
-			HEL_CHECK(helUpdateMemory(inode->backingMemory, kHelManageInitialize,
-					manage.offset(), manage.length()));
-		}else{
-			assert(manage.type() == kHelManageWriteback);
+		assert(num_blocks * blockSize <= length);
+		co_await readDataBlocks(inode, offset / blockSize, num_blocks, file_map.get());
+
+		HEL_CHECK(helUpdateMemory(inode->backingMemory, kHelManageInitialize,
+				offset, length));
+	}else{
+		assert(type == kHelManageWriteback);
 
-			helix::Mapping file_map{helix::BorrowedDescriptor{inode->backingMemory},
-					static_cast<ptrdiff_t>(manage.offset()), manage.length(), kHelMapProtRead};
+		helix::Mapping file_map{helix::BorrowedDescriptor{inode->backingMemory},
+				static_cast<ptrdiff_t>(offset), length, kHelMapProtRead};
 
-			assert(!(manage.offset() % inode->fs.blockSize));
-			size_t backed_size = std::min(manage.length(), inode->fileSize() - manage.offset());
-			size_t num_blocks = (backed_size + (inode->fs.blockSize - 1)) / inode->fs.blockSize;
+		assert(!(offset % blockSize));
+		size_t backed_size = std::min(length, inode->fileSize() - offset);
+		size_t num_blocks = (backed_size + (blockSize - 1)) / blockSize;
 
-			assert(num_blocks * inode->fs.blockSize <= manage.length());
-			co_await inode->fs.writeDataBlocks(inode, manage.offset() / inode->fs.blockSize,
-					num_blocks, file_map.get());
+		assert(num_blocks * blockSize <= length);
+		if(!readOnly)
+			co_await writeDataBlocks(inode, offset / blockSize, num_blocks, file_map.get());
 
-			HEL_CHECK(helUpdateMemory(inode->backingMemory, kHelManageWriteback,
-					manage.offset(), manage.length()));
-		}
+		HEL_CHECK(helUpdateMemory(inode->backingMemory, kHelManageWriteback,
+				offset, length));
 	}
+
+	manageLimit->release();
+	inode->manageLimit.release();
 }
 
 async::detached FileSystem::manageIndirect(std::shared_ptr<Inode> inode,
@@ -867,7 +1612,25 @@ async::detached FileSystem::manageIndirect(std::shared_ptr<Inode> inode,
 		co_await submit_manage.async_wait();
 		HEL_CHECK(manage.error());
 
-		uint32_t element = manage.offset() >> blockPagesShift;
+		assert(!(manage.offset() & ((1 << blockPagesShift) - 1))
+				&& "TODO: propery support multi-page blocks");
+		assert(!(manage.length() & ((1 << blockPagesShift) - 1))
+				&& "TODO: propery support multi-page blocks");
+
+		// File data requests wait for indirection blocks while holding the manage limits.
+		// Hence, indirection blocks cannot be subject to those limits without risking deadlocks;
+		// their concurrency is bounded by the number of file data requests anyway.
+		handleIndirect(inode, order, memory, manage.type(), manage.offset(), manage.length());
+	}
+}
+
+async::detached FileSystem::handleIndirect(std::shared_ptr<Inode> inode, int order,
+		helix::BorrowedDescriptor memory, int type, uintptr_t offset, size_t length) {
+	// The kernel may fuse adjacent indirection blocks into a single request.
+	helix::Mapping out_map{memory, static_cast<ptrdiff_t>(offset), length};
+	for(size_t progress = 0; progress < length;
+			progress += size_t{1} << blockPagesShift) {
+		uint32_t element = (offset + progress) >> blockPagesShift;
 
 		uint32_t block;
 		if(order == 1) {
@@ -901,112 +1664,300 @@ async::detached FileSystem::manageIndirect(std::shared_ptr<Inode> inode,
 			block = reinterpret_cast<uint32_t *>(indirect_map.get())[indirect_index];
 		}
 
-		assert(!(manage.offset() & ((1 << blockPagesShift) - 1))
-				&& "TODO: propery support multi-page blocks");
-		assert(manage.length() == (1 << blockPagesShift)
-				&& "TODO: propery support multi-page blocks");
-
-		if (manage.type() == kHelManageInitialize) {
-			helix::Mapping out_map{memory,
-					static_cast<ptrdiff_t>(manage.offset()), manage.length()};
+		auto window = reinterpret_cast<std::byte *>(out_map.get()) + progress;
+		if (type == kHelManageInitialize) {
 			co_await device->readSectors(block * sectorsPerBlock,
-					out_map.get(), sectorsPerBlock);
-			HEL_CHECK(helUpdateMemory(memory.getHandle(), kHelManageInitialize,
-					manage.offset(), manage.length()));
+					window, sectorsPerBlock);
 		} else {
-			assert(manage.type() == kHelManageWriteback);
-
-			helix::Mapping out_map{memory,
-					static_cast<ptrdiff_t>(manage.offset()), manage.length()};
-			co_await device->writeSectors(block * sectorsPerBlock,
-					out_map.get(), sectorsPerBlock);
-			HEL_CHECK(helUpdateMemory(memory.getHandle(), kHelManageWriteback,
-					manage.offset(), manage.length()));
-
+			assert(type == kHelManageWriteback);
+			if(!readOnly)
+				co_await device->writeSectors(block * sectorsPerBlock,
+						window, sectorsPerBlock);
 		}
 	}
+
+	HEL_CHECK(helUpdateMemory(memory.getHandle(), type, offset, length));
 }
 
-async::result<uint32_t> FileSystem::allocateBlock() {
-	for(uint32_t bg_idx = 0; bg_idx < numBlockGroups; bg_idx++) {
-		helix::LockMemoryView lock_bitmap;
-		auto &&submit_bitmap = helix::submitLockMemoryView(blockBitmap,
-				&lock_bitmap,
-				bg_idx << blockPagesShift, 1 << blockPagesShift,
-				helix::Dispatcher::global());
-		co_await submit_bitmap.async_wait();
-		HEL_CHECK(lock_bitmap.error());
+async::result<void> FileSystem::lockBlockBitmap(uint32_t bg_idx) {
+	if(blockBitmapLocks[bg_idx])
+		co_return;
 
-		helix::Mapping bitmap_map{blockBitmap,
-				bg_idx << blockPagesShift, size_t{1} << blockPagesShift,
-				kHelMapProtRead | kHelMapProtWrite | kHelMapDontRequireBacking};
+	helix::LockMemoryView lock_bitmap;
+	auto &&submit_bitmap = helix::submitLockMemoryView(blockBitmap,
+			&lock_bitmap,
+			bg_idx << blockPagesShift, 1 << blockPagesShift,
+			helix::Dispatcher::global());
+	co_await submit_bitmap.async_wait();
+	HEL_CHECK(lock_bitmap.error());
+
+	// Another allocation might have locked the bitmap in the meantime.
+	if(!blockBitmapLocks[bg_idx])
+		blockBitmapLocks[bg_idx] = lock_bitmap.descriptor();
+}
+
+async::result<void> FileSystem::lockInodeBitmap(uint32_t bg_idx) {
+	if(inodeBitmapLocks[bg_idx])
+		co_return;
+
+	helix::LockMemoryView lock_bitmap;
+	auto &&submit_bitmap = helix::submitLockMemoryView(inodeBitmap,
+			&lock_bitmap,
+			bg_idx << blockPagesShift, 1 << blockPagesShift,
+			helix::Dispatcher::global());
+	co_await submit_bitmap.async_wait();
+	HEL_CHECK(lock_bitmap.error());
+
+	if(!inodeBitmapLocks[bg_idx])
+		inodeBitmapLocks[bg_idx] = lock_bitmap.descriptor();
+}
+
+uint64_t *FileSystem::blockBitmapWords(uint32_t bg_idx) {
+	assert(blockBitmapLocks[bg_idx]);
+	return reinterpret_cast<uint64_t *>(
+			reinterpret_cast<char *>(blockBitmapMapping.get()) + (bg_idx << blockPagesShift));
+}
+
+uint64_t *FileSystem::inodeBitmapWords(uint32_t bg_idx) {
+	assert(inodeBitmapLocks[bg_idx]);
+	return reinterpret_cast<uint64_t *>(
+			reinterpret_cast<char *>(inodeBitmapMapping.get()) + (bg_idx << blockPagesShift));
+}
+
+uint64_t FileSystem::inodeGoal(Inode *inode) {
+	auto bg_idx = (inode->number - 1) / inodesPerGroup;
+	return firstDataBlock + static_cast<uint64_t>(bg_idx) * blocksPerGroup;
+}
 
-		auto words = reinterpret_cast<uint32_t *>(bitmap_map.get());
-		for(unsigned int i = 0; i < (blocksPerGroup + 31) / 32; i++) {
-			if(words[i] == 0xFFFFFFFF)
+void FileSystem::releaseReservation(Inode *owner) {
+	if(!owner->reservationLength)
+		return;
+	reservations.erase(owner->reservationStart);
+	owner->reservationStart = 0;
+	owner->reservationLength = 0;
+}
+
+async::result<std::pair<uint32_t, size_t>> FileSystem::allocateBlocks(Inode *owner,
+		uint64_t goal, size_t count) {
+	assert(count);
+
+	// Writes to the bitmap and the BGDT after blocks have been allocated.
+	auto commit = [&] (uint32_t bg_idx) -> async::result<void> {
+		auto syncBitmap = co_await helix_ng::synchronizeSpace(
+				helix::BorrowedDescriptor{kHelNullHandle},
+				blockBitmapWords(bg_idx), size_t{1} << blockPagesShift);
+		HEL_CHECK(syncBitmap.error());
+		co_await writebackBgdt();
+	};
+
+	// Returns the end of the reservation that contains the block (or zero).
+	auto reserved_until = [&] (uint64_t block) -> uint64_t {
+		auto it = reservations.upper_bound(block);
+		if(it == reservations.begin())
+			return 0;
+		--it;
+		if(block < it->first + it->second.length)
+			return it->first + it->second.length;
+		return 0;
+	};
+
+	// Returns the start of the next reservation after the block.
+	auto next_reservation = [&] (uint64_t block) -> uint64_t {
+		auto it = reservations.upper_bound(block);
+		if(it == reservations.end())
+			return UINT64_MAX;
+		return it->first;
+	};
+
+	if(owner && owner->reservationLength && goal == owner->reservationStart) {
+		// Make sure that the bitmap is accessible before touching the reservation.
+		co_await lockBlockBitmap((goal - firstDataBlock) / blocksPerGroup);
+	}
+
+	if(owner && owner->reservationLength) {
+		if(goal == owner->reservationStart) {
+			// Appends are satisfied from the reservation.
+			auto block = owner->reservationStart;
+			auto bg_idx = (block - firstDataBlock) / blocksPerGroup;
+			auto n = std::min<size_t>(count, owner->reservationLength);
+			auto remaining = owner->reservationLength - n;
+
+			releaseReservation(owner);
+			if(remaining) {
+				owner->reservationStart = block + n;
+				owner->reservationLength = remaining;
+				reservations.emplace(owner->reservationStart, Reservation{remaining, owner});
+			}
+
+			setBits(blockBitmapWords(bg_idx), block - firstDataBlock - bg_idx * blocksPerGroup, n);
+			bgdt[bg_idx].freeBlocksCount -= n;
+			co_await commit(bg_idx);
+			co_return std::pair<uint32_t, size_t>{block, n};
+		}
+
+		// The file is not appended to sequentially; give up the reservation.
+		releaseReservation(owner);
+	}
+
+	if(goal < firstDataBlock || goal >= blocksCount)
+		goal = owner ? inodeGoal(owner) : firstDataBlock;
+	uint32_t goal_group = (goal - firstDataBlock) / blocksPerGroup;
+
+	for(int attempt = 0; attempt < 2; attempt++) {
+		// The goal's group is visited twice: first from the goal on, at last from its start.
+		for(uint32_t i = 0; i <= numBlockGroups; i++) {
+			auto bg_idx = (goal_group + i) % numBlockGroups;
+			if(!bgdt[bg_idx].freeBlocksCount)
 				continue;
-			for(int j = 0; j < 32; j++) {
-				if(i * 32 + j >= blocksPerGroup)
+			co_await lockBlockBitmap(bg_idx);
+
+			uint64_t group_start = firstDataBlock + static_cast<uint64_t>(bg_idx) * blocksPerGroup;
+			size_t limit = std::min<uint64_t>(blocksPerGroup, blocksCount - group_start);
+			auto words = blockBitmapWords(bg_idx);
+
+			size_t bit = i ? 0 : goal - group_start;
+			while(true) {
+				bit = scanBitmap(words, bit, limit, false);
+				if(bit == limit)
 					break;
-				if(words[i] & (static_cast<uint32_t>(1) << j))
+
+				// Skip blocks that are reserved by other files.
+				if(auto end = reserved_until(group_start + bit); end) {
+					bit = end - group_start;
 					continue;
-				// TODO: Make sure we never return reserved blocks.
-				// TODO: Make sure we never return blocks higher than the max. block in the SB.
-				auto block = bg_idx * blocksPerGroup + i * 32 + j;
-				assert(block);
-				assert(block < blocksCount);
-				words[i] |= static_cast<uint32_t>(1) << j;
+				}
 
-				bgdt[bg_idx].freeBlocksCount--;
-				co_await writebackBgdt();
+				// Extend the allocation as far as possible.
+				auto run_limit = std::min<uint64_t>({limit, bit + count,
+						next_reservation(group_start + bit) - group_start});
+				auto end = scanBitmap(words, bit, run_limit, true);
+				auto n = end - bit;
+				setBits(words, bit, n);
+				bgdt[bg_idx].freeBlocksCount -= n;
+
+				// Reserve the following blocks if the file is likely to grow further.
+				if(owner && owner->fileType == kTypeRegular && n == count) {
+					auto window_limit = std::min<uint64_t>({limit, end + reservationBlocks,
+							next_reservation(group_start + end) - group_start});
+					auto window_end = scanBitmap(words, end, window_limit, true);
+					if(window_end > end) {
+						// A concurrent allocation might have reserved a window for the
+						// file while we were waiting for the bitmap.
+						releaseReservation(owner);
+						owner->reservationStart = group_start + end;
+						owner->reservationLength = window_end - end;
+						reservations.emplace(owner->reservationStart,
+								Reservation{owner->reservationLength, owner});
+					}
+				}
 
-				co_return block;
+				auto block = group_start + bit;
+				assert(block);
+				assert(block < blocksCount);
+				co_await commit(bg_idx);
+				co_return std::pair<uint32_t, size_t>{block, n};
 			}
-			assert(!"Failed to find zero-bit");
 		}
+
+		// Free blocks might only be left in reservations of other files.
+		if(reservations.empty())
+			break;
+		for(auto &[start, reservation] : reservations) {
+			reservation.owner->reservationStart = 0;
+			reservation.owner->reservationLength = 0;
+		}
+		reservations.clear();
 	}
 
-	co_return 0;
+	co_return std::pair<uint32_t, size_t>{0, 0};
 }
 
-async::result<uint32_t> FileSystem::allocateInode() {
-	// TODO: Do not start at block group zero.
-	for(uint32_t bg_idx = 0; bg_idx < numBlockGroups; bg_idx++) {
-		helix::LockMemoryView lock_bitmap;
-		auto &&submit_bitmap = helix::submitLockMemoryView(inodeBitmap,
-				&lock_bitmap,
-				bg_idx << blockPagesShift, 1 << blockPagesShift,
-				helix::Dispatcher::global());
-		co_await submit_bitmap.async_wait();
-		HEL_CHECK(lock_bitmap.error());
+async::result<uint32_t> FileSystem::allocateBlock(Inode *owner, uint64_t goal) {
+	auto [block, n] = co_await allocateBlocks(owner, goal, 1);
+	co_return block;
+}
 
-		helix::Mapping bitmap_map{inodeBitmap,
-				bg_idx << blockPagesShift, size_t{1} << blockPagesShift,
-				kHelMapProtRead | kHelMapProtWrite | kHelMapDontRequireBacking};
+async::result<void> FileSystem::freeBlocks(uint64_t block, size_t count) {
+	while(count) {
+		uint32_t bg_idx = (block - firstDataBlock) / blocksPerGroup;
+		uint64_t group_start = firstDataBlock + static_cast<uint64_t>(bg_idx) * blocksPerGroup;
+		auto n = std::min<uint64_t>(count, group_start + blocksPerGroup - block);
+		co_await lockBlockBitmap(bg_idx);
 
-		auto words = reinterpret_cast<uint32_t *>(bitmap_map.get());
-		for(unsigned int i = 0; i < (inodesPerGroup + 31) / 32; i++) {
-			if(words[i] == 0xFFFFFFFF)
-				continue;
-			for(int j = 0; j < 32; j++) {
-				if(i * 32 + j >= inodesPerGroup)
-					break;
-				if(words[i] & (static_cast<uint32_t>(1) << j))
-					continue;
-				// TODO: Make sure we never return reserved inodes.
-				// TODO: Make sure we never return inodes higher than the max. inode in the SB.
-				auto ino = bg_idx * inodesPerGroup + i * 32 + j + 1;
-				assert(ino);
-				assert(ino < inodesCount);
-				words[i] |= static_cast<uint32_t>(1) << j;
+		clearBits(blockBitmapWords(bg_idx), block - group_start, n);
+		bgdt[bg_idx].freeBlocksCount += n;
+		auto syncBitmap = co_await helix_ng::synchronizeSpace(
+				helix::BorrowedDescriptor{kHelNullHandle},
+				blockBitmapWords(bg_idx), size_t{1} << blockPagesShift);
+		HEL_CHECK(syncBitmap.error());
 
-				bgdt[bg_idx].freeInodesCount--;
-				co_await writebackBgdt();
+		block += n;
+		count -= n;
+	}
+	co_await writebackBgdt();
+}
 
-				co_return ino;
+async::result<uint32_t> FileSystem::allocateInode(uint32_t parent, bool directory) {
+	uint32_t goal_group;
+	if(directory) {
+		// Spread directories over the disk: prefer groups with an above-average
+		// number of free inodes and many free blocks.
+		uint64_t free_inodes = 0;
+		for(uint32_t bg_idx = 0; bg_idx < numBlockGroups; bg_idx++)
+			free_inodes += bgdt[bg_idx].freeInodesCount;
+		auto average = free_inodes / numBlockGroups;
+
+		goal_group = parent ? (parent - 1) / inodesPerGroup : 0;
+		int best_blocks = -1;
+		for(uint32_t i = 0; i < numBlockGroups; i++) {
+			auto bg_idx = (goal_group + i) % numBlockGroups;
+			if(!bgdt[bg_idx].freeInodesCount || bgdt[bg_idx].freeInodesCount < average)
+				continue;
+			if(bgdt[bg_idx].freeBlocksCount > best_blocks) {
+				best_blocks = bgdt[bg_idx].freeBlocksCount;
+				goal_group = bg_idx;
 			}
-			assert(!"Failed to find zero-bit");
 		}
+	}else if(parent) {
+		// Keep files close to their directory.
+		goal_group = (parent - 1) / inodesPerGroup;
+	}else{
+		goal_group = inodeGroupHint;
+	}
+
+	for(uint32_t i = 0; i < numBlockGroups; i++) {
+		auto bg_idx = (goal_group + i) % numBlockGroups;
+		if(!bgdt[bg_idx].freeInodesCount)
+			continue;
+		co_await lockInodeBitmap(bg_idx);
+
+		size_t limit = std::min<uint64_t>(inodesPerGroup,
+				inodesCount - static_cast<uint64_t>(bg_idx) * inodesPerGroup);
+		auto words = inodeBitmapWords(bg_idx);
+
+		// TODO: Make sure we never return reserved inodes.
+		auto bit = scanBitmap(words, 0, limit, false);
+		if(bit == limit)
+			continue;
+		setBits(words, bit, 1);
+
+		auto ino = bg_idx * inodesPerGroup + bit + 1;
+		assert(ino);
+		assert(ino <= inodesCount);
+
+		bgdt[bg_idx].freeInodesCount--;
+		if(directory)
+			bgdt[bg_idx].usedDirsCount++;
+		if(!parent)
+			inodeGroupHint = bg_idx;
+
+		auto syncBitmap = co_await helix_ng::synchronizeSpace(
+				helix::BorrowedDescriptor{kHelNullHandle},
+				words, size_t{1} << blockPagesShift);
+		HEL_CHECK(syncBitmap.error());
+		co_await writebackBgdt();
+
+		co_return ino;
 	}
 
 	co_return 0;
@@ -1014,6 +1965,11 @@ async::result<uint32_t> FileSystem::allocateInode() {
 
 async::result<void> FileSystem::assignDataBlocks(Inode *inode,
 		uint64_t block_offset, size_t num_blocks) {
+	if(inode->usesExtents()) {
+		co_await assignExtentBlocks(inode, block_offset, num_blocks);
+		co_return;
+	}
+
 	size_t per_indirect = blockSize / 4;
 	size_t per_single = per_indirect;
 	size_t per_double = per_indirect * per_indirect;
@@ -1025,6 +1981,14 @@ async::result<void> FileSystem::assignDataBlocks(Inode *inode,
 
 	auto disk_inode = inode->diskInode();
 
+	// Place new blocks right after the previously allocated one.
+	uint64_t goal = 0;
+	auto next_goal = [&] (uint32_t previous) {
+		if(previous)
+			goal = previous + 1;
+		return goal ? goal : inodeGoal(inode);
+	};
+
 	size_t prg = 0;
 	while(prg < num_blocks) {
 		if(block_offset + prg < i_range) {
@@ -1035,7 +1999,8 @@ async::result<void> FileSystem::assignDataBlocks(Inode *inode,
 					prg++;
 					continue;
 				}
-				auto block = co_await allocateBlock();
+				auto block = co_await allocateBlock(inode,
+						next_goal(idx ? disk_inode->data.blocks.direct[idx - 1] : 0));
 				assert(block && "Out of disk space"); // TODO: Fix this.
 				disk_inode->blocks += (blockSize / 512);
 				disk_inode->data.blocks.direct[idx] = block;
@@ -1046,7 +2011,8 @@ async::result<void> FileSystem::assignDataBlocks(Inode *inode,
 
 			// Allocate the single-indirect block itself.
 			if(!disk_inode->data.blocks.singleIndirect) {
-				auto block = co_await allocateBlock();
+				auto block = co_await allocateBlock(inode,
+						next_goal(disk_inode->data.blocks.direct[11]));
 				assert(block && "Out of disk space"); // TODO: Fix this.
 				disk_inode->blocks += (blockSize / 512);
 				disk_inode->data.blocks.singleIndirect = block;
@@ -1075,7 +2041,8 @@ async::result<void> FileSystem::assignDataBlocks(Inode *inode,
 					prg++;
 					continue;
 				}
-				auto block = co_await allocateBlock();
+				auto block = co_await allocateBlock(inode,
+						next_goal(idx ? window[idx - 1] : disk_inode->data.blocks.singleIndirect));
 				assert(block && "Out of disk space"); // TODO: Fix this.
 				disk_inode->blocks += (blockSize / 512);
 				window[idx] = block;
@@ -1094,6 +2061,540 @@ async::result<void> FileSystem::assignDataBlocks(Inode *inode,
 	HEL_CHECK(syncInode.error());
 }
 
+void FileSystem::initExtentRoot(DiskInode *disk_inode) {
+	disk_inode->flags |= EXT4_EXTENTS_FL;
+
+	DiskExtentHeader header{};
+	header.magic = EXT4_EXT_MAGIC;
+	header.entries = 0;
+	header.max = (sizeof(FileData) - sizeof(DiskExtentHeader)) / sizeof(DiskExtent);
+	header.depth = 0;
+	memset(disk_inode->data.embedded, 0, sizeof(FileData));
+	memcpy(disk_inode->data.embedded, &header, sizeof(DiskExtentHeader));
+}
+
+async::result<void> FileSystem::loadExtentTree(Inode *inode) {
+	inode->extents.clear();
+	inode->extentRoot = Inode::ExtentNode{};
+
+	// Copy the root since loading may suspend.
+	std::array<std::byte, sizeof(FileData)> root;
+	memcpy(root.data(), inode->diskInode()->data.embedded, sizeof(FileData));
+	co_await loadExtentNode(inode, &inode->extentRoot, root.data(), root.size());
+}
+
+async::result<void> FileSystem::loadExtentNode(Inode *inode, Inode::ExtentNode *node,
+		const std::byte *data, size_t size) {
+	DiskExtentHeader header;
+	memcpy(&header, data, sizeof(DiskExtentHeader));
+	if(header.magic != EXT4_EXT_MAGIC
+			|| sizeof(DiskExtentHeader) + header.entries * sizeof(DiskExtent) > size) {
+		std::cerr << "ext2fs: Corrupted extent tree in inode " << inode->number << std::endl;
+		abort();
+	}
+	node->depth = header.depth;
+
+	if(!header.depth) {
+		for(size_t i = 0; i < header.entries; i++) {
+			DiskExtent disk_extent;
+			memcpy(&disk_extent, data + sizeof(DiskExtentHeader) + i * sizeof(DiskExtent),
+					sizeof(DiskExtent));
+
+			Inode::Extent extent;
+			extent.logical = disk_extent.block;
+			extent.physical = disk_extent.startLo
+					| (static_cast<uint64_t>(disk_extent.startHi) << 32);
+			extent.uninitialized = disk_extent.length > maxInitializedExtent;
+			extent.length = extent.uninitialized
+					? disk_extent.length - maxInitializedExtent : disk_extent.length;
+			assert(inode->extents.empty()
+					|| inode->extents.back().logical + inode->extents.back().length
+						<= extent.logical);
+			inode->extents.push_back(extent);
+		}
+		node->numExtents = header.entries;
+		co_return;
+	}
+
+	std::vector<std::byte> buffer(blockSize);
+	for(size_t i = 0; i < header.entries; i++) {
+		DiskExtentIndex index;
+		memcpy(&index, data + sizeof(DiskExtentHeader) + i * sizeof(DiskExtentIndex),
+				sizeof(DiskExtentIndex));
+
+		auto child = std::make_unique<Inode::ExtentNode>();
+		child->block = index.leafLo | (static_cast<uint64_t>(index.leafHi) << 32);
+		co_await device->readSectors(child->block * sectorsPerBlock,
+				buffer.data(), sectorsPerBlock);
+		co_await loadExtentNode(inode, child.get(), buffer.data(), buffer.size());
+		node->numExtents += child->numExtents;
+		node->children.push_back(std::move(child));
+	}
+}
+
+std::pair<std::vector<Inode::ExtentNode *>, size_t> FileSystem::findExtentLeaf(Inode *inode,
+		size_t idx, bool inserted) {
+	std::vector<Inode::ExtentNode *> path{&inode->extentRoot};
+	size_t offset = 0;
+	while(path.back()->depth) {
+		auto &children = path.back()->children;
+		assert(!children.empty());
+
+		// New extents are appended to the preceding leaf if possible.
+		size_t i = 0;
+		while(i + 1 < children.size()
+				&& idx >= offset + children[i]->numExtents + (inserted ? 1 : 0)) {
+			offset += children[i]->numExtents;
+			i++;
+		}
+		path.push_back(children[i].get());
+	}
+	return {std::move(path), offset};
+}
+
+void FileSystem::insertExtent(Inode *inode, size_t idx) {
+	constexpr size_t root_entries = (sizeof(FileData) - sizeof(DiskExtentHeader)) / sizeof(DiskExtent);
+	size_t per_block = (blockSize - sizeof(DiskExtentHeader)) / sizeof(DiskExtent);
+	auto &root = inode->extentRoot;
+
+	auto entries = [] (Inode::ExtentNode *node) -> size_t {
+		return node->depth ? node->children.size() : node->numExtents;
+	};
+
+	auto [path, offset] = findExtentLeaf(inode, idx, true);
+	for(auto node : path)
+		node->numExtents++;
+	// The first extent of a leaf is also the key of the index entries above it.
+	if(idx == offset) {
+		for(auto node : path)
+			node->dirty = true;
+	}
+	path.back()->dirty = true;
+
+	// Split nodes that overflow, starting at the leaf. If the new entry is the last one,
+	// the file is most likely appended to; only the new entry is moved to the new node
+	// in that case, such that the old node stays full.
+	bool append = idx + 1 == offset + path.back()->numExtents;
+	for(size_t d = path.size() - 1; d; d--) {
+		auto node = path[d];
+		if(entries(node) <= per_block)
+			break;
+		auto parent = path[d - 1];
+		size_t keep = append ? entries(node) - 1 : entries(node) / 2;
+
+		auto sibling = std::make_unique<Inode::ExtentNode>();
+		sibling->depth = node->depth;
+		sibling->dirty = true;
+		if(node->depth) {
+			for(size_t i = keep; i < node->children.size(); i++) {
+				sibling->numExtents += node->children[i]->numExtents;
+				sibling->children.push_back(std::move(node->children[i]));
+			}
+			node->children.erase(node->children.begin() + keep, node->children.end());
+		}else{
+			sibling->numExtents = node->numExtents - keep;
+		}
+		node->numExtents -= sibling->numExtents;
+		node->dirty = true;
+		parent->dirty = true;
+
+		auto it = std::find_if(parent->children.begin(), parent->children.end(),
+				[&] (const std::unique_ptr<Inode::ExtentNode> &child) {
+			return child.get() == node;
+		});
+		it = parent->children.insert(std::next(it), std::move(sibling));
+		append = std::next(it) == parent->children.end();
+	}
+
+	// If the root overflows, its entries are moved to a new block below it.
+	if(entries(&root) > root_entries) {
+		auto child = std::make_unique<Inode::ExtentNode>();
+		child->depth = root.depth;
+		child->numExtents = root.numExtents;
+		child->dirty = true;
+		child->children = std::move(root.children);
+		root.children.clear();
+		root.children.push_back(std::move(child));
+		root.depth++;
+		root.dirty = true;
+	}
+}
+
+void FileSystem::touchExtent(Inode *inode, size_t idx) {
+	auto [path, offset] = findExtentLeaf(inode, idx, false);
+	if(idx == offset) {
+		for(auto node : path)
+			node->dirty = true;
+	}
+	path.back()->dirty = true;
+}
+
+// Only the root is updated in the disk inode; the caller has to synchronize it.
+async::result<void> FileSystem::storeExtentTree(Inode *inode) {
+	constexpr size_t root_entries = (sizeof(FileData) - sizeof(DiskExtentHeader)) / sizeof(DiskExtent);
+	size_t per_block = (blockSize - sizeof(DiskExtentHeader)) / sizeof(DiskExtent);
+	auto disk_inode = inode->diskInode();
+	auto &extents = inode->extents;
+
+	co_await inode->extentMutex.async_lock();
+
+	// Allocate blocks for new nodes. Nodes may be split while we are suspended,
+	// hence we repeat this until all nodes have a block.
+	while(true) {
+		std::vector<Inode::ExtentNode *> unplaced;
+		auto collect = [&] (auto &self, Inode::ExtentNode *node) -> void {
+			for(auto &child : node->children) {
+				if(!child->block)
+					unplaced.push_back(child.get());
+				self(self, child.get());
+			}
+		};
+		collect(collect, &inode->extentRoot);
+		if(unplaced.empty())
+			break;
+
+		for(auto node : unplaced) {
+			// Do not pass the inode as owner; this would drop its reservation for appends.
+			auto block = co_await allocateBlock(nullptr, inodeGoal(inode));
+			assert(block && "Out of disk space"); // TODO: Fix this.
+			disk_inode->blocks += (blockSize / 512);
+			node->block = block;
+		}
+	}
+
+	auto write_header = [] (std::byte *node, size_t entries, size_t max, size_t depth) {
+		DiskExtentHeader header{};
+		header.magic = EXT4_EXT_MAGIC;
+		header.entries = entries;
+		header.max = max;
+		header.depth = depth;
+		memcpy(node, &header, sizeof(DiskExtentHeader));
+	};
+
+	auto write_extent = [] (std::byte *entry, const Inode::Extent &extent) {
+		DiskExtent disk_extent{};
+		disk_extent.block = extent.logical;
+		disk_extent.length = extent.uninitialized
+				? extent.length + maxInitializedExtent : extent.length;
+		disk_extent.startLo = static_cast<uint32_t>(extent.physical);
+		disk_extent.startHi = static_cast<uint16_t>(extent.physical >> 32);
+		memcpy(entry, &disk_extent, sizeof(DiskExtent));
+	};
+
+	auto write_index = [] (std::byte *entry, uint32_t logical, uint64_t block) {
+		DiskExtentIndex index{};
+		index.block = logical;
+		index.leafLo = static_cast<uint32_t>(block);
+		index.leafHi = static_cast<uint16_t>(block >> 32);
+		memcpy(entry, &index, sizeof(DiskExtentIndex));
+	};
+
+	// Serialize all dirty nodes without suspending, such that they are consistent.
+	// Nodes are visited in pre-order; offset is the index of the node's first extent.
+	std::array<std::byte, sizeof(FileData)> root{};
+	bool root_dirty = inode->extentRoot.dirty;
+	std::vector<std::pair<uint64_t, std::vector<std::byte>>> writes;
+	auto serialize = [&] (auto &self, Inode::ExtentNode *node, size_t offset) -> void {
+		if(node->dirty) {
+			bool is_root = node == &inode->extentRoot;
+			std::vector<std::byte> buffer;
+			std::byte *data = root.data();
+			if(!is_root) {
+				buffer.resize(blockSize);
+				data = buffer.data();
+			}
+
+			if(node->depth) {
+				write_header(data, node->children.size(),
+						is_root ? root_entries : per_block, node->depth);
+				size_t child_offset = offset;
+				for(size_t i = 0; i < node->children.size(); i++) {
+					auto &child = node->children[i];
+					write_index(data + sizeof(DiskExtentHeader) + i * sizeof(DiskExtentIndex),
+							extents[child_offset].logical, child->block);
+					child_offset += child->numExtents;
+				}
+			}else{
+				write_header(data, node->numExtents,
+						is_root ? root_entries : per_block, 0);
+				for(size_t i = 0; i < node->numExtents; i++)
+					write_extent(data + sizeof(DiskExtentHeader) + i * sizeof(DiskExtent),
+							extents[offset + i]);
+			}
+
+			node->dirty = false;
+			if(!is_root)
+				writes.push_back({node->block, std::move(buffer)});
+		}
+
+		for(auto &child : node->children) {
+			self(self, child.get(), offset);
+			offset += child->numExtents;
+		}
+	};
+	serialize(serialize, &inode->extentRoot, 0);
+
+	// Write children before their parents, such that new blocks are
+	// initialized before they become reachable.
+	for(auto it = writes.rbegin(); it != writes.rend(); ++it)
+		co_await device->writeSectors(it->first * sectorsPerBlock,
+				it->second.data(), sectorsPerBlock);
+	if(root_dirty)
+		memcpy(disk_inode->data.embedded, root.data(), sizeof(FileData));
+
+	inode->extentMutex.unlock();
+}
+
+async::result<void> FileSystem::truncateExtents(Inode *inode, uint64_t num_blocks) {
+	auto &extents = inode->extents;
+	auto disk_inode = inode->diskInode();
+
+	co_await inode->extentMutex.async_lock();
+
+	// Cut off all extents beyond the new end of the file.
+	std::vector<std::pair<uint64_t, size_t>> freed;
+	while(!extents.empty()) {
+		auto &extent = extents.back();
+		if(extent.logical + extent.length <= num_blocks)
+			break;
+
+		size_t keep = num_blocks > extent.logical ? num_blocks - extent.logical : 0;
+		freed.push_back({extent.physical + keep, extent.length - keep});
+		if(keep) {
+			extent.length = keep;
+			break;
+		}
+		extents.pop_back();
+	}
+
+	if(freed.empty()) {
+		inode->extentMutex.unlock();
+		co_return;
+	}
+
+	// Rebuild the tree from scratch. This is simpler than removing entries from
+	// the existing nodes and truncation is rare compared to appends.
+	auto collect = [&] (auto &self, Inode::ExtentNode *node) -> void {
+		for(auto &child : node->children) {
+			freed.push_back({child->block, 1});
+			self(self, child.get());
+		}
+	};
+	collect(collect, &inode->extentRoot);
+
+	inode->extentRoot = Inode::ExtentNode{};
+	inode->extentRoot.dirty = true;
+	for(size_t i = 0; i < extents.size(); i++)
+		insertExtent(inode, i);
+
+	for(auto [block, count] : freed)
+		disk_inode->blocks -= count * (blockSize / 512);
+
+	inode->extentMutex.unlock();
+
+	// Only free the blocks once the new tree is on disk.
+	co_await storeExtentTree(inode);
+	for(auto [block, count] : freed)
+		co_await freeBlocks(block, count);
+}
+
+std::pair<uint64_t, size_t> FileSystem::mapExtent(Inode *inode, uint64_t block, size_t limit) {
+	auto &extents = inode->extents;
+
+	// Find the first extent that starts after the block.
+	auto it = std::upper_bound(extents.begin(), extents.end(), block,
+			[] (uint64_t block, const Inode::Extent &extent) {
+		return block < extent.logical;
+	});
+
+	if(it != extents.begin()) {
+		auto &extent = *std::prev(it);
+		if(block < extent.logical + extent.length) {
+			auto count = std::min<size_t>(limit, extent.logical + extent.length - block);
+			// Uninitialized extents read as zeros.
+			if(extent.uninitialized)
+				return {0, count};
+			return {extent.physical + (block - extent.logical), count};
+		}
+	}
+
+	// The block is part of a hole that extends up to the next extent.
+	if(it == extents.end())
+		return {0, limit};
+	return {0, std::min<size_t>(limit, it->logical - block)};
+}
+
+async::result<void> FileSystem::assignExtentBlocks(Inode *inode,
+		uint64_t block_offset, size_t num_blocks) {
+	auto &extents = inode->extents;
+	auto disk_inode = inode->diskInode();
+	bool changed = false;
+
+	size_t prg = 0;
+	while(prg < num_blocks) {
+		uint64_t block = block_offset + prg;
+		auto it = std::upper_bound(extents.begin(), extents.end(), block,
+				[] (uint64_t block, const Inode::Extent &extent) {
+			return block < extent.logical;
+		});
+		size_t idx = it - extents.begin();
+
+		if(idx && block < extents[idx - 1].logical + extents[idx - 1].length) {
+			auto &extent = extents[idx - 1];
+			if(extent.uninitialized) {
+				// Writing into a preallocated extent: zero the written blocks on disk, such that
+				// parts of them that are not overwritten read as zeros, and split the extent
+				// such that only the written blocks are initialized.
+				auto count = std::min<size_t>(num_blocks - prg,
+						extent.logical + extent.length - block);
+				auto physical = extent.physical + (block - extent.logical);
+				std::vector<std::byte> zeros(std::min<size_t>(count, 64) * blockSize);
+				for(size_t p = 0; p < count; p += zeros.size() / blockSize) {
+					auto n = std::min<size_t>(count - p, zeros.size() / blockSize);
+					co_await device->writeSectors((physical + p) * sectorsPerBlock,
+							zeros.data(), n * sectorsPerBlock);
+				}
+
+				// Look up the extent again since extents may have changed while we were suspended.
+				// If the blocks are no longer mapped the same way, start over.
+				it = std::upper_bound(extents.begin(), extents.end(), block,
+						[] (uint64_t block, const Inode::Extent &extent) {
+					return block < extent.logical;
+				});
+				idx = it - extents.begin();
+				if(!idx)
+					continue;
+				auto &current = extents[idx - 1];
+				if(!current.uninitialized
+						|| block + count > current.logical + current.length
+						|| current.physical + (block - current.logical) != physical)
+					continue;
+
+				auto head = static_cast<uint32_t>(block - current.logical);
+				auto tail = static_cast<uint32_t>(current.logical + current.length
+						- (block + count));
+				Inode::Extent written{static_cast<uint32_t>(block), static_cast<uint32_t>(count),
+						physical, false};
+				Inode::Extent rest{static_cast<uint32_t>(block + count), tail,
+						physical + count, true};
+
+				size_t pos = idx - 1;
+				if(head) {
+					current.length = head;
+					touchExtent(inode, pos);
+					pos++;
+					extents.insert(extents.begin() + pos, written);
+					insertExtent(inode, pos);
+				}else{
+					current = written;
+					touchExtent(inode, pos);
+				}
+				if(tail) {
+					pos++;
+					extents.insert(extents.begin() + pos, rest);
+					insertExtent(inode, pos);
+				}
+
+				changed = true;
+				prg += count;
+				continue;
+			}
+
+			prg += std::min<size_t>(num_blocks - prg, extent.logical + extent.length - block);
+			continue;
+		}
+
+		// Fill the hole with a single run of blocks if possible.
+		// The run is placed such that it continues the previous extent.
+		auto count = std::min<size_t>(num_blocks - prg, maxInitializedExtent);
+		if(idx < extents.size())
+			count = std::min<size_t>(count, extents[idx].logical - block);
+		uint64_t goal = 0;
+		if(idx)
+			goal = extents[idx - 1].physical + (block - extents[idx - 1].logical);
+
+		auto [physical, n] = co_await allocateBlocks(inode, goal, count);
+		assert(physical && "Out of disk space"); // TODO: Fix this.
+		disk_inode->blocks += n * (blockSize / 512);
+		changed = true;
+
+		// Extend adjacent extents if possible, otherwise insert a new one.
+		// Note that extents may have changed while allocateBlocks() was suspended.
+		it = std::upper_bound(extents.begin(), extents.end(), block,
+				[] (uint64_t block, const Inode::Extent &extent) {
+			return block < extent.logical;
+		});
+		idx = it - extents.begin();
+		if(idx) {
+			auto &previous = extents[idx - 1];
+			if(!previous.uninitialized
+					&& previous.logical + previous.length == block
+					&& previous.physical + previous.length == physical
+					&& previous.length + n <= maxInitializedExtent) {
+				previous.length += n;
+				touchExtent(inode, idx - 1);
+				prg += n;
+				continue;
+			}
+		}
+		if(idx < extents.size()) {
+			auto &next = extents[idx];
+			if(!next.uninitialized
+					&& next.logical == block + n
+					&& next.physical == physical + n
+					&& next.length + n <= maxInitializedExtent) {
+				next.logical -= n;
+				next.physical -= n;
+				next.length += n;
+				touchExtent(inode, idx);
+				prg += n;
+				continue;
+			}
+		}
+		extents.insert(extents.begin() + idx,
+				Inode::Extent{static_cast<uint32_t>(block), static_cast<uint32_t>(n),
+						physical, false});
+		insertExtent(inode, idx);
+		prg += n;
+	}
+
+	if(changed)
+		co_await storeExtentTree(inode);
+
+	auto syncInode = co_await helix_ng::synchronizeSpace(
+			helix::BorrowedDescriptor{kHelNullHandle},
+			inode->diskMapping.get(), inodeSize);
+	HEL_CHECK(syncInode.error());
+}
+
+async::result<void> FileSystem::transferRuns(bool write, const std::vector<BlockRun> &runs,
+		void *buffer) {
+	size_t pending = runs.size();
+	if(!pending)
+		co_return;
+
+	async::oneshot_event done;
+	auto complete = [&] {
+		if(!--pending)
+			done.raise();
+	};
+
+	device->plug();
+	for(auto &run : runs) {
+		auto p = reinterpret_cast<uint8_t *>(buffer) + run.bufferBlock * blockSize;
+		if(write) {
+			async::detach(device->writeSectors(run.physical * sectorsPerBlock,
+					p, run.count * sectorsPerBlock), complete);
+		}else{
+			async::detach(device->readSectors(run.physical * sectorsPerBlock,
+					p, run.count * sectorsPerBlock), complete);
+		}
+	}
+	device->unplug();
+
+	co_await done.wait();
+}
+
 async::result<void> FileSystem::readDataBlocks(std::shared_ptr<Inode> inode,
 		uint64_t offset, size_t num_blocks, void *buffer) {
 	// We perform "block-fusion" here i.e. we try to read/write multiple
@@ -1120,6 +2621,23 @@ async::result<void> FileSystem::readDataBlocks(std::shared_ptr<Inode> inode,
 	co_await inode->readyJump.wait();
 	// TODO: Assert that we do not read past the EOF.
 
+	if(inode->usesExtents()) {
+		std::vector<BlockRun> runs;
+		size_t progress = 0;
+		while(progress < num_blocks) {
+			auto [physical, count] = mapExtent(inode.get(), offset + progress,
+					num_blocks - progress);
+			if(physical) {
+				runs.push_back({physical, count, progress});
+			}else{
+				memset((uint8_t *)buffer + progress * blockSize, 0, count * blockSize);
+			}
+			progress += count;
+		}
+		co_await transferRuns(false, runs, buffer);
+		co_return;
+	}
+
 	constexpr size_t indirectBufferSize = 8;
 
 	std::array<uint32_t, indirectBufferSize> indirectBuffer;
@@ -1241,6 +2759,20 @@ async::result<void> FileSystem::writeDataBlocks(std::shared_ptr<Inode> inode,
 	co_await inode->readyJump.wait();
 	// TODO: Assert that we do not write past the EOF.
 
+	if(inode->usesExtents()) {
+		std::vector<BlockRun> runs;
+		size_t progress = 0;
+		while(progress < num_blocks) {
+			auto [physical, count] = mapExtent(inode.get(), offset + progress,
+					num_blocks - progress);
+			assert(physical && "Blocks must be assigned before they are written");
+			runs.push_back({physical, count, progress});
+			progress += count;
+		}
+		co_await transferRuns(true, runs, const_cast<void *>(buffer));
+		co_return;
+	}
+
 	size_t progress = 0;
 	while(progress < num_blocks) {
 		// Block number and block count of the writeSectors() command that we will issue here.
@@ -1307,6 +2839,14 @@ async::result<void> FileSystem::truncate(Inode *inode, size_t size) {
 	HEL_CHECK(helResizeMemory(inode->backingMemory,
 			(size + 0xFFF) & ~size_t(0xFFF)));
 	inode->setFileSize(size);
+
+	// Free the blocks beyond the end of the file.
+	// TODO: Files that do not use extents keep their blocks.
+	if(inode->usesExtents()) {
+		releaseReservation(inode);
+		co_await truncateExtents(inode, (size + blockSize - 1) >> blockShift);
+	}
+
 	auto syncInode = co_await helix_ng::synchronizeSpace(
 			helix::BorrowedDescriptor{kHelNullHandle},
 			inode->diskMapping.get(), inodeSize);
@@ -1324,8 +2864,24 @@ async::result<void> FileSystem::writebackBgdt() {
 // OpenFile
 // --------------------------------------------------------
 
+namespace {
+	// Frees the blocks of a file that was unlinked while it was open.
+	async::detached releaseUnlinked(std::shared_ptr<Inode> inode) {
+		co_await inode->fs.truncate(inode.get(), 0);
+	}
+}
+
 OpenFile::OpenFile(std::shared_ptr<Inode> inode)
-: inode(inode), offset(0) { }
+: inode(inode), offset(0) {
+	inode->openFiles++;
+}
+
+OpenFile::~OpenFile() {
+	// TODO: Mappings of the file can outlive the OpenFile; we do not track them.
+	if(!--inode->openFiles && inode->isReady && inode->fileType == kTypeRegular
+			&& !inode->diskInode()->linksCount)
+		releaseUnlinked(inode);
+}
 
 async::result<std::optional<std::string>>
 OpenFile::readEntries() {
@@ -1,7 +1,9 @@
 
+#include <assert.h>
 #include <string.h>
 #include <time.h>
 #include <optional>
+#include <map>
 #include <memory>
 #include <optional>
 #include <unordered_map>
@@ -9,6 +11,7 @@
 #include <vector>
 #include <protocols/fs/file-locks.hpp>
 
+#include <async/mutex.hpp>
 #include <async/oneshot-event.hpp>
 #include <async/recurring-event.hpp>
 #include <hel.h>
@@ -93,7 +96,9 @@ struct DiskSuperblock {
 	//-- Other options --
 	uint32_t defaultMountOptions;
 	uint32_t firstMetaBg;
-	uint8_t unused[760];
+	uint8_t unused1[88];
+	uint32_t flags;
+	uint8_t unused2[668];
 };
 static_assert(sizeof(DiskSuperblock) == 1024, "Bad DiskSuperblock struct size");
 
@@ -135,6 +140,80 @@ enum {
 	EXT2_ROOT_INO = 2
 };
 
+enum {
+	// Bits of DiskSuperblock::featureCompat.
+	EXT3_FEATURE_COMPAT_DIR_INDEX = 0x20
+};
+
+enum {
+	// Bits of DiskSuperblock::flags.
+	EXT2_FLAGS_UNSIGNED_HASH = 0x2
+};
+
+enum {
+	// Bits of DiskSuperblock::featureIncompat.
+	EXT2_FEATURE_INCOMPAT_FILETYPE = 0x2,
+	EXT4_FEATURE_INCOMPAT_EXTENTS = 0x40,
+	EXT4_FEATURE_INCOMPAT_FLEX_BG = 0x200
+};
+
+enum {
+	// Bits of DiskSuperblock::featureRoCompat.
+	EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER = 0x1,
+	EXT2_FEATURE_RO_COMPAT_LARGE_FILE = 0x2
+};
+
+// Features that we implement. Images with other r/w-required features are not mounted;
+// images with other w-required features (e.g., metadata checksums) are mounted read-only.
+inline constexpr uint32_t supportedIncompat = EXT2_FEATURE_INCOMPAT_FILETYPE
+		| EXT4_FEATURE_INCOMPAT_EXTENTS | EXT4_FEATURE_INCOMPAT_FLEX_BG;
+inline constexpr uint32_t supportedRoCompat = EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER
+		| EXT2_FEATURE_RO_COMPAT_LARGE_FILE;
+
+enum {
+	// Bits of DiskInode::flags.
+	EXT2_INDEX_FL = 0x1000,
+	EXT4_EXTENTS_FL = 0x80000
+};
+
+// --------------------------------------------------------
+// Extent trees
+// --------------------------------------------------------
+
+enum {
+	EXT4_EXT_MAGIC = 0xF30A
+};
+
+// Every node of an extent tree (including the root in DiskInode::data) starts with this header.
+struct DiskExtentHeader {
+	uint16_t magic;
+	uint16_t entries;
+	uint16_t max;
+	uint16_t depth;
+	uint32_t generation;
+};
+static_assert(sizeof(DiskExtentHeader) == 12, "Bad DiskExtentHeader struct size");
+
+// Entry of an inner node (depth > 0).
+struct DiskExtentIndex {
+	uint32_t block;
+	uint32_t leafLo;
+	uint16_t leafHi;
+	uint16_t unused;
+};
+static_assert(sizeof(DiskExtentIndex) == 12, "Bad DiskExtentIndex struct size");
+
+// Entry of a leaf node (depth == 0).
+struct DiskExtent {
+	uint32_t block;
+	uint16_t length; // Values > maxInitializedExtent denote uninitialized extents.
+	uint16_t startHi;
+	uint32_t startLo;
+};
+static_assert(sizeof(DiskExtent) == 12, "Bad DiskExtent struct size");
+
+inline constexpr uint32_t maxInitializedExtent = 32768;
+
 enum {
 	EXT2_S_IFMT = 0xF000,
 	EXT2_S_IFLNK = 0xA000,
@@ -153,9 +232,88 @@ struct DiskDirEntry {
 enum {
 	EXT2_FT_REG_FILE = 1,
 	EXT2_FT_DIR = 2,
-	EXT2_FT_SYMLINK = 7
+	EXT2_FT_SYMLINK = 7,
+	// Used by the fake entry that stores the checksum of the block if metadata_csum is enabled.
+	EXT4_FT_DIR_CSUM = 0xDE
 };
 
+// --------------------------------------------------------
+// Hashed directory index (htree)
+// --------------------------------------------------------
+
+enum {
+	DX_HASH_LEGACY = 0,
+	DX_HASH_HALF_MD4 = 1,
+	DX_HASH_TEA = 2,
+	DX_HASH_LEGACY_UNSIGNED = 3,
+	DX_HASH_HALF_MD4_UNSIGNED = 4,
+	DX_HASH_TEA_UNSIGNED = 5
+};
+
+// Block 0 of an indexed directory contains the "." and ".." entries (12 bytes each),
+// followed by this structure and the root's DiskDxEntry array. Interior nodes contain
+// a single empty DiskDirEntry that covers the whole block, followed by a DiskDxEntry array.
+// In both cases, the directory still looks valid to code that does not know about the index.
+struct DiskDxRootInfo {
+	uint32_t reservedZero;
+	uint8_t hashVersion;
+	uint8_t infoLength;
+	uint8_t indirectLevels;
+	uint8_t unusedFlags;
+};
+static_assert(sizeof(DiskDxRootInfo) == 8, "Bad DiskDxRootInfo struct size");
+
+// Entry i covers all hashes in [hash_i, hash_i+1). Entry 0 has an implicit hash
+// (inherited from the parent); its hash field is replaced by a DiskDxCountLimit.
+// Bit 0 of the hash is set if the previous block contains names with the same hash.
+struct DiskDxEntry {
+	uint32_t hash;
+	uint32_t block;
+};
+static_assert(sizeof(DiskDxEntry) == 8, "Bad DiskDxEntry struct size");
+
+struct DiskDxCountLimit {
+	uint16_t limit;
+	uint16_t count;
+};
+static_assert(sizeof(DiskDxCountLimit) == 4, "Bad DiskDxCountLimit struct size");
+
+uint32_t hashDirName(int version, const uint32_t *seed, const char *name, size_t length);
+
+// Directories of at least this size that are not indexed keep an in-memory name cache.
+inline constexpr size_t nameCacheThreshold = 64 * 1024;
+
+// --------------------------------------------------------
+// ConcurrencyLimit
+// --------------------------------------------------------
+
+// Bounds the number of operations that run concurrently.
+struct ConcurrencyLimit {
+	ConcurrencyLimit(size_t limit)
+	: _limit{limit} { }
+
+	async::result<void> acquire() {
+		while(_count >= _limit)
+			co_await _event.async_wait();
+		_count++;
+	}
+
+	void release() {
+		assert(_count);
+		_count--;
+		_event.raise();
+	}
+
+private:
+	size_t _limit;
+	size_t _count = 0;
+	async::recurring_event _event;
+};
+
+// Maximal number of manage requests that are processed concurrently per inode / globally.
+inline constexpr size_t maxManagePerInode = 8;
+inline constexpr size_t maxManageGlobal = 64;
+
 // --------------------------------------------------------
 // DirEntry
 // --------------------------------------------------------
@@ -173,6 +331,7 @@ struct FileSystem;
 
 struct Inode : std::enable_shared_from_this<Inode> {
 	Inode(FileSystem &fs, uint32_t number);
+	~Inode();
 
 	DiskInode *diskInode() {
 		return reinterpret_cast<DiskInode *>(diskMapping.get());
@@ -188,6 +347,41 @@ struct Inode : std::enable_shared_from_this<Inode> {
 	async::result<frg::expected<protocols::fs::Error, std::optional<DirEntry>>>
 	findEntry(std::string name);
 
+	// Helpers for directories. The directory has to be locked into memory.
+	std::optional<DirEntry> lookupEntry(const std::string &name);
+	DiskDirEntry *findInBlock(size_t begin, size_t end, const std::string &name,
+			DiskDirEntry **previous);
+	// Returns the offset and length of a free record of at least the required length.
+	// This may shrink the existing record that the free space is taken from.
+	std::optional<std::pair<size_t, size_t>> findSlot(size_t begin, size_t end, size_t required);
+	void rewriteBlock(size_t block, const std::vector<DiskDirEntry *> &entries);
+	async::result<helix::UniqueDescriptor> lockDirectory();
+	// Appends an empty block to the directory and returns its index.
+	async::result<size_t> growDirectory();
+
+	// Support for the hashed directory index (htree).
+	struct DxFrame {
+		size_t block;
+		size_t position;
+	};
+	bool usesIndex() {
+		return diskInode()->flags & EXT2_INDEX_FL;
+	}
+	DiskDxRootInfo *dxRootInfo();
+	DiskDxEntry *dxEntries(size_t block);
+	std::optional<uint32_t> dxHash(const std::string &name);
+	// Returns the leaf block that may contain the hash, or std::nullopt if the index is not usable.
+	std::optional<size_t> dxProbe(uint32_t hash, std::vector<DxFrame> &path);
+	// Returns the next leaf block if it may contain names with the same hash.
+	std::optional<size_t> dxNextLeaf(uint32_t hash, std::vector<DxFrame> &path);
+	void dxInsert(size_t block, size_t position, uint32_t hash, size_t target);
+	// Returns false if the index is not usable.
+	bool dxLookup(const std::string &name, DiskDirEntry **entry, DiskDirEntry **previous);
+	async::result<std::optional<std::pair<size_t, size_t>>>
+	dxFindSlot(const std::string &name, size_t required);
+	async::result<bool> dxCreateIndex();
+	async::result<void> dxDrop();
+
 	async::result<std::optional<DirEntry>> link(std::string name, int64_t ino, blockfs::FileType type);
 	async::result<frg::expected<protocols::fs::Error>> unlink(std::string name);
 	async::result<std::optional<DirEntry>> mkdir(std::string name);
@@ -227,6 +421,57 @@ struct Inode : std::enable_shared_from_this<Inode> {
 	// - Indirection level 3/3 for triple indirect blocks.
 	helix::UniqueDescriptor indirectOrder3;
 
+	// In-memory copy of the extent tree, sorted by logical block.
+	// Only meaningful if usesExtents() is true.
+	struct Extent {
+		uint32_t logical;
+		uint32_t length;
+		uint64_t physical;
+		bool uninitialized;
+	};
+	std::vector<Extent> extents;
+
+	// Structure of the extent tree. Leaves store consecutive ranges of extents;
+	// the root is embedded into the disk inode.
+	struct ExtentNode {
+		// Disk block that stores the node (0 for the root and for new nodes).
+		uint64_t block = 0;
+		uint16_t depth = 0;
+		// Number of extents in the subtree.
+		size_t numExtents = 0;
+		// Set if the node has to be written back.
+		bool dirty = false;
+		std::vector<std::unique_ptr<ExtentNode>> children;
+	};
+	ExtentNode extentRoot;
+
+	// Serializes writeback of the extent tree against truncation.
+	async::mutex extentMutex;
+
+	bool usesExtents() {
+		return diskInode()->flags & EXT4_EXTENTS_FL;
+	}
+
+	// Number of OpenFiles of this inode. The blocks of unlinked files
+	// are freed when the last OpenFile is closed.
+	size_t openFiles = 0;
+
+	// Blocks that are reserved for appends to this file. See FileSystem::allocateBlocks().
+	uint64_t reservationStart = 0;
+	uint32_t reservationLength = 0;
+
+	// Maps names to entries for large directories that are not indexed.
+	// Only valid if nameCacheValid is true.
+	std::unordered_map<std::string, DirEntry> nameCache;
+	bool nameCacheValid = false;
+
+	// Serializes accesses to directory entries.
+	async::mutex dirMutex;
+
+	// Bounds the number of manage requests for the file data of this inode
+	// that are processed concurrently.
+	ConcurrencyLimit manageLimit{maxManagePerInode};
+
 	// NOTE: The following fields are only meaningful if the isReady is true
 
 	FileType fileType;
@@ -242,9 +487,10 @@ struct Inode : std::enable_shared_from_this<Inode> {
 // --------------------------------------------------------
 
 struct FileSystem {
-	FileSystem(BlockDevice *device);
+	FileSystem(BlockDevice *device, ConcurrencyLimit *manage_limit);
 
-	async::result<void> init();
+	// Returns false if the file system uses features that we do not support.
+	async::result<bool> init();
 
 	async::detached manageBlockBitmap(helix::UniqueDescriptor memory);
 	async::detached manageInodeBitmap(helix::UniqueDescriptor memory);
@@ -252,9 +498,9 @@ struct FileSystem {
 
 	std::shared_ptr<Inode> accessRoot();
 	std::shared_ptr<Inode> accessInode(uint32_t number);
-	async::result<std::shared_ptr<Inode>> createRegular();
-	async::result<std::shared_ptr<Inode>> createDirectory();
-	async::result<std::shared_ptr<Inode>> createSymlink();
+	async::result<std::shared_ptr<Inode>> createRegular(uint32_t parent);
+	async::result<std::shared_ptr<Inode>> createDirectory(uint32_t parent);
+	async::result<std::shared_ptr<Inode>> createSymlink(uint32_t parent);
 
 	async::result<void> write(Inode *inode, uint64_t offset,
 			const void *buffer, size_t length);
@@ -264,12 +510,72 @@ struct FileSystem {
 	async::detached manageIndirect(std::shared_ptr<Inode> inode, int order,
 			helix::UniqueDescriptor memory);
 
-	async::result<uint32_t> allocateBlock();
-	async::result<uint32_t> allocateInode();
+	// Handle a single manage request. For file data, the caller acquires the manage limits.
+	async::detached handleFileData(std::shared_ptr<Inode> inode,
+			int type, uintptr_t offset, size_t length);
+	async::detached handleIndirect(std::shared_ptr<Inode> inode, int order,
+			helix::BorrowedDescriptor memory, int type, uintptr_t offset, size_t length);
+
+	// Bitmaps are locked into memory on first use and stay mapped afterwards.
+	async::result<void> lockBlockBitmap(uint32_t bg_idx);
+	async::result<void> lockInodeBitmap(uint32_t bg_idx);
+	uint64_t *blockBitmapWords(uint32_t bg_idx);
+	uint64_t *inodeBitmapWords(uint32_t bg_idx);
+
+	// Allocates up to count contiguous blocks, preferably starting at goal.
+	// Returns the first block and the number of allocated blocks (or zeros if the disk is full).
+	// If owner is given, the blocks after the allocation are reserved for future appends.
+	async::result<std::pair<uint32_t, size_t>> allocateBlocks(Inode *owner,
+			uint64_t goal, size_t count);
+	async::result<uint32_t> allocateBlock(Inode *owner = nullptr, uint64_t goal = 0);
+	// Frees count blocks starting at block. The blocks may span multiple groups.
+	async::result<void> freeBlocks(uint64_t block, size_t count);
+	// Returns the first block of the group that contains the inode.
+	uint64_t inodeGoal(Inode *inode);
+	void releaseReservation(Inode *owner);
+
+	// Allocates an inode close to its parent directory (if any).
+	async::result<uint32_t> allocateInode(uint32_t parent, bool directory);
 
 	async::result<void> assignDataBlocks(Inode *inode,
 			uint64_t block_offset, size_t num_blocks);
 
+	// Extent tree support. See Inode::extents.
+	void initExtentRoot(DiskInode *disk_inode);
+	async::result<void> loadExtentTree(Inode *inode);
+	async::result<void> loadExtentNode(Inode *inode, Inode::ExtentNode *node,
+			const std::byte *data, size_t size);
+	// Returns the path from the root to the leaf that contains (or receives, if inserted is
+	// true) the extent at index idx and the index of the leaf's first extent.
+	std::pair<std::vector<Inode::ExtentNode *>, size_t> findExtentLeaf(Inode *inode,
+			size_t idx, bool inserted);
+	// Updates the tree after the extent at index idx was inserted into (or changed in)
+	// Inode::extents. Nodes that need to be written back are marked as dirty.
+	void insertExtent(Inode *inode, size_t idx);
+	void touchExtent(Inode *inode, size_t idx);
+	// Writes back all dirty nodes of the extent tree.
+	async::result<void> storeExtentTree(Inode *inode);
+	// Frees all blocks of extents beyond num_blocks and rebuilds the extent tree.
+	async::result<void> truncateExtents(Inode *inode, uint64_t num_blocks);
+	async::result<void> assignExtentBlocks(Inode *inode,
+			uint64_t block_offset, size_t num_blocks);
+	// Returns the physical block of a logical block (or 0 for holes) and the number
+	// of logical blocks (up to limit) that are mapped contiguously from there on.
+	std::pair<uint64_t, size_t> mapExtent(Inode *inode, uint64_t block, size_t limit);
+
+	// A range of consecutive blocks on disk and the block of the buffer that it is
+	// transferred to or from.
+	struct BlockRun {
+		uint64_t physical;
+		size_t count;
+		size_t bufferBlock;
+	};
+
+	// Reads or writes all runs concurrently. The device is plugged while the requests
+	// are submitted, such that runs that are adjacent on disk are merged.
+	async::result<void> transferRuns(bool write, const std::vector<BlockRun> &runs,
+			void *buffer);
+
 	async::result<void> readDataBlocks(std::shared_ptr<Inode> inode, uint64_t block_offset,
 			size_t num_blocks, void *buffer);
 	async::result<void> writeDataBlocks(std::shared_ptr<Inode> inode, uint64_t block_offset,
@@ -290,6 +596,15 @@ struct FileSystem {
 	uint32_t inodesPerGroup;
 	uint32_t blocksCount;
 	uint32_t inodesCount;
+	uint32_t firstDataBlock;
+	bool extentsEnabled;
+	bool dirIndexEnabled;
+	// Set if the file system has w-required features that we do not support.
+	// Requests that modify the file system fail and writeback is skipped.
+	bool readOnly;
+	bool unsignedHash;
+	uint8_t defaultHashVersion;
+	uint32_t hashSeed[4];
 	std::vector<std::byte> blockGroupDescriptorBuffer;
 	DiskGroupDesc *bgdt;
 
@@ -297,7 +612,27 @@ struct FileSystem {
 	helix::UniqueDescriptor inodeBitmap;
 	helix::UniqueDescriptor inodeTable;
 
+	helix::Mapping blockBitmapMapping;
+	helix::Mapping inodeBitmapMapping;
+	std::vector<helix::UniqueDescriptor> blockBitmapLocks;
+	std::vector<helix::UniqueDescriptor> inodeBitmapLocks;
+
+	// Block reservations of appending writers, indexed by their first block.
+	// Reserved blocks are free on disk but are skipped by allocations of other files.
+	struct Reservation {
+		uint32_t length;
+		Inode *owner;
+	};
+	std::map<uint64_t, Reservation> reservations;
+
+	// Group in which the last inode without a parent was allocated.
+	uint32_t inodeGroupHint = 0;
+
 	std::unordered_map<uint32_t, std::weak_ptr<Inode>> activeInodes;
+
+	// Bounds the number of manage requests of all inodes that are processed concurrently.
+	// Shared by all file systems on the same disk.
+	ConcurrencyLimit *manageLimit;
 };
 
 // --------------------------------------------------------
@@ -306,6 +641,7 @@ struct FileSystem {
 
 struct OpenFile {
 	OpenFile(std::shared_ptr<Inode> inode);
+	~OpenFile();
 
 	async::result<std::optional<std::string>> readEntries();
 
@@ -88,5 +88,21 @@ async::result<size_t> Partition::getSize() {
 	co_return _numSectors * sectorSize;
 }
 
+size_t Partition::queueDepth() {
+	return _table.getDevice()->queueDepth();
+}
+
+size_t Partition::maxTransferSectors() {
+	return _table.getDevice()->maxTransferSectors();
+}
+
+void Partition::plug() {
+	_table.getDevice()->plug();
+}
+
+void Partition::unplug() {
+	_table.getDevice()->unplug();
+}
+
 } } // namespace blockfs::gpt
 
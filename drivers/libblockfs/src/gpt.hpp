@@ -104,6 +104,11 @@ struct Partition : public BlockDevice {
 
 	async::result<size_t> getSize() override;
 
+	size_t queueDepth() override;
+	size_t maxTransferSectors() override;
+	void plug() override;
+	void unplug() override;
+
 	Guid id();
 
 	Guid type();
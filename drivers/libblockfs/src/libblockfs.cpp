@@ -6,6 +6,7 @@
 #include <sys/epoll.h>
 #include <linux/cdrom.h>
 
+#include <async/oneshot-event.hpp>
 #include <helix/ipc.hpp>
 #include <protocols/fs/server.hpp>
 #include <protocols/mbus/client.hpp>
@@ -15,15 +16,17 @@
 #include "gpt.hpp"
 #include "ext2fs.hpp"
 #include "raw.hpp"
+#include "queue.hpp"
 #include "fs.bragi.hpp"
 #include <bragi/helpers-std.hpp>
 
 namespace blockfs {
 
-// TODO: Support more than one table.
-gpt::Table *table;
-ext2fs::FileSystem *fs;
-raw::RawFs *rawFs;
+// A partition that is served by this process.
+struct Mount {
+	ext2fs::FileSystem *fs;
+	raw::RawFs *rawFs;
+};
 
 protocols::ostrace::Context ostContext;
 protocols::ostrace::EventId ostReadEvent;
@@ -162,6 +165,8 @@ async::result<frg::expected<protocols::fs::Error, size_t>> write(void *object, c
 	assert(length);
 
 	auto self = static_cast<ext2fs::OpenFile *>(object);
+	if(self->inode->fs.readOnly)
+		co_return protocols::fs::Error::accessDenied;
 	co_await self->inode->fs.write(self->inode.get(), self->offset, buffer, length);
 	self->offset += length;
 	co_return length;
@@ -187,6 +192,8 @@ readEntries(void *object) {
 async::result<frg::expected<protocols::fs::Error>>
 truncate(void *object, size_t size) {
 	auto self = static_cast<ext2fs::OpenFile *>(object);
+	if(self->inode->fs.readOnly)
+		co_return protocols::fs::Error::accessDenied;
 	co_await self->inode->fs.truncate(self->inode.get(), size);
 	co_return {};
 }
@@ -243,12 +250,15 @@ getLink(std::shared_ptr<void> object,
 	}
 
 	assert(entry->inode);
-	co_return protocols::fs::GetLinkResult{fs->accessInode(entry->inode), entry->inode, type};
+	co_return protocols::fs::GetLinkResult{self->fs.accessInode(entry->inode), entry->inode, type};
 }
 
 async::result<protocols::fs::GetLinkResult> link(std::shared_ptr<void> object,
 		std::string name, int64_t ino) {
 	auto self = std::static_pointer_cast<ext2fs::Inode>(object);
+	if(self->fs.readOnly)
+		co_return protocols::fs::GetLinkResult{nullptr, -1,
+				protocols::fs::FileType::unknown};
 	auto entry = co_await self->link(std::move(name), ino, kTypeRegular);
 	if(!entry)
 		co_return protocols::fs::GetLinkResult{nullptr, -1,
@@ -270,11 +280,13 @@ async::result<protocols::fs::GetLinkResult> link(std::shared_ptr<void> object,
 	}
 
 	assert(entry->inode);
-	co_return protocols::fs::GetLinkResult{fs->accessInode(entry->inode), entry->inode, type};
+	co_return protocols::fs::GetLinkResult{self->fs.accessInode(entry->inode), entry->inode, type};
 }
 
 async::result<frg::expected<protocols::fs::Error>> unlink(std::shared_ptr<void> object, std::string name) {
 	auto self = std::static_pointer_cast<ext2fs::Inode>(object);
+	if(self->fs.readOnly)
+		co_return protocols::fs::Error::accessDenied;
 	auto result = co_await self->unlink(std::move(name));
 	if(!result) {
 		assert(result.error() == protocols::fs::Error::fileNotFound);
@@ -360,29 +372,35 @@ async::result<std::string> readSymlink(std::shared_ptr<void> object) {
 async::result<protocols::fs::MkdirResult>
 mkdir(std::shared_ptr<void> object, std::string name) {
 	auto self = std::static_pointer_cast<ext2fs::Inode>(object);
+	if(self->fs.readOnly)
+		co_return protocols::fs::MkdirResult{nullptr, -1};
 	auto entry = co_await self->mkdir(std::move(name));
 
 	if(!entry)
 		co_return protocols::fs::MkdirResult{nullptr, -1};
 
 	assert(entry->inode);
-	co_return protocols::fs::MkdirResult{fs->accessInode(entry->inode), entry->inode};
+	co_return protocols::fs::MkdirResult{self->fs.accessInode(entry->inode), entry->inode};
 }
 
 async::result<protocols::fs::SymlinkResult>
 symlink(std::shared_ptr<void> object, std::string name, std::string target) {
 	auto self = std::static_pointer_cast<ext2fs::Inode>(object);
+	if(self->fs.readOnly)
+		co_return protocols::fs::SymlinkResult{nullptr, -1};
 	auto entry = co_await self->symlink(std::move(name), std::move(target));
 
 	if(!entry)
 		co_return protocols::fs::SymlinkResult{nullptr, -1};
 
 	assert(entry->inode);
-	co_return protocols::fs::SymlinkResult{fs->accessInode(entry->inode), entry->inode};
+	co_return protocols::fs::SymlinkResult{self->fs.accessInode(entry->inode), entry->inode};
 }
 
 async::result<protocols::fs::Error> chmod(std::shared_ptr<void> object, int mode) {
 	auto self = std::static_pointer_cast<ext2fs::Inode>(object);
+	if(self->fs.readOnly)
+		co_return protocols::fs::Error::accessDenied;
 	auto result = co_await self->chmod(mode);
 
 	co_return result;
@@ -390,6 +408,8 @@ async::result<protocols::fs::Error> chmod(std::shared_ptr<void> object, int mode
 
 async::result<protocols::fs::Error> utimensat(std::shared_ptr<void> object, uint64_t atime_sec, uint64_t atime_nsec, uint64_t mtime_sec, uint64_t mtime_nsec) {
 	auto self = std::static_pointer_cast<ext2fs::Inode>(object);
+	if(self->fs.readOnly)
+		co_return protocols::fs::Error::accessDenied;
 	auto result = co_await self->utimensat(atime_sec, atime_nsec, mtime_sec, mtime_nsec);
 
 	co_return result;
@@ -573,12 +593,31 @@ constexpr protocols::fs::FileOperations rawOperations {
 	.flock = rawFlock,
 };
 
+bool ostraceStarted = false;
+async::oneshot_event ostraceReady;
+
+// The ostrace context is shared by all devices of this process.
+async::result<void> setupOstrace() {
+	if(ostraceStarted) {
+		co_await ostraceReady.wait();
+		co_return;
+	}
+	ostraceStarted = true;
+
+	ostContext = co_await protocols::ostrace::createContext();
+	ostReadEvent = co_await ostContext.announceEvent("libblockfs.read");
+	ostReaddirEvent = co_await ostContext.announceEvent("libblockfs.readdir");
+	ostByteCounter = co_await ostContext.announceItem("numBytes");
+	ostTimeCounter = co_await ostContext.announceItem("time");
+	ostraceReady.raise();
+}
+
 } // anonymous namespace
 
 BlockDevice::BlockDevice(size_t sector_size, int64_t parent_id)
 : size(0), sectorSize(sector_size), parentId(parent_id) { }
 
-async::detached servePartition(helix::UniqueLane lane) {
+async::detached servePartition(Mount *mount, helix::UniqueLane lane) {
 	std::cout << "unix device: Connection" << std::endl;
 
 	while(true) {
@@ -608,7 +647,7 @@ async::detached servePartition(helix::UniqueLane lane) {
 		if(req.req_type() == managarm::fs::CntReqType::DEV_MOUNT) {
 			helix::UniqueLane local_lane, remote_lane;
 			std::tie(local_lane, remote_lane) = helix::createStream();
-			protocols::fs::serveNode(std::move(local_lane), fs->accessRoot(),
+			protocols::fs::serveNode(std::move(local_lane), mount->fs->accessRoot(),
 					&nodeOperations);
 
 			managarm::fs::SvrResponse resp;
@@ -623,7 +662,18 @@ async::detached servePartition(helix::UniqueLane lane) {
 			HEL_CHECK(send_resp.error());
 			HEL_CHECK(push_node.error());
 		}else if(req.req_type() == managarm::fs::CntReqType::SB_CREATE_REGULAR) {
-			auto inode = co_await fs->createRegular();
+			if(mount->fs->readOnly) {
+				managarm::fs::SvrResponse resp;
+				resp.set_error(managarm::fs::Errors::ACCESS_DENIED);
+
+				auto ser = resp.SerializeAsString();
+				auto [send_resp] = co_await helix_ng::exchangeMsgs(conversation,
+					helix_ng::sendBuffer(ser.data(), ser.size()));
+				HEL_CHECK(send_resp.error());
+				continue;
+			}
+
+			auto inode = co_await mount->fs->createRegular(req.parent_id());
 
 			helix::UniqueLane local_lane, remote_lane;
 			std::tie(local_lane, remote_lane) = helix::createStream();
@@ -658,8 +708,19 @@ async::detached servePartition(helix::UniqueLane lane) {
 				break;
 			}
 
-			auto oldInode = fs->accessInode(req->inode_source());
-			auto newInode = fs->accessInode(req->inode_target());
+			if(mount->fs->readOnly) {
+				managarm::fs::SvrResponse resp;
+				resp.set_error(managarm::fs::Errors::ACCESS_DENIED);
+
+				auto ser = resp.SerializeAsString();
+				auto [send_resp] = co_await helix_ng::exchangeMsgs(conversation,
+					helix_ng::sendBuffer(ser.data(), ser.size()));
+				HEL_CHECK(send_resp.error());
+				continue;
+			}
+
+			auto oldInode = mount->fs->accessInode(req->inode_source());
+			auto newInode = mount->fs->accessInode(req->inode_target());
 
 			assert(!req->old_name().empty() && req->old_name() != "." && req->old_name() != "..");
 			auto old_result = co_await oldInode->findEntry(req->old_name());
@@ -714,7 +775,7 @@ async::detached servePartition(helix::UniqueLane lane) {
 		}else if(req.req_type() == managarm::fs::CntReqType::DEV_OPEN) {
 			helix::UniqueLane local_lane, remote_lane;
 			std::tie(local_lane, remote_lane) = helix::createStream();
-			auto file = smarter::make_shared<raw::OpenFile>(rawFs);
+			auto file = smarter::make_shared<raw::OpenFile>(mount->rawFs);
 			async::detach(protocols::fs::servePassthrough(std::move(local_lane),
 					file,
 					&rawOperations));
@@ -737,13 +798,13 @@ async::detached servePartition(helix::UniqueLane lane) {
 }
 
 async::detached runDevice(BlockDevice *device) {
-	ostContext = co_await protocols::ostrace::createContext();
-	ostReadEvent = co_await ostContext.announceEvent("libblockfs.read");
-	ostReaddirEvent = co_await ostContext.announceEvent("libblockfs.readdir");
-	ostByteCounter = co_await ostContext.announceItem("numBytes");
-	ostTimeCounter = co_await ostContext.announceItem("time");
+	co_await setupOstrace();
 
-	table = new gpt::Table(device);
+	// All I/O goes through the request queue, which is shared by all partitions of the disk.
+	// Likewise, the file systems share a single bound on concurrent manage requests.
+	auto queue = new RequestQueue(device);
+	auto manage_limit = new ext2fs::ConcurrencyLimit{ext2fs::maxManageGlobal};
+	auto table = new gpt::Table(queue);
 	co_await table->parse();
 
 	int64_t diskId = 0;
@@ -777,12 +838,18 @@ async::detached runDevice(BlockDevice *device) {
 			continue;
 		printf("It's a Windows data partition!\n");
 
-		fs = new ext2fs::FileSystem(&table->getPartition(i));
-		co_await fs->init();
+		auto mount = new Mount;
+		mount->fs = new ext2fs::FileSystem(&table->getPartition(i), manage_limit);
+		if(!co_await mount->fs->init()) {
+			printf("ext2fs: Cannot mount partition %lu\n", i);
+			delete mount->fs;
+			delete mount;
+			continue;
+		}
 		printf("ext2fs is ready!\n");
 
-		rawFs = new raw::RawFs(fs->device);
-		co_await rawFs->init();
+		mount->rawFs = new raw::RawFs(mount->fs->device);
+		co_await mount->rawFs->init();
 		printf("rawfs is ready!\n");
 
 		// Create an mbus object for the partition.
@@ -797,10 +864,10 @@ async::detached runDevice(BlockDevice *device) {
 		};
 
 		auto handler = mbus::ObjectHandler{}
-		.withBind([] () -> async::result<helix::UniqueDescriptor> {
+		.withBind([mount] () -> async::result<helix::UniqueDescriptor> {
 			helix::UniqueLane local_lane, remote_lane;
 			std::tie(local_lane, remote_lane) = helix::createStream();
-			servePartition(std::move(local_lane));
+			servePartition(mount, std::move(local_lane));
 
 			co_return std::move(remote_lane);
 		});
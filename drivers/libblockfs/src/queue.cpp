@@ -0,0 +1,265 @@
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <memory>
+
+#include <hel.h>
+#include <hel-syscalls.h>
+
+#include "queue.hpp"
+
+namespace blockfs {
+
+namespace {
+	constexpr bool logRequests = false;
+
+	// If enabled, latency histograms are printed every latencyDumpInterval requests.
+	constexpr bool logLatencies = false;
+	constexpr uint64_t latencyDumpInterval = 4096;
+
+	uint64_t currentNanos() {
+		uint64_t tick;
+		HEL_CHECK(helGetClock(&tick));
+		return tick;
+	}
+}
+
+// --------------------------------------------------------
+// LatencyHistogram
+// --------------------------------------------------------
+
+void LatencyHistogram::record(uint64_t nanos) {
+	auto micros = nanos / 1000;
+	size_t bucket = 0;
+	while(bucket < numBuckets - 1 && (uint64_t(1) << bucket) <= micros)
+		bucket++;
+	buckets[bucket]++;
+	count++;
+	totalNanos += nanos;
+}
+
+void LatencyHistogram::dump(const char *name) {
+	if(!count)
+		return;
+	printf("libblockfs: %s latency: %" PRIu64 " requests, average %" PRIu64 " us\n",
+			name, count, totalNanos / count / 1000);
+	for(size_t i = 0; i < numBuckets; i++) {
+		if(!buckets[i])
+			continue;
+		printf("libblockfs:     < %" PRIu64 " us: %" PRIu64 "\n", uint64_t(1) << i, buckets[i]);
+	}
+}
+
+// --------------------------------------------------------
+// RequestQueue
+// --------------------------------------------------------
+
+RequestQueue::RequestQueue(BlockDevice *device)
+: BlockDevice{device->sectorSize, device->parentId}, _device{device} {
+	assert(_device->queueDepth() >= 1);
+	assert(_device->maxTransferSectors() >= 1);
+	_dispatchLoop();
+}
+
+async::result<void> RequestQueue::readSectors(uint64_t sector, void *buffer,
+		size_t num_sectors) {
+	return _submit(false, sector, buffer, num_sectors);
+}
+
+async::result<void> RequestQueue::writeSectors(uint64_t sector, const void *buffer,
+		size_t num_sectors) {
+	return _submit(true, sector, const_cast<void *>(buffer), num_sectors);
+}
+
+async::result<size_t> RequestQueue::getSize() {
+	return _device->getSize();
+}
+
+size_t RequestQueue::queueDepth() {
+	return _device->queueDepth();
+}
+
+size_t RequestQueue::maxTransferSectors() {
+	return _device->maxTransferSectors();
+}
+
+void RequestQueue::plug() {
+	_plugCount++;
+}
+
+void RequestQueue::unplug() {
+	assert(_plugCount);
+	if(!--_plugCount)
+		_doorbell.raise();
+}
+
+async::result<void> RequestQueue::_submit(bool write, uint64_t sector, void *buffer,
+		size_t num_sectors) {
+	auto max_sectors = _device->maxTransferSectors();
+	auto now = currentNanos();
+
+	// Split the request such that each part can be handled by the driver.
+	std::vector<std::unique_ptr<Request>> requests;
+	for(size_t progress = 0; progress < num_sectors; progress += max_sectors) {
+		auto request = std::make_unique<Request>();
+		request->write = write;
+		request->sector = sector + progress;
+		request->numSectors = std::min(num_sectors - progress, max_sectors);
+		request->buffer = reinterpret_cast<char *>(buffer) + progress * sectorSize;
+		request->enqueueTime = now;
+		_enqueue(request.get());
+		requests.push_back(std::move(request));
+	}
+	_doorbell.raise();
+
+	for(auto &request : requests)
+		co_await request->done.wait();
+}
+
+void RequestQueue::_enqueue(Request *request) {
+	request->pendingIt = _pending.insert(_pending.end(), request);
+	request->startIt = _byStart[request->write].emplace(request->sector, request);
+	request->endIt = _byEnd[request->write].emplace(request->sector + request->numSectors,
+			request);
+}
+
+void RequestQueue::_remove(Request *request) {
+	_pending.erase(request->pendingIt);
+	_byStart[request->write].erase(request->startIt);
+	_byEnd[request->write].erase(request->endIt);
+}
+
+std::vector<RequestQueue::Request *> RequestQueue::_takeBatch() {
+	auto first = _pending.front();
+	_remove(first);
+
+	auto max_sectors = _device->maxTransferSectors();
+	size_t total = first->numSectors;
+
+	// Finds a pending request in the range that still fits into the batch.
+	auto findFitting = [&] (auto range) -> Request * {
+		for(auto it = range.first; it != range.second; ++it) {
+			if(total + it->second->numSectors <= max_sectors)
+				return it->second;
+		}
+		return nullptr;
+	};
+
+	// Grow the batch in both directions until no adjacent request is left.
+	std::vector<Request *> batch{first};
+	while(true) {
+		auto back = batch.back();
+		auto request = findFitting(_byStart[first->write].equal_range(
+				back->sector + back->numSectors));
+		if(!request)
+			break;
+		_remove(request);
+		batch.push_back(request);
+		total += request->numSectors;
+		_numMerged++;
+	}
+
+	std::vector<Request *> front;
+	auto lowest = first->sector;
+	while(true) {
+		auto request = findFitting(_byEnd[first->write].equal_range(lowest));
+		if(!request)
+			break;
+		_remove(request);
+		front.push_back(request);
+		lowest = request->sector;
+		total += request->numSectors;
+		_numMerged++;
+	}
+	batch.insert(batch.begin(), front.rbegin(), front.rend());
+
+	return batch;
+}
+
+async::detached RequestQueue::_dispatchLoop() {
+	while(true) {
+		if(_pending.empty() || _plugCount || _inFlight >= _device->queueDepth()) {
+			co_await _doorbell.async_wait();
+			continue;
+		}
+
+		_inFlight++;
+		_dispatch(_takeBatch());
+	}
+}
+
+async::detached RequestQueue::_dispatch(std::vector<Request *> batch) {
+	auto first = batch.front();
+	size_t num_sectors = 0;
+	bool contiguous = true;
+	for(auto request : batch) {
+		if(reinterpret_cast<char *>(request->buffer)
+				!= reinterpret_cast<char *>(first->buffer) + num_sectors * sectorSize)
+			contiguous = false;
+		num_sectors += request->numSectors;
+	}
+
+	if(logRequests)
+		printf("libblockfs: Dispatching %s of %zu sectors at %" PRIu64 " (%zu requests%s)\n",
+				first->write ? "write" : "read", num_sectors, first->sector,
+				batch.size(), contiguous ? "" : ", bounced");
+
+	if(contiguous) {
+		if(first->write) {
+			co_await _device->writeSectors(first->sector, first->buffer, num_sectors);
+		}else{
+			co_await _device->readSectors(first->sector, first->buffer, num_sectors);
+		}
+	}else{
+		// Merged requests whose buffers are not adjacent go through a bounce buffer.
+		// This is cheap compared to issuing an extra command to the device.
+		auto size = num_sectors * sectorSize;
+		auto bounce = reinterpret_cast<char *>(aligned_alloc(0x1000, (size + 0xFFF) & ~size_t(0xFFF)));
+		assert(bounce);
+
+		if(first->write) {
+			size_t offset = 0;
+			for(auto request : batch) {
+				memcpy(bounce + offset, request->buffer, request->numSectors * sectorSize);
+				offset += request->numSectors * sectorSize;
+			}
+			co_await _device->writeSectors(first->sector, bounce, num_sectors);
+		}else{
+			co_await _device->readSectors(first->sector, bounce, num_sectors);
+			size_t offset = 0;
+			for(auto request : batch) {
+				memcpy(request->buffer, bounce + offset, request->numSectors * sectorSize);
+				offset += request->numSectors * sectorSize;
+			}
+		}
+
+		free(bounce);
+		_numBounced++;
+	}
+
+	// Note that waking up a request may free it.
+	auto now = currentNanos();
+	for(auto request : batch) {
+		auto &histogram = request->write ? _writeLatency : _readLatency;
+		histogram.record(now - request->enqueueTime);
+		request->done.raise();
+	}
+
+	_numDispatched++;
+	if(logLatencies && !(_numDispatched % latencyDumpInterval)) {
+		printf("libblockfs: %" PRIu64 " commands dispatched, %" PRIu64 " requests merged, "
+				"%" PRIu64 " bounced\n",
+				_numDispatched, _numMerged, _numBounced);
+		_readLatency.dump("read");
+		_writeLatency.dump("write");
+	}
+
+	_inFlight--;
+	_doorbell.raise();
+}
+
+} // namespace blockfs
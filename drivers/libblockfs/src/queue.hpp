@@ -0,0 +1,111 @@
+#pragma once
+
+#include <array>
+#include <list>
+#include <map>
+#include <vector>
+
+#include <async/oneshot-event.hpp>
+#include <async/recurring-event.hpp>
+#include <blockfs.hpp>
+
+namespace blockfs {
+
+// --------------------------------------------------------
+// LatencyHistogram
+// --------------------------------------------------------
+
+// Histogram of request latencies. Bucket i counts requests that took
+// less than 2^i microseconds (and at least 2^(i - 1) microseconds).
+struct LatencyHistogram {
+	static constexpr size_t numBuckets = 24;
+
+	void record(uint64_t nanos);
+
+	void dump(const char *name);
+
+	std::array<uint64_t, numBuckets> buckets{};
+	uint64_t count = 0;
+	uint64_t totalNanos = 0;
+};
+
+// --------------------------------------------------------
+// RequestQueue
+// --------------------------------------------------------
+
+// Sits between the file systems and the driver's BlockDevice.
+// Accepts any number of concurrent requests, splits requests that are too large,
+// merges requests for adjacent sectors and dispatches up to queueDepth() at a time.
+// Note that concurrent requests for overlapping sectors are not ordered.
+struct RequestQueue final : BlockDevice {
+	RequestQueue(BlockDevice *device);
+
+	async::result<void> readSectors(uint64_t sector, void *buffer,
+			size_t num_sectors) override;
+
+	async::result<void> writeSectors(uint64_t sector, const void *buffer,
+			size_t num_sectors) override;
+
+	async::result<size_t> getSize() override;
+
+	size_t queueDepth() override;
+	size_t maxTransferSectors() override;
+	void plug() override;
+	void unplug() override;
+
+	const LatencyHistogram &readLatency() {
+		return _readLatency;
+	}
+
+	const LatencyHistogram &writeLatency() {
+		return _writeLatency;
+	}
+
+private:
+	struct Request {
+		bool write;
+		uint64_t sector;
+		size_t numSectors;
+		void *buffer;
+		uint64_t enqueueTime;
+		async::oneshot_event done;
+
+		// Position in _pending, _byStart and _byEnd while the request is pending.
+		std::list<Request *>::iterator pendingIt;
+		std::multimap<uint64_t, Request *>::iterator startIt;
+		std::multimap<uint64_t, Request *>::iterator endIt;
+	};
+
+	async::result<void> _submit(bool write, uint64_t sector, void *buffer, size_t num_sectors);
+
+	void _enqueue(Request *request);
+	void _remove(Request *request);
+
+	// Removes the oldest pending request together with all requests that can be merged with it.
+	std::vector<Request *> _takeBatch();
+
+	async::detached _dispatchLoop();
+	async::detached _dispatch(std::vector<Request *> batch);
+
+	BlockDevice *_device;
+
+	// Requests that were not dispatched yet, in submission order.
+	std::list<Request *> _pending;
+	// The same requests by first sector and by end sector (i.e., one past the last sector).
+	// Index 0 holds reads, index 1 holds writes.
+	std::array<std::multimap<uint64_t, Request *>, 2> _byStart;
+	std::array<std::multimap<uint64_t, Request *>, 2> _byEnd;
+	async::recurring_event _doorbell;
+
+	size_t _inFlight = 0;
+	size_t _plugCount = 0;
+
+	// Statistics.
+	LatencyHistogram _readLatency;
+	LatencyHistogram _writeLatency;
+	uint64_t _numDispatched = 0;
+	uint64_t _numMerged = 0;
+	uint64_t _numBounced = 0;
+};
+
+} // namespace blockfs
@@ -1,18 +1,45 @@
 #include <nic/virtio/virtio.hpp>
 
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <vector>
+
 #include <arch/dma_pool.hpp>
+#include <async/recurring-event.hpp>
 #include <core/virtio/core.hpp>
 
 namespace {
 // Device feature bits.
-constexpr size_t legacyHeaderSize = 10;
 enum {
-	VIRTIO_NET_F_MAC = 5
+	VIRTIO_NET_F_CSUM = 0,
+	VIRTIO_NET_F_GUEST_CSUM = 1,
+	VIRTIO_NET_F_MAC = 5,
+	VIRTIO_NET_F_HOST_TSO4 = 11,
+	VIRTIO_NET_F_MRG_RXBUF = 15,
+	VIRTIO_F_VERSION_1 = 32
 };
 
+// The header lacks the numBuffers field unless VIRTIO_NET_F_MRG_RXBUF
+// or VIRTIO_F_VERSION_1 is negotiated.
+constexpr size_t legacyHeaderSize = 10;
+constexpr size_t fullHeaderSize = 12;
+
+// Each receive buffer holds the virtio-net header followed by the frame.
+// With mergeable receive buffers, larger frames span multiple buffers.
+constexpr size_t maxFrameSize = 1514;
+constexpr size_t receiveBufferSize = fullHeaderSize + maxFrameSize;
+
+// Largest frame that we send with VIRTIO_NET_F_HOST_TSO4.
+constexpr size_t maxTsoFrameSize = 14 + nic::maxTsoPacketSize;
+
+// Number of freed receive buffers that are kept for reuse.
+constexpr size_t maxCachedReceiveBuffers = 512;
+
 // Bits for VirtHeader::flags.
 enum {
-	VIRTIO_NET_HDR_F_NEEDS_CSUM = 1
+	VIRTIO_NET_HDR_F_NEEDS_CSUM = 1,
+	VIRTIO_NET_HDR_F_DATA_VALID = 2
 };
 
 // Values for VirtHeader::gsoType.
@@ -33,23 +60,53 @@ struct VirtHeader {
 	uint16_t csumOffset;
 	uint16_t numBuffers;
 };
+static_assert(sizeof(VirtHeader) == fullHeaderSize);
 
 struct VirtioNic : nic::Link {
 	VirtioNic(std::unique_ptr<virtio_core::Transport> transport);
 
-	virtual async::result<void> receive(arch::dma_buffer_view) override;
-	virtual async::result<void> send(const arch::dma_buffer_view) override;
+	virtual async::result<void> receive(std::vector<ReceivedFrame> &frames) override;
+	virtual async::result<void> send(const arch::dma_buffer_view,
+			nic::TransmitOffload offload) override;
 
 	virtual ~VirtioNic() override = default;
 private:
+	// A receive buffer that is posted to the receive virtq.
+	struct ReceiveSlot : virtio_core::Request {
+		VirtioNic *nic;
+		arch::dma_buffer buffer;
+	};
+
+	async::detached fillReceiveQueue_();
+	async::result<void> postReceive_(ReceiveSlot *slot);
+	static void completeReceive_(virtio_core::Request *base);
+
+	// Number of buffers that the frame starting at the given slot occupies.
+	size_t numBuffers_(ReceiveSlot *slot);
+	// Number of slots at the start of receivedSlots_ that hold complete frames.
+	size_t completeSlots_();
+
 	std::unique_ptr<virtio_core::Transport> transport_;
 	arch::contiguous_pool dmaPool_;
+	nic::RecyclingPool receivePool_;
 	virtio_core::Queue *receiveVq_;
 	virtio_core::Queue *transmitVq_;
+
+	// Negotiated features.
+	bool mergeable_ = false;
+	size_t headerSize_ = legacyHeaderSize;
+
+	// Without mergeable buffers, each slot occupies two descriptors (header and frame).
+	// Otherwise, each slot is a single descriptor and frames may span multiple slots.
+	std::vector<ReceiveSlot> receiveSlots_;
+	// Slots that were completed by the device but not yet passed to receive().
+	std::vector<ReceiveSlot *> receivedSlots_;
+	async::recurring_event receiveDoorbell_;
 };
 
 VirtioNic::VirtioNic(std::unique_ptr<virtio_core::Transport> transport)
-	: nic::Link(1500, &dmaPool_), transport_ { std::move(transport) }
+	: nic::Link(1500, &dmaPool_), transport_ { std::move(transport) },
+	receivePool_ { &dmaPool_, receiveBufferSize, maxCachedReceiveBuffers }
 {
 	if(transport_->checkDeviceFeature(VIRTIO_NET_F_MAC)) {
 		for (int i = 0; i < 6; i++) {
@@ -64,47 +121,182 @@ VirtioNic::VirtioNic(std::unique_ptr<virtio_core::Transport> transport)
 		transport_->acknowledgeDriverFeature(VIRTIO_NET_F_MAC);
 	}
 
+	if(transport_->checkDeviceFeature(VIRTIO_NET_F_CSUM)) {
+		transport_->acknowledgeDriverFeature(VIRTIO_NET_F_CSUM);
+		capabilities |= nic::LINK_CAP_TX_CSUM;
+
+		if(transport_->checkDeviceFeature(VIRTIO_NET_F_HOST_TSO4)) {
+			transport_->acknowledgeDriverFeature(VIRTIO_NET_F_HOST_TSO4);
+			capabilities |= nic::LINK_CAP_TSO4;
+		}
+	}
+	if(transport_->checkDeviceFeature(VIRTIO_NET_F_GUEST_CSUM)) {
+		transport_->acknowledgeDriverFeature(VIRTIO_NET_F_GUEST_CSUM);
+		capabilities |= nic::LINK_CAP_RX_CSUM;
+	}
+	if(transport_->checkDeviceFeature(VIRTIO_NET_F_MRG_RXBUF)) {
+		transport_->acknowledgeDriverFeature(VIRTIO_NET_F_MRG_RXBUF);
+		mergeable_ = true;
+	}
+
 	transport_->finalizeFeatures();
+	if(mergeable_ || transport_->checkDriverFeature(VIRTIO_F_VERSION_1))
+		headerSize_ = fullHeaderSize;
+
 	transport_->claimQueues(2);
 	receiveVq_ = transport_->setupQueue(0);
 	transmitVq_ = transport_->setupQueue(1);
 
+	receiveSlots_.resize(receiveVq_->numDescriptors() / (mergeable_ ? 1 : 2));
+
 	transport_->runDevice();
+	fillReceiveQueue_();
 }
 
-async::result<void> VirtioNic::receive(arch::dma_buffer_view frame) {
-	arch::dma_object<VirtHeader> header { &dmaPool_ };
+async::detached VirtioNic::fillReceiveQueue_() {
+	for (auto &slot : receiveSlots_) {
+		slot.nic = this;
+		co_await postReceive_(&slot);
+	}
+	receiveVq_->notify();
+}
+
+async::result<void> VirtioNic::postReceive_(ReceiveSlot *slot) {
+	slot->buffer = arch::dma_buffer { &receivePool_, receiveBufferSize };
 
 	virtio_core::Chain chain;
-	chain.append(co_await receiveVq_->obtainDescriptor());
-	chain.setupBuffer(virtio_core::deviceToHost,
-			header.view_buffer().subview(0, legacyHeaderSize));
-	chain.append(co_await receiveVq_->obtainDescriptor());
-	chain.setupBuffer(virtio_core::deviceToHost, frame);
+	if (mergeable_) {
+		chain.append(co_await receiveVq_->obtainDescriptor());
+		chain.setupBuffer(virtio_core::deviceToHost, slot->buffer);
+	} else {
+		chain.append(co_await receiveVq_->obtainDescriptor());
+		chain.setupBuffer(virtio_core::deviceToHost,
+				slot->buffer.subview(0, headerSize_));
+		chain.append(co_await receiveVq_->obtainDescriptor());
+		chain.setupBuffer(virtio_core::deviceToHost,
+				slot->buffer.subview(headerSize_));
+	}
+
+	receiveVq_->postDescriptor(chain.front(), slot, &completeReceive_);
+}
+
+void VirtioNic::completeReceive_(virtio_core::Request *base) {
+	auto slot = static_cast<ReceiveSlot *>(base);
+	// This is called for every used descriptor of an interrupt; the
+	// doorbell wakes up receive() once for the whole batch.
+	slot->nic->receivedSlots_.push_back(slot);
+	slot->nic->receiveDoorbell_.raise();
+}
+
+size_t VirtioNic::numBuffers_(ReceiveSlot *slot) {
+	if (!mergeable_ || slot->written < fullHeaderSize)
+		return 1;
+	auto header = reinterpret_cast<VirtHeader *>(slot->buffer.data());
+	return std::max(header->numBuffers, uint16_t{1});
+}
+
+size_t VirtioNic::completeSlots_() {
+	size_t n = 0;
+	while (n < receivedSlots_.size()) {
+		auto count = numBuffers_(receivedSlots_[n]);
+		if (n + count > receivedSlots_.size())
+			break;
+		n += count;
+	}
+	return n;
+}
 
-	co_await receiveVq_->submitDescriptor(chain.front());
+async::result<void> VirtioNic::receive(std::vector<ReceivedFrame> &frames) {
+	// The device may report the buffers of a merged frame in separate interrupts.
+	size_t n;
+	while (!(n = completeSlots_()))
+		co_await receiveDoorbell_.async_wait();
 
-	co_return;
+	std::vector<ReceiveSlot *> batch{receivedSlots_.begin(), receivedSlots_.begin() + n};
+	receivedSlots_.erase(receivedSlots_.begin(), receivedSlots_.begin() + n);
+
+	// Number of frame bytes in a slot's buffer, starting at offset.
+	auto bufferLength = [] (ReceiveSlot *s, size_t offset) -> size_t {
+		auto written = std::min<size_t>(s->written, s->buffer.size());
+		return written > offset ? written - offset : 0;
+	};
+
+	for (size_t i = 0; i < batch.size();) {
+		auto slot = batch[i];
+		auto count = numBuffers_(slot);
+
+		VirtHeader header{};
+		std::memcpy(&header, slot->buffer.data(),
+				std::min(headerSize_, slot->written));
+		bool checksumValid = header.flags
+				& (VIRTIO_NET_HDR_F_NEEDS_CSUM | VIRTIO_NET_HDR_F_DATA_VALID);
+
+		if (count == 1) {
+			auto length = std::min(bufferLength(slot, headerSize_), maxFrameSize);
+			auto frame = slot->buffer.subview(headerSize_, length);
+			frames.push_back({ std::move(slot->buffer), frame, checksumValid });
+		} else {
+			// Copy frames that span multiple buffers into a single buffer.
+			size_t length = bufferLength(slot, headerSize_);
+			for (size_t j = 1; j < count; j++)
+				length += bufferLength(batch[i + j], 0);
+
+			// The merged buffer may be freed by a worker thread.
+			arch::dma_buffer merged { &receivePool_, length };
+			size_t offset = 0;
+			for (size_t j = 0; j < count; j++) {
+				auto part = batch[i + j];
+				auto skip = j ? 0 : headerSize_;
+				auto partLength = bufferLength(part, skip);
+				std::memcpy(merged.subview(offset).byte_data(),
+						part->buffer.subview(skip).byte_data(), partLength);
+				offset += partLength;
+				part->buffer = {};
+			}
+
+			auto frame = merged.subview(0);
+			frames.push_back({ std::move(merged), frame, checksumValid });
+		}
+		i += count;
+	}
+
+	// Repost the slots with recycled buffers. The descriptors of the
+	// completed chains were already freed, so this does not block.
+	for (auto slot : batch)
+		co_await postReceive_(slot);
+	receiveVq_->notify();
 }
 
-async::result<void> VirtioNic::send(const arch::dma_buffer_view payload) {
-	if (payload.size() > 1514) {
+async::result<void> VirtioNic::send(const arch::dma_buffer_view payload,
+		nic::TransmitOffload offload) {
+	bool tso = offload.segmentSize && (capabilities & nic::LINK_CAP_TSO4);
+	if (payload.size() > (tso ? maxTsoFrameSize : maxFrameSize)) {
 		throw std::runtime_error("data exceeds mtu");
 	}
 
 	arch::dma_object<VirtHeader> header { &dmaPool_ };
 	memset(header.data(), 0, sizeof(VirtHeader));
+	if (offload.needsCsum) {
+		assert(capabilities & nic::LINK_CAP_TX_CSUM);
+		header->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+		header->csumStart = offload.csumStart;
+		header->csumOffset = offload.csumOffset;
+	}
+	if (tso) {
+		assert(offload.needsCsum);
+		header->gsoType = VIRTIO_NET_HDR_GSO_TCPV4;
+		header->gsoSize = offload.segmentSize;
+		header->hdrLen = offload.headerLength;
+	}
 
 	virtio_core::Chain chain;
 	chain.append(co_await transmitVq_->obtainDescriptor());
 	chain.setupBuffer(virtio_core::hostToDevice,
-			header.view_buffer().subview(0, legacyHeaderSize));
+			header.view_buffer().subview(0, headerSize_));
 	chain.append(co_await transmitVq_->obtainDescriptor());
 	chain.setupBuffer(virtio_core::hostToDevice, payload);
 
-	std::cout << "virtio-driver: sending frame" << std::endl;
 	co_await transmitVq_->submitDescriptor(chain.front());
-	std::cout << "virtio-driver: sent frame" << std::endl;
 }
 } // namespace
 
@@ -222,6 +222,12 @@ extern inline __attribute__ (( always_inline )) HelError helPointerPhysical(cons
 	return error;
 };
 
+extern inline __attribute__ (( always_inline )) HelError helPointerPhysicalRange(const void *pointer,
+		size_t num_pages, uintptr_t *physicals) {
+	return helSyscall3(kHelCallPointerPhysicalRange, (HelWord)pointer, (HelWord)num_pages,
+			(HelWord)physicals);
+};
+
 extern inline __attribute__ (( always_inline )) HelError helSubmitReadMemory(HelHandle handle,
 		uintptr_t address, size_t length, void *buffer,
 		HelHandle queue, uintptr_t context) {
@@ -441,6 +447,15 @@ extern inline __attribute__ (( always_inline )) HelError helBindKernlet(HelHandl
 	return error;
 };
 
+extern inline __attribute__ (( always_inline )) HelError helInvokeKernlet(HelHandle handle,
+		size_t iterations, uint64_t *cycles) {
+	HelWord cycles_word;
+	HelError error = helSyscall2_1(kHelCallInvokeKernlet, (HelWord)handle,
+			(HelWord)iterations, &cycles_word);
+	*cycles = (uint64_t)cycles_word;
+	return error;
+};
+
 extern inline __attribute__ (( always_inline )) HelError helSetAffinity(HelHandle thread,
 		uint8_t *mask, size_t size) {
 	return helSyscall3(kHelCallSetAffinity, (HelWord)thread,
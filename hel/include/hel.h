@@ -16,7 +16,7 @@
 
 enum {
 	// largest system call number plus 1
-	kHelNumCalls = 103,
+	kHelNumCalls = 105,
 
 	kHelCallLog = 1,
 	kHelCallPanic = 10,
@@ -48,6 +48,7 @@ enum {
 	kHelCallSubmitSynchronizeSpace = 53,
 	kHelCallUnmapMemory = 36,
 	kHelCallPointerPhysical = 43,
+	kHelCallPointerPhysicalRange = 104,
 	kHelCallSubmitReadMemory = 77,
 	kHelCallSubmitWriteMemory = 78,
 	kHelCallMemoryInfo = 26,
@@ -95,6 +96,7 @@ enum {
 	kHelCallEnableFullIo = 35,
 
 	kHelCallBindKernlet = 93,
+	kHelCallInvokeKernlet = 103,
 
 	kHelCallSetAffinity = 100,
 
@@ -526,6 +528,35 @@ union HelKernletData {
 	HelHandle handle;
 };
 
+enum HelKernletRingFlags {
+	kHelRingFlipTag = 1
+};
+
+//! Control block of a descriptor ring that is scanned by kernlets.
+//! This struct is placed in a memory view that is bound to the kernlet;
+//! the __scan_ring() intrinsic reads it to count the ring entries
+//! that are ready to be consumed.
+struct HelKernletRing {
+	//! Offset of the ring relative to the control block's memory view.
+	uint32_t ringOffset;
+	//! Binary logarithm of the size of a ring entry (in bytes).
+	uint16_t entryShift;
+	//! Binary logarithm of the number of ring entries.
+	uint16_t sizeShift;
+	//! Free-running index of the next entry that will be consumed.
+	//! Written by user space after it consumed entries.
+	uint32_t head;
+	//! Offset of the 32-bit tag word within each entry.
+	uint16_t tagOffset;
+	//! Combination of flags from HelKernletRingFlags.
+	uint16_t flags;
+	//! An entry is ready if (tag & tagMask) == tagValue.
+	//! If kHelRingFlipTag is set, tagValue is XORed with tagMask
+	//! on every odd pass through the ring (e.g., NVMe phase tags).
+	uint32_t tagMask;
+	uint32_t tagValue;
+};
+
 struct HelThreadStats {
 	uint64_t userTime;
 };
@@ -788,6 +819,21 @@ HEL_C_LINKAGE HelError helUnmapMemory(HelHandle spaceHandle, void *pointer, size
 
 HEL_C_LINKAGE HelError helPointerPhysical(const void *pointer, uintptr_t *physical);
 
+//! Resolves the physical addresses of a range of pages.
+//!
+//! This is equivalent to calling ::helPointerPhysical on each page
+//! but only requires a single system call.
+//! @param[in] pointer
+//!     Pointer into the first page of the range.
+//!     Does not need to be aligned to the system's page size.
+//! @param[in] numPages
+//!     Number of pages that are resolved.
+//! @param[out] physicals
+//!     Array of @p numPages entries that receives the (page-aligned)
+//!     physical addresses of the pages.
+HEL_C_LINKAGE HelError helPointerPhysicalRange(const void *pointer, size_t numPages,
+		uintptr_t *physicals);
+
 //! Load memory (i.e., bytes) from a descriptor.
 //!
 //! This is an asynchronous operation.
@@ -1080,6 +1126,22 @@ HEL_C_LINKAGE HelError helEnableFullIo();
 HEL_C_LINKAGE HelError helBindKernlet(HelHandle handle,
 		const union HelKernletData *data, size_t numData, HelHandle *boundHandle);
 
+//! Invoke a bound kernlet (for benchmarking purposes).
+//!
+//! The kernlet is invoked with IRQs disabled, i.e., in the same
+//! context as IRQ automation. Note that the kernlet performs all of its
+//! side effects (such as MMIO accesses and event triggers).
+//! IRQs are only disabled for up to 16 consecutive invocations;
+//! in between, the calling thread can be preempted.
+//! @param[in] handle
+//!     Handle to the bound kernlet.
+//! @param[in] iterations
+//!     Number of times that the kernlet is invoked.
+//! @param[out] cycles
+//!     Number of timestamp counter ticks spent in all invocations.
+HEL_C_LINKAGE HelError helInvokeKernlet(HelHandle handle,
+		size_t iterations, uint64_t *cycles);
+
 //! @}
 
 extern inline __attribute__ (( always_inline )) const char *_helErrorString(HelError code) {
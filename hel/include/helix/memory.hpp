@@ -81,4 +81,9 @@ inline uintptr_t addressToPhysical(uintptr_t p) {
 	return phys;
 }
 
+// Stores the page-aligned physical addresses of numPages pages starting at p.
+inline void rangeToPhysical(uintptr_t p, size_t numPages, uintptr_t *physicals) {
+	HEL_CHECK(helPointerPhysicalRange(reinterpret_cast<const void *>(p), numPages, physicals));
+}
+
 } // namespace helix
@@ -981,6 +981,37 @@ HelError helPointerPhysical(const void *pointer, uintptr_t *physical) {
 	return kHelErrNone;
 }
 
+HelError helPointerPhysicalRange(const void *pointer, size_t numPages, uintptr_t *physicals) {
+	auto thisThread = getCurrentThread();
+	auto space = thisThread->getAddressSpace().lock();
+
+	auto pageAddress = reinterpret_cast<VirtualAddr>(pointer) & ~(kPageSize - 1);
+
+	// Write the results back in chunks to avoid allocating a kernel buffer.
+	constexpr size_t chunkSize = 64;
+	uintptr_t chunk[chunkSize];
+	size_t progress = 0;
+	while(progress < numPages) {
+		auto n = frg::min(numPages - progress, chunkSize);
+		for(size_t i = 0; i < n; i++) {
+			auto physicalOrError = Thread::asyncBlockCurrent(space->retrievePhysical(
+					pageAddress + (progress + i) * kPageSize,
+					thisThread->mainWorkQueue()->take()));
+			if(!physicalOrError) {
+				assert(physicalOrError.error() == Error::fault);
+				return kHelErrFault;
+			}
+			chunk[i] = physicalOrError.value();
+		}
+
+		if(!writeUserArray(physicals + progress, chunk, n))
+			return kHelErrFault;
+		progress += n;
+	}
+
+	return kHelErrNone;
+}
+
 HelError helSubmitReadMemory(HelHandle handle, uintptr_t address,
 		size_t length, void *buffer,
 		HelHandle queueHandle, uintptr_t context) {
@@ -3143,8 +3174,9 @@ HelError helBindKernlet(HelHandle handle, const HelKernletData *data, size_t num
 				memory = wrapper->get<MemoryViewDescriptor>().memory;
 			}
 
-			auto window = reinterpret_cast<char *>(KernelVirtualMemory::global().allocate(0x10000));
-			assert(memory->getLength() <= 0x10000);
+			auto window = reinterpret_cast<char *>(
+					KernelVirtualMemory::global().allocate(kernletWindowSize));
+			assert(memory->getLength() <= kernletWindowSize);
 
 			for(size_t off = 0; off < memory->getLength(); off += kPageSize) {
 				auto range = memory->peekRange(off);
@@ -3153,7 +3185,7 @@ HelError helBindKernlet(HelHandle handle, const HelKernletData *data, size_t num
 						range.get<0>(), page_access::write, range.get<1>());
 			}
 
-			bound->setupMemoryViewBinding(i, window);
+			bound->setupMemoryViewBinding(i, window, memory->getLength());
 		}else{
 			assert(defn.type == KernletParameterType::bitsetEvent);
 
@@ -3185,6 +3217,47 @@ HelError helBindKernlet(HelHandle handle, const HelKernletData *data, size_t num
 	return kHelErrNone;
 }
 
+HelError helInvokeKernlet(HelHandle handle, size_t iterations, uint64_t *cycles) {
+	auto this_thread = getCurrentThread();
+	auto this_universe = this_thread->getUniverse();
+
+	smarter::shared_ptr<BoundKernlet> kernlet;
+	{
+		auto irq_lock = frg::guard(&irqMutex());
+		Universe::Guard universe_guard(this_universe->lock);
+
+		auto kernlet_wrapper = this_universe->getDescriptor(universe_guard, handle);
+		if(!kernlet_wrapper)
+			return kHelErrNoDescriptor;
+		if(!kernlet_wrapper->is<BoundKernletDescriptor>())
+			return kHelErrBadDescriptor;
+		kernlet = kernlet_wrapper->get<BoundKernletDescriptor>().boundKernlet;
+	}
+
+	// Each invocation may scan up to kernletMaxRingEntries ring entries.
+	// To keep the time that IRQs are disabled short, we invoke the kernlet
+	// in small chunks. Between chunks, IRQs are enabled again such that
+	// pending IRQs (including the preemption timer) are handled.
+	constexpr size_t invocationsPerChunk = 16;
+
+	uint64_t total = 0;
+	while(iterations) {
+		auto chunk = frg::min(iterations, invocationsPerChunk);
+
+		{
+			auto irq_lock = frg::guard(&irqMutex());
+			auto start = getRawTimestampCounter();
+			for(size_t i = 0; i < chunk; i++)
+				kernlet->invokeIrqAutomation();
+			total += getRawTimestampCounter() - start;
+		}
+		iterations -= chunk;
+	}
+
+	*cycles = total;
+	return kHelErrNone;
+}
+
 HelError helSetAffinity(HelHandle thread, uint8_t *mask, size_t size) {
 	if (thread != kHelThisThread)
 		return kHelErrIllegalArgs;
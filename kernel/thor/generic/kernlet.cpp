@@ -1,4 +1,5 @@
 
+#include <stddef.h>
 #include <stdint.h>
 
 #ifdef __x86_64__
@@ -7,8 +8,10 @@
 #include <arch/mem_space.hpp>
 #include <frg/string.hpp>
 #include <elf.h>
+#include <hel.h>
 #include <thor-internal/universe.hpp>
 #include <thor-internal/coroutine.hpp>
+#include <thor-internal/cpu-data.hpp>
 #include <thor-internal/fiber.hpp>
 #include <thor-internal/kernlet.hpp>
 #include <thor-internal/physical.hpp>
@@ -69,7 +72,7 @@ const KernletParameterDefn &KernletObject::defnOfBindParameter(size_t index) {
 // ------------------------------------------------------------------------
 
 BoundKernlet::BoundKernlet(smarter::shared_ptr<KernletObject> object)
-: _object{std::move(object)} {
+: _object{std::move(object)}, _windows{*kernelAlloc} {
 	_instance = reinterpret_cast<char *>(kernelAlloc->allocate(_object->instanceSize()));
 }
 
@@ -82,13 +85,16 @@ void BoundKernlet::setupOffsetBinding(size_t index, uint32_t offset) {
 	memcpy(_instance + defn.offset, &offset, sizeof(uint32_t));
 }
 
-void BoundKernlet::setupMemoryViewBinding(size_t index, void *p) {
+void BoundKernlet::setupMemoryViewBinding(size_t index, void *p, size_t length) {
 	assert(index < _object->numberOfBindParameters());
+	assert(length <= kernletWindowSize);
 	const auto &defn = _object->defnOfBindParameter(index);
 	if(logBinding)
 		infoLogger() << "thor: Binding memory view " << p
-				<< " to instance offset " << defn.offset << frg::endlog;
+				<< " (" << length << " bytes) to instance offset " << defn.offset
+				<< frg::endlog;
 	memcpy(_instance + defn.offset, &p, sizeof(void *));
+	_windows.push_back({reinterpret_cast<const char *>(p), length});
 }
 
 void BoundKernlet::setupBitsetEventBinding(size_t index, smarter::shared_ptr<BitsetEvent> event) {
@@ -101,9 +107,22 @@ void BoundKernlet::setupBitsetEventBinding(size_t index, smarter::shared_ptr<Bit
 	memcpy(_instance + defn.offset, &p, sizeof(void *));
 }
 
+size_t BoundKernlet::mappedLength(const void *p) {
+	for(const auto &window : _windows) {
+		if(window.base == p)
+			return window.length;
+	}
+	return 0;
+}
+
 int BoundKernlet::invokeIrqAutomation() {
+	auto cpuData = getCpuData();
+	auto previous = cpuData->activeKernlet;
+	cpuData->activeKernlet = this;
 	auto entry = reinterpret_cast<int (*)(const void *)>(_object->_entry);
-	return entry(_instance);
+	auto result = entry(_instance);
+	cpuData->activeKernlet = previous;
+	return result;
 }
 
 // ------------------------------------------------------------------------
@@ -270,6 +289,55 @@ smarter::shared_ptr<KernletObject> processElfDso(const char *buffer,
 					infoLogger() << "    Wrote " << value << frg::endlog;
 			};
 
+		// Counts the ready entries of the ring that is described by the HelKernletRing
+		// at the given offset. The loop is bounded by the size of the ring (which is
+		// limited to kernletMaxRingEntries) and all accesses are limited to the part
+		// of the window that is actually mapped; the rest of the window is unmapped.
+		uint32_t (*abi_scan_ring)(const char *, ptrdiff_t) =
+			[] (const char *base, ptrdiff_t offset) -> uint32_t {
+				auto kernlet = getCpuData()->activeKernlet;
+				size_t mapped = kernlet ? kernlet->mappedLength(base) : 0;
+				if(offset < 0 || offset + sizeof(HelKernletRing) > mapped
+						|| (offset & 3))
+					return 0;
+				HelKernletRing ctrl;
+				memcpy(&ctrl, base + offset, sizeof(HelKernletRing));
+				// The head is updated by user space concurrently; read it exactly once.
+				auto head = __atomic_load_n(reinterpret_cast<const uint32_t *>(base + offset
+						+ offsetof(HelKernletRing, head)), __ATOMIC_ACQUIRE);
+
+				if(ctrl.entryShift < 2 || ctrl.entryShift > 12
+						|| (size_t{1} << ctrl.sizeShift) > kernletMaxRingEntries
+						|| ctrl.tagOffset + sizeof(uint32_t) > (size_t{1} << ctrl.entryShift)
+						|| (ctrl.tagOffset & 3))
+					return 0;
+				size_t ringSize = size_t{1} << (ctrl.entryShift + ctrl.sizeShift);
+				if(ctrl.ringOffset > mapped || ringSize > mapped - ctrl.ringOffset)
+					return 0;
+
+				uint32_t numEntries = uint32_t{1} << ctrl.sizeShift;
+				uint32_t n = 0;
+				while(n < numEntries) {
+					auto index = head + n;
+					auto expected = ctrl.tagValue;
+					if((ctrl.flags & kHelRingFlipTag) && ((index >> ctrl.sizeShift) & 1))
+						expected ^= ctrl.tagMask;
+
+					auto slot = index & (numEntries - 1);
+					auto p = reinterpret_cast<const uint32_t *>(base + ctrl.ringOffset
+							+ (slot << ctrl.entryShift) + ctrl.tagOffset);
+					auto tag = arch::mem_ops<uint32_t>::load(p);
+					if((tag & ctrl.tagMask) != expected)
+						break;
+					n++;
+				}
+				if(logIo)
+					infoLogger() << "__scan_ring on " << (void *)base
+							<< ", offset: " << offset << ", head: " << head
+							<< ", found " << n << " entries" << frg::endlog;
+				return n;
+			};
+
 		void (*abi_trigger_bitset)(void *, uint32_t) =
 			[] (void *p, uint32_t bits) {
 				if(logIo)
@@ -293,6 +361,8 @@ smarter::shared_ptr<KernletObject> processElfDso(const char *buffer,
 			return reinterpret_cast<void *>(abi_mmio_read32);
 		else if(name == "__mmio_write32")
 			return reinterpret_cast<void *>(abi_mmio_write32);
+		else if(name == "__scan_ring")
+			return reinterpret_cast<void *>(abi_scan_ring);
 		else if(name == "__trigger_bitset")
 			return reinterpret_cast<void *>(abi_trigger_bitset);
 		panicLogger() << "Could not resolve external " << name.data() << frg::endlog;
@@ -630,6 +630,10 @@ void handleSyscall(SyscallImageAccessor image) {
 		*image.error() = helPointerPhysical((void *)arg0, &physical);
 		*image.out0() = physical;
 	} break;
+	case kHelCallPointerPhysicalRange: {
+		*image.error() = helPointerPhysicalRange((void *)arg0, (size_t)arg1,
+				(uintptr_t *)arg2);
+	} break;
 	case kHelCallSubmitReadMemory: {
 		*image.error() = helSubmitReadMemory((HelHandle)arg0, (uintptr_t)arg1,
 				(size_t)arg2, (void *)arg3,
@@ -802,6 +806,12 @@ void handleSyscall(SyscallImageAccessor image) {
 		*image.out0() = bound_handle;
 	} break;
 
+	case kHelCallInvokeKernlet: {
+		uint64_t cycles;
+		*image.error() = helInvokeKernlet((HelHandle)arg0, (size_t)arg1, &cycles);
+		*image.out0() = cycles;
+	} break;
+
 	case kHelCallSetAffinity: {
 		*image.error() = helSetAffinity((HelHandle)arg0, (uint8_t *)arg1, (size_t)arg2);
 	} break;
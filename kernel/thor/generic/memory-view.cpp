@@ -188,6 +188,155 @@ static initgraph::Task initReclaim{&globalInitEngine, "generic.init-reclaim",
 	}
 };
 
+// --------------------------------------------------------
+// Writeback implementation.
+// --------------------------------------------------------
+
+namespace {
+	constexpr bool logWriteback = false;
+
+	// Dirty pages are written back once they are older than this.
+	constexpr uint64_t dirtyExpireNanos = 5'000'000'000;
+	// Period of the writeback fiber.
+	constexpr uint64_t writebackIntervalNanos = 1'000'000'000;
+
+	// Percentage of physical memory that may be dirty before background writeback starts.
+	constexpr size_t dirtyBackgroundRatio = 10;
+	// Percentage of physical memory that may be dirty before writers are throttled.
+	constexpr size_t dirtyRatio = 20;
+}
+
+struct MemoryWriteback {
+	size_t backgroundThreshold() {
+		return physicalAllocator->numTotalPages() * dirtyBackgroundRatio / 100;
+	}
+
+	size_t throttleThreshold() {
+		return physicalAllocator->numTotalPages() * dirtyRatio / 100;
+	}
+
+	// Note: this may be called with external locks held (see markDirty()).
+	//       Instead of waking up the writeback fiber, we rely on its periodic wakeup
+	//       and on throttle() to start background writeback.
+	void accountDirty(size_t numPages) {
+		_dirtyPages.fetch_add(numPages, std::memory_order_relaxed);
+	}
+
+	void accountClean(size_t numPages) {
+		auto dirtyPages = _dirtyPages.fetch_sub(numPages, std::memory_order_relaxed) - numPages;
+		if(dirtyPages <= throttleThreshold())
+			_cleanEvent.raise();
+	}
+
+	// Called when the list of deferred dirty pages of a ManagedSpace becomes non-empty.
+	void postSpace(ManagedSpace *space) {
+		auto irqLock = frg::guard(&irqMutex());
+		auto lock = frg::guard(&_mutex);
+
+		if(space->writebackPosted)
+			return;
+		space->selfPtr.ctr()->increment();
+		space->writebackPosted = true;
+		space->dirtySince = systemClockSource()->currentNanos();
+		_dirtySpaces.push_back(space);
+	}
+
+	// Blocks writers while too much memory is dirty. Writers that exceed the background
+	// threshold start writeback of their own space before they are throttled.
+	coroutine<void> throttle(ManagedSpace *space) {
+		auto dirtyPages = _dirtyPages.load(std::memory_order_relaxed);
+		if(dirtyPages <= backgroundThreshold())
+			co_return;
+
+		space->flushDirty();
+		if(dirtyPages <= throttleThreshold())
+			co_return;
+
+		if(logWriteback)
+			infoLogger() << "thor: Throttling writer, " << dirtyPages
+					<< " pages are dirty" << frg::endlog;
+		_kickEvent.raise();
+		co_await _cleanEvent.async_wait_if([&] () -> bool {
+			return _dirtyPages.load(std::memory_order_relaxed) > throttleThreshold();
+		});
+	}
+
+	void runWritebackFiber() {
+		// Returns the next space that needs to be written back (or nullptr).
+		auto nextSpace = [this] () -> ManagedSpace * {
+			auto irqLock = frg::guard(&irqMutex());
+			auto lock = frg::guard(&_mutex);
+
+			if(_dirtySpaces.empty())
+				return nullptr;
+
+			// Spaces are ordered by the age of their oldest deferred dirty page.
+			auto space = _dirtySpaces.front();
+			auto now = systemClockSource()->currentNanos();
+			if(space->dirtySince + dirtyExpireNanos > now
+					&& _dirtyPages.load(std::memory_order_relaxed) <= backgroundThreshold())
+				return nullptr;
+
+			_dirtySpaces.pop_front();
+			space->writebackPosted = false;
+			return space;
+		};
+
+		KernelFiber::run([=] {
+			while(true) {
+				if(logWriteback)
+					infoLogger() << "thor: " << _dirtyPages.load(std::memory_order_relaxed)
+							<< " pages are dirty" << frg::endlog;
+
+				while(auto space = nextSpace()) {
+					space->flushDirty();
+					space->selfPtr.ctr()->decrement();
+				}
+
+				KernelFiber::asyncBlockCurrent(async::race_and_cancel(
+					[&] (async::cancellation_token cancellation) {
+						return async::transform(_kickEvent.async_wait(cancellation),
+								[] (auto) { });
+					},
+					[&] (async::cancellation_token cancellation) {
+						return generalTimerEngine()->sleepFor(writebackIntervalNanos,
+								cancellation);
+					}
+				));
+			}
+		});
+	}
+
+private:
+	frg::ticket_spinlock _mutex;
+
+	frg::intrusive_list<
+		ManagedSpace,
+		frg::locate_member<
+			ManagedSpace,
+			frg::default_list_hook<ManagedSpace>,
+			&ManagedSpace::writebackHook
+		>
+	> _dirtySpaces;
+
+	std::atomic<size_t> _dirtyPages{0};
+
+	// Raised to make the writeback fiber run early.
+	async::recurring_event _kickEvent;
+	// Raised when the number of dirty pages drops below the throttling threshold.
+	async::recurring_event _cleanEvent;
+};
+
+static frg::manual_box<MemoryWriteback> globalWriteback;
+
+static initgraph::Task initWriteback{&globalInitEngine, "generic.init-writeback",
+	initgraph::Requires{getFibersAvailableStage()},
+	[] {
+		globalWriteback.initialize();
+		globalWriteback->runWritebackFiber();
+	}
+};
+
 // --------------------------------------------------------
 // MemoryView.
 // --------------------------------------------------------
@@ -445,12 +594,9 @@ ImmediateMemory::ImmediateMemory(size_t length)
 	auto numPages = (length + kPageSize - 1) >> kPageShift;
 	_physicalPages.resize(numPages);
 	for(size_t i = 0; i < numPages; ++i) {
-		auto physical = physicalAllocator->allocate(kPageSize, 64);
+		auto physical = allocateZeroedPage();
 		assert(physical != PhysicalAddr(-1) && "OOM when allocating ImmediateMemory");
 
-		PageAccessor accessor{physical};
-		memset(accessor.get(), 0, kPageSize);
-
 		_physicalPages[i] = physical;
 	}
 }
@@ -470,12 +616,9 @@ void ImmediateMemory::resize(size_t newSize, async::any_receiver<void> receiver)
 		assert(newNumPages >= currentNumPages);
 		_physicalPages.resize(newNumPages);
 		for(size_t i = currentNumPages; i < newNumPages; ++i) {
-			auto physical = physicalAllocator->allocate(kPageSize, 64);
+			auto physical = allocateZeroedPage();
 			assert(physical != PhysicalAddr(-1) && "OOM when allocating ImmediateMemory");
 
-			PageAccessor accessor{physical};
-			memset(accessor.get(), 0, kPageSize);
-
 			_physicalPages[i] = physical;
 		}
 	}
@@ -685,13 +828,20 @@ AllocatedMemory::fetchRange(uintptr_t offset, FetchFlags, smarter::shared_ptr<Wo
 	assert(index < _physicalChunks.size());
 
 	if(_physicalChunks[index] == PhysicalAddr(-1)) {
-		auto physical = physicalAllocator->allocate(_chunkSize, _addressBits);
-		assert(physical != PhysicalAddr(-1) && "OOM");
-		assert(!(physical & (_chunkAlign - 1)));
+		PhysicalAddr physical;
+		if(_chunkSize == kPageSize && _chunkAlign == kPageSize && _addressBits == 64) {
+			// Fast path for anonymous memory: take a pre-zeroed page.
+			physical = allocateZeroedPage();
+			assert(physical != PhysicalAddr(-1) && "OOM");
+		}else{
+			physical = physicalAllocator->allocate(_chunkSize, _addressBits);
+			assert(physical != PhysicalAddr(-1) && "OOM");
+			assert(!(physical & (_chunkAlign - 1)));
 
-		for(size_t pg_progress = 0; pg_progress < _chunkSize; pg_progress += kPageSize) {
-			PageAccessor accessor{physical + pg_progress};
-			memset(accessor.get(), 0, kPageSize);
+			for(size_t pg_progress = 0; pg_progress < _chunkSize; pg_progress += kPageSize) {
+				PageAccessor accessor{physical + pg_progress};
+				memset(accessor.get(), 0, kPageSize);
+			}
 		}
 		_physicalChunks[index] = physical;
 	}
@@ -726,8 +876,9 @@ void AllocatedMemory::retireGlobalFutex(uintptr_t) {
 // ManagedSpace
 // --------------------------------------------------------
 
-ManagedSpace::ManagedSpace(size_t length, bool readahead)
-: pages{*kernelAlloc}, numPages{length >> kPageShift}, readahead{readahead} {
+ManagedSpace::ManagedSpace(size_t length, bool readahead, size_t manageLimit)
+: pages{*kernelAlloc}, numPages{length >> kPageShift}, readahead{readahead},
+		manageLimit{manageLimit} {
 	assert(!(length & (kPageSize - 1)));
 
 	[] (ManagedSpace *self, enable_detached_coroutine = {}) -> void {
@@ -874,24 +1025,46 @@ void ManagedSpace::_progressManagement(ManageList &pending) {
 	// "Proper" priorization should probably be done in the userspace driver
 	// (we do not want to store per-page priorities here).
 
-	while(!_writebackList.empty() && !_managementQueue.empty()) {
-		auto page = _writebackList.front();
-		auto index = page->identity;
-
-		// Fuse the request with adjacent pages in the list.
-		ptrdiff_t count = 0;
-		while(!_writebackList.empty()) {
-			auto fuse_cache_page = _writebackList.front();
-			auto fuse_index = fuse_cache_page->identity;
-			auto fuse_managed_page = frg::container_of(fuse_cache_page, &ManagedPage::cachePage);
-			if(fuse_index != index + count)
-				break;
-			assert(fuse_managed_page->loadState == kStateWantWriteback);
-			fuse_managed_page->loadState = kStateWriteback;
+	// Fuses the page at the front of the list with adjacent pages in the same state.
+	// Adjacent pages do not need to be adjacent in the list; we look them up in the tree.
+	// Returns the index of the first page and the number of pages in the request.
+	auto fuseRequest = [&] (auto &list, LoadState wantState, LoadState newState)
+			-> frg::tuple<size_t, size_t> {
+		auto index = list.front()->identity;
+		auto limit = frg::max(manageLimit >> kPageShift, size_t{1});
+
+		auto isWanted = [&] (size_t other) -> bool {
+			auto pit = pages.find(other);
+			return pit && pit->loadState == wantState;
+		};
+
+		// Extend the request backwards first, such that it still contains the front page.
+		size_t first = index;
+		while(first > 0 && index - first + 1 < limit && isWanted(first - 1))
+			first--;
+
+		size_t count = 0;
+		while(count < limit && isWanted(first + count)) {
+			auto pit = pages.find(first + count);
+			pit->loadState = newState;
+			// Deferred dirty pages are written back early if that enlarges the request.
+			if(pit->writebackDeferred) {
+				_dirtyList.erase(_dirtyList.iterator_to(&pit->cachePage));
+				pit->writebackDeferred = false;
+			}else{
+				list.erase(list.iterator_to(&pit->cachePage));
+			}
 			count++;
-			_writebackList.pop_front();
 		}
 		assert(count);
+		assert(index >= first && index < first + count);
+
+		return frg::make_tuple(first, count);
+	};
+
+	while(!_writebackList.empty() && !_managementQueue.empty()) {
+		auto [index, count] = fuseRequest(_writebackList,
+				kStateWantWriteback, kStateWriteback);
 
 		auto node = _managementQueue.pop_front();
 		node->setup(Error::success, ManageRequest::writeback,
@@ -900,23 +1073,8 @@ void ManagedSpace::_progressManagement(ManageList &pending) {
 	}
 
 	while(!_initializationList.empty() && !_managementQueue.empty()) {
-		auto page = _initializationList.front();
-		auto index = page->identity;
-
-		// Fuse the request with adjacent pages in the list.
-		ptrdiff_t count = 0;
-		while(!_initializationList.empty()) {
-			auto fuse_cache_page = _initializationList.front();
-			auto fuse_index = fuse_cache_page->identity;
-			auto fuse_managed_page = frg::container_of(fuse_cache_page, &ManagedPage::cachePage);
-			if(fuse_index != index + count)
-				break;
-			assert(fuse_managed_page->loadState == kStateWantInitialization);
-			fuse_managed_page->loadState = kStateInitialization;
-			count++;
-			_initializationList.pop_front();
-		}
-		assert(count);
+		auto [index, count] = fuseRequest(_initializationList,
+				kStateWantInitialization, kStateInitialization);
 
 		auto node = _managementQueue.pop_front();
 		node->setup(Error::success, ManageRequest::initialize,
@@ -925,6 +1083,29 @@ void ManagedSpace::_progressManagement(ManageList &pending) {
 	}
 }
 
+void ManagedSpace::flushDirty() {
+	ManageList pending;
+	{
+		auto irqLock = frg::guard(&irqMutex());
+		auto lock = frg::guard(&mutex);
+
+		while(!_dirtyList.empty()) {
+			auto page = _dirtyList.pop_front();
+			auto pit = frg::container_of(page, &ManagedPage::cachePage);
+			assert(pit->loadState == kStateWantWriteback);
+			assert(pit->writebackDeferred);
+			pit->writebackDeferred = false;
+			_writebackList.push_back(page);
+		}
+		_progressManagement(pending);
+	}
+
+	while(!pending.empty()) {
+		auto node = pending.pop_front();
+		node->complete();
+	}
+}
+
 void ManagedSpace::_progressMonitors(MonitorList &pending) {
 	// TODO: Accelerate this by storing the monitors in a RB tree ordered by their progress.
 	auto progressNode = [&] (MonitorNode *node) -> bool {
@@ -1030,11 +1211,8 @@ BackingMemory::fetchRange(uintptr_t offset, FetchFlags, smarter::shared_ptr<Work
 	assert(pit);
 
 	if(pit->physical == PhysicalAddr(-1)) {
-		PhysicalAddr physical = physicalAllocator->allocate(kPageSize);
+		PhysicalAddr physical = allocateZeroedPage();
 		assert(physical != PhysicalAddr(-1) && "OOM");
-
-		PageAccessor accessor{physical};
-		memset(accessor.get(), 0, kPageSize);
 		pit->physical = physical;
 	}
 
@@ -1059,6 +1237,7 @@ Error BackingMemory::updateRange(ManageRequest type, size_t offset, size_t lengt
 	assert((length % kPageSize) == 0);
 
 	MonitorList pending;
+	size_t numCleaned = 0;
 	{
 		auto irqLock = frg::guard(&irqMutex());
 		auto lock = frg::guard(&_managed->mutex);
@@ -1095,6 +1274,9 @@ Error BackingMemory::updateRange(ManageRequest type, size_t offset, size_t lengt
 					pit->loadState = ManagedSpace::kStatePresent;
 					if(!pit->lockCount)
 						globalReclaimer->addPage(&pit->cachePage);
+					assert(_managed->numDirtyPages);
+					_managed->numDirtyPages--;
+					numCleaned++;
 				}else{
 					assert(pit->loadState == ManagedSpace::kStateAnotherWriteback);
 					pit->loadState = ManagedSpace::kStateWantWriteback;
@@ -1106,6 +1288,9 @@ Error BackingMemory::updateRange(ManageRequest type, size_t offset, size_t lengt
 		_managed->_progressMonitors(pending);
 	}
 
+	if(numCleaned)
+		globalWriteback->accountClean(numCleaned);
+
 	while(!pending.empty()) {
 		auto node = pending.pop_front();
 		node->event.raise();
@@ -1273,24 +1458,37 @@ void FrontalMemory::markDirty(uintptr_t offset, size_t size) {
 	assert(!(offset % kPageSize));
 	assert(!(size % kPageSize));
 
+	// Writeback of newly dirtied pages is deferred to the writeback fiber.
+	// This allows us to combine multiple writes to the same page.
+	auto deferPage = [&] (ManagedSpace::ManagedPage *pit) {
+		pit->loadState = ManagedSpace::kStateWantWriteback;
+		pit->writebackDeferred = true;
+		_managed->_dirtyList.push_back(&pit->cachePage);
+		_managed->numDirtyPages++;
+	};
+
+	size_t numDirtied = 0;
+	bool needsPost = false;
 	{
 		auto irqLock = frg::guard(&irqMutex());
 		auto lock = frg::guard(&_managed->mutex);
 
+		needsPost = _managed->_dirtyList.empty();
+
 		// Put the pages into the dirty state.
 		for(size_t pg = 0; pg < size; pg += kPageSize) {
 			auto index = (offset + pg) >> kPageShift;
 			auto pit = _managed->pages.find(index);
 			assert(pit);
 			if(pit->loadState == ManagedSpace::kStatePresent) {
-				pit->loadState = ManagedSpace::kStateWantWriteback;
 				if(!pit->lockCount)
 					globalReclaimer->removePage(&pit->cachePage);
-				_managed->_writebackList.push_back(&pit->cachePage);
+				deferPage(pit);
+				numDirtied++;
 			}else if(pit->loadState == ManagedSpace::kStateEvicting) {
-				pit->loadState = ManagedSpace::kStateWantWriteback;
 				assert(!pit->lockCount);
-				_managed->_writebackList.push_back(&pit->cachePage);
+				deferPage(pit);
+				numDirtied++;
 			}else if(pit->loadState == ManagedSpace::kStateWriteback) {
 				pit->loadState = ManagedSpace::kStateAnotherWriteback;
 			}else{
@@ -1298,11 +1496,22 @@ void FrontalMemory::markDirty(uintptr_t offset, size_t size) {
 						|| pit->loadState == ManagedSpace::kStateAnotherWriteback);
 			}
 		}
+
+		if(_managed->_dirtyList.empty())
+			needsPost = false;
 	}
 
-	// We cannot call management callbacks with locks held, but markDirty() may be called
-	// with external locks held; do it on a WorkQueue.
-	_managed->_deferredManagement.invoke();
+	if(numDirtied)
+		globalWriteback->accountDirty(numDirtied);
+	if(needsPost)
+		globalWriteback->postSpace(_managed.get());
+}
+
+coroutine<frg::expected<Error>> FrontalMemory::copyTo(uintptr_t offset,
+		const void *pointer, size_t size,
+		smarter::shared_ptr<WorkQueue> wq) {
+	co_await globalWriteback->throttle(_managed.get());
+	co_return co_await MemoryView::copyTo(offset, pointer, size, std::move(wq));
 }
 
 size_t FrontalMemory::getLength() {
@@ -1615,7 +1824,11 @@ bool CopyOnWriteMemory::asyncLockRange(uintptr_t offset, size_t size,
 				continue;
 			}
 
-			PhysicalAddr physical = physicalAllocator->allocate(kPageSize);
+			// Anonymous memory (e.g., .bss) is backed by ZeroMemory; we can use
+			// a pre-zeroed page instead of copying from the root view.
+			bool fromZero = view.get() == getZeroMemory().get();
+			PhysicalAddr physical = fromZero
+					? allocateZeroedPage() : physicalAllocator->allocate(kPageSize);
 			assert(physical != PhysicalAddr(-1) && "OOM");
 			PageAccessor accessor{physical};
 
@@ -1638,7 +1851,7 @@ bool CopyOnWriteMemory::asyncLockRange(uintptr_t offset, size_t size,
 			}
 
 			// Copy from the root view.
-			if(!chain) {
+			if(!chain && !fromZero) {
 				// TODO: Handle errors here -- we need to drop the lock again.
 				auto copyOutcome = co_await view->copyFrom(pageOffset & ~(kPageSize - 1),
 						accessor.get(), kPageSize, wq);
@@ -1745,7 +1958,11 @@ CopyOnWriteMemory::fetchRange(uintptr_t offset, FetchFlags, smarter::shared_ptr<
 		co_return PhysicalRange{cowIt->physical, kPageSize, CachingMode::null};
 	}
 
-	PhysicalAddr physical = physicalAllocator->allocate(kPageSize);
+	// Anonymous memory (e.g., .bss) is backed by ZeroMemory; we can use
+	// a pre-zeroed page instead of copying from the root view.
+	bool fromZero = view.get() == getZeroMemory().get();
+	PhysicalAddr physical = fromZero
+			? allocateZeroedPage() : physicalAllocator->allocate(kPageSize);
 	assert(physical != PhysicalAddr(-1) && "OOM");
 	PageAccessor accessor{physical};
 
@@ -1768,7 +1985,7 @@ CopyOnWriteMemory::fetchRange(uintptr_t offset, FetchFlags, smarter::shared_ptr<
 	}
 
 	// Copy from the root view.
-	if(!chain) {
+	if(!chain && !fromZero) {
 		FRG_CO_TRY(co_await view->copyFrom(pageOffset & ~(kPageSize - 1),
 				accessor.get(), kPageSize, wq));
 	}
@@ -1,4 +1,5 @@
 #include <assert.h>
+#include <string.h>
 #include <thor-internal/arch/paging.hpp>
 #include <thor-internal/cpu-data.hpp>
 #include <thor-internal/debug.hpp>
@@ -8,6 +9,12 @@ namespace thor {
 
 static bool logPhysicalAllocs = false;
 
+namespace {
+	// Number of pages that refillZeroedPagePool() zeroes at a time.
+	// This bounds the IRQ latency of the idle task.
+	constexpr size_t zeroedPageBatch = 8;
+}
+
 // --------------------------------------------------------
 // SkeletalRegion
 // --------------------------------------------------------
@@ -114,4 +121,63 @@ void PhysicalChunkAllocator::free(PhysicalAddr address, size_t size) {
 	assert(!"Physical page is not part of any region");
 }
 
+// --------------------------------------------------------
+// Pre-zeroed pages
+// --------------------------------------------------------
+
+namespace {
+	void zeroPage(void *page) {
+#ifdef __x86_64__
+		// Use non-temporal stores; the page is usually not accessed before it is mapped,
+		// so there is no point in polluting the cache with it.
+		auto words = reinterpret_cast<uint64_t *>(page);
+		for(size_t i = 0; i < kPageSize / sizeof(uint64_t); i += 4)
+			asm volatile ("movnti %1, (%0)\n"
+					"\tmovnti %1, 8(%0)\n"
+					"\tmovnti %1, 16(%0)\n"
+					"\tmovnti %1, 24(%0)"
+					: : "r"(words + i), "r"(uint64_t{0}) : "memory");
+		asm volatile ("sfence" : : : "memory");
+#else
+		memset(page, 0, kPageSize);
+#endif
+	}
+}
+
+PhysicalAddr allocateZeroedPage() {
+	{
+		auto irqLock = frg::guard(&irqMutex());
+		auto pool = &getCpuData()->zeroedPagePool;
+		if(pool->count)
+			return pool->pages[--pool->count];
+	}
+
+	auto physical = physicalAllocator->allocate(kPageSize);
+	if(physical == PhysicalAddr(-1))
+		return physical;
+	PageAccessor accessor{physical};
+	memset(accessor.get(), 0, kPageSize);
+	return physical;
+}
+
+void refillZeroedPagePool() {
+	assert(!intsAreEnabled());
+	auto pool = &getCpuData()->zeroedPagePool;
+
+	for(size_t i = 0; i < zeroedPageBatch; i++) {
+		if(pool->count == ZeroedPagePool::capacity)
+			return;
+		// Do not hold on to pages if memory is getting scarce.
+		if(physicalAllocator->numFreePages() < physicalAllocator->numTotalPages() / 4)
+			return;
+
+		auto physical = physicalAllocator->allocate(kPageSize);
+		if(physical == PhysicalAddr(-1))
+			return;
+		PageAccessor accessor{physical};
+		zeroPage(accessor.get());
+		pool->pages[pool->count++] = physical;
+	}
+}
+
 } // namespace thor
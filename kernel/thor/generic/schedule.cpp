@@ -3,6 +3,7 @@
 #include <thor-internal/arch/ints.hpp>
 #include <thor-internal/arch/cpu.hpp>
 #include <thor-internal/cpu-data.hpp>
+#include <thor-internal/physical.hpp>
 #include <thor-internal/schedule.hpp>
 #include <thor-internal/timer.hpp>
 
@@ -27,6 +28,8 @@ namespace {
 			runOnStack([] (Continuation) {
 				if(logIdle)
 					infoLogger() << "System is idle" << frg::endlog;
+				// Use the idle time to zero pages for anonymous memory.
+				refillZeroedPagePool();
 				suspendSelf();
 				__builtin_trap();
 			}, getCpuData()->idleStack.base());
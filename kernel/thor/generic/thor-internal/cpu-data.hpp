@@ -3,11 +3,13 @@
 #include <thor-internal/arch/cpu.hpp>
 #include <thor-internal/executor-context.hpp>
 #include <thor-internal/kernel-locks.hpp>
+#include <thor-internal/physical.hpp>
 #include <thor-internal/schedule.hpp>
 
 namespace thor {
 
 // Forward defined for pointers that are part of CpuData.
+struct BoundKernlet;
 struct KernelFiber;
 struct SingleContextRecordRing;
 struct WorkQueue;
@@ -34,10 +36,13 @@ struct CpuData : public PlatformCpuData {
 	int cpuIndex;
 
 	ExecutorContext *executorContext = nullptr;
+	// Kernlet that is currently running on this CPU (with IRQs disabled).
+	BoundKernlet *activeKernlet = nullptr;
 	KernelFiber *activeFiber;
 	KernelFiber *wqFiber = nullptr;
 	smarter::shared_ptr<WorkQueue> generalWorkQueue;
 	std::atomic<uint64_t> heartbeat;
+	ZeroedPagePool zeroedPagePool;
 
 	unsigned int irqEntropySeq = 0;
 	std::atomic<ProfileMechanism> profileMechanism{};
@@ -8,6 +8,12 @@ namespace thor {
 
 struct BoundKernlet;
 
+// Size of the kernel window that memory views are mapped to when bound to a kernlet.
+inline constexpr size_t kernletWindowSize = 0x10000;
+
+// Upper bound on the number of entries that __scan_ring() inspects per invocation.
+inline constexpr size_t kernletMaxRingEntries = 4096;
+
 enum class KernletParameterType {
 	null,
 	offset,
@@ -49,14 +55,25 @@ struct BoundKernlet {
 	}
 
 	void setupOffsetBinding(size_t index, uint32_t offset);
-	void setupMemoryViewBinding(size_t index, void *p);
+	// length is the number of bytes that are actually mapped at p.
+	void setupMemoryViewBinding(size_t index, void *p, size_t length);
 	void setupBitsetEventBinding(size_t index, smarter::shared_ptr<BitsetEvent> event);
 
+	// Returns the number of mapped bytes of the memory view binding at p
+	// (or zero if p is not the start of such a binding).
+	size_t mappedLength(const void *p);
+
 	int invokeIrqAutomation();
 
 private:
+	struct MappedWindow {
+		const char *base;
+		size_t length;
+	};
+
 	smarter::shared_ptr<KernletObject> _object;
 	char *_instance;
+	frg::vector<MappedWindow, KernelAlloc> _windows;
 };
 
 void initializeKernletCtl();
@@ -850,36 +850,15 @@ struct ManagedSpace : CacheBundle {
 		PhysicalAddr physical = PhysicalAddr(-1);
 		LoadState loadState = kStateMissing;
 		unsigned int lockCount = 0;
+		// True if the page is kStateWantWriteback but still on the _dirtyList.
+		bool writebackDeferred = false;
 		CachePage cachePage;
 	};
 
-	// Calls management callbacks from a WQ; required to implement markDirty().
-	struct DeferredManagement {
-		void setUp() {
-			self->selfPtr.ctr()->increment();
-		}
-
-		void execute() {
-			ManageList pending;
-			{
-				auto irqLock = frg::guard(&irqMutex());
-				auto lock = frg::guard(&self->mutex);
-
-				self->_progressManagement(pending);
-			}
-
-			while(!pending.empty()) {
-				auto node = pending.pop_front();
-				node->complete();
-			}
+	// Default upper bound on the size of a single (fused) ManageNode.
+	static constexpr size_t defaultManageLimit = size_t{64} << kPageShift;
 
-			self->selfPtr.ctr()->decrement();
-		}
-
-		ManagedSpace *self;
-	};
-
-	ManagedSpace(size_t length, bool readahead);
+	ManagedSpace(size_t length, bool readahead, size_t manageLimit = defaultManageLimit);
 	~ManagedSpace();
 
 	Error lockPages(uintptr_t offset, size_t size);
@@ -890,6 +869,9 @@ struct ManagedSpace : CacheBundle {
 	void _progressManagement(ManageList &pending);
 	void _progressMonitors(MonitorList &pending);
 
+	// Moves all deferred dirty pages to the _writebackList.
+	void flushDirty();
+
 	smarter::borrowed_ptr<ManagedSpace> selfPtr;
 
 	frg::ticket_spinlock mutex;
@@ -898,6 +880,8 @@ struct ManagedSpace : CacheBundle {
 
 	size_t numPages;
 	bool readahead;
+	// Maximal size (in bytes) of a request that is handed out to the pager.
+	size_t manageLimit;
 
 	EvictionQueue _evictQueue;
 
@@ -919,10 +903,26 @@ struct ManagedSpace : CacheBundle {
 		>
 	> _writebackList;
 
+	// Dirty pages whose writeback is deferred (to the writeback fiber).
+	frg::intrusive_list<
+		CachePage,
+		frg::locate_member<
+			CachePage,
+			frg::default_list_hook<CachePage>,
+			&CachePage::listHook
+		>
+	> _dirtyList;
+
+	// Number of pages in one of the kState*Writeback states.
+	size_t numDirtyPages = 0;
+
+	// The following fields are protected by the writeback mechanism's mutex.
+	frg::default_list_hook<ManagedSpace> writebackHook;
+	bool writebackPosted = false;
+	uint64_t dirtySince = 0;
+
 	ManageList _managementQueue;
 	MonitorList _monitorQueue;
-
-	DeferredWork<DeferredManagement> _deferredManagement{{this}};
 };
 
 struct BackingMemory final : MemoryView {
@@ -971,6 +971,9 @@ public:
 			fetchRange(uintptr_t offset, FetchFlags flags,
 			smarter::shared_ptr<WorkQueue> wq) override;
 	void markDirty(uintptr_t offset, size_t size) override;
+	coroutine<frg::expected<Error>> copyTo(uintptr_t offset,
+			const void *pointer, size_t size,
+			smarter::shared_ptr<WorkQueue> wq) override;
 
 	coroutine<frg::expected<Error, PhysicalAddr>> takeGlobalFutex(uintptr_t offset,
 			smarter::shared_ptr<WorkQueue> wq) override;
@@ -65,4 +65,21 @@ private:
 
 extern constinit frg::manual_box<PhysicalChunkAllocator> physicalAllocator;
 
+// Per-CPU pool of pages that are already filled with zeros.
+// The pool is refilled from the idle task.
+struct ZeroedPagePool {
+	static constexpr size_t capacity = 64;
+
+	PhysicalAddr pages[capacity];
+	size_t count = 0;
+};
+
+// Allocates a single page that is filled with zeros.
+// Pages are taken from the local ZeroedPagePool if possible.
+PhysicalAddr allocateZeroedPage();
+
+// Zeroes a bounded number of pages into the local ZeroedPagePool.
+// Must be called with IRQs disabled (i.e., from the idle task).
+void refillZeroedPagePool();
+
 } // namespace thor
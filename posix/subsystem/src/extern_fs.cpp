@@ -19,7 +19,7 @@ struct DirectoryNode;
 struct Superblock final : FsSuperblock {
 	Superblock(helix::UniqueLane lane);
 
-	FutureMaybe<std::shared_ptr<FsNode>> createRegular() override;
+	FutureMaybe<std::shared_ptr<FsNode>> createRegular(FsNode *directory) override;
 	FutureMaybe<std::shared_ptr<FsNode>> createSocket() override;
 
 	async::result<frg::expected<Error, std::shared_ptr<FsLink>>>
@@ -797,7 +797,7 @@ std::shared_ptr<FsNode> StructuralLink::getTarget() {
 Superblock::Superblock(helix::UniqueLane lane)
 : _lane{std::move(lane)} { }
 
-FutureMaybe<std::shared_ptr<FsNode>> Superblock::createRegular() {
+FutureMaybe<std::shared_ptr<FsNode>> Superblock::createRegular(FsNode *directory) {
 	helix::Offer offer;
 	helix::SendBuffer send_req;
 	helix::RecvInline recv_resp;
@@ -805,6 +805,7 @@ FutureMaybe<std::shared_ptr<FsNode>> Superblock::createRegular() {
 
 	managarm::fs::CntRequest req;
 	req.set_req_type(managarm::fs::CntReqType::SB_CREATE_REGULAR);
+	req.set_parent_id(static_cast<Node *>(directory)->getInode());
 
 	auto ser = req.SerializeAsString();
 	auto &&transmit = helix::submitAsync(_lane, helix::Dispatcher::global(),
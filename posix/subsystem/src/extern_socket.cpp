@@ -24,6 +24,26 @@ struct Socket : File {
 		co_return resultOrError.value();
 	}
 
+	async::result<frg::expected<Error, AcceptResult>> accept(Process *) override {
+		auto laneOrError = co_await _file.accept();
+		if(!laneOrError) {
+			switch(laneOrError.error()) {
+			case protocols::fs::Error::wouldBlock:
+				co_return Error::wouldBlock;
+			case protocols::fs::Error::illegalOperationTarget:
+				// The socket type does not support accept() (e.g., UDP).
+				co_return Error::illegalOperationTarget;
+			default:
+				// E.g., the socket is not listening.
+				co_return Error::illegalArguments;
+			}
+		}
+
+		auto file = smarter::make_shared<Socket>(std::move(laneOrError.value()));
+		file->setupWeakFile(file);
+		co_return File::constructHandle(file);
+	}
+
 	helix::BorrowedDescriptor getPassthroughLane() override {
 		return _file.getLane();
 	}
@@ -59,7 +59,9 @@ protected:
 	~FsSuperblock() = default;
 
 public:
-	virtual FutureMaybe<std::shared_ptr<FsNode>> createRegular() = 0;
+	// The directory is only a hint for the placement of the node;
+	// the caller still has to link the node into it.
+	virtual FutureMaybe<std::shared_ptr<FsNode>> createRegular(FsNode *directory) = 0;
 	virtual FutureMaybe<std::shared_ptr<FsNode>> createSocket() = 0;
 
 	virtual async::result<frg::expected<Error, std::shared_ptr<FsLink>>>
@@ -2244,7 +2244,7 @@ async::result<void> serveRequests(std::shared_ptr<Process> self,
 					}
 				}else{
 					assert(directory->superblock());
-					auto node = co_await directory->superblock()->createRegular();
+					auto node = co_await directory->superblock()->createRegular(directory.get());
 					if (!node) {
 						co_await sendErrorResponse(managarm::posix::Errors::FILE_NOT_FOUND);
 						continue;
@@ -2970,8 +2970,14 @@ async::result<void> serveRequests(std::shared_ptr<Process> self,
 
 			auto newfileResult = co_await sockfile->accept(self.get());
 			if(!newfileResult) {
-				assert(newfileResult.error() == Error::wouldBlock);
-				co_await sendErrorResponse(managarm::posix::Errors::WOULD_BLOCK);
+				if(newfileResult.error() == Error::wouldBlock) {
+					co_await sendErrorResponse(managarm::posix::Errors::WOULD_BLOCK);
+				}else if(newfileResult.error() == Error::illegalOperationTarget) {
+					co_await sendErrorResponse(managarm::posix::Errors::NOT_SUPPORTED);
+				}else{
+					assert(newfileResult.error() == Error::illegalArguments);
+					co_await sendErrorResponse(managarm::posix::Errors::ILLEGAL_ARGUMENTS);
+				}
 				continue;
 			}
 			auto newfile = newfileResult.value();
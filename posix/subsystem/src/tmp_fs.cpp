@@ -489,7 +489,7 @@ private:
 };
 
 struct Superblock final : FsSuperblock {
-	FutureMaybe<std::shared_ptr<FsNode>> createRegular() override {
+	FutureMaybe<std::shared_ptr<FsNode>> createRegular(FsNode *) override {
 		auto node = std::make_shared<MemoryNode>(this);
 		co_return std::move(node);
 	}
@@ -39,6 +39,19 @@ struct File {
 
 	async::result<helix::UniqueDescriptor> accessMemory();
 
+	// Returns the passthrough lane of the accepted socket.
+	async::result<frg::expected<Error, helix::UniqueDescriptor>> accept();
+
+	// Returns the memory of the socket's shared ring, see protocols/fs/socket-ring.hpp.
+	async::result<frg::expected<Error, helix::UniqueDescriptor>> mapRing();
+
+	// Tells the server that the client advanced its counters of the shared ring.
+	async::result<Error> notifyRing();
+
+	// Reads or sets a socket option (PT_GET_OPTION, PT_SET_OPTION), e.g., SO_RCVBUF.
+	async::result<frg::expected<Error, int>> getOption(int option);
+	async::result<Error> setOption(int option, int value);
+
 private:
 	helix::UniqueDescriptor _lane;
 };
@@ -32,6 +32,8 @@ enum class Error {
 	noSpaceLeft = 21,
 	noBackingDevice = 23,
 	isDirectory = 22,
+	connectionRefused = 25,
+	connectionReset = 26,
 };
 
 using ReadResult = std::variant<Error, size_t>;
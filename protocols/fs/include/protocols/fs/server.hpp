@@ -133,6 +133,20 @@ struct FileOperations {
 		listen = f;
 		return *this;
 	}
+	constexpr FileOperations &withAccept(async::result<frg::expected<Error, helix::UniqueLane>>
+			(*f)(void *object)) {
+		accept = f;
+		return *this;
+	}
+	constexpr FileOperations &withMapRing(async::result<frg::expected<Error, helix::BorrowedDescriptor>>
+			(*f)(void *object)) {
+		mapRing = f;
+		return *this;
+	}
+	constexpr FileOperations &withNotifyRing(async::result<Error> (*f)(void *object)) {
+		notifyRing = f;
+		return *this;
+	}
 
 	constexpr FileOperations &withPeername(async::result<frg::expected<Error, size_t>> (*f)(void *object,
 			void *addr_ptr, size_t max_addr_length)) {
@@ -166,6 +180,12 @@ struct FileOperations {
 	async::result<Error> (*bind)(void *object, const char *credentials,
 			const void *addr_ptr, size_t addr_length);
 	async::result<Error> (*listen)(void *object);
+	// Returns the passthrough lane of the accepted socket.
+	async::result<frg::expected<Error, helix::UniqueLane>> (*accept)(void *object);
+	// Returns the memory of the socket's shared ring, see protocols/fs/socket-ring.hpp.
+	async::result<frg::expected<Error, helix::BorrowedDescriptor>> (*mapRing)(void *object);
+	// Called after the client advanced its counters of the shared ring.
+	async::result<Error> (*notifyRing)(void *object);
 	async::result<Error> (*connect)(void *object, const char *credentials,
 			const void *addr_ptr, size_t addr_length);
 	async::result<size_t> (*sockname)(void *object, void *addr_ptr, size_t max_addr_length);
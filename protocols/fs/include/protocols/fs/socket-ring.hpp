@@ -0,0 +1,47 @@
+#pragma once
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+namespace protocols {
+namespace fs {
+
+// Layout of the shared memory that File::mapRing() returns. Sockets that support
+// it can exchange payload through this memory instead of PT_SENDMSG / PT_RECVMSG.
+//
+// The memory starts with this header (padded to headerSize bytes), followed by
+// the transmit area (written by the client) and the receive area (written by the
+// server). Both areas have power-of-two sizes. All counters are free-running byte
+// offsets: the position inside an area is the counter modulo the area's size.
+// Each counter is only written by one side.
+//
+// After producing or consuming data, the client calls File::notifyRing().
+// The server reports new data and free space via pollWait() (EPOLLIN / EPOLLOUT).
+struct SocketRingHeader {
+	static constexpr size_t headerSize = 0x1000;
+
+	char *txArea() {
+		return reinterpret_cast<char *>(this) + headerSize;
+	}
+
+	char *rxArea() {
+		return txArea() + txSize;
+	}
+
+	// Constant after the ring was set up.
+	uint64_t txSize;
+	uint64_t rxSize;
+
+	// Written by the client.
+	alignas(64) std::atomic<uint64_t> txHead;
+	std::atomic<uint64_t> rxTail;
+
+	// Written by the server.
+	alignas(64) std::atomic<uint64_t> txTail;
+	std::atomic<uint64_t> rxHead;
+};
+
+static_assert(sizeof(SocketRingHeader) <= SocketRingHeader::headerSize);
+
+} } // namespace protocols::fs
@@ -201,5 +201,154 @@ async::result<helix::UniqueDescriptor> File::accessMemory() {
 	co_return recv_memory.descriptor();
 }
 
+async::result<frg::expected<Error, helix::UniqueDescriptor>> File::accept() {
+	managarm::fs::CntRequest req;
+	req.set_req_type(managarm::fs::CntReqType::PT_ACCEPT);
+
+	auto ser = req.SerializeAsString();
+	uint8_t buffer[128];
+
+	auto [offer, send_req, recv_resp] =
+		co_await helix_ng::exchangeMsgs(
+			_lane,
+			helix_ng::offer(
+				helix_ng::sendBuffer(ser.data(), ser.size()),
+				helix_ng::recvBuffer(buffer, 128)
+			)
+		);
+
+	HEL_CHECK(offer.error());
+	HEL_CHECK(send_req.error());
+	HEL_CHECK(recv_resp.error());
+
+	managarm::fs::SvrResponse resp;
+	resp.ParseFromArray(buffer, recv_resp.actualLength());
+	if(resp.error() != managarm::fs::Errors::SUCCESS)
+		co_return static_cast<Error>(resp.error());
+
+	// The lane is only pushed if the request succeeded.
+	auto [pull_lane] = co_await helix_ng::exchangeMsgs(
+		offer.descriptor(),
+		helix_ng::pullDescriptor()
+	);
+	HEL_CHECK(pull_lane.error());
+	co_return pull_lane.descriptor();
+}
+
+async::result<frg::expected<Error, helix::UniqueDescriptor>> File::mapRing() {
+	managarm::fs::CntRequest req;
+	req.set_req_type(managarm::fs::CntReqType::PT_MAP_RING);
+
+	auto ser = req.SerializeAsString();
+	uint8_t buffer[128];
+
+	auto [offer, send_req, recv_resp] =
+		co_await helix_ng::exchangeMsgs(
+			_lane,
+			helix_ng::offer(
+				helix_ng::sendBuffer(ser.data(), ser.size()),
+				helix_ng::recvBuffer(buffer, 128)
+			)
+		);
+
+	HEL_CHECK(offer.error());
+	HEL_CHECK(send_req.error());
+	HEL_CHECK(recv_resp.error());
+
+	managarm::fs::SvrResponse resp;
+	resp.ParseFromArray(buffer, recv_resp.actualLength());
+	if(resp.error() != managarm::fs::Errors::SUCCESS)
+		co_return static_cast<Error>(resp.error());
+
+	// The memory is only pushed if the request succeeded.
+	auto [pull_memory] = co_await helix_ng::exchangeMsgs(
+		offer.descriptor(),
+		helix_ng::pullDescriptor()
+	);
+	HEL_CHECK(pull_memory.error());
+	co_return pull_memory.descriptor();
+}
+
+async::result<Error> File::notifyRing() {
+	managarm::fs::CntRequest req;
+	req.set_req_type(managarm::fs::CntReqType::PT_NOTIFY_RING);
+
+	auto ser = req.SerializeAsString();
+	uint8_t buffer[128];
+
+	auto [offer, send_req, recv_resp] =
+		co_await helix_ng::exchangeMsgs(
+			_lane,
+			helix_ng::offer(
+				helix_ng::sendBuffer(ser.data(), ser.size()),
+				helix_ng::recvBuffer(buffer, 128)
+			)
+		);
+
+	HEL_CHECK(offer.error());
+	HEL_CHECK(send_req.error());
+	HEL_CHECK(recv_resp.error());
+
+	managarm::fs::SvrResponse resp;
+	resp.ParseFromArray(buffer, recv_resp.actualLength());
+	co_return static_cast<Error>(resp.error());
+}
+
+async::result<frg::expected<Error, int>> File::getOption(int option) {
+	managarm::fs::CntRequest req;
+	req.set_req_type(managarm::fs::CntReqType::PT_GET_OPTION);
+	req.set_command(option);
+
+	auto ser = req.SerializeAsString();
+	uint8_t buffer[128];
+
+	auto [offer, send_req, recv_resp] =
+		co_await helix_ng::exchangeMsgs(
+			_lane,
+			helix_ng::offer(
+				helix_ng::sendBuffer(ser.data(), ser.size()),
+				helix_ng::recvBuffer(buffer, 128)
+			)
+		);
+
+	HEL_CHECK(offer.error());
+	HEL_CHECK(send_req.error());
+	HEL_CHECK(recv_resp.error());
+
+	managarm::fs::SvrResponse resp;
+	resp.ParseFromArray(buffer, recv_resp.actualLength());
+	if(resp.error() != managarm::fs::Errors::SUCCESS)
+		co_return static_cast<Error>(resp.error());
+	// The server returns the value in the pid field.
+	co_return static_cast<int>(resp.pid());
+}
+
+async::result<Error> File::setOption(int option, int value) {
+	managarm::fs::CntRequest req;
+	req.set_req_type(managarm::fs::CntReqType::PT_SET_OPTION);
+	req.set_command(option);
+	req.set_value(value);
+
+	auto ser = req.SerializeAsString();
+	uint8_t buffer[128];
+
+	auto [offer, send_req, recv_resp] =
+		co_await helix_ng::exchangeMsgs(
+			_lane,
+			helix_ng::offer(
+				helix_ng::sendBuffer(ser.data(), ser.size()),
+				helix_ng::recvBuffer(buffer, 128)
+			)
+		);
+
+	HEL_CHECK(offer.error());
+	HEL_CHECK(send_req.error());
+	HEL_CHECK(recv_resp.error());
+
+	managarm::fs::SvrResponse resp;
+	resp.ParseFromArray(buffer, recv_resp.actualLength());
+	co_return static_cast<Error>(resp.error());
+}
+
 } } // namespace protocol::fs
 
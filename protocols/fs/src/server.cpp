@@ -782,6 +782,99 @@ async::detached handlePassthrough(smarter::shared_ptr<void> file,
 		managarm::fs::SvrResponse resp;
 		resp.set_error(managarm::fs::Errors::SUCCESS);
 
+		auto ser = resp.SerializeAsString();
+		auto [send_resp] = co_await helix_ng::exchangeMsgs(
+			conversation,
+			helix_ng::sendBuffer(ser.data(), ser.size())
+		);
+		HEL_CHECK(send_resp.error());
+	}else if(req.req_type() == managarm::fs::CntReqType::PT_ACCEPT) {
+		if(!file_ops->accept) {
+			managarm::fs::SvrResponse resp;
+			resp.set_error(managarm::fs::Errors::ILLEGAL_OPERATION_TARGET);
+
+			auto ser = resp.SerializeAsString();
+			auto [send_resp] = co_await helix_ng::exchangeMsgs(
+				conversation,
+				helix_ng::sendBuffer(ser.data(), ser.size())
+			);
+			HEL_CHECK(send_resp.error());
+			co_return;
+		}
+
+		auto result = co_await file_ops->accept(file.get());
+		if(!result) {
+			managarm::fs::SvrResponse resp;
+			resp.set_error(static_cast<managarm::fs::Errors>(result.error()));
+
+			auto ser = resp.SerializeAsString();
+			auto [send_resp] = co_await helix_ng::exchangeMsgs(
+				conversation,
+				helix_ng::sendBuffer(ser.data(), ser.size())
+			);
+			HEL_CHECK(send_resp.error());
+			co_return;
+		}
+
+		managarm::fs::SvrResponse resp;
+		resp.set_error(managarm::fs::Errors::SUCCESS);
+
+		auto ser = resp.SerializeAsString();
+		auto [send_resp, push_lane] = co_await helix_ng::exchangeMsgs(
+			conversation,
+			helix_ng::sendBuffer(ser.data(), ser.size()),
+			helix_ng::pushDescriptor(result.value())
+		);
+		HEL_CHECK(send_resp.error());
+		HEL_CHECK(push_lane.error());
+	}else if(req.req_type() == managarm::fs::CntReqType::PT_MAP_RING) {
+		if(!file_ops->mapRing) {
+			managarm::fs::SvrResponse resp;
+			resp.set_error(managarm::fs::Errors::ILLEGAL_OPERATION_TARGET);
+
+			auto ser = resp.SerializeAsString();
+			auto [send_resp] = co_await helix_ng::exchangeMsgs(
+				conversation,
+				helix_ng::sendBuffer(ser.data(), ser.size())
+			);
+			HEL_CHECK(send_resp.error());
+			co_return;
+		}
+
+		auto result = co_await file_ops->mapRing(file.get());
+		if(!result) {
+			managarm::fs::SvrResponse resp;
+			resp.set_error(static_cast<managarm::fs::Errors>(result.error()));
+
+			auto ser = resp.SerializeAsString();
+			auto [send_resp] = co_await helix_ng::exchangeMsgs(
+				conversation,
+				helix_ng::sendBuffer(ser.data(), ser.size())
+			);
+			HEL_CHECK(send_resp.error());
+			co_return;
+		}
+
+		managarm::fs::SvrResponse resp;
+		resp.set_error(managarm::fs::Errors::SUCCESS);
+
+		auto ser = resp.SerializeAsString();
+		auto [send_resp, push_memory] = co_await helix_ng::exchangeMsgs(
+			conversation,
+			helix_ng::sendBuffer(ser.data(), ser.size()),
+			helix_ng::pushDescriptor(result.value())
+		);
+		HEL_CHECK(send_resp.error());
+		HEL_CHECK(push_memory.error());
+	}else if(req.req_type() == managarm::fs::CntReqType::PT_NOTIFY_RING) {
+		managarm::fs::SvrResponse resp;
+		if(!file_ops->notifyRing) {
+			resp.set_error(managarm::fs::Errors::ILLEGAL_OPERATION_TARGET);
+		}else{
+			auto error = co_await file_ops->notifyRing(file.get());
+			resp.set_error(static_cast<managarm::fs::Errors>(error));
+		}
+
 		auto ser = resp.SerializeAsString();
 		auto [send_resp] = co_await helix_ng::exchangeMsgs(
 			conversation,
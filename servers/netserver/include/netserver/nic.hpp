@@ -2,7 +2,12 @@
 
 #include <arch/dma_pool.hpp>
 #include <async/result.hpp>
+#include <atomic>
+#include <cassert>
 #include <cstdint>
+#include <new>
+#include <thread>
+#include <vector>
 
 namespace nic {
 struct MacAddress {
@@ -34,26 +39,145 @@ enum EtherType : uint16_t {
 	ETHER_TYPE_ARP = 0x0806,
 };
 
-// TODO(arsen): Expose interface for csum offloading, constructing frames, and
-// other features of NICs
+// DMA pool for buffers of a single size, e.g., receive buffers.
+// Freed buffers are kept for reuse instead of being returned to the upstream pool.
+// Allocation is restricted to the thread that created the pool, but buffers
+// may be freed by any thread (e.g., after a worker processed a received packet).
+struct RecyclingPool final : arch::dma_pool {
+	inline RecyclingPool(arch::dma_pool *upstream, size_t bufferSize,
+			size_t maxCached)
+		: upstream_(upstream), bufferSize_(bufferSize),
+		maxCached_(maxCached), owner_(std::this_thread::get_id()) {}
+
+	inline void *allocate(size_t size, size_t count, size_t align) override {
+		assert(std::this_thread::get_id() == owner_);
+		reclaim_();
+		if (size * count == bufferSize_ && !cached_.empty()) {
+			auto p = cached_.back();
+			cached_.pop_back();
+			return p;
+		}
+		return upstream_->allocate(size, count, align);
+	}
+
+	inline void deallocate(void *pointer, size_t size, size_t count,
+			size_t align) override {
+		if (std::this_thread::get_id() != owner_) {
+			// Hand the buffer back to the owner. The buffer itself
+			// stores the list node, so this does not allocate.
+			assert(size * count >= sizeof(Returned));
+			auto node = new (pointer) Returned{size, count, align, nullptr};
+			auto head = returned_.load(std::memory_order_relaxed);
+			do {
+				node->next = head;
+			} while (!returned_.compare_exchange_weak(head, node,
+					std::memory_order_release, std::memory_order_relaxed));
+			return;
+		}
+		release_(pointer, size, count, align);
+	}
+
+private:
+	struct Returned {
+		size_t size;
+		size_t count;
+		size_t align;
+		Returned *next;
+	};
+
+	inline void release_(void *pointer, size_t size, size_t count,
+			size_t align) {
+		if (size * count == bufferSize_ && cached_.size() < maxCached_) {
+			cached_.push_back(pointer);
+			return;
+		}
+		upstream_->deallocate(pointer, size, count, align);
+	}
+
+	// Takes back the buffers that other threads freed.
+	inline void reclaim_() {
+		if (!returned_.load(std::memory_order_relaxed))
+			return;
+		auto node = returned_.exchange(nullptr, std::memory_order_acquire);
+		while (node) {
+			auto next = node->next;
+			release_(node, node->size, node->count, node->align);
+			node = next;
+		}
+	}
+
+	arch::dma_pool *upstream_;
+	size_t bufferSize_;
+	size_t maxCached_;
+	std::thread::id owner_;
+	std::vector<void *> cached_;
+	std::atomic<Returned *> returned_{nullptr};
+};
+
+// Offloads that a link can perform.
+enum LinkCapabilities : uint32_t {
+	// The link computes TCP/UDP checksums of outgoing frames (see TransmitOffload).
+	LINK_CAP_TX_CSUM = 1,
+	// The link verifies TCP/UDP checksums of incoming frames.
+	LINK_CAP_RX_CSUM = 2,
+	// The link splits large TCP/IPv4 frames into segments. Implies LINK_CAP_TX_CSUM.
+	LINK_CAP_TSO4 = 4,
+	// Frames sent on the link are received by this host. The IP layer does not
+	// resolve neighbours on such links and passes packets to itself directly.
+	LINK_CAP_LOOPBACK = 8,
+};
+
+// Per-frame offload requests for outgoing frames.
+// Offsets are relative to the start of the ethernet frame.
+struct TransmitOffload {
+	// If set, the link computes the checksum over the bytes starting at
+	// csumStart and stores it at csumStart + csumOffset. The checksum field
+	// must contain the (non-inverted) sum of the pseudo header.
+	bool needsCsum = false;
+	uint16_t csumStart = 0;
+	uint16_t csumOffset = 0;
+
+	// If non-zero, the link splits the TCP payload into segments of
+	// segmentSize bytes. headerLength is the size of the ethernet, IP and
+	// TCP headers that are replicated in each segment. Requires needsCsum.
+	uint16_t segmentSize = 0;
+	uint16_t headerLength = 0;
+};
+
+// Largest IPv4 packet that can be handed to links that support LINK_CAP_TSO4.
+constexpr size_t maxTsoPacketSize = 0xFFFF;
+
+// TODO(arsen): Expose interface for constructing frames and other features of NICs
 struct Link {
 	struct AllocatedBuffer {
 		arch::dma_buffer frame;
 		arch::dma_buffer_view payload;
 	};
+	struct ReceivedFrame {
+		arch::dma_buffer buffer;
+		//! The ethernet frame inside of buffer
+		arch::dma_buffer_view frame;
+		//! True if the link already verified the TCP/UDP checksum
+		bool checksumValid = false;
+	};
 	inline Link(unsigned int mtu, arch::dma_pool *dmaPool)
 		: mtu(mtu), dmaPool_(dmaPool) {}
 	virtual ~Link() = default;
-	//! Receives an entire frame from the network
-	virtual async::result<void> receive(arch::dma_buffer_view) = 0;
-	//! Sends an entire ethernet frame
-	virtual async::result<void> send(const arch::dma_buffer_view) = 0;
+	//! Waits until frames were received from the network and appends
+	//! all of them to frames
+	virtual async::result<void> receive(std::vector<ReceivedFrame> &frames) = 0;
+	//! Sends an entire ethernet frame. The offloads must be a subset
+	//! of the link's capabilities
+	virtual async::result<void> send(const arch::dma_buffer_view,
+		TransmitOffload offload = {}) = 0;
 	arch::dma_pool *dmaPool();
 	AllocatedBuffer allocateFrame(MacAddress to, EtherType type,
 		size_t payloadSize);
 
 	MacAddress deviceMac();
 	unsigned int mtu;
+	//! Bitmask of LinkCapabilities
+	uint32_t capabilities = 0;
 protected:
 	arch::dma_pool *dmaPool_;
 	MacAddress mac_;
@@ -6,6 +6,7 @@
 #include <cstring>
 #include <iomanip>
 #include "ip4.hpp"
+#include "../worker.hpp"
 
 struct ArpHeader {
 	uint16_t hrd;
@@ -48,24 +49,27 @@ async::result<void> sendArp(uint16_t op,
 	ensureEndian(sender);
 	ensureEndian(targetProto);
 
-	auto buffer = link->allocateFrame(targetMac, nic::ETHER_TYPE_ARP,
-		sizeof(leader)
-		+ 2 * sizeof(nic::MacAddress)
-		+ 2 * sizeof(uint32_t));
-	arch::dma_buffer_view bufv { buffer.payload };
-	auto appendData = [&bufv] (auto data) {
-		std::memcpy(bufv.data(), &data, sizeof(data));
-		bufv = bufv.subview(sizeof(data));
-	};
-
-	appendData(leader);
-
-	appendData(link->deviceMac());
-	appendData(sender);
-
-	appendData(targetHw);
-	appendData(targetProto);
-	co_await link->send(std::move(buffer.frame));
+	// links are only driven by the main thread
+	co_await runOn(Worker::main(), [&] () -> async::result<void> {
+		auto buffer = link->allocateFrame(targetMac, nic::ETHER_TYPE_ARP,
+			sizeof(leader)
+			+ 2 * sizeof(nic::MacAddress)
+			+ 2 * sizeof(uint32_t));
+		arch::dma_buffer_view bufv { buffer.payload };
+		auto appendData = [&bufv] (auto data) {
+			std::memcpy(bufv.data(), &data, sizeof(data));
+			bufv = bufv.subview(sizeof(data));
+		};
+
+		appendData(leader);
+
+		appendData(link->deviceMac());
+		appendData(sender);
+
+		appendData(targetHw);
+		appendData(targetProto);
+		co_await link->send(std::move(buffer.frame));
+	});
 }
 }
 
@@ -124,7 +128,8 @@ void Neighbours::feedArp(nic::MacAddress, arch::dma_buffer_view view) {
 
 	updateTable(senderProto, senderHw);
 
-	if (leader.op != 1) {
+	// every worker sees all ARP packets, but only one of them answers
+	if (leader.op != 1 || &Worker::current() != &Worker::shard(0)) {
 		return;
 	}
 
@@ -137,6 +142,7 @@ Neighbours::Entry &Neighbours::getEntry(uint32_t ip) {
 	if (auto f = table_.find(ip); f != table_.end()) {
 		if (time + staleTimeMs * 1'000'000 <= f->second.mtime_ns) {
 			f->second.state = State::stale;
+			ip4().invalidateTargets();
 		}
 		return f->second;
 	}
@@ -148,6 +154,10 @@ Neighbours::Entry &Neighbours::getEntry(uint32_t ip) {
 
 void Neighbours::updateTable(uint32_t ip, nic::MacAddress mac) {
 	auto &entry = getEntry(ip);
+	// targets only cache reachable entries
+	if (entry.state == State::reachable && entry.mac != mac) {
+		ip4().invalidateTargets();
+	}
 	entry.mac = mac;
 	entry.state = State::reachable;
 	entry.change.raise();
@@ -191,6 +201,6 @@ async::result<std::optional<nic::MacAddress>> Neighbours::tryResolve(uint32_t ip
 }
 
 Neighbours &neigh4() {
-	static Neighbours neigh;
+	thread_local Neighbours neigh;
 	return neigh;
 }
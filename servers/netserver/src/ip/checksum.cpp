@@ -1,6 +1,172 @@
 #include "checksum.hpp"
 
 #include <arch/bit.hpp>
+#include <bit>
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+namespace {
+
+// The implementations below sum the data as native-endian 32-bit words into
+// 64-bit accumulators. This yields the same one's complement sum as summing
+// big-endian 16-bit words, up to a final byte swap (RFC 1071, 2(B)).
+// 64-bit accumulators cannot overflow for buffers of less than 4 GiB.
+using SumFunction = uint64_t (*)(const unsigned char *p, size_t size);
+
+uint64_t sumGeneric(const unsigned char *p, size_t size) {
+	uint64_t acc0 = 0;
+	uint64_t acc1 = 0;
+	while(size >= 8) {
+		uint32_t w[2];
+		memcpy(w, p, 8);
+		acc0 += w[0];
+		acc1 += w[1];
+		p += 8;
+		size -= 8;
+	}
+	if(size >= 4) {
+		uint32_t w;
+		memcpy(&w, p, 4);
+		acc0 += w;
+		p += 4;
+		size -= 4;
+	}
+	if(size >= 2) {
+		uint16_t w;
+		memcpy(&w, p, 2);
+		acc1 += w;
+	}
+	return acc0 + acc1;
+}
+
+#if defined(__x86_64__)
+
+uint64_t sumSse2(const unsigned char *p, size_t size) {
+	auto zero = _mm_setzero_si128();
+	auto acc = _mm_setzero_si128();
+	while(size >= 16) {
+		auto v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+		acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(v, zero));
+		acc = _mm_add_epi64(acc, _mm_unpackhi_epi32(v, zero));
+		p += 16;
+		size -= 16;
+	}
+
+	uint64_t lanes[2];
+	_mm_storeu_si128(reinterpret_cast<__m128i *>(lanes), acc);
+	return lanes[0] + lanes[1] + sumGeneric(p, size);
+}
+
+[[gnu::target("avx2")]]
+uint64_t sumAvx2(const unsigned char *p, size_t size) {
+	auto zero = _mm256_setzero_si256();
+	auto acc0 = _mm256_setzero_si256();
+	auto acc1 = _mm256_setzero_si256();
+	while(size >= 64) {
+		auto v0 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+		auto v1 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + 32));
+		acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(v0, zero));
+		acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(v0, zero));
+		acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(v1, zero));
+		acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(v1, zero));
+		p += 64;
+		size -= 64;
+	}
+	if(size >= 32) {
+		auto v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+		acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(v, zero));
+		acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(v, zero));
+		p += 32;
+		size -= 32;
+	}
+
+	uint64_t lanes[4];
+	_mm256_storeu_si256(reinterpret_cast<__m256i *>(lanes), _mm256_add_epi64(acc0, acc1));
+	return lanes[0] + lanes[1] + lanes[2] + lanes[3] + sumSse2(p, size);
+}
+
+bool haveAvx2() {
+	unsigned int eax, ebx, ecx, edx;
+	if(!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return false;
+	if(!(ecx & bit_AVX) || !(ecx & bit_OSXSAVE))
+		return false;
+
+	// Check that the kernel saves the AVX state.
+	uint32_t xcr0Low, xcr0High;
+	asm volatile ("xgetbv" : "=a"(xcr0Low), "=d"(xcr0High) : "c"(0));
+	if((xcr0Low & 6) != 6)
+		return false;
+
+	if(!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+		return false;
+	return ebx & bit_AVX2;
+}
+
+#elif defined(__aarch64__)
+
+uint64_t sumNeon(const unsigned char *p, size_t size) {
+	auto acc0 = vdupq_n_u64(0);
+	auto acc1 = vdupq_n_u64(0);
+	while(size >= 32) {
+		acc0 = vpadalq_u32(acc0, vreinterpretq_u32_u8(vld1q_u8(p)));
+		acc1 = vpadalq_u32(acc1, vreinterpretq_u32_u8(vld1q_u8(p + 16)));
+		p += 32;
+		size -= 32;
+	}
+	if(size >= 16) {
+		acc0 = vpadalq_u32(acc0, vreinterpretq_u32_u8(vld1q_u8(p)));
+		p += 16;
+		size -= 16;
+	}
+	return vaddvq_u64(vaddq_u64(acc0, acc1)) + sumGeneric(p, size);
+}
+
+#endif
+
+constexpr ChecksumImplementation implementations[] = {
+#if defined(__x86_64__)
+	{"avx2", &sumAvx2, &haveAvx2},
+	{"sse2", &sumSse2, nullptr},
+#elif defined(__aarch64__)
+	{"neon", &sumNeon, nullptr},
+#endif
+	{"generic", &sumGeneric, nullptr},
+};
+
+// Picks the first (i.e., fastest) implementation that the CPU supports.
+SumFunction selectSum() {
+	for(auto &impl : implementations) {
+		if(!impl.isSupported || impl.isSupported())
+			return impl.sum;
+	}
+	__builtin_unreachable();
+}
+
+const SumFunction sumFunction = selectSum();
+
+} // anonymous namespace
+
+std::span<const ChecksumImplementation> checksumImplementations() {
+	return implementations;
+}
+
+uint16_t foldChecksumSum(uint64_t sum) {
+	sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+	sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+	sum = (sum & 0xFFFF) + (sum >> 16);
+	sum = (sum & 0xFFFF) + (sum >> 16);
+	auto folded = static_cast<uint16_t>(sum);
+	if constexpr (std::endian::native == std::endian::little)
+		folded = __builtin_bswap16(folded);
+	return folded;
+}
 
 void Checksum::update(uint16_t word)  {
 	state_ += word;
@@ -10,16 +176,12 @@ void Checksum::update(uint16_t word)  {
 }
 
 void Checksum::update(const void *data, size_t size) {
-	using namespace arch;
 	auto iter = static_cast<const unsigned char*>(data);
 	if (size % 2 != 0) {
 		size--;
-		update(iter[size] << 8);
-	}
-	auto end = iter + size;
-	for (; iter < end; iter += 2) {
-		update(iter[0] << 8 | iter[1]);
+		update(static_cast<uint16_t>(iter[size] << 8));
 	}
+	update(foldChecksumSum(sumFunction(iter, size)));
 }
 
 void Checksum::update(arch::dma_buffer_view view) {
@@ -30,3 +192,19 @@ uint16_t Checksum::finalize() {
 	auto state_ = this->state_;
 	return ~state_;
 }
+
+uint16_t Checksum::adjust(uint16_t checksum, uint16_t oldValue, uint16_t newValue) {
+	// HC' = ~(~HC + ~m + m'), see RFC 1624, 3.
+	Checksum csum;
+	csum.update(static_cast<uint16_t>(~checksum));
+	csum.update(static_cast<uint16_t>(~oldValue));
+	csum.update(newValue);
+	return csum.finalize();
+}
+
+uint16_t Checksum::adjust(uint16_t checksum, uint32_t oldValue, uint32_t newValue) {
+	checksum = adjust(checksum, static_cast<uint16_t>(oldValue >> 16),
+			static_cast<uint16_t>(newValue >> 16));
+	return adjust(checksum, static_cast<uint16_t>(oldValue),
+			static_cast<uint16_t>(newValue));
+}
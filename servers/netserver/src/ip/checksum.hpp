@@ -1,6 +1,7 @@
 #pragma once
 
 #include <arch/dma_structs.hpp>
+#include <span>
 
 // 16-bit one's compliment sum checksum, as described in RFC791, amongst others
 struct Checksum {
@@ -9,6 +10,28 @@ struct Checksum {
 	void update(arch::dma_buffer_view area);
 	uint16_t finalize();
 
+	// Returns the new checksum of some data after a 16-bit (or 32-bit) value in the data
+	// changed from oldValue to newValue, without summing the data again (RFC 1624).
+	static uint16_t adjust(uint16_t checksum, uint16_t oldValue, uint16_t newValue);
+	static uint16_t adjust(uint16_t checksum, uint32_t oldValue, uint32_t newValue);
+
 private:
 	uint32_t state_ = 0;
 };
+
+// An implementation of the sum that Checksum computes. It sums native-endian
+// 32-bit words; foldChecksumSum() turns the result into a one's complement sum.
+// Checksum uses the fastest implementation that the CPU supports.
+struct ChecksumImplementation {
+	const char *name;
+	uint64_t (*sum)(const unsigned char *p, size_t size);
+	// Null if the implementation is always supported.
+	bool (*isSupported)();
+};
+
+// All implementations (including unsupported ones), fastest first.
+// The last one is the portable reference implementation.
+std::span<const ChecksumImplementation> checksumImplementations();
+
+// Folds a 64-bit sum into a 16-bit one's complement sum in network byte order.
+uint16_t foldChecksumSum(uint64_t sum);
@@ -2,6 +2,7 @@
 
 #include "arp.hpp"
 #include "checksum.hpp"
+#include "../worker.hpp"
 #include <async/recurring-event.hpp>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -16,36 +17,92 @@ using namespace protocols::fs;
 
 using Route = Ip4Router::Route;
 
+// each worker runs its own instance of the stack
 Ip4Router &ip4Router() {
-	static Ip4Router inst;
+	thread_local Ip4Router inst;
 	return inst;
 }
 
 Ip4 &ip4() {
-	static Ip4 inst;
+	thread_local Ip4 inst;
 	return inst;
 }
 
+namespace {
+// bit of ip that follows a prefix of the given length
+int bitAfterPrefix(uint32_t ip, uint8_t prefix) {
+	return (ip >> (31 - prefix)) & 1;
+}
+
+// length of the longest prefix that both networks share
+uint8_t commonPrefix(CidrAddress a, CidrAddress b) {
+	auto diff = a.ip ^ b.ip;
+	uint8_t common = diff ? __builtin_clz(diff) : 32;
+	return std::min({ common, a.prefix, b.prefix });
+}
+} // namespace
+
 bool Ip4Router::addRoute(Route r) {
-	return routes.emplace(std::move(r)).second;
+	r.network.ip &= r.network.mask();
+	auto net = r.network;
+
+	// find or create the node for net
+	auto slot = &root_;
+	while (*slot && commonPrefix((*slot)->network, net) == (*slot)->network.prefix
+			&& (*slot)->network.prefix != net.prefix)
+		slot = &(*slot)->children[bitAfterPrefix(net.ip, (*slot)->network.prefix)];
+
+	if (!*slot) {
+		*slot = std::make_unique<Node>(net);
+	} else if ((*slot)->network.prefix != net.prefix
+			|| (*slot)->network.ip != net.ip) {
+		// the node diverges from net; split it at the common prefix
+		auto common = commonPrefix((*slot)->network, net);
+		auto split = std::make_unique<Node>(CidrAddress{
+			net.ip & CidrAddress{ 0, common }.mask(), common });
+		auto old = bitAfterPrefix((*slot)->network.ip, common);
+		split->children[old] = std::move(*slot);
+		*slot = std::move(split);
+		if (common != net.prefix) {
+			slot = &(*slot)->children[!old];
+			*slot = std::make_unique<Node>(net);
+		}
+	}
+
+	auto &routes = (*slot)->routes;
+	auto it = std::lower_bound(routes.begin(), routes.end(), r);
+	if (it != routes.end() && !(r < *it))
+		return false;
+	routes.insert(it, std::move(r));
+	ip4().invalidateTargets();
+	return true;
 }
 
 std::optional<Route> Ip4Router::resolveRoute(uint32_t ip) {
-	for (auto i = routes.begin(); i != routes.end(); i++) {
-		const auto &r = *i;
-		if (r.network.sameNet(ip)) {
-			if (r.link.expired()) {
-				i = routes.erase(i);
-				continue;
-			}
-			return { r };
+	// deeper nodes have longer prefixes, hence the last match wins
+	Node *match = nullptr;
+	for (auto node = root_.get(); node && node->network.sameNet(ip);) {
+		auto expired = std::remove_if(node->routes.begin(), node->routes.end(),
+			[] (const Route &r) { return r.link.expired(); });
+		if (expired != node->routes.end()) {
+			node->routes.erase(expired, node->routes.end());
+			ip4().invalidateTargets();
 		}
+
+		if (!node->routes.empty())
+			match = node;
+		if (node->network.prefix == 32)
+			break;
+		node = node->children[bitAfterPrefix(ip, node->network.prefix)].get();
 	}
-	return {};
+
+	if (!match)
+		return {};
+	return { match->routes.front() };
 }
 
-bool operator<(const CidrAddress &lhs, const CidrAddress &) {
-	return std::tie(lhs.prefix, lhs.ip) < std::tie(lhs.prefix, lhs.ip);
+bool operator<(const CidrAddress &lhs, const CidrAddress &rhs) {
+	return std::tie(lhs.prefix, lhs.ip) < std::tie(rhs.prefix, rhs.ip);
 }
 
 bool operator<(const Route &lhs, const Route &rhs) {
@@ -159,6 +216,7 @@ private:
 	friend struct Ip4;
 	int proto;
 	uint32_t remote = 0;
+	Ip4TargetCache targetCache;
 	std::queue<smarter::shared_ptr<const Ip4Packet>> pqueue;
 	async::recurring_event bell;
 };
@@ -192,12 +250,12 @@ async::result<frg::expected<protocols::fs::Error, size_t>> Ip4Socket::sendmsg(vo
 		co_return protocols::fs::Error::accessDenied;
 	}
 
-	auto ti = co_await ip4().targetByRemote(address);
+	auto ti = co_await ip4().targetByRemote(address, self->targetCache);
 	if (!ti) {
-		co_return protocols::fs::Error::netUnreachable;
+		co_return ti.error();
 	}
 
-	auto error = co_await ip4().sendFrame(std::move(*ti),
+	auto error = co_await ip4().sendFrame(std::move(ti.value()),
 		data, len, self->proto);
 	if (error != protocols::fs::Error::none) {
 		co_return error;
@@ -236,6 +294,34 @@ Ip4::targetByRemote(uint32_t remote) {
 	co_return Ip4TargetInfo { remote, source, *oroute, std::move(target) };
 }
 
+async::result<frg::expected<protocols::fs::Error, Ip4TargetInfo>>
+Ip4::targetByRemote(uint32_t remote, Ip4TargetCache &cache) {
+	if (cache.target && cache.remote == remote
+			&& cache.generation == targetGeneration_) {
+		co_return *cache.target;
+	}
+
+	auto generation = targetGeneration_;
+	auto ti = co_await targetByRemote(remote);
+	if (!ti) {
+		co_return protocols::fs::Error::netUnreachable;
+	}
+
+	// loopback links do not need a MAC
+	if (!(ti->link->capabilities & nic::LINK_CAP_LOOPBACK)) {
+		auto macTarget = ti->route.gateway ? ti->route.gateway : remote;
+		ti->mac = co_await neigh4().tryResolve(macTarget, ti->source);
+		if (!ti->mac) {
+			co_return protocols::fs::Error::hostUnreachable;
+		}
+	}
+
+	// if the tables changed in the meantime, the next call looks up
+	// the target again
+	cache = { remote, generation, ti };
+	co_return std::move(*ti);
+}
+
 bool Ip4::hasIp(uint32_t addr) {
 	return std::any_of(ips.cbegin(), ips.cend(),
 		[addr] (auto &x) {
@@ -244,7 +330,7 @@ bool Ip4::hasIp(uint32_t addr) {
 }
 
 async::result<protocols::fs::Error> Ip4::sendFrame(Ip4TargetInfo ti,
-		void *data, size_t len, uint16_t proto) {
+		void *data, size_t len, uint16_t proto, nic::TransmitOffload offload) {
 	using arch::convert_endian;
 	using arch::endian;
 
@@ -252,26 +338,26 @@ async::result<protocols::fs::Error> Ip4::sendFrame(Ip4TargetInfo ti,
 	// calculate header size
 	size_t header_size = sizeof(Ip4Packet::Header);
 	size_t packet_size = len + header_size;
-	// TODO(arsen): options
-	if (ti.route.mtu != 0 && ti.route.mtu < packet_size) {
-		std::cout << "netserver: cant fragment 1" << std::endl;
-		co_return protocols::fs::Error::messageSize;
-	}
-
 	auto &target = ti.link;
-	if (target->mtu < packet_size) {
-		std::cout << "netserver: cant fragment 2" << std::endl;
-		co_return protocols::fs::Error::messageSize;
-	}
+	// packets that the link segments only need to fit into the IP header
+	bool tso = offload.segmentSize
+		&& (target->capabilities & nic::LINK_CAP_TSO4);
+	if (tso) {
+		if (packet_size > nic::maxTsoPacketSize)
+			co_return protocols::fs::Error::messageSize;
+	} else {
+		offload.segmentSize = 0;
 
-	auto macTarget = ti.route.gateway;
-	if (macTarget == 0) {
-		macTarget = ti.remote;
-	}
+		// TODO(arsen): options
+		if (ti.route.mtu != 0 && ti.route.mtu < packet_size) {
+			std::cout << "netserver: cant fragment 1" << std::endl;
+			co_return protocols::fs::Error::messageSize;
+		}
 
-	auto mac = co_await neigh4().tryResolve(macTarget, ti.source);
-	if (!mac) {
-		co_return protocols::fs::Error::hostUnreachable;
+		if (target->mtu < packet_size) {
+			std::cout << "netserver: cant fragment 2" << std::endl;
+			co_return protocols::fs::Error::messageSize;
+		}
 	}
 
 	Ip4Packet::Header hdr;
@@ -295,23 +381,72 @@ async::result<protocols::fs::Error> Ip4::sendFrame(Ip4TargetInfo ti,
 	chk.update(reinterpret_cast<void *>(&hdr), sizeof(hdr));
 	hdr.checksum = convert_endian<endian::big>(chk.finalize());
 
-	auto fb = target->allocateFrame(*mac, nic::ETHER_TYPE_IP4, packet_size);
+	if (target->capabilities & nic::LINK_CAP_LOOPBACK) {
+		// segments that are dropped on purpose are lost on the wire
+		if (loopbackLoss_ && proto == static_cast<uint16_t>(IpProto::tcp)
+				&& ++loopbackLossCounter_ >= loopbackLoss_) {
+			loopbackLossCounter_ = 0;
+			co_return protocols::fs::Error::none;
+		}
+
+		// short-circuit: skip ARP, the ethernet header and the link, and
+		// queue the packet for the worker that receives it. the transport
+		// checksum was not computed (see LINK_CAP_TX_CSUM)
+		arch::dma_buffer buffer { target->dmaPool(), packet_size };
+		std::memcpy(buffer.data(), &hdr, sizeof(hdr));
+		std::memcpy(buffer.subview(header_size).byte_data(), data, len);
+
+		auto packet = buffer.subview(0);
+		Worker::forIp4Packet(packet).post(
+			[buffer = std::move(buffer), packet] () mutable {
+			ip4().feedPacket({}, {}, std::move(buffer), packet, true);
+		});
+		co_return protocols::fs::Error::none;
+	}
+
+	auto mac = ti.mac;
+	if (!mac) {
+		auto macTarget = ti.route.gateway;
+		if (macTarget == 0) {
+			macTarget = ti.remote;
+		}
+
+		mac = co_await neigh4().tryResolve(macTarget, ti.source);
+		if (!mac) {
+			co_return protocols::fs::Error::hostUnreachable;
+		}
+	}
+
+	// links are only driven by the main thread
+	co_await runOn(Worker::main(), [&] () -> async::result<void> {
+		auto fb = target->allocateFrame(*mac, nic::ETHER_TYPE_IP4, packet_size);
+
+		std::memcpy(fb.payload.data(), &hdr, sizeof(hdr));
+		std::memcpy(fb.payload.subview(header_size).byte_data(), data, len);
 
-	std::memcpy(fb.payload.data(), &hdr, sizeof(hdr));
-	std::memcpy(fb.payload.subview(header_size).byte_data(), data, len);
+		// rebase the offload offsets onto the start of the frame
+		auto dataOffset = static_cast<uint16_t>(fb.payload.byte_data()
+			- fb.frame.byte_data() + header_size);
+		if (offload.needsCsum)
+			offload.csumStart += dataOffset;
+		if (offload.segmentSize)
+			offload.headerLength += dataOffset;
 
-	co_await target->send(std::move(fb.frame));
+		co_await target->send(std::move(fb.frame), offload);
+	});
 	co_return protocols::fs::Error::none;
 }
 
 void Ip4::feedPacket(nic::MacAddress, nic::MacAddress,
-		arch::dma_buffer owner, arch::dma_buffer_view frame) {
+		arch::dma_buffer owner, arch::dma_buffer_view frame,
+		bool checksumValid) {
 	Ip4Packet hdr;
 	if (!hdr.parse(std::move(owner), frame)) {
 		std::cout << "netserver: runt, or otherwise invalid, ip4 frame received"
 			<< std::endl;
 		return;
 	}
+	hdr.checksumValid = checksumValid;
 	auto proto = hdr.header.protocol;
 
 	auto begin = sockets.lower_bound(proto);
@@ -337,6 +472,7 @@ void Ip4::feedPacket(nic::MacAddress, nic::MacAddress,
 
 void Ip4::setLink(CidrAddress addr, std::weak_ptr<nic::Link> l) {
 	ips.emplace(addr, std::move(l));
+	invalidateTargets();
 }
 
 std::shared_ptr<nic::Link> Ip4::getLink(uint32_t addr) {
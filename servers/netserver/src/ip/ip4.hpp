@@ -2,12 +2,13 @@
 
 #include <arch/bit.hpp>
 #include <arch/dma_structs.hpp>
+#include <frg/expected.hpp>
 #include <helix/ipc.hpp>
 #include <map>
 #include <smarter.hpp>
 #include <netserver/nic.hpp>
 #include <protocols/fs/common.hpp>
-#include <set>
+#include <vector>
 #include <cstdint>
 #include <memory>
 #include <optional>
@@ -57,9 +58,22 @@ struct Ip4Router {
 
 	// false if insertion fails
 	bool addRoute(Route r);
+	// returns the best route of the longest prefix that contains ip
 	std::optional<Route> resolveRoute(uint32_t ip);
 private:
-	std::set<Route> routes;
+	// node of a path-compressed binary trie, keyed by network prefix
+	struct Node {
+		inline Node(CidrAddress net)
+			: network(net) {}
+
+		CidrAddress network;
+		// routes for exactly this network, best route first
+		std::vector<Route> routes;
+		// subtries whose next bit after network.prefix is 0 or 1
+		std::unique_ptr<Node> children[2];
+	};
+
+	std::unique_ptr<Node> root_;
 };
 
 class Ip4Packet {
@@ -96,6 +110,8 @@ public:
 	} header;
 	static_assert(sizeof(header) == 20, "bad header size");
 	arch::dma_buffer_view data;
+	// true if the link already verified the TCP/UDP checksum
+	bool checksumValid = false;
 
 	inline arch::dma_buffer_view payload() const {
 		return data.subview(header.ihl * 4);
@@ -114,6 +130,16 @@ struct Ip4TargetInfo {
 	uint32_t source;
 	Ip4Router::Route route;
 	std::shared_ptr<nic::Link> link;
+	// MAC of the next hop, resolved by sendFrame if not set
+	std::optional<nic::MacAddress> mac = std::nullopt;
+};
+
+// remembers the target of the last destination of a socket, so that
+// sending does not need to consult the routing and neighbour tables
+struct Ip4TargetCache {
+	uint32_t remote = 0;
+	uint64_t generation = 0;
+	std::optional<Ip4TargetInfo> target;
 };
 
 struct Ip4Socket;
@@ -121,7 +147,8 @@ struct Ip4 {
 	managarm::fs::Errors serveSocket(helix::UniqueLane lane, int type, int proto, int flags);
 	// frame is a view into the owner buffer, stripping away eth bits
 	void feedPacket(nic::MacAddress dest, nic::MacAddress src,
-		arch::dma_buffer owner, arch::dma_buffer_view frame);
+		arch::dma_buffer owner, arch::dma_buffer_view frame,
+		bool checksumValid = false);
 
 	bool hasIp(uint32_t ip);
 	std::shared_ptr<nic::Link> getLink(uint32_t ip);
@@ -129,12 +156,37 @@ struct Ip4 {
 	std::optional<uint32_t> findLinkIp(uint32_t ipOnNet, nic::Link *link);
 
 	async::result<std::optional<Ip4TargetInfo>> targetByRemote(uint32_t);
+	// like the above, but also resolves the next hop, and reuses the
+	// cached target if the tables did not change since it was cached;
+	// fails with netUnreachable if there is no route and with
+	// hostUnreachable if the next hop does not answer ARP requests
+	async::result<frg::expected<protocols::fs::Error, Ip4TargetInfo>>
+	targetByRemote(uint32_t, Ip4TargetCache &cache);
+	// called when routes, addresses or neighbours change
+	inline void invalidateTargets() {
+		targetGeneration_++;
+	}
+	inline Tcp4 &tcp4() {
+		return tcp;
+	}
+	// drops every n-th TCP segment that is sent over a loopback link (zero
+	// disables this); simulates a lossy link to exercise retransmission and
+	// congestion control, see netserver.loopback_loss= in main.cpp
+	inline void setLoopbackLoss(unsigned int n) {
+		loopbackLoss_ = n;
+		loopbackLossCounter_ = 0;
+	}
+	// offsets in the offload are relative to the start of data; the link
+	// of the target must support the requested offloads
 	async::result<protocols::fs::Error> sendFrame(Ip4TargetInfo,
 		void*, size_t,
-		uint16_t);
+		uint16_t, nic::TransmitOffload offload = {});
 private:
 	std::multimap<int, smarter::shared_ptr<Ip4Socket>> sockets;
 	std::map<CidrAddress, std::weak_ptr<nic::Link>> ips;
+	uint64_t targetGeneration_ = 1;
+	unsigned int loopbackLoss_ = 0;
+	unsigned int loopbackLossCounter_ = 0;
 
 	Udp4 udp;
 	Tcp4 tcp;
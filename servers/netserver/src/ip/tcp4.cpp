@@ -3,10 +3,18 @@
 #include <async/result.hpp>
 #include <arch/bit.hpp>
 #include <arch/variable.hpp>
+#include <helix/memory.hpp>
+#include <helix/timer.hpp>
 #include <protocols/fs/server.hpp>
+#include <protocols/fs/socket-ring.hpp>
+#include <algorithm>
+#include <array>
+#include <cstddef>
 #include <cstring>
 #include <deque>
 #include <iomanip>
+#include <memory>
+#include <optional>
 #include <random>
 #include <fcntl.h>
 #include <sys/epoll.h>
@@ -17,11 +25,66 @@
 #include "checksum.hpp"
 #include "ip4.hpp"
 #include "tcp4.hpp"
+#include "../worker.hpp"
 
 namespace {
 
 constexpr bool debugTcp = false;
 
+// If enabled, the counters of each socket are printed when the socket is destroyed.
+constexpr bool logTcpStats = false;
+
+// Parameters of the retransmission timer (RFC 6298), in nanoseconds.
+// Like most implementations, we use a lower minimum than the 1 second of the RFC.
+constexpr uint64_t initialRto = 1'000'000'000;
+constexpr uint64_t minRto = 200'000'000;
+constexpr uint64_t maxRto = 60'000'000'000;
+
+// Number of duplicate ACKs that trigger a fast retransmit (RFC 5681).
+constexpr unsigned int dupAckThreshold = 3;
+
+// Limits of the queues of listening sockets. The SYN queue holds connections
+// that did not complete the handshake yet, the accept queue holds connections
+// that are waiting for accept(). SYNs are dropped while either queue is full.
+// Connections in the SYN queue that complete the handshake always move to the
+// accept queue, as they may do so on another worker.
+constexpr size_t synBacklog = 256;
+constexpr size_t acceptBacklog = 128;
+
+// Number of SYN-ACK retransmissions before a half-open connection is dropped.
+constexpr unsigned int maxSynAckRetransmits = 5;
+
+// Number of retransmission timeouts before a connection whose socket
+// was closed is dropped (like Linux' tcp_orphan_retries).
+constexpr unsigned int maxOrphanRetransmits = 8;
+
+// Time that a connection stays in FIN_WAIT_2 and TIME_WAIT after our FIN
+// was acknowledged (2 * MSL, RFC 9293). Like Linux, we use 60 seconds.
+constexpr uint64_t timeWaitDuration = 60'000'000'000;
+
+// MSS that we announce and the maximum that we use for outgoing segments.
+// TODO: Perform path MTU discovery.
+constexpr uint32_t defaultMss = 1000;
+// MSS that is assumed if the remote side does not send the MSS option (RFC 9293).
+constexpr uint32_t defaultRemoteMss = 536;
+
+// Largest payload of segments that are handed to links that support TSO.
+// This leaves room for the IP header and the largest possible TCP header.
+constexpr size_t maxTsoPayload = nic::maxTsoPacketSize - 20 - 60;
+
+// Sizes of the socket buffers, as powers of two. Unless the sizes are set via
+// SO_RCVBUF and SO_SNDBUF, the buffers start at the default size and grow
+// up to the maximum size as the connection's bandwidth-delay product demands.
+constexpr int minBufferShift = 12;
+constexpr int defaultBufferShift = 16;
+constexpr int maxBufferShift = 22;
+
+// Largest window scale allowed by RFC 7323.
+constexpr int maxWindowScale = 14;
+
+// Maximal number of out-of-order segments that we keep around.
+constexpr size_t maxOutOfOrderSegments = 64;
+
 struct stl_allocator {
 	void *allocate(size_t size) {
 		return operator new(size);
@@ -49,15 +112,42 @@ struct RingBuffer {
 	RingBuffer(const RingBuffer &) = delete;
 
 	~RingBuffer() {
-		operator delete(storage_);
+		if(ownsStorage_)
+			operator delete(storage_);
 	}
 
 	RingBuffer &operator= (const RingBuffer &) = delete;
 
+	int shift() {
+		return shift_;
+	}
+
+	size_t capacity() {
+		return size_t{1} << shift_;
+	}
+
 	size_t spaceForEnqueue() {
 		return (size_t{1} << shift_) - (enqPtr_ - deqPtr_);
 	}
 
+	// Changes the capacity while preserving the contents.
+	// Returns false if the contents do not fit into the new capacity.
+	bool resize(int shift) {
+		assert(ownsStorage_);
+		size_t available = availableToDequeue();
+		if(available > (size_t{1} << shift))
+			return false;
+
+		auto storage = reinterpret_cast<char *>(operator new (size_t{1} << shift));
+		dequeueLookahead(0, storage, available);
+		operator delete(storage_);
+		storage_ = storage;
+		shift_ = shift;
+		deqPtr_ = 0;
+		enqPtr_ = available;
+		return true;
+	}
+
 	size_t availableToDequeue() {
 		return enqPtr_ - deqPtr_;
 	}
@@ -81,7 +171,7 @@ struct RingBuffer {
 	void dequeueLookahead(size_t offset, void *data, size_t size) {
 		assert(offset + size <= availableToDequeue());
 		size_t ringSize = size_t{1} << shift_;
-		auto wrappedPtr = deqPtr_ & (ringSize - 1);
+		auto wrappedPtr = (deqPtr_ + offset) & (ringSize - 1);
 		auto p = reinterpret_cast<char *>(data);
 		size_t bytesUntilEnd = std::min(size, ringSize - wrappedPtr);
 		memcpy(p, storage_ + wrappedPtr, bytesUntilEnd);
@@ -92,21 +182,166 @@ struct RingBuffer {
 		deqPtr_ += size;
 	}
 
+	// Moves the contents to storage of the same capacity that is owned by
+	// someone else, e.g., memory that is shared with a client.
+	void moveTo(char *storage) {
+		memcpy(storage, storage_, capacity());
+		if(ownsStorage_)
+			operator delete(storage_);
+		storage_ = storage;
+		ownsStorage_ = false;
+	}
+
+	uint64_t enqueuePointer() {
+		return enqPtr_;
+	}
+
+	uint64_t dequeuePointer() {
+		return deqPtr_;
+	}
+
+	// Accounts for data that was written directly into the storage.
+	// Returns false if ptr would overrun the ring.
+	bool setEnqueuePointer(uint64_t ptr) {
+		if(ptr - enqPtr_ > spaceForEnqueue())
+			return false;
+		enqPtr_ = ptr;
+		return true;
+	}
+
+	// Accounts for data that was read directly from the storage.
+	// Returns false if ptr is beyond the enqueued data.
+	bool setDequeuePointer(uint64_t ptr) {
+		if(ptr - deqPtr_ > availableToDequeue())
+			return false;
+		deqPtr_ = ptr;
+		return true;
+	}
+
 private:
 	char *storage_;
+	bool ownsStorage_ = true;
 	int shift_;
 	uint64_t enqPtr_ = 0;
 	uint64_t deqPtr_ = 0;
 };
 
 // TODO: Use a CSPRNG, see also UDP.
-static std::mt19937 globalPrng;
+thread_local std::mt19937 globalPrng;
+
+uint64_t currentNanos() {
+	uint64_t tick;
+	HEL_CHECK(helGetClock(&tick));
+	return tick;
+}
+
+// Clock of the TCP timestamps option (RFC 7323), ticks once per millisecond.
+uint32_t timestampClock() {
+	return currentNanos() / 1'000'000;
+}
+
+// Returns the smallest buffer shift that holds at least size bytes.
+int bufferShiftFor(size_t size) {
+	int shift = minBufferShift;
+	while(shift < maxBufferShift && (size_t{1} << shift) < size)
+		shift++;
+	return shift;
+}
+
+// Compares TCP sequence numbers, taking wrap-around into account.
+bool seqLess(uint32_t a, uint32_t b) {
+	return static_cast<int32_t>(a - b) < 0;
+}
+
+// If true, the checksums of outgoing segments are computed by the link.
+bool offloadsChecksum(const Ip4TargetInfo &targetInfo) {
+	return targetInfo.link->capabilities & nic::LINK_CAP_TX_CSUM;
+}
+
+// Sorts ranges [first, second) of sequence numbers and merges overlapping ranges.
+// All ranges must be within 2^31 of each other.
+void mergeSeqRanges(std::vector<std::pair<uint32_t, uint32_t>> &ranges) {
+	std::sort(ranges.begin(), ranges.end(), [] (const auto &a, const auto &b) {
+		return seqLess(a.first, b.first);
+	});
+
+	std::vector<std::pair<uint32_t, uint32_t>> merged;
+	for(auto range : ranges) {
+		if(!merged.empty() && !seqLess(merged.back().second, range.first)) {
+			if(seqLess(merged.back().second, range.second))
+				merged.back().second = range.second;
+		}else{
+			merged.push_back(range);
+		}
+	}
+	ranges = std::move(merged);
+}
+
+// --------------------------------------------------------
+// Congestion control
+// --------------------------------------------------------
+
+// Congestion control algorithm of a single connection.
+// Loss detection and recovery (RFC 6298, RFC 6582) are implemented by Tcp4Socket;
+// the algorithm decides how the congestion window grows and how far it shrinks on loss.
+struct TcpCongestionControl {
+	virtual ~TcpCongestionControl() = default;
+
+	// Called when new data is acknowledged outside of loss recovery.
+	virtual void onAck(uint32_t &cwnd, uint32_t ssthresh, uint32_t mss, uint32_t acked) = 0;
+
+	// Returns the slow start threshold after a loss was detected.
+	virtual uint32_t onLoss(uint32_t cwnd, uint32_t flightSize, uint32_t mss) = 0;
+};
+
+// Slow start and congestion avoidance as in RFC 5681, with appropriate
+// byte counting (RFC 3465) in congestion avoidance.
+struct NewRenoCongestionControl final : TcpCongestionControl {
+	void onAck(uint32_t &cwnd, uint32_t ssthresh, uint32_t mss, uint32_t acked) override {
+		if(cwnd < ssthresh) {
+			cwnd += std::min(acked, mss);
+			return;
+		}
+
+		// Grow by one MSS per window of acknowledged data.
+		bytesAcked_ += acked;
+		if(bytesAcked_ >= cwnd) {
+			bytesAcked_ -= cwnd;
+			cwnd += mss;
+		}
+	}
+
+	uint32_t onLoss(uint32_t, uint32_t flightSize, uint32_t mss) override {
+		bytesAcked_ = 0;
+		return std::max(flightSize / 2, 2 * mss);
+	}
+
+private:
+	uint32_t bytesAcked_ = 0;
+};
+
+std::unique_ptr<TcpCongestionControl> makeCongestionControl() {
+	return std::make_unique<NewRenoCongestionControl>();
+}
+
+// Per-socket counters.
+struct TcpStats {
+	uint64_t segmentsSent = 0;
+	uint64_t segmentsReceived = 0;
+	uint64_t bytesSent = 0;
+	uint64_t bytesReceived = 0;
+	uint64_t retransmits = 0;
+	uint64_t fastRetransmits = 0;
+	uint64_t timeouts = 0;
+	uint64_t dupAcks = 0;
+};
 
 } // namespace
 
 struct TcpHeader {
 	static constexpr arch::field<uint16_t, bool> finFlag{0, 1};
 	static constexpr arch::field<uint16_t, bool> synFlag{1, 1};
+	static constexpr arch::field<uint16_t, bool> rstFlag{2, 1};
 	static constexpr arch::field<uint16_t, bool> ackFlag{4, 1};
 	static constexpr arch::field<uint16_t, unsigned int> headerWords{12, 4};
 
@@ -122,6 +357,95 @@ struct TcpHeader {
 
 static_assert(sizeof(TcpHeader) == 20);
 
+enum class TcpOption : uint8_t {
+	end = 0,
+	noOp = 1,
+	mss = 2,
+	windowScale = 3,
+	sackPermitted = 4,
+	sack = 5,
+	timestamps = 8,
+};
+
+// Options of a received segment. Unknown options are ignored.
+struct TcpOptions {
+	// Parses the options; returns false if they are malformed.
+	bool parse(const uint8_t *p, size_t size);
+
+	std::optional<uint16_t> mss;
+	std::optional<uint8_t> windowScale;
+	bool sackPermitted = false;
+	bool hasTimestamps = false;
+	uint32_t tsVal = 0;
+	uint32_t tsEcr = 0;
+	// Up to four SACK blocks (RFC 2018) as pairs of [left, right) sequence numbers.
+	std::array<std::pair<uint32_t, uint32_t>, 4> sackBlocks;
+	size_t numSackBlocks = 0;
+};
+
+bool TcpOptions::parse(const uint8_t *p, size_t size) {
+	auto load16 = [] (const uint8_t *q) -> uint16_t {
+		return (uint16_t{q[0]} << 8) | q[1];
+	};
+	auto load32 = [] (const uint8_t *q) -> uint32_t {
+		return (uint32_t{q[0]} << 24) | (uint32_t{q[1]} << 16) | (uint32_t{q[2]} << 8) | q[3];
+	};
+
+	size_t i = 0;
+	while(i < size) {
+		auto kind = static_cast<TcpOption>(p[i]);
+		if(kind == TcpOption::end)
+			break;
+		if(kind == TcpOption::noOp) {
+			i++;
+			continue;
+		}
+
+		if(i + 2 > size)
+			return false;
+		size_t length = p[i + 1];
+		if(length < 2 || i + length > size)
+			return false;
+		auto data = p + i + 2;
+
+		switch(kind) {
+		case TcpOption::mss:
+			if(length != 4)
+				return false;
+			mss = load16(data);
+			break;
+		case TcpOption::windowScale:
+			if(length != 3)
+				return false;
+			windowScale = std::min(int{data[0]}, maxWindowScale);
+			break;
+		case TcpOption::sackPermitted:
+			if(length != 2)
+				return false;
+			sackPermitted = true;
+			break;
+		case TcpOption::sack:
+			if((length - 2) % 8)
+				return false;
+			numSackBlocks = std::min((length - 2) / 8, sackBlocks.size());
+			for(size_t j = 0; j < numSackBlocks; j++)
+				sackBlocks[j] = {load32(data + 8 * j), load32(data + 8 * j + 4)};
+			break;
+		case TcpOption::timestamps:
+			if(length != 10)
+				return false;
+			hasTimestamps = true;
+			tsVal = load32(data);
+			tsEcr = load32(data + 4);
+			break;
+		default:
+			break;
+		}
+		i += length;
+	}
+	return true;
+}
+
 struct TcpPacket {
 	arch::dma_buffer_view payload() {
 		auto words = header.flags.load() & TcpHeader::headerWords;
@@ -140,7 +464,11 @@ struct TcpPacket {
 		if (ipPayload.size() < words * 4)
 			return false;
 
-		if (header.checksum.load()) {
+		auto optionsPtr = reinterpret_cast<const uint8_t *>(ipPayload.data()) + sizeof(TcpHeader);
+		if (!options.parse(optionsPtr, words * 4 - sizeof(TcpHeader)))
+			return false;
+
+		if (header.checksum.load() && !packet->checksumValid) {
 			PseudoHeader pseudo {
 				.src = packet->header.source,
 				.dst = packet->header.destination,
@@ -160,6 +488,7 @@ struct TcpPacket {
 	}
 
 	TcpHeader header;
+	TcpOptions options;
 	smarter::shared_ptr<const Ip4Packet> packet;
 };
 
@@ -179,20 +508,95 @@ protocols::fs::Error checkAddress(const void *addrPtr, size_t addrLength, TcpEnd
 	return protocols::fs::Error::none;
 }
 
+async::result<void> transmitReset(TcpEndpoint local, TcpEndpoint remote,
+		uint32_t sn, std::optional<uint32_t> ackSn) {
+	auto targetResult = co_await ip4().targetByRemote(remote.ipAddress);
+	if(!targetResult)
+		co_return;
+	auto &targetInfo = targetResult.value();
+
+	TcpHeader header {
+		.srcPort = local.port,
+		.destPort = remote.port,
+		.seqNumber = sn,
+		.ackNumber = ackSn.value_or(0),
+		.window = 0,
+		.checksum = 0,
+		.urgentPointer = 0
+	};
+	header.flags.store(TcpHeader::headerWords(sizeof(TcpHeader) / 4)
+			| TcpHeader::rstFlag(true) | TcpHeader::ackFlag(ackSn.has_value()));
+
+	PseudoHeader pseudo {
+		.src = targetInfo.source,
+		.dst = remote.ipAddress,
+		.len = sizeof(TcpHeader)
+	};
+	Checksum csum;
+	csum.update(&pseudo, sizeof(PseudoHeader));
+	csum.update(&header, sizeof(TcpHeader));
+	header.checksum = csum.finalize();
+
+	auto error = co_await ip4().sendFrame(std::move(targetInfo),
+		&header, sizeof(TcpHeader),
+		static_cast<uint16_t>(IpProto::tcp));
+	if(error != protocols::fs::Error::none)
+		std::cout << "netserver: Could not send TCP RST" << std::endl;
+}
+
+// Answers a segment that does not belong to any connection with a RST
+// (RFC 9293, 3.10.7.1). RSTs themselves are never answered.
+void sendReset(TcpPacket &packet) {
+	auto flags = packet.header.flags.load();
+	if(flags & TcpHeader::rstFlag)
+		return;
+	if(packet.packet->header.destination == INADDR_BROADCAST)
+		return;
+
+	TcpEndpoint local{packet.packet->header.destination, packet.header.destPort.load()};
+	TcpEndpoint remote{packet.packet->header.source, packet.header.srcPort.load()};
+	if(flags & TcpHeader::ackFlag) {
+		async::detach(transmitReset(local, remote, packet.header.ackNumber.load(),
+				std::nullopt));
+	}else{
+		// SYN and FIN count as one byte each.
+		uint32_t length = packet.payload().size();
+		if(flags & TcpHeader::synFlag)
+			length++;
+		if(flags & TcpHeader::finFlag)
+			length++;
+		async::detach(transmitReset(local, remote, 0,
+				packet.header.seqNumber.load() + length));
+	}
+}
+
 } // anonymous namespace
 
 struct Tcp4Socket {
 	Tcp4Socket(Tcp4 *parent, bool nonBlock)
-	: parent_(parent), nonBlock_{nonBlock}, recvRing_{14}, sendRing_{14} {}
+	: parent_(parent), worker_{&Worker::current()}, nonBlock_{nonBlock},
+		recvRing_{defaultBufferShift}, sendRing_{defaultBufferShift} {}
 
 	~Tcp4Socket() {
-		parent_->unbind(localEp_);
+		if(bound_)
+			parent_->unbind(localEp_);
+		if(pinned_)
+			parent_->unpinPort(localEp_.port);
+
+		if(logTcpStats)
+			std::cout << "netserver: TCP socket sent " << stats_.segmentsSent << " segments ("
+					<< stats_.bytesSent << " bytes), received " << stats_.segmentsReceived
+					<< " segments (" << stats_.bytesReceived << " bytes), "
+					<< stats_.retransmits << " retransmits ("
+					<< stats_.fastRetransmits << " fast retransmits, "
+					<< stats_.timeouts << " timeouts), "
+					<< stats_.dupAcks << " duplicate ACKs" << std::endl;
 	}
 
 	static auto makeSocket(Tcp4 *parent, bool nonBlock) {
 		auto s = smarter::make_shared<Tcp4Socket>(parent, nonBlock);
 		s->holder_ = s;
-		async::detach(s->flushOutPackets_());
+		async::detach(s->flushOutPackets_(s));
 		return s;
 	}
 
@@ -248,10 +652,21 @@ struct Tcp4Socket {
 			co_return protocols::fs::Error::accessDenied;
 		}
 
-		// Bind the socket if necessary.
-		if (!self->localEp_.port && !self->bindAvailable()) {
-			std::cout << "netserver: No source port" << std::endl;
-			co_return protocols::fs::Error::addressNotAvailable;
+		// Bind the socket if necessary. Choose a port such that the
+		// connection's segments are steered to this worker.
+		if (!self->localEp_.port) {
+			uint32_t source = 0;
+			if (auto ti = co_await ip4().targetByRemote(connectEp.ipAddress); ti)
+				source = ti->source;
+
+			auto steered = [&] (uint16_t port) {
+				TcpConnectionKey key{{source, port}, connectEp};
+				return &Worker::forTcpConnection(key) == self->worker_;
+			};
+			if (!self->bindAvailable(INADDR_ANY, steered)) {
+				std::cout << "netserver: No source port" << std::endl;
+				co_return protocols::fs::Error::addressNotAvailable;
+			}
 		}
 
 		// Connect to the remote.
@@ -264,9 +679,55 @@ struct Tcp4Socket {
 				break;
 			co_await self->settleEvent_.async_wait();
 		}
+		co_return self->resetError_;
+	}
+
+	static async::result<protocols::fs::Error> listen(void *object) {
+		auto self = static_cast<Tcp4Socket *>(object);
+
+		if(self->connectState_ == ConnectState::listen)
+			co_return protocols::fs::Error::none;
+		if(self->connectState_ != ConnectState::none)
+			co_return protocols::fs::Error::illegalArguments;
+
+		// Bind the socket if necessary.
+		if(!self->localEp_.port && !self->bindAvailable()) {
+			std::cout << "netserver: No source port" << std::endl;
+			co_return protocols::fs::Error::addressInUse;
+		}
+
+		self->connectState_ = ConnectState::listen;
 		co_return protocols::fs::Error::none;
 	}
 
+	static async::result<frg::expected<protocols::fs::Error, helix::UniqueLane>>
+	accept(void *object) {
+		auto self = static_cast<Tcp4Socket *>(object);
+
+		if(self->connectState_ != ConnectState::listen)
+			co_return protocols::fs::Error::illegalArguments;
+
+		while(self->acceptQueue_.empty()) {
+			if(self->nonBlock_)
+				co_return protocols::fs::Error::wouldBlock;
+			co_await self->inEvent_.async_wait();
+		}
+
+		auto child = std::move(self->acceptQueue_.front());
+		self->acceptQueue_.pop_front();
+
+		// The connection is served by the worker that handles its segments.
+		auto [localLane, remoteLane] = helix::createStream();
+		child->worker_->dispatch([child, lane = std::move(localLane)] () mutable {
+			async::detach(protocols::fs::servePassthrough(std::move(lane),
+					child, &ops),
+				[child] {
+					child->close_();
+				});
+		});
+		co_return std::move(remoteLane);
+	}
+
 	static async::result<protocols::fs::ReadResult> read(void *object, const char *creds,
 			void *data, size_t size) {
 		auto result = co_await recvMsg(object, creds, 0, data, size, nullptr, 0, {});
@@ -287,6 +748,10 @@ struct Tcp4Socket {
 		auto self = static_cast<Tcp4Socket *>(object);
 		auto p = reinterpret_cast<char *>(data);
 
+		// Once the ring is shared, the client owns its consumer side.
+		if(self->ring_)
+			co_return protocols::fs::Error::illegalOperationTarget;
+
 		if(flags & ~MSG_PEEK)
 			std::cout << "\e[31m" "netserver/tcp: Encountered unexpected recvMsg() flags: "
 					<< flags << "\e[39m" << std::endl;
@@ -297,6 +762,8 @@ struct Tcp4Socket {
 			if(!available) {
 				if(progress)
 					break;
+				if(self->resetError_ != protocols::fs::Error::none)
+					co_return self->resetError_;
 				if(self->nonBlock_)
 					co_return protocols::fs::Error::wouldBlock;
 				co_await self->inEvent_.async_wait();
@@ -308,6 +775,7 @@ struct Tcp4Socket {
 			if(flags & MSG_PEEK)
 				break;
 			self->recvRing_.dequeueAdvance(chunk);
+			self->tuneReceiveBuffer_(chunk);
 			self->flushEvent_.raise();
 		}
 
@@ -328,9 +796,20 @@ struct Tcp4Socket {
 		auto self = static_cast<Tcp4Socket *>(object);
 		auto p = reinterpret_cast<char *>(data);
 
+		// Once the ring is shared, the client owns its producer side.
+		if(self->ring_)
+			co_return protocols::fs::Error::illegalOperationTarget;
+
 		size_t progress = 0;
 		while(progress < size) {
+			if(self->resetError_ != protocols::fs::Error::none) {
+				if(progress)
+					break;
+				co_return self->resetError_;
+			}
 			size_t space = self->sendRing_.spaceForEnqueue();
+			if(!space && self->tuneSendBuffer_())
+				continue;
 			if(!space) {
 				if(self->nonBlock_) {
 					if(progress)
@@ -385,6 +864,10 @@ struct Tcp4Socket {
 			active |= EPOLLOUT;
 		if(self->remoteClosed_)
 			active |= EPOLLHUP;
+		if(!self->acceptQueue_.empty())
+			active |= EPOLLIN;
+		if(self->resetError_ != protocols::fs::Error::none)
+			active |= EPOLLIN | EPOLLOUT | EPOLLHUP | EPOLLERR;
 
 		co_return protocols::fs::PollStatusResult{self->currentSeq_, active};
 	}
@@ -410,12 +893,113 @@ struct Tcp4Socket {
 		co_return 0;
 	}
 
+	// SO_RCVBUF and SO_SNDBUF arrive as PT_GET_OPTION and PT_SET_OPTION on the
+	// passthrough lane, see protocols::fs::File::getOption() and setOption().
+	// POSIX programs depend on mlibc (which is not part of this tree) to forward
+	// getsockopt() and setsockopt() for these options.
+	static async::result<int> getOption(void *object, int option) {
+		auto self = static_cast<Tcp4Socket *>(object);
+		if(option == SO_RCVBUF) {
+			co_return self->recvRing_.capacity();
+		}else if(option == SO_SNDBUF) {
+			co_return self->sendRing_.capacity();
+		}
+		std::cout << "netserver: Unknown TCP socket option " << option << std::endl;
+		co_return 0;
+	}
+
+	static async::result<void> setOption(void *object, int option, int value) {
+		auto self = static_cast<Tcp4Socket *>(object);
+		if(value < 0)
+			co_return;
+
+		// Shared buffers cannot be resized.
+		if(self->ring_ && (option == SO_RCVBUF || option == SO_SNDBUF))
+			co_return;
+
+		// Explicitly sized buffers are not auto-tuned anymore. Shrinking a buffer
+		// fails silently if its contents do not fit into the new size.
+		auto shift = bufferShiftFor(value);
+		if(option == SO_RCVBUF) {
+			// The window scale is fixed once the SYN is sent.
+			if(self->connectState_ != ConnectState::none
+					&& self->connectState_ != ConnectState::listen)
+				shift = std::min(shift, self->maxReceiveShift_());
+			self->recvRing_.resize(shift);
+			self->rcvBufLocked_ = true;
+			self->flushEvent_.raise();
+		}else if(option == SO_SNDBUF) {
+			self->sendRing_.resize(shift);
+			self->sndBufLocked_ = true;
+			self->settleEvent_.raise();
+		}else{
+			std::cout << "netserver: Unknown TCP socket option " << option << std::endl;
+		}
+	}
+
+	// Moves both socket buffers into memory that is shared with the client.
+	// Afterwards, payload is exchanged through the ring instead of recvMsg()
+	// and sendMsg(), see protocols/fs/socket-ring.hpp.
+	static async::result<frg::expected<protocols::fs::Error, helix::BorrowedDescriptor>>
+	mapRing(void *object) {
+		auto self = static_cast<Tcp4Socket *>(object);
+		if(self->ring_)
+			co_return helix::BorrowedDescriptor{self->ringMemory_};
+
+		using protocols::fs::SocketRingHeader;
+		size_t size = SocketRingHeader::headerSize
+				+ self->sendRing_.capacity() + self->recvRing_.capacity();
+		HelHandle handle;
+		HEL_CHECK(helAllocateMemory(size, 0, nullptr, &handle));
+		self->ringMemory_ = helix::UniqueDescriptor{handle};
+		self->ringMapping_ = helix::Mapping{self->ringMemory_, 0, size};
+
+		auto ring = new (self->ringMapping_.get()) SocketRingHeader{};
+		ring->txSize = self->sendRing_.capacity();
+		ring->rxSize = self->recvRing_.capacity();
+		self->sendRing_.moveTo(ring->txArea());
+		self->recvRing_.moveTo(ring->rxArea());
+		ring->txHead.store(self->sendRing_.enqueuePointer(), std::memory_order_relaxed);
+		ring->rxTail.store(self->recvRing_.dequeuePointer(), std::memory_order_relaxed);
+
+		// The window scale and the client's view of the ring depend on the sizes.
+		self->rcvBufLocked_ = true;
+		self->sndBufLocked_ = true;
+		self->ring_ = ring;
+		self->publishRing_();
+		co_return helix::BorrowedDescriptor{self->ringMemory_};
+	}
+
+	static async::result<protocols::fs::Error> notifyRing(void *object) {
+		auto self = static_cast<Tcp4Socket *>(object);
+		if(!self->ring_)
+			co_return protocols::fs::Error::illegalOperationTarget;
+		if(self->resetError_ != protocols::fs::Error::none)
+			co_return self->resetError_;
+
+		auto txHead = self->ring_->txHead.load(std::memory_order_acquire);
+		auto rxTail = self->ring_->rxTail.load(std::memory_order_acquire);
+		if(!self->sendRing_.setEnqueuePointer(txHead)
+				|| !self->recvRing_.setDequeuePointer(rxTail))
+			co_return protocols::fs::Error::illegalArguments;
+
+		// New data may be sent and the receive window may have opened.
+		self->flushEvent_.raise();
+		co_return protocols::fs::Error::none;
+	}
+
 	constexpr static protocols::fs::FileOperations ops {
 		.read = &read,
 		.write = &write,
+		.getOption = &getOption,
+		.setOption = &setOption,
 		.pollWait = &pollWait,
 		.pollStatus = &pollStatus,
 		.bind = &bind,
+		.listen = &listen,
+		.accept = &accept,
+		.mapRing = &mapRing,
+		.notifyRing = &notifyRing,
 		.connect = &connect,
 		.getFileFlags = &getFileFlags,
 		.setFileFlags = &setFileFlags,
@@ -424,7 +1008,13 @@ struct Tcp4Socket {
 	};
 
 	bool bindAvailable(uint32_t ipAddress = INADDR_ANY) {
-		static std::uniform_int_distribution<uint16_t> dist {
+		return bindAvailable(ipAddress, [] (uint16_t) { return true; });
+	}
+
+	// Like the above, but only considers ports for which suitable() returns true.
+	template<typename F>
+	bool bindAvailable(uint32_t ipAddress, F suitable) {
+		thread_local std::uniform_int_distribution<uint16_t> dist {
 			32768, 60999
 		};
 		auto number = dist(globalPrng);
@@ -432,6 +1022,8 @@ struct Tcp4Socket {
 		auto self = holder_.lock();
 		for (int i = 0; i < range; i++) {
 			uint16_t port = dist.a() + ((number + i) % range);
+			if (!suitable(port))
+				continue;
 			if (parent_->tryBind(self, { ipAddress, port }))
 				return true;
 		}
@@ -439,7 +1031,141 @@ struct Tcp4Socket {
 	}
 
 private:
-	async::result<void> flushOutPackets_();
+	// Runs until the connection is closed. self keeps the socket alive until then.
+	async::result<void> flushOutPackets_(smarter::shared_ptr<Tcp4Socket> self);
+
+	// Waits until flushEvent_ is raised or the retransmission timer
+	// (or the TIME_WAIT timer) expires.
+	async::result<void> waitForFlush_();
+
+	bool rtoExpired_() {
+		return rtoDeadline_ && currentNanos() >= rtoDeadline_;
+	}
+
+	// Makes the server's counters of the shared ring visible to the client.
+	void publishRing_() {
+		if(!ring_)
+			return;
+		ring_->rxHead.store(recvRing_.enqueuePointer(), std::memory_order_release);
+		ring_->txTail.store(sendRing_.dequeuePointer(), std::memory_order_release);
+	}
+
+	// Builds a segment whose payload starts at offset bytes into sendRing_.
+	std::vector<char> buildSegment_(const Ip4TargetInfo &targetInfo,
+			uint32_t sn, size_t offset, size_t length, bool syn, bool ack, bool fin);
+
+	// Returns false if the segment could not be passed to the IP layer.
+	async::result<bool> transmitSegment_(Ip4TargetInfo targetInfo,
+			std::vector<char> buf, size_t length);
+
+	// Largest payload that we put into a single segment. With TSO, the link
+	// splits such segments into chunks of mss_ bytes.
+	size_t maxSegmentPayload_() {
+		if(!linkTso_)
+			return mss_;
+		return std::max(size_t{mss_}, maxTsoPayload / mss_ * mss_);
+	}
+
+	void startRttSample_(uint32_t sn) {
+		rttTiming_ = true;
+		rttSn_ = sn;
+		rttStart_ = currentNanos();
+	}
+
+	void sampleRtt_(uint64_t rtt);
+	void handleRetransmitTimeout_();
+	void handleAck_(TcpPacket &packet);
+
+	// Transitions from sendSyn or sendSynAck to connected.
+	void completeHandshake_(TcpPacket &packet);
+
+	// Handles a SYN that arrives at a listening socket.
+	void handleSyn_(TcpPacket &packet);
+
+	// A connection that a listening socket hands to the worker of its 4-tuple.
+	struct ConnectionRequest {
+		TcpConnectionKey key;
+		uint32_t remoteSn;
+		TcpOptions options;
+		smarter::weak_ptr<Tcp4Socket> listener;
+		Worker *listenerWorker;
+		// Explicitly set buffer sizes of the listening socket (or -1).
+		int recvShift;
+		int sendShift;
+	};
+
+	// Creates the connection on the calling worker and sends the SYN-ACK.
+	static void spawnConnection_(ConnectionRequest request);
+
+	// Runs f(listener, child) on the worker of the listening socket that created
+	// this connection. If that socket is gone, the connection is closed instead.
+	template<typename F>
+	void withListener_(F f);
+
+	// Moves a connection from the SYN queue to the accept queue.
+	void enqueueAccepted_(smarter::shared_ptr<Tcp4Socket> child);
+
+	// Forgets about a connection that did not complete the handshake.
+	void dropHalfOpen_();
+
+	// Called when the socket's file is closed. Connections send a FIN once
+	// all data is flushed; all other sockets are terminated immediately.
+	void close_();
+
+	// Removes the connection from Tcp4 and stops flushOutPackets_().
+	void terminate_();
+
+	// Checks whether a RST is acceptable (RFC 5961, 3.2). RSTs that are within
+	// the window but not at remoteKnownSn_ are answered with a challenge ACK.
+	bool acceptReset_(TcpPacket &packet);
+
+	// Terminates the connection after a RST and reports error to the user.
+	void reset_(protocols::fs::Error error);
+
+	// Reduces the options that we offered in the SYN to the ones
+	// that the remote side supports (RFC 7323, RFC 2018).
+	void negotiateOptions_(const TcpOptions &options);
+
+	// Takes an RTT sample from the timestamps option (RFC 7323).
+	// Returns false if the segment does not allow such a sample.
+	bool sampleTimestampRtt_(TcpPacket &packet);
+
+	// Largest receive buffer whose size can be announced with our window scale.
+	int maxReceiveShift_() {
+		return std::min(maxBufferShift, 16 + rcvWscale_);
+	}
+
+	// Receive window that we can announce, rounded down to our window scale.
+	size_t receiveWindow_() {
+		auto window = std::min(recvRing_.spaceForEnqueue(), size_t{0xFFFF} << rcvWscale_);
+		return window & ~((size_t{1} << rcvWscale_) - 1);
+	}
+
+	uint32_t remoteWindow_(TcpPacket &packet) {
+		// The window in SYN segments is never scaled.
+		if(packet.header.flags.load() & TcpHeader::synFlag)
+			return packet.header.window.load();
+		return uint32_t{packet.header.window.load()} << sndWscale_;
+	}
+
+	// Grows the receive buffer if the application reads (almost) the whole window per RTT.
+	void tuneReceiveBuffer_(size_t copied);
+	// Grows the send buffer if it limits the amount of data in flight.
+	// Returns true if the buffer was grown.
+	bool tuneSendBuffer_();
+
+	void storeOutOfOrder_(uint32_t sn, arch::dma_buffer_view payload);
+	// Moves out-of-order data that became contiguous to recvRing_.
+	void drainOutOfOrder_();
+	size_t buildSackBlocks_(std::pair<uint32_t, uint32_t> *blocks, size_t maxBlocks);
+
+	// Merges the SACK blocks of a segment into the scoreboard.
+	// Returns true if new data was acknowledged selectively.
+	bool updateScoreboard_(const TcpOptions &options);
+	void trimScoreboard_();
+	// Returns the first range at or after sn that was not acknowledged selectively,
+	// as long as data after that range was acknowledged selectively.
+	std::optional<std::pair<uint32_t, uint32_t>> nextHole_(uint32_t sn);
 
 	void handleInPacket_(TcpPacket packet);
 
@@ -448,24 +1174,60 @@ private:
 
 	enum class ConnectState {
 		none,
+		listen, // Server-side only.
 		sendSyn, // Client-side only.
 		sendSynAck, // Server-side only.
 		connected,
+		closed,
 	};
 
 	Tcp4 *parent_;
+	// Worker that the socket lives on. Except for worker_ itself,
+	// members are only accessed on this worker.
+	Worker *worker_;
 	bool nonBlock_;
 	TcpEndpoint remoteEp_;
 	TcpEndpoint localEp_;
 	smarter::weak_ptr<Tcp4Socket> holder_;
+	// Set if localEp_ is registered in Tcp4::binds. Connections that are created by
+	// listening sockets share the local endpoint with the listening socket.
+	bool bound_ = false;
+	// Set if the socket is registered in Tcp4::connections under connectionKey_.
+	bool registered_ = false;
+	TcpConnectionKey connectionKey_;
+	// Set if the local port is pinned to this worker (see Tcp4::pinPort).
+	bool pinned_ = false;
 
 	ConnectState connectState_ = ConnectState::none;
 	bool remoteClosed_ = false;
+	// Set if the remote side refused or reset the connection.
+	protocols::fs::Error resetError_ = protocols::fs::Error::none;
+	bool localClosed_ = false;
+	// Our FIN is sent after all data in sendRing_; it occupies the Out-SN finSn_.
+	bool finSent_ = false;
+	bool finAcked_ = false;
+	uint32_t finSn_ = 0;
+	// Set if we sent our FIN before we received the remote FIN.
+	bool activeClose_ = false;
+	// Zero unless our FIN was acknowledged.
+	uint64_t timeWaitDeadline_ = 0;
+
+	// Listening sockets only.
+	std::deque<smarter::shared_ptr<Tcp4Socket>> synQueue_;
+	std::deque<smarter::shared_ptr<Tcp4Socket>> acceptQueue_;
+
+	// Connections that are created by listening sockets only.
+	// The listening socket may live on another worker.
+	smarter::weak_ptr<Tcp4Socket> listener_;
+	Worker *listenerWorker_ = nullptr;
 
 	// Out-SN corresponding to the front of sendRing_.
 	uint32_t localSettledSn_ = 0;
 	// Out-SN that has already been flushed to the IP layer (>= localSettledSn_).
+	// This is reset to localSettledSn_ when the retransmission timer expires.
 	uint32_t localFlushedSn_ = 0;
+	// Highest Out-SN that was ever flushed to the IP layer (>= localFlushedSn_).
+	uint32_t localHighestSn_ = 0;
 	// Out-SN of the end of the remote window (>= localSettledSn_).
 	uint32_t localWindowSn_ = 0;
 	// In-SN that we already acknowledged.
@@ -474,10 +1236,84 @@ private:
 	uint32_t remoteKnownSn_ = 0;
 	// Size of received window that we announced to the remote side.
 	uint32_t announcedWindow_ = 0;
+	// Set if we need to send an ACK even if remoteAckedSn_ is up-to-date.
+	bool ackPending_ = false;
+
+	// TCP options (RFC 7323, RFC 2018). Before the handshake, these are the options
+	// that we offer. Afterwards, they are the options that both sides agreed on.
+	bool wsOk_ = true;
+	bool sackOk_ = true;
+	bool tsOk_ = true;
+	// Scale of the windows that we announce.
+	int rcvWscale_ = 0;
+	// Scale of the windows that the remote side announces.
+	int sndWscale_ = 0;
+	// Timestamp that we echo to the remote side.
+	uint32_t tsRecent_ = 0;
+
+	// Received data beyond remoteKnownSn_.
+	struct OutOfOrderSegment {
+		uint32_t sn;
+		std::vector<char> data;
+	};
+	std::vector<OutOfOrderSegment> outOfOrder_;
+	// In-SN of the most recently received out-of-order segment.
+	uint32_t lastOutOfOrderSn_ = 0;
+
+	// Ranges of Out-SNs beyond localSettledSn_ that the remote side acknowledged
+	// selectively, sorted and non-overlapping.
+	std::vector<std::pair<uint32_t, uint32_t>> sacked_;
+	// Out-SN up to which holes were retransmitted during the current recovery.
+	uint32_t retransmitSn_ = 0;
+
+	// Buffers that are sized via SO_RCVBUF or SO_SNDBUF are not auto-tuned.
+	bool rcvBufLocked_ = false;
+	bool sndBufLocked_ = false;
+	// Amount of data that the application read since rcvTuneStart_.
+	uint64_t rcvTuneStart_ = 0;
+	size_t rcvTuneBytes_ = 0;
+
+	// Congestion control state (RFC 5681).
+	std::unique_ptr<TcpCongestionControl> cc_ = makeCongestionControl();
+	uint32_t mss_ = defaultMss;
+	uint32_t cwnd_ = defaultMss;
+	uint32_t ssthresh_ = UINT32_MAX;
+	// Whether the link of the last route supports TSO.
+	bool linkTso_ = false;
+	Ip4TargetCache targetCache_;
+
+	// Fast retransmit and NewReno fast recovery (RFC 6582).
+	unsigned int dupAcks_ = 0;
+	bool inRecovery_ = false;
+	// Highest Out-SN at the time loss recovery was entered.
+	uint32_t recoverSn_ = 0;
+	// Set if the first unacknowledged segment needs to be retransmitted.
+	bool retransmitPending_ = false;
+
+	// Retransmission timer (RFC 6298). All times are in nanoseconds.
+	uint64_t srtt_ = 0;
+	uint64_t rttvar_ = 0;
+	uint64_t rto_ = initialRto;
+	// Zero if the timer is not running.
+	uint64_t rtoDeadline_ = 0;
+	// Number of consecutive timeouts.
+	unsigned int backoffs_ = 0;
+	// Out-SN whose acknowledgement completes the current RTT sample.
+	// Retransmissions cancel the sample (Karn's algorithm).
+	bool rttTiming_ = false;
+	uint32_t rttSn_ = 0;
+	uint64_t rttStart_ = 0;
+
+	TcpStats stats_;
 
 	RingBuffer recvRing_;
 	RingBuffer sendRing_;
 
+	// Memory that holds both rings once they are shared with the client.
+	helix::UniqueDescriptor ringMemory_;
+	helix::Mapping ringMapping_;
+	protocols::fs::SocketRingHeader *ring_ = nullptr;
+
 	async::recurring_event inEvent_;
 	async::recurring_event flushEvent_;
 	async::recurring_event settleEvent_;
@@ -491,180 +1327,1092 @@ private:
 	async::recurring_event pollEvent_;
 };
 
-async::result<void> Tcp4Socket::flushOutPackets_() {
-	while(true) {
-		if(connectState_ == ConnectState::none) {
-			co_await flushEvent_.async_wait();
-			continue;
-		}
-
-		if(connectState_ == ConnectState::sendSyn) {
-			if(localSettledSn_ != localFlushedSn_) {
-				co_await flushEvent_.async_wait();
-				continue;
-			}
-
-			// Obtain a new random sequence number.
-			auto randomSn = globalPrng();
-			localSettledSn_ = randomSn;
-			localFlushedSn_ = randomSn;
+async::result<void> Tcp4Socket::waitForFlush_() {
+	auto deadline = rtoDeadline_;
+	if(timeWaitDeadline_ && (!deadline || timeWaitDeadline_ < deadline))
+		deadline = timeWaitDeadline_;
 
-			// Construct and transmit the initial SYN packet.
-			auto targetInfo = co_await ip4().targetByRemote(remoteEp_.ipAddress);
-			if (!targetInfo) {
-				// TODO: Return an error to users.
-				std::cout << "netserver: Destination unreachable" << std::endl;
-				co_return;
-			}
+	if(!deadline) {
+		co_await flushEvent_.async_wait();
+		co_return;
+	}
 
-			std::vector<char> buf;
-			buf.resize(sizeof(TcpHeader));
-
-			auto header = new (buf.data()) TcpHeader {
-				.srcPort = localEp_.port,
-				.destPort = remoteEp_.port,
-				.seqNumber = localFlushedSn_,
-				.ackNumber = 0,
-				.window = 0,
-				.checksum = 0,
-				.urgentPointer = 0
-			};
-			header->flags.store(TcpHeader::headerWords(sizeof(TcpHeader) / 4)
-					| TcpHeader::synFlag(true));
+	auto now = currentNanos();
+	if(now >= deadline)
+		co_return;
 
-			// Fill in the checksum.
-			PseudoHeader pseudo {
-				.src = targetInfo->source,
-				.dst = remoteEp_.ipAddress,
-				.len = buf.size()
-			};
-			Checksum csum;
-			csum.update(&pseudo, sizeof(PseudoHeader));
-			csum.update(buf.data(), buf.size());
-			header->checksum = csum.finalize();
+	async::cancellation_event ev;
+	helix::TimeoutCancellation timer{deadline - now, ev};
+	co_await flushEvent_.async_wait(ev);
+	co_await timer.retire();
+}
 
-			++localFlushedSn_;
+std::vector<char> Tcp4Socket::buildSegment_(const Ip4TargetInfo &targetInfo,
+		uint32_t sn, size_t offset, size_t length, bool syn, bool ack, bool fin) {
+	// Options take at most 40 bytes and are padded to a multiple of 4 bytes.
+	std::array<uint8_t, 40> options;
+	size_t optionsSize = 0;
+	auto put8 = [&] (uint8_t v) {
+		options[optionsSize++] = v;
+	};
+	auto put16 = [&] (uint16_t v) {
+		put8(v >> 8);
+		put8(v);
+	};
+	auto put32 = [&] (uint32_t v) {
+		put16(v >> 16);
+		put16(v);
+	};
+	auto putOption = [&] (TcpOption kind, uint8_t size) {
+		put8(static_cast<uint8_t>(kind));
+		put8(size);
+	};
+	auto putNoOp = [&] () {
+		put8(static_cast<uint8_t>(TcpOption::noOp));
+	};
 
-			if(debugTcp)
-				std::cout << "netserver: Sending TCP SYN" << std::endl;
-			auto error = co_await ip4().sendFrame(std::move(*targetInfo),
-				buf.data(), buf.size(), static_cast<uint16_t>(IpProto::tcp));
-			if (error != protocols::fs::Error::none) {
-				// TODO: Return an error to users.
-				std::cout << "netserver: Could not send TCP packet" << std::endl;
-				co_return;
+	if(syn) {
+		putOption(TcpOption::mss, 4);
+		put16(defaultMss);
+		if(wsOk_) {
+			putNoOp();
+			putOption(TcpOption::windowScale, 3);
+			put8(rcvWscale_);
+		}
+		if(sackOk_) {
+			if(!tsOk_) {
+				putNoOp();
+				putNoOp();
 			}
-		}else{
-			assert(connectState_ == ConnectState::connected);
-			size_t flushPointer = localFlushedSn_ - localSettledSn_;
-			size_t windowPointer = localWindowSn_ - localSettledSn_;
-
-			size_t bytesAvailable = sendRing_.availableToDequeue();
-			assert(bytesAvailable >= flushPointer);
+			putOption(TcpOption::sackPermitted, 2);
+		}
+	}
+	if(tsOk_) {
+		// In SYNs, the SACK-permitted option takes the place of the padding.
+		if(!syn || !sackOk_) {
+			putNoOp();
+			putNoOp();
+		}
+		putOption(TcpOption::timestamps, 10);
+		put32(timestampClock());
+		put32(tsRecent_);
+	}
+	if(!syn && sackOk_ && !outOfOrder_.empty()) {
+		std::array<std::pair<uint32_t, uint32_t>, 4> blocks;
+		auto numBlocks = buildSackBlocks_(blocks.data(), tsOk_ ? 3 : 4);
+		putNoOp();
+		putNoOp();
+		putOption(TcpOption::sack, 2 + 8 * numBlocks);
+		for(size_t i = 0; i < numBlocks; i++) {
+			put32(blocks[i].first);
+			put32(blocks[i].second);
+		}
+	}
+	assert(!(optionsSize % 4));
+
+	std::vector<char> buf;
+	buf.resize(sizeof(TcpHeader) + optionsSize + length);
+
+	// The window in SYN segments is never scaled (RFC 7323).
+	size_t window = syn ? std::min(recvRing_.spaceForEnqueue(), size_t{0xFFFF})
+			: receiveWindow_();
+
+	auto header = new (buf.data()) TcpHeader {
+		.srcPort = localEp_.port,
+		.destPort = remoteEp_.port,
+		.seqNumber = sn,
+		.ackNumber = ack ? remoteKnownSn_ : 0,
+		.window = static_cast<uint16_t>(window >> (syn ? 0 : rcvWscale_)),
+		.checksum = 0,
+		.urgentPointer = 0
+	};
+	header->flags.store(TcpHeader::headerWords((sizeof(TcpHeader) + optionsSize) / 4)
+			| TcpHeader::synFlag(syn) | TcpHeader::ackFlag(ack) | TcpHeader::finFlag(fin));
+	memcpy(buf.data() + sizeof(TcpHeader), options.data(), optionsSize);
+
+	if(length)
+		sendRing_.dequeueLookahead(offset, buf.data() + sizeof(TcpHeader) + optionsSize, length);
+
+	// Fill in the checksum. If the link computes it, it expects the
+	// sum of the pseudo header in the checksum field.
+	PseudoHeader pseudo {
+		.src = targetInfo.source,
+		.dst = remoteEp_.ipAddress,
+		.len = buf.size()
+	};
+	Checksum csum;
+	csum.update(&pseudo, sizeof(PseudoHeader));
+	if(offloadsChecksum(targetInfo)) {
+		header->checksum = static_cast<uint16_t>(~csum.finalize());
+	}else{
+		csum.update(buf.data(), buf.size());
+		header->checksum = csum.finalize();
+	}
 
-			// Check whether we need to send a packet.
-			// TODO: Add retransmission here.
-			bool wantData = (bytesAvailable > flushPointer && windowPointer > flushPointer);
-			bool wantAck = (remoteAckedSn_ != remoteKnownSn_);
-			bool wantWindowUpdate = (announcedWindow_ < recvRing_.spaceForEnqueue());
+	if(ack) {
+		remoteAckedSn_ = remoteKnownSn_;
+		announcedWindow_ = window;
+		ackPending_ = false;
+	}
+	return buf;
+}
 
-			if(!wantData && !wantAck && !wantWindowUpdate) {
-				co_await flushEvent_.async_wait();
+async::result<bool> Tcp4Socket::transmitSegment_(Ip4TargetInfo targetInfo,
+		std::vector<char> buf, size_t length) {
+	stats_.segmentsSent++;
+	stats_.bytesSent += length;
+
+	nic::TransmitOffload offload;
+	if(offloadsChecksum(targetInfo)) {
+		offload.needsCsum = true;
+		offload.csumOffset = offsetof(TcpHeader, checksum);
+		if(length > mss_) {
+			offload.segmentSize = mss_;
+			offload.headerLength = buf.size() - length;
+		}
+	}
+
+	auto error = co_await ip4().sendFrame(std::move(targetInfo),
+		buf.data(), buf.size(),
+		static_cast<uint16_t>(IpProto::tcp), offload);
+	if (error != protocols::fs::Error::none) {
+		// TODO: Return an error to users.
+		std::cout << "netserver: Could not send TCP packet" << std::endl;
+		co_return false;
+	}
+	co_return true;
+}
+
+void Tcp4Socket::sampleRtt_(uint64_t rtt) {
+	if(!srtt_) {
+		srtt_ = rtt;
+		rttvar_ = rtt / 2;
+	}else{
+		auto delta = srtt_ > rtt ? srtt_ - rtt : rtt - srtt_;
+		rttvar_ = (3 * rttvar_ + delta) / 4;
+		srtt_ = (7 * srtt_ + rtt) / 8;
+	}
+	rto_ = std::clamp(srtt_ + 4 * rttvar_, minRto, maxRto);
+}
+
+void Tcp4Socket::handleRetransmitTimeout_() {
+	stats_.timeouts++;
+	if(debugTcp)
+		std::cout << "netserver: TCP retransmission timeout" << std::endl;
+
+	// Only the first timeout of a series reduces ssthresh (RFC 5681).
+	if(!backoffs_)
+		ssthresh_ = cc_->onLoss(cwnd_, localHighestSn_ - localSettledSn_, mss_);
+	cwnd_ = mss_;
+
+	// Back off the timer (RFC 6298). It is restarted by the retransmission.
+	rto_ = std::min(2 * rto_, maxRto);
+	rtoDeadline_ = 0;
+	backoffs_++;
+
+	// Resend everything starting at the first unacknowledged byte.
+	// The remote side may have discarded selectively acknowledged data (RFC 2018).
+	localFlushedSn_ = localSettledSn_;
+	rttTiming_ = false;
+	dupAcks_ = 0;
+	inRecovery_ = false;
+	retransmitPending_ = false;
+	recoverSn_ = localHighestSn_;
+	sacked_.clear();
+}
+
+void Tcp4Socket::negotiateOptions_(const TcpOptions &options) {
+	// Window scaling is only used if both sides send the option.
+	if(wsOk_ && options.windowScale) {
+		sndWscale_ = *options.windowScale;
+	}else{
+		wsOk_ = false;
+		rcvWscale_ = 0;
+		sndWscale_ = 0;
+	}
+
+	sackOk_ = sackOk_ && options.sackPermitted;
+	tsOk_ = tsOk_ && options.hasTimestamps;
+	if(tsOk_)
+		tsRecent_ = options.tsVal;
+
+	// The MSS does not include options; timestamps are sent in every segment.
+	mss_ = std::min(defaultMss, options.mss ? uint32_t{*options.mss} : defaultRemoteMss);
+	if(tsOk_)
+		mss_ -= 12;
+	mss_ = std::max(mss_, uint32_t{64});
+}
+
+bool Tcp4Socket::sampleTimestampRtt_(TcpPacket &packet) {
+	if(!tsOk_ || !packet.options.hasTimestamps || !packet.options.tsEcr)
+		return false;
+
+	// Unlike Karn's algorithm, this also works for retransmitted segments.
+	auto ticks = std::max(timestampClock() - packet.options.tsEcr, uint32_t{1});
+	sampleRtt_(uint64_t{ticks} * 1'000'000);
+	rttTiming_ = false;
+	return true;
+}
+
+void Tcp4Socket::tuneReceiveBuffer_(size_t copied) {
+	if(rcvBufLocked_ || connectState_ != ConnectState::connected)
+		return;
+
+	auto now = currentNanos();
+	if(!rcvTuneStart_)
+		rcvTuneStart_ = now;
+	rcvTuneBytes_ += copied;
+	if(now - rcvTuneStart_ < (srtt_ ? srtt_ : rto_))
+		return;
+
+	// Similar to Linux' dynamic right-sizing: the remote side can only keep the
+	// link busy if the window is about twice the amount of data read per RTT.
+	auto shift = std::min(bufferShiftFor(2 * rcvTuneBytes_), maxReceiveShift_());
+	if(shift > recvRing_.shift()) {
+		if(debugTcp)
+			std::cout << "netserver: Growing TCP receive buffer to "
+					<< (size_t{1} << shift) << " bytes" << std::endl;
+		recvRing_.resize(shift);
+	}
+	rcvTuneStart_ = now;
+	rcvTuneBytes_ = 0;
+}
+
+bool Tcp4Socket::tuneSendBuffer_() {
+	if(sndBufLocked_ || connectState_ != ConnectState::connected
+			|| sendRing_.shift() >= maxBufferShift)
+		return false;
+
+	// Grow the buffer if the windows allow more data in flight than the buffer holds.
+	size_t window = std::min<size_t>(localWindowSn_ - localSettledSn_, cwnd_);
+	if(2 * window < sendRing_.capacity())
+		return false;
+
+	if(debugTcp)
+		std::cout << "netserver: Growing TCP send buffer to "
+				<< 2 * sendRing_.capacity() << " bytes" << std::endl;
+	return sendRing_.resize(sendRing_.shift() + 1);
+}
+
+void Tcp4Socket::storeOutOfOrder_(uint32_t sn, arch::dma_buffer_view payload) {
+	// Only keep data that fits into the receive window.
+	if(sn - remoteKnownSn_ + payload.size() > recvRing_.spaceForEnqueue())
+		return;
+
+	lastOutOfOrderSn_ = sn;
+	for(auto &segment : outOfOrder_) {
+		if(segment.sn == sn && segment.data.size() >= payload.size())
+			return;
+	}
+	if(outOfOrder_.size() >= maxOutOfOrderSegments)
+		return;
+
+	auto p = reinterpret_cast<const char *>(payload.data());
+	outOfOrder_.push_back({sn, std::vector<char>(p, p + payload.size())});
+}
+
+void Tcp4Socket::drainOutOfOrder_() {
+	bool progress = true;
+	while(progress) {
+		progress = false;
+		for(auto it = outOfOrder_.begin(); it != outOfOrder_.end(); ++it) {
+			if(seqLess(remoteKnownSn_, it->sn))
 				continue;
+
+			size_t skip = remoteKnownSn_ - it->sn;
+			if(skip < it->data.size()) {
+				size_t chunk = std::min(it->data.size() - skip, recvRing_.spaceForEnqueue());
+				recvRing_.enqueue(it->data.data() + skip, chunk);
+				remoteKnownSn_ += chunk;
+				stats_.bytesReceived += chunk;
+				announcedWindow_ -= std::min<uint32_t>(chunk, announcedWindow_);
 			}
+			outOfOrder_.erase(it);
+			progress = true;
+			break;
+		}
+	}
+}
 
-			// Construct and transmit the TCP packet.
-			auto targetInfo = co_await ip4().targetByRemote(remoteEp_.ipAddress);
-			if (!targetInfo) {
+size_t Tcp4Socket::buildSackBlocks_(std::pair<uint32_t, uint32_t> *blocks, size_t maxBlocks) {
+	// Merge the out-of-order segments into contiguous ranges.
+	std::vector<std::pair<uint32_t, uint32_t>> merged;
+	for(auto &segment : outOfOrder_)
+		merged.push_back({segment.sn, segment.sn + segment.data.size()});
+	mergeSeqRanges(merged);
+
+	// The first block must contain the most recently received segment (RFC 2018).
+	size_t n = 0;
+	for(auto range : merged) {
+		if(!seqLess(lastOutOfOrderSn_, range.first) && seqLess(lastOutOfOrderSn_, range.second)) {
+			blocks[n++] = range;
+			break;
+		}
+	}
+	for(auto range : merged) {
+		if(n == maxBlocks)
+			break;
+		if(n && range == blocks[0])
+			continue;
+		blocks[n++] = range;
+	}
+	return n;
+}
+
+bool Tcp4Socket::updateScoreboard_(const TcpOptions &options) {
+	if(!sackOk_ || !options.numSackBlocks)
+		return false;
+
+	auto coverage = [&] {
+		size_t bytes = 0;
+		for(auto [left, right] : sacked_)
+			bytes += right - left;
+		return bytes;
+	};
+	auto before = coverage();
+
+	for(size_t i = 0; i < options.numSackBlocks; i++) {
+		auto block = options.sackBlocks[i];
+		// Ignore blocks outside of the data in flight (including D-SACKs).
+		if(!seqLess(block.first, block.second)
+				|| seqLess(block.first, localSettledSn_)
+				|| seqLess(localHighestSn_, block.second))
+			continue;
+		sacked_.push_back(block);
+	}
+
+	mergeSeqRanges(sacked_);
+	return coverage() != before;
+}
+
+void Tcp4Socket::trimScoreboard_() {
+	auto it = sacked_.begin();
+	while(it != sacked_.end() && !seqLess(localSettledSn_, it->second))
+		++it;
+	sacked_.erase(sacked_.begin(), it);
+	if(!sacked_.empty() && seqLess(sacked_.front().first, localSettledSn_))
+		sacked_.front().first = localSettledSn_;
+}
+
+std::optional<std::pair<uint32_t, uint32_t>> Tcp4Socket::nextHole_(uint32_t sn) {
+	if(seqLess(sn, localSettledSn_))
+		sn = localSettledSn_;
+	for(auto [left, right] : sacked_) {
+		if(seqLess(sn, left))
+			return std::pair{sn, left};
+		if(seqLess(sn, right))
+			sn = right;
+	}
+	return std::nullopt;
+}
+
+async::result<void> Tcp4Socket::flushOutPackets_(smarter::shared_ptr<Tcp4Socket> self) {
+	while(true) {
+		if(connectState_ == ConnectState::closed)
+			co_return;
+
+		if(connectState_ == ConnectState::none || connectState_ == ConnectState::listen) {
+			co_await flushEvent_.async_wait();
+			continue;
+		}
+
+		if(connectState_ == ConnectState::sendSyn
+				|| connectState_ == ConnectState::sendSynAck) {
+			auto handshakeState = connectState_;
+			bool synAck = handshakeState == ConnectState::sendSynAck;
+
+			bool retransmit = false;
+			if(localSettledSn_ != localFlushedSn_) {
+				if(!rtoExpired_()) {
+					co_await waitForFlush_();
+					continue;
+				}
+
+				if(synAck && backoffs_ >= maxSynAckRetransmits) {
+					if(debugTcp)
+						std::cout << "netserver: Dropping half-open TCP connection" << std::endl;
+					dropHalfOpen_();
+					co_return;
+				}
+
+				// The SYN was lost; send it again with the same sequence number.
+				stats_.timeouts++;
+				rto_ = std::min(2 * rto_, maxRto);
+				rtoDeadline_ = 0;
+				backoffs_++;
+				rttTiming_ = false;
+				retransmit = true;
+			}
+
+			// Construct and transmit the initial SYN packet.
+			auto targetResult = co_await ip4().targetByRemote(remoteEp_.ipAddress, targetCache_);
+			if (!targetResult) {
 				// TODO: Return an error to users.
 				std::cout << "netserver: Destination unreachable" << std::endl;
 				co_return;
 			}
+			auto &targetInfo = targetResult.value();
 
-			auto chunk = std::min({
-				bytesAvailable - flushPointer,
-				windowPointer - flushPointer,
-				size_t{1000} // TODO: Perform path MTU discovery.
-			});
+			// The SYN-ACK (or the final ACK) might have arrived while we were waiting.
+			if(connectState_ != handshakeState)
+				continue;
+
+			if(!retransmit) {
+				// If the socket was bound explicitly, its 4-tuple may be steered
+				// to another worker. Pin the port so that the SYN-ACK reaches us.
+				TcpConnectionKey key{{targetInfo.source, localEp_.port}, remoteEp_};
+				if(!synAck && !pinned_ && &Worker::forTcpConnection(key) != worker_) {
+					pinned_ = parent_->pinPort(localEp_.port);
+					if(!pinned_)
+						std::cout << "netserver: Could not pin TCP port "
+								<< localEp_.port << " to this worker" << std::endl;
+				}
+
+				// Choose a window scale that can announce the largest receive buffer.
+				if(wsOk_)
+					rcvWscale_ = std::max(0,
+							(rcvBufLocked_ ? recvRing_.shift() : maxBufferShift) - 16);
+
+				// Obtain a new random sequence number.
+				auto randomSn = globalPrng();
+				localSettledSn_ = randomSn;
+				localFlushedSn_ = randomSn;
+				recoverSn_ = randomSn;
+				startRttSample_(randomSn + 1);
+			}else{
+				stats_.retransmits++;
+			}
 
-			std::vector<char> buf;
-			buf.resize(sizeof(TcpHeader) + chunk);
-
-			auto header = new (buf.data()) TcpHeader {
-				.srcPort = localEp_.port,
-				.destPort = remoteEp_.port,
-				.seqNumber = localFlushedSn_,
-				.ackNumber = remoteKnownSn_,
-				.window = std::min(recvRing_.spaceForEnqueue(), size_t{0xFFFF}),
-				.checksum = 0,
-				.urgentPointer = 0
+			auto buf = buildSegment_(targetInfo, localSettledSn_, 0, 0, true, synAck, false);
+			localFlushedSn_ = localSettledSn_ + 1; // SYN counts as one byte.
+			localHighestSn_ = localFlushedSn_;
+			rtoDeadline_ = currentNanos() + rto_;
+
+			if(debugTcp)
+				std::cout << "netserver: Sending TCP " << (synAck ? "SYN-ACK" : "SYN") << std::endl;
+			if(!co_await transmitSegment_(std::move(targetInfo), std::move(buf), 0))
+				co_return;
+		}else{
+			assert(connectState_ == ConnectState::connected);
+
+			if(finAcked_) {
+				// Bound FIN_WAIT_2 and TIME_WAIT together after an active close.
+				// After a passive close, nothing is left to do.
+				auto now = currentNanos();
+				if(!timeWaitDeadline_)
+					timeWaitDeadline_ = activeClose_ ? now + timeWaitDuration : now;
+				if(now >= timeWaitDeadline_) {
+					if(debugTcp)
+						std::cout << "netserver: TCP connection closed" << std::endl;
+					terminate_();
+					co_return;
+				}
+			}
+
+			if(rtoExpired_()) {
+				if(localHighestSn_ != localSettledSn_) {
+					if(localClosed_ && backoffs_ >= maxOrphanRetransmits) {
+						if(debugTcp)
+							std::cout << "netserver: Dropping closed TCP connection" << std::endl;
+						terminate_();
+						co_return;
+					}
+					handleRetransmitTimeout_();
+				}else{
+					rtoDeadline_ = 0;
+				}
+			}
+
+			// Determines the next segment that we need to send (if any).
+			struct Segment {
+				uint32_t sn;
+				size_t length;
+				bool retransmit;
+				bool fastRetransmit;
+				bool fin;
 			};
-			header->flags.store(TcpHeader::headerWords(sizeof(TcpHeader) / 4)
-					| TcpHeader::ackFlag(true));
+			auto nextSegment = [&] () -> std::optional<Segment> {
+				// The FIN occupies one Out-SN but no space in sendRing_.
+				bool finFlushed = finSent_ && !finAcked_ && localFlushedSn_ == finSn_ + 1;
+				size_t flushPointer = localFlushedSn_ - localSettledSn_ - finFlushed;
+				size_t bytesAvailable = sendRing_.availableToDequeue();
+				assert(bytesAvailable >= flushPointer);
+
+				// Retransmissions that end at the FIN carry the FIN again.
+				auto endsAtFin = [&] (uint32_t sn, size_t length) {
+					return finSent_ && !finAcked_ && sn + length == finSn_;
+				};
+
+				if(retransmitPending_) {
+					if(!sacked_.empty()) {
+						// Retransmit the next range that was not acknowledged selectively.
+						if(auto hole = nextHole_(retransmitSn_); hole) {
+							size_t length = std::min({size_t{hole->second - hole->first},
+									size_t{mss_},
+									bytesAvailable - size_t{hole->first - localSettledSn_}});
+							return Segment{hole->first, length, true, true,
+									endsAtFin(hole->first, length)};
+						}
+					}else{
+						size_t outstanding = localHighestSn_ - localSettledSn_;
+						if(outstanding) {
+							size_t length = std::min({outstanding, bytesAvailable, size_t{mss_}});
+							return Segment{localSettledSn_, length, true, true,
+									endsAtFin(localSettledSn_, length)};
+						}
+					}
+					retransmitPending_ = false;
+				}
 
-			sendRing_.dequeueLookahead(flushPointer, buf.data() + sizeof(TcpHeader), chunk);
+				// Up to min(cwnd, rwnd) bytes may be in flight.
+				size_t windowPointer = std::min<size_t>(localWindowSn_ - localSettledSn_, cwnd_);
+				if(bytesAvailable > flushPointer && windowPointer > flushPointer) {
+					auto chunk = std::min({
+						bytesAvailable - flushPointer,
+						windowPointer - flushPointer,
+						maxSegmentPayload_()
+					});
+					return Segment{localFlushedSn_, chunk,
+							seqLess(localFlushedSn_, localHighestSn_), false, false};
+				}
 
-			// Fill in the checksum.
-			PseudoHeader pseudo {
-				.src = targetInfo->source,
-				.dst = remoteEp_.ipAddress,
-				.len = buf.size()
+				// Send the FIN once all data is flushed. It does not need window space.
+				if(localClosed_ && !finAcked_ && !finFlushed && bytesAvailable == flushPointer)
+					return Segment{localFlushedSn_, 0, finSent_, false, true};
+
+				// Send pure ACKs and window updates.
+				if(ackPending_ || remoteAckedSn_ != remoteKnownSn_
+						|| announcedWindow_ < receiveWindow_())
+					return Segment{localFlushedSn_, 0, false, false, false};
+				return std::nullopt;
 			};
-			Checksum csum;
-			csum.update(&pseudo, sizeof(PseudoHeader));
-			csum.update(buf.data(), buf.size());
-			header->checksum = csum.finalize();
 
-			localFlushedSn_ += chunk;
-			remoteAckedSn_ = remoteKnownSn_;
-			announcedWindow_ = recvRing_.spaceForEnqueue();
+			if(!nextSegment()) {
+				co_await waitForFlush_();
+				continue;
+			}
 
-			if(debugTcp)
-				std::cout << "netserver: Sending TCP data (" << chunk << " bytes)" << std::endl;
-			auto error = co_await ip4().sendFrame(std::move(*targetInfo),
-				buf.data(), buf.size(),
-				static_cast<uint16_t>(IpProto::tcp));
-			if (error != protocols::fs::Error::none) {
+			// Construct and transmit the TCP packet.
+			auto targetResult = co_await ip4().targetByRemote(remoteEp_.ipAddress, targetCache_);
+			if (!targetResult) {
 				// TODO: Return an error to users.
-				std::cout << "netserver: Could not send TCP packet" << std::endl;
+				std::cout << "netserver: Destination unreachable" << std::endl;
 				co_return;
 			}
+			auto &targetInfo = targetResult.value();
+			linkTso_ = targetInfo.link->capabilities & nic::LINK_CAP_TSO4;
+
+			// Incoming packets might have changed the state while we were waiting.
+			if(connectState_ != ConnectState::connected)
+				continue;
+			auto segment = nextSegment();
+			if(!segment)
+				continue;
+
+			auto buf = buildSegment_(targetInfo, segment->sn,
+					segment->sn - localSettledSn_, segment->length, false, true, segment->fin);
+
+			if(segment->length) {
+				if(segment->retransmit) {
+					stats_.retransmits++;
+					rttTiming_ = false;
+				}else if(!rttTiming_) {
+					startRttSample_(segment->sn + segment->length);
+				}
+
+				if(segment->fastRetransmit) {
+					retransmitSn_ = segment->sn + segment->length;
+					retransmitPending_ = false;
+				}else{
+					localFlushedSn_ += segment->length;
+					if(seqLess(localHighestSn_, localFlushedSn_))
+						localHighestSn_ = localFlushedSn_;
+				}
+
+				if(!rtoDeadline_)
+					rtoDeadline_ = currentNanos() + rto_;
+			}
+
+			if(segment->fin) {
+				if(!finSent_) {
+					finSent_ = true;
+					finSn_ = segment->sn;
+					activeClose_ = !remoteClosed_;
+				}else if(!segment->length) {
+					stats_.retransmits++;
+				}
+
+				if(segment->fastRetransmit) {
+					retransmitSn_ = finSn_ + 1;
+					retransmitPending_ = false;
+				}else{
+					localFlushedSn_ = finSn_ + 1;
+					if(seqLess(localHighestSn_, localFlushedSn_))
+						localHighestSn_ = localFlushedSn_;
+				}
+
+				if(!rtoDeadline_)
+					rtoDeadline_ = currentNanos() + rto_;
+			}
+
+			if(debugTcp)
+				std::cout << "netserver: Sending TCP data (" << segment->length << " bytes"
+						<< (segment->retransmit ? ", retransmit" : "")
+						<< (segment->fin ? ", FIN" : "") << ")" << std::endl;
+			if(!co_await transmitSegment_(std::move(targetInfo), std::move(buf),
+					segment->length))
+				co_return;
+		}
+	}
+}
+
+void Tcp4Socket::handleAck_(TcpPacket &packet) {
+	auto ackNumber = packet.header.ackNumber.load();
+	auto window = remoteWindow_(packet);
+
+	size_t validWindow = localHighestSn_ - localSettledSn_;
+	size_t ackPointer = ackNumber - localSettledSn_;
+	if(ackPointer > validWindow) {
+		std::cout << "netserver: Rejecting ack-number outside of valid window"
+				<< std::endl;
+		return;
+	}
+
+	bool sackUpdate = updateScoreboard_(packet.options);
+
+	if(!ackPointer) {
+		// RFC 5681 defines a duplicate ACK as an ACK that carries no data
+		// and does not change the window while data is outstanding.
+		bool isDuplicate = !packet.payload().size()
+				&& !(packet.header.flags.load() & TcpHeader::synFlag)
+				&& !(packet.header.flags.load() & TcpHeader::finFlag)
+				&& localWindowSn_ == localSettledSn_ + window
+				&& localHighestSn_ != localSettledSn_;
+		localWindowSn_ = localSettledSn_ + window;
+
+		if(isDuplicate) {
+			stats_.dupAcks++;
+			dupAcks_++;
+			if(inRecovery_) {
+				// Each duplicate ACK signals that a segment left the network.
+				// With SACK, we also know which segment needs to be retransmitted next.
+				cwnd_ += mss_;
+				if(sackUpdate)
+					retransmitPending_ = true;
+			}else if(dupAcks_ == dupAckThreshold && seqLess(recoverSn_, ackNumber)) {
+				if(debugTcp)
+					std::cout << "netserver: TCP fast retransmit" << std::endl;
+				stats_.fastRetransmits++;
+				ssthresh_ = cc_->onLoss(cwnd_, localHighestSn_ - localSettledSn_, mss_);
+				cwnd_ = ssthresh_ + dupAckThreshold * mss_;
+				recoverSn_ = localHighestSn_;
+				retransmitSn_ = localSettledSn_;
+				inRecovery_ = true;
+				retransmitPending_ = true;
+			}
+		}
+		flushEvent_.raise();
+		return;
+	}
+
+	// The FIN occupies one Out-SN but no space in sendRing_.
+	size_t dataPointer = ackPointer;
+	if(finSent_ && !finAcked_ && !seqLess(ackNumber, finSn_ + 1)) {
+		dataPointer = finSn_ - localSettledSn_;
+		finAcked_ = true;
+	}
+
+	localSettledSn_ += ackPointer;
+	localWindowSn_ = localSettledSn_ + window;
+	sendRing_.dequeueAdvance(dataPointer);
+	if(seqLess(localFlushedSn_, localSettledSn_))
+		localFlushedSn_ = localSettledSn_;
+	if(seqLess(retransmitSn_, localSettledSn_))
+		retransmitSn_ = localSettledSn_;
+	trimScoreboard_();
+
+	auto now = currentNanos();
+	if(!sampleTimestampRtt_(packet) && rttTiming_ && !seqLess(localSettledSn_, rttSn_)) {
+		sampleRtt_(now - rttStart_);
+		rttTiming_ = false;
+	}
+	backoffs_ = 0;
+
+	if(inRecovery_) {
+		if(!seqLess(ackNumber, recoverSn_)) {
+			// Full acknowledgement: leave fast recovery.
+			uint32_t flightSize = localHighestSn_ - localSettledSn_;
+			cwnd_ = std::min(ssthresh_, std::max(flightSize, mss_) + mss_);
+			inRecovery_ = false;
+			dupAcks_ = 0;
+		}else{
+			// Partial acknowledgement: the next segment was lost as well.
+			// Deflate the window by the amount of acknowledged data (RFC 6582).
+			cwnd_ -= std::min<uint32_t>(ackPointer, cwnd_);
+			if(ackPointer >= mss_)
+				cwnd_ += mss_;
+			retransmitPending_ = true;
+		}
+	}else{
+		dupAcks_ = 0;
+		cc_->onAck(cwnd_, ssthresh_, mss_, ackPointer);
+	}
+
+	// Restart the timer if data is still outstanding (RFC 6298).
+	if(localSettledSn_ == localHighestSn_) {
+		rtoDeadline_ = 0;
+	}else{
+		rtoDeadline_ = now + rto_;
+	}
+
+	publishRing_();
+	outSeq_ = ++currentSeq_;
+	flushEvent_.raise();
+	settleEvent_.raise();
+	pollEvent_.raise();
+}
+
+void Tcp4Socket::completeHandshake_(TcpPacket &packet) {
+	if(!sampleTimestampRtt_(packet)) {
+		if(rttTiming_) {
+			sampleRtt_(currentNanos() - rttStart_);
+			rttTiming_ = false;
+		}else if(backoffs_ && !srtt_) {
+			// The SYN was retransmitted and we have no RTT sample (RFC 6298, 5.7).
+			rto_ = 3'000'000'000;
+		}
+	}
+
+	// Initial window (RFC 5681); only one segment if the SYN was lost.
+	cwnd_ = backoffs_ ? mss_ : std::min(4 * mss_, std::max(2 * mss_, uint32_t{4380}));
+	backoffs_ = 0;
+	rtoDeadline_ = 0;
+
+	++localSettledSn_;
+	localWindowSn_ = localSettledSn_ + remoteWindow_(packet);
+	retransmitSn_ = localSettledSn_;
+	connectState_ = ConnectState::connected;
+	flushEvent_.raise();
+	settleEvent_.raise();
+}
+
+template<typename F>
+void Tcp4Socket::withListener_(F f) {
+	listenerWorker_->dispatch([listener = listener_, child = holder_.lock(),
+			f = std::move(f)] () mutable {
+		auto locked = listener.lock();
+		if(!locked) {
+			child->worker_->dispatch([child] {
+				child->close_();
+			});
+			return;
+		}
+		f(locked.get(), std::move(child));
+	});
+}
+
+void Tcp4Socket::handleSyn_(TcpPacket &packet) {
+	auto flags = packet.header.flags.load();
+	if(flags & TcpHeader::rstFlag) {
+		return;
+	}else if(flags & TcpHeader::ackFlag) {
+		// The segment belongs to a connection that does not exist (anymore).
+		std::cout << "netserver: Rejecting packet with ACK [listen]"
+				<< std::endl;
+		sendReset(packet);
+		return;
+	}else if(!(flags & TcpHeader::synFlag)) {
+		std::cout << "netserver: Rejecting packet without SYN [listen]"
+				<< std::endl;
+		return;
+	}
+
+	// The remote side retransmits the SYN if we drop it.
+	if(synQueue_.size() >= synBacklog || acceptQueue_.size() >= acceptBacklog) {
+		if(debugTcp)
+			std::cout << "netserver: TCP backlog is full, dropping SYN" << std::endl;
+		return;
+	}
+
+	ConnectionRequest request{
+		.key = {
+			.local = {packet.packet->header.destination, localEp_.port},
+			.remote = {packet.packet->header.source, packet.header.srcPort.load()}
+		},
+		.remoteSn = packet.header.seqNumber.load(),
+		.options = packet.options,
+		.listener = holder_,
+		.listenerWorker = worker_,
+		// Connections inherit explicitly sized buffers from the listening socket.
+		.recvShift = rcvBufLocked_ ? recvRing_.shift() : -1,
+		.sendShift = sndBufLocked_ ? sendRing_.shift() : -1
+	};
+
+	// The connection lives on the worker that its segments are steered to.
+	auto &worker = Worker::forTcpConnection(request.key);
+	worker.dispatch([request = std::move(request)] () mutable {
+		spawnConnection_(std::move(request));
+	});
+}
+
+void Tcp4Socket::spawnConnection_(ConnectionRequest request) {
+	auto child = makeSocket(&ip4().tcp4(), false);
+	child->localEp_ = request.key.local;
+	child->remoteEp_ = request.key.remote;
+	child->listener_ = std::move(request.listener);
+	child->listenerWorker_ = request.listenerWorker;
+	child->remoteAckedSn_ = request.remoteSn;
+	child->remoteKnownSn_ = request.remoteSn + 1; // SYN counts as one byte.
+	child->negotiateOptions_(request.options);
+	child->connectState_ = ConnectState::sendSynAck;
+
+	if(request.recvShift >= 0) {
+		child->recvRing_.resize(request.recvShift);
+		child->rcvBufLocked_ = true;
+	}
+	if(request.sendShift >= 0) {
+		child->sendRing_.resize(request.sendShift);
+		child->sndBufLocked_ = true;
+	}
+	// Fails if this is a retransmitted SYN of an existing connection.
+	if(!child->parent_->registerConnection(child, request.key)) {
+		child->terminate_();
+		return;
+	}
+
+	child->flushEvent_.raise();
+	child->withListener_([] (Tcp4Socket *listener, smarter::shared_ptr<Tcp4Socket> connection) {
+		if(listener->connectState_ != ConnectState::listen) {
+			connection->worker_->dispatch([connection] {
+				connection->terminate_();
+			});
+			return;
 		}
+		listener->synQueue_.push_back(std::move(connection));
+	});
+}
+
+void Tcp4Socket::enqueueAccepted_(smarter::shared_ptr<Tcp4Socket> child) {
+	auto it = std::find_if(synQueue_.begin(), synQueue_.end(), [&] (const auto &s) {
+		return s.get() == child.get();
+	});
+	if(it == synQueue_.end()) {
+		// The listening socket was closed in the meantime.
+		child->worker_->dispatch([child] {
+			child->close_();
+		});
+		return;
+	}
+	synQueue_.erase(it);
+	acceptQueue_.push_back(std::move(child));
+
+	inSeq_ = ++currentSeq_;
+	inEvent_.raise();
+	pollEvent_.raise();
+}
+
+void Tcp4Socket::dropHalfOpen_() {
+	withListener_([] (Tcp4Socket *listener, smarter::shared_ptr<Tcp4Socket> child) {
+		auto it = std::find_if(listener->synQueue_.begin(), listener->synQueue_.end(),
+				[&] (const auto &s) { return s.get() == child.get(); });
+		if(it != listener->synQueue_.end())
+			listener->synQueue_.erase(it);
+	});
+	terminate_();
+}
+
+void Tcp4Socket::close_() {
+	localClosed_ = true;
+	if(bound_) {
+		parent_->unbind(localEp_);
+		bound_ = false;
+	}
+
+	if(connectState_ == ConnectState::listen) {
+		// Connections that were not accepted yet are closed as well.
+		for(auto &child : synQueue_)
+			child->worker_->dispatch([child] {
+				child->terminate_();
+			});
+		for(auto &child : acceptQueue_)
+			child->worker_->dispatch([child] {
+				child->close_();
+			});
+		synQueue_.clear();
+		acceptQueue_.clear();
+		terminate_();
+	}else if(connectState_ == ConnectState::connected) {
+		// flushOutPackets_() sends the FIN and terminates the connection.
+		flushEvent_.raise();
+	}else{
+		terminate_();
+	}
+}
+
+void Tcp4Socket::terminate_() {
+	if(registered_)
+		parent_->unregisterConnection(connectionKey_);
+	if(pinned_) {
+		parent_->unpinPort(localEp_.port);
+		pinned_ = false;
+	}
+	connectState_ = ConnectState::closed;
+	rtoDeadline_ = 0;
+	flushEvent_.raise();
+	settleEvent_.raise();
+}
+
+bool Tcp4Socket::acceptReset_(TcpPacket &packet) {
+	auto sn = packet.header.seqNumber.load();
+	if(sn == remoteKnownSn_)
+		return true;
+	if(sn - remoteKnownSn_ < announcedWindow_) {
+		ackPending_ = true;
+		flushEvent_.raise();
 	}
+	return false;
+}
+
+void Tcp4Socket::reset_(protocols::fs::Error error) {
+	resetError_ = error;
+
+	// Connections that were not accepted yet leave the accept queue.
+	if(listenerWorker_) {
+		listenerWorker_->dispatch([listener = listener_, child = holder_.lock()] {
+			auto locked = listener.lock();
+			if(!locked)
+				return;
+			auto it = std::find_if(locked->acceptQueue_.begin(), locked->acceptQueue_.end(),
+					[&] (const auto &s) { return s.get() == child.get(); });
+			if(it != locked->acceptQueue_.end())
+				locked->acceptQueue_.erase(it);
+		});
+	}
+	terminate_();
+
+	inSeq_ = ++currentSeq_;
+	outSeq_ = ++currentSeq_;
+	hupSeq_ = ++currentSeq_;
+	inEvent_.raise();
+	pollEvent_.raise();
 }
 
 void Tcp4Socket::handleInPacket_(TcpPacket packet) {
-	if(connectState_ == ConnectState::sendSyn) {
+	stats_.segmentsReceived++;
+
+	if(connectState_ == ConnectState::none || connectState_ == ConnectState::closed) {
+		// The socket is bound but has no connection.
+		sendReset(packet);
+		return;
+	}else if(connectState_ == ConnectState::listen) {
+		handleSyn_(packet);
+		return;
+	}else if(connectState_ == ConnectState::sendSyn) {
 		if(localSettledSn_ == localFlushedSn_) {
 			std::cout << "netserver: Rejecting packet before SYN is sent [sendSyn]"
 					<< std::endl;
 			return;
 		}
 
-		if(!(packet.header.flags.load() & TcpHeader::synFlag)) {
+		auto flags = packet.header.flags.load();
+		if((flags & TcpHeader::ackFlag)
+				&& packet.header.ackNumber.load() != localSettledSn_ + 1) {
+			std::cout << "netserver: Rejecting packet with bad ack-number [sendSyn]"
+					<< std::endl;
+			sendReset(packet);
+			return;
+		}
+
+		if(flags & TcpHeader::rstFlag) {
+			// Only RSTs that acknowledge our SYN refuse the connection.
+			if(flags & TcpHeader::ackFlag) {
+				if(debugTcp)
+					std::cout << "netserver: TCP connection refused" << std::endl;
+				reset_(protocols::fs::Error::connectionRefused);
+			}
+			return;
+		}else if(!(flags & TcpHeader::synFlag)) {
 			std::cout << "netserver: Rejecting packet without SYN [sendSyn]"
 					<< std::endl;
 			return;
-		}else if(!(packet.header.flags.load() & TcpHeader::ackFlag)) {
+		}else if(!(flags & TcpHeader::ackFlag)) {
 			std::cout << "netserver: Rejecting SYN packet without ACK [sendSyn]"
 					<< std::endl;
 			return;
 		}
 
+		remoteAckedSn_ = packet.header.seqNumber.load();
+		remoteKnownSn_ = packet.header.seqNumber.load() + 1; // SYN counts as one byte.
+		negotiateOptions_(packet.options);
+
+		// From now on, segments are demultiplexed by the full 4-tuple.
+		parent_->registerConnection(holder_.lock(),
+				{{packet.packet->header.destination, localEp_.port}, remoteEp_});
+		completeHandshake_(packet);
+		return;
+	}else if(connectState_ == ConnectState::sendSynAck) {
+		if(packet.header.flags.load() & TcpHeader::rstFlag) {
+			// The connection returns to the listening socket, i.e., it is dropped.
+			if(acceptReset_(packet)) {
+				if(debugTcp)
+					std::cout << "netserver: Half-open TCP connection was reset" << std::endl;
+				dropHalfOpen_();
+			}
+			return;
+		}else if(packet.header.flags.load() & TcpHeader::synFlag) {
+			// The remote side retransmitted its SYN; the SYN-ACK is retransmitted
+			// once our retransmission timer expires.
+			return;
+		}else if(!(packet.header.flags.load() & TcpHeader::ackFlag)) {
+			std::cout << "netserver: Rejecting packet without ACK [sendSynAck]"
+					<< std::endl;
+			return;
+		}
+
+		if(localSettledSn_ == localFlushedSn_) {
+			std::cout << "netserver: Rejecting packet before SYN-ACK is sent [sendSynAck]"
+					<< std::endl;
+			return;
+		}
+
 		if(packet.header.ackNumber.load() != localSettledSn_ + 1) {
-			std::cout << "netserver: Rejecting packet with bad ack-number [sendSyn]"
+			std::cout << "netserver: Rejecting packet with bad ack-number [sendSynAck]"
 					<< std::endl;
+			sendReset(packet);
 			return;
 		}
 
-		++localSettledSn_;
-		localWindowSn_ = localSettledSn_ + packet.header.window.load();
-		remoteAckedSn_ = packet.header.seqNumber.load();
-		remoteKnownSn_ = packet.header.seqNumber.load() + 1; // SYN counts as one byte.
-		connectState_ = ConnectState::connected;
-		flushEvent_.raise();
-		settleEvent_.raise();
-	}else if(connectState_ == ConnectState::connected) {
+		completeHandshake_(packet);
+		withListener_([] (Tcp4Socket *listener, smarter::shared_ptr<Tcp4Socket> child) {
+			listener->enqueueAccepted_(std::move(child));
+		});
+		// Fall through: the final ACK may already carry data.
+	}
+
+	if(connectState_ == ConnectState::connected) {
+		if(packet.header.flags.load() & TcpHeader::rstFlag) {
+			if(acceptReset_(packet)) {
+				if(debugTcp)
+					std::cout << "netserver: TCP connection was reset" << std::endl;
+				reset_(protocols::fs::Error::connectionReset);
+			}
+			return;
+		}
+
+		if(tsOk_ && packet.options.hasTimestamps) {
+			// Protection against wrapped sequence numbers (RFC 7323, 5):
+			// drop segments with old timestamps but acknowledge them.
+			if(seqLess(packet.options.tsVal, tsRecent_)) {
+				if(packet.payload().size()) {
+					ackPending_ = true;
+					flushEvent_.raise();
+				}
+				return;
+			}
+			if(!seqLess(remoteAckedSn_, packet.header.seqNumber.load()))
+				tsRecent_ = packet.options.tsVal;
+		}
+
 		if(packet.header.seqNumber.load() == remoteKnownSn_) {
 			bool gotUpdate = false;
 
@@ -673,11 +2421,14 @@ void Tcp4Socket::handleInPacket_(TcpPacket packet) {
 			if(chunk) {
 				recvRing_.enqueue(payload.data(), chunk);
 				remoteKnownSn_ += chunk;
+				stats_.bytesReceived += chunk;
 				if(announcedWindow_ < chunk) {
 					announcedWindow_ = 0;
 				}else{
 					announcedWindow_ -= chunk;
 				}
+				drainOutOfOrder_();
+				publishRing_();
 
 				inSeq_ = ++currentSeq_;
 				gotUpdate = true;
@@ -696,23 +2447,22 @@ void Tcp4Socket::handleInPacket_(TcpPacket packet) {
 				flushEvent_.raise();
 				pollEvent_.raise();
 			}
+		}else if(packet.payload().size()) {
+			// Out-of-order data: send an immediate duplicate ACK so that
+			// the remote side can detect the loss (RFC 5681, 4.2).
+			// The data is kept and reported in SACK blocks.
+			if(seqLess(remoteKnownSn_, packet.header.seqNumber.load()))
+				storeOutOfOrder_(packet.header.seqNumber.load(), packet.payload());
+			ackPending_ = true;
+			flushEvent_.raise();
+		}else if(remoteClosed_ && (packet.header.flags.load() & TcpHeader::finFlag)) {
+			// The remote side retransmitted its FIN; our ACK was lost.
+			ackPending_ = true;
+			flushEvent_.raise();
 		}
 
-		if(packet.header.flags.load() & TcpHeader::ackFlag) {
-			size_t validWindow = localFlushedSn_ - localSettledSn_;
-			size_t ackPointer = packet.header.ackNumber.load() - localSettledSn_;
-			if(ackPointer <= validWindow) {
-				localSettledSn_ += ackPointer;
-				localWindowSn_ = localSettledSn_ + packet.header.window.load();
-				sendRing_.dequeueAdvance(ackPointer);
-				outSeq_ = ++currentSeq_;
-				settleEvent_.raise();
-				pollEvent_.raise();
-			}else{
-				std::cout << "netserver: Rejecting ack-number outside of valid window"
-						<< std::endl;
-			}
-		}
+		if(packet.header.flags.load() & TcpHeader::ackFlag)
+			handleAck_(packet);
 	}
 }
 
@@ -727,15 +2477,27 @@ void Tcp4::feedDatagram(smarter::shared_ptr<const Ip4Packet> packet) {
 		std::cout << "netserver: Received TCP packet at port " << tcp.header.destPort.load()
 				<< " (" << tcp.payload().size() << " bytes)" << std::endl;
 
+	TcpConnectionKey key{
+		.local = {tcp.packet->header.destination, tcp.header.destPort.load()},
+		.remote = {tcp.packet->header.source, tcp.header.srcPort.load()}
+	};
+	if (auto it = connections.find(key); it != connections.end()) {
+		it->second->handleInPacket_(std::move(tcp));
+		return;
+	}
+
 	auto it = binds.lower_bound({ 0, tcp.header.destPort.load() });
 	for (; it != binds.end() && it->first.port == tcp.header.destPort.load(); it++) {
 		auto existingEp = it->first;
 		if (existingEp.ipAddress == tcp.packet->header.destination
 				|| existingEp.ipAddress == INADDR_ANY) {
 			it->second->handleInPacket_(std::move(tcp));
-			break;
+			return;
 		}
 	}
+
+	// No socket is bound to the port.
+	sendReset(tcp);
 }
 
 bool Tcp4::tryBind(smarter::shared_ptr<Tcp4Socket> socket, TcpEndpoint wantedEp) {
@@ -747,18 +2509,83 @@ bool Tcp4::tryBind(smarter::shared_ptr<Tcp4Socket> socket, TcpEndpoint wantedEp)
 			return false;
 		}
 	}
+	if (!acquirePort(wantedEp.port))
+		return false;
 	socket->localEp_ = wantedEp;
+	socket->bound_ = true;
 	binds.emplace(wantedEp, std::move(socket));
 	return true;
 }
 
 bool Tcp4::unbind(TcpEndpoint e) {
-	return binds.erase(e) != 0;
+	if (!binds.erase(e))
+		return false;
+	releasePort(e.port);
+	return true;
+}
+
+bool Tcp4::registerConnection(smarter::shared_ptr<Tcp4Socket> socket, TcpConnectionKey key) {
+	auto raw = socket.get();
+	if (!connections.emplace(key, std::move(socket)).second)
+		return false;
+	raw->connectionKey_ = key;
+	raw->registered_ = true;
+	return true;
+}
+
+bool Tcp4::unregisterConnection(TcpConnectionKey key) {
+	auto it = connections.find(key);
+	if (it == connections.end())
+		return false;
+	it->second->registered_ = false;
+	connections.erase(it);
+	return true;
+}
+
+bool Tcp4::acquirePort(uint16_t port) {
+	auto &users = portUsers[port];
+	if (!users && !Worker::claimPort(IpProto::tcp, port)) {
+		portUsers.erase(port);
+		return false;
+	}
+	users++;
+	return true;
+}
+
+void Tcp4::releasePort(uint16_t port) {
+	auto it = portUsers.find(port);
+	assert(it != portUsers.end());
+	if (--it->second)
+		return;
+	portUsers.erase(it);
+	Worker::releasePort(IpProto::tcp, port);
+}
+
+bool Tcp4::pinPort(uint16_t port) {
+	auto &users = pinUsers[port];
+	if (!users && !Worker::pinTcpPort(port)) {
+		pinUsers.erase(port);
+		return false;
+	}
+	users++;
+	return true;
+}
+
+void Tcp4::unpinPort(uint16_t port) {
+	auto it = pinUsers.find(port);
+	assert(it != pinUsers.end());
+	if (--it->second)
+		return;
+	pinUsers.erase(it);
+	Worker::unpinTcpPort(port);
 }
 
 void Tcp4::serveSocket(int flags, helix::UniqueLane lane) {
 	using protocols::fs::servePassthrough;
 	auto sock = Tcp4Socket::makeSocket(this, flags & SOCK_NONBLOCK);
-	async::detach(servePassthrough(std::move(lane), std::move(sock),
-			&Tcp4Socket::ops));
+	async::detach(servePassthrough(std::move(lane), sock,
+			&Tcp4Socket::ops),
+		[sock] {
+			sock->close_();
+		});
 }
@@ -3,6 +3,7 @@
 #include <helix/ipc.hpp>
 #include <smarter.hpp>
 #include <map>
+#include <unordered_map>
 
 class Ip4Packet;
 
@@ -11,18 +12,65 @@ struct TcpEndpoint {
 		return std::tie(l.port, l.ipAddress) < std::tie(r.port, r.ipAddress);
 	}
 
+	friend bool operator==(const TcpEndpoint &l, const TcpEndpoint &r) {
+		return l.port == r.port && l.ipAddress == r.ipAddress;
+	}
+
 	uint32_t ipAddress = 0;
 	uint16_t port = 0;
 };
 
+// Identifies an established (or half-open) connection by its 4-tuple.
+struct TcpConnectionKey {
+	friend bool operator==(const TcpConnectionKey &l, const TcpConnectionKey &r) {
+		return l.local == r.local && l.remote == r.remote;
+	}
+
+	TcpEndpoint local;
+	TcpEndpoint remote;
+};
+
+struct TcpConnectionKeyHash {
+	size_t operator()(const TcpConnectionKey &k) const {
+		uint64_t ips = (uint64_t{k.local.ipAddress} << 32) | k.remote.ipAddress;
+		uint32_t ports = (uint32_t{k.local.port} << 16) | k.remote.port;
+		return std::hash<uint64_t>{}(ips) ^ (std::hash<uint32_t>{}(ports) * 0x9E3779B97F4A7C15);
+	}
+};
+
 struct Tcp4Socket;
 
 struct Tcp4 {
 	void feedDatagram(smarter::shared_ptr<const Ip4Packet>);
 	bool tryBind(smarter::shared_ptr<Tcp4Socket> socket, TcpEndpoint ipAddress);
 	bool unbind(TcpEndpoint remote);
+	bool registerConnection(smarter::shared_ptr<Tcp4Socket> socket, TcpConnectionKey key);
+	bool unregisterConnection(TcpConnectionKey key);
 	void serveSocket(int flags, helix::UniqueLane lane);
 
+	// Pins the local port to this worker (see Worker::pinTcpPort),
+	// counting the connections that need the pin.
+	bool pinPort(uint16_t port);
+	void unpinPort(uint16_t port);
+
 private:
+	// Claims the local port for this worker (see Worker::claimPort),
+	// counting the binds that use it.
+	bool acquirePort(uint16_t port);
+	void releasePort(uint16_t port);
+
+	// Sockets that are bound to a local endpoint. Incoming segments that do not
+	// belong to a connection in connections are delivered to these sockets.
 	std::map<TcpEndpoint, smarter::shared_ptr<Tcp4Socket>> binds;
+
+	// Connections that completed (or are completing) the handshake.
+	std::unordered_map<TcpConnectionKey, smarter::shared_ptr<Tcp4Socket>,
+			TcpConnectionKeyHash> connections;
+
+	// Number of binds that use each local port. Connections do not claim their
+	// port since their segments are steered by their 4-tuple.
+	std::unordered_map<uint16_t, unsigned int> portUsers;
+
+	// Number of connections that pinned each local port.
+	std::unordered_map<uint16_t, unsigned int> pinUsers;
 };
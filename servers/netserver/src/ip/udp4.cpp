@@ -2,12 +2,14 @@
 
 #include "ip4.hpp"
 #include "checksum.hpp"
+#include "../worker.hpp"
 
 #include <async/basic.hpp>
 #include <async/result.hpp>
 #include <async/queue.hpp>
 #include <arch/bit.hpp>
 #include <protocols/fs/server.hpp>
+#include <cstddef>
 #include <cstring>
 #include <iomanip>
 #include <random>
@@ -16,6 +18,8 @@
 #include <netinet/ip.h>
 
 namespace {
+constexpr bool debugUdp = false;
+
 struct stl_allocator {
 	void *allocate(size_t size) {
 		return operator new(size);
@@ -79,7 +83,7 @@ struct Udp {
 		if (payload.size() < header.len) {
 			return false;
 		}
-		if (header.chk != 0) {
+		if (header.chk != 0 && !packet->checksumValid) {
 			PseudoHeader phdr;
 			phdr.src = packet->header.source;
 			phdr.dst = packet->header.destination;
@@ -290,42 +294,54 @@ struct Udp4Socket {
 		source.ensureEndian();
 		target.ensureEndian();
 
-		auto ti = co_await ip4().targetByRemote(targetIpNe);
+		auto ti = co_await ip4().targetByRemote(targetIpNe, self->targetCache_);
 		if (!ti) {
-			co_return protocols::fs::Error::netUnreachable;
+			co_return ti.error();
 		}
 
 		Checksum chk;
 		PseudoHeader psh {
-			.src = convert_endian<endian::big>(ti->source),
+			.src = convert_endian<endian::big>(ti.value().source),
 			.dst = target.addr,
 			.len = header.len
 		};
 		chk.update(&psh, sizeof(psh));
-		chk.update(&header, sizeof(header));
-		chk.update(data, len);
-		header.chk = convert_endian<endian::big>(chk.finalize());
 
-		std::cout << "netserver:" << std::endl << std::hex
-			<< std::setw(8) << psh.src << std::endl
-			<< std::setw(8) << psh.dst << std::endl
-			<< std::setw(8) << psh.len << std::endl
+		// let the link compute the checksum if it can
+		nic::TransmitOffload offload;
+		if (ti.value().link->capabilities & nic::LINK_CAP_TX_CSUM) {
+			offload.needsCsum = true;
+			offload.csumOffset = offsetof(Udp::Header, chk);
+			header.chk = convert_endian<endian::big>(
+				static_cast<uint16_t>(~chk.finalize()));
+		} else {
+			chk.update(&header, sizeof(header));
+			chk.update(data, len);
+			header.chk = convert_endian<endian::big>(chk.finalize());
+		}
+
+		if (debugUdp) {
+			std::cout << "netserver:" << std::endl << std::hex
+				<< std::setw(8) << psh.src << std::endl
+				<< std::setw(8) << psh.dst << std::endl
+				<< std::setw(8) << psh.len << std::endl
 
-			<< std::setw(8) << header.src << std::endl
-			<< std::setw(8) << header.dst << std::endl
-			<< std::setw(8) << header.len << std::endl
-			<< std::setw(8) << header.chk << std::endl << std::dec;
+				<< std::setw(8) << header.src << std::endl
+				<< std::setw(8) << header.dst << std::endl
+				<< std::setw(8) << header.len << std::endl
+				<< std::setw(8) << header.chk << std::endl << std::dec;
+		}
 
-		if (header.chk == 0) {
+		if (!offload.needsCsum && header.chk == 0) {
 			header.chk = ~header.chk;
 		}
 
 		std::memcpy(buf.data(), &header, sizeof(header));
 		std::memcpy(buf.data() + sizeof(header), data, len);
 
-		auto error = co_await ip4().sendFrame(std::move(*ti),
+		auto error = co_await ip4().sendFrame(std::move(ti.value()),
 			buf.data(), buf.size(),
-			static_cast<uint16_t>(IpProto::udp));
+			static_cast<uint16_t>(IpProto::udp), offload);
 		if (error != protocols::fs::Error::none) {
 			co_return error;
 		}
@@ -341,8 +357,8 @@ struct Udp4Socket {
 	};
 
 	bool bindAvailable(uint32_t addr = INADDR_ANY) {
-		static std::mt19937 rng;
-		static std::uniform_int_distribution<uint16_t> dist {
+		thread_local std::mt19937 rng;
+		thread_local std::uniform_int_distribution<uint16_t> dist {
 			32768, 60999
 		};
 		// TODO(arsen): this rng probably is suboptimal, at some point
@@ -371,6 +387,7 @@ private:
 	async::queue<Udp, stl_allocator> queue_;
 	Endpoint remote_;
 	Endpoint local_;
+	Ip4TargetCache targetCache_;
 	Udp4 *parent_;
 	smarter::weak_ptr<Udp4Socket> holder_;
 };
@@ -382,7 +399,9 @@ void Udp4::feedDatagram(smarter::shared_ptr<const Ip4Packet> packet) {
 		return;
 	}
 
-	std::cout << "received udp datagram to port " << udp.header.dst << std::endl;
+	if (debugUdp) {
+		std::cout << "received udp datagram to port " << udp.header.dst << std::endl;
+	}
 
 	auto i = binds.lower_bound({ 0, udp.header.dst });
 	for (; i != binds.end() && i->first.port == udp.header.dst; i++) {
@@ -404,13 +423,26 @@ bool Udp4::tryBind(smarter::shared_ptr<Udp4Socket> socket, Endpoint addr) {
 			return false;
 		}
 	}
+	// the first bind on a port steers its datagrams to this worker
+	auto j = binds.lower_bound({ 0, addr.port });
+	bool first = j == binds.end() || j->first.port != addr.port;
+	if (first && !Worker::claimPort(IpProto::udp, addr.port)) {
+		return false;
+	}
 	socket->local_ = addr;
 	binds.emplace(addr, std::move(socket));
 	return true;
 }
 
 bool Udp4::unbind(Endpoint e) {
-	return binds.erase(e) != 0;
+	if (!binds.erase(e)) {
+		return false;
+	}
+	auto i = binds.lower_bound({ 0, e.port });
+	if (i == binds.end() || i->first.port != e.port) {
+		Worker::releasePort(IpProto::udp, e.port);
+	}
+	return true;
 }
 
 void Udp4::serveSocket(helix::UniqueLane lane) {
@@ -0,0 +1,73 @@
+#include "loopback.hpp"
+
+#include <async/recurring-event.hpp>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <vector>
+
+namespace {
+
+// Loopback frames never leave the CPU, so ordinary heap memory is sufficient.
+// Unlike DMA pools of NICs, this pool may be used by any thread.
+struct HeapPool final : arch::dma_pool {
+	void *allocate(size_t size, size_t count, size_t align) override {
+		return operator new(size * count, std::align_val_t{align});
+	}
+
+	void deallocate(void *pointer, size_t, size_t, size_t align) override {
+		operator delete(pointer, std::align_val_t{align});
+	}
+};
+
+struct LoopbackLink final : nic::Link {
+	LoopbackLink();
+
+	async::result<void> receive(std::vector<ReceivedFrame> &frames) override;
+	async::result<void> send(const arch::dma_buffer_view,
+		nic::TransmitOffload offload) override;
+
+private:
+	HeapPool pool_;
+	// Frames that were sent but not yet received.
+	std::vector<ReceivedFrame> pending_;
+	async::recurring_event doorbell_;
+};
+
+LoopbackLink::LoopbackLink()
+	: nic::Link(nic::maxTsoPacketSize, &pool_) {
+	// Checksums and segmentation are not needed on the loopback link;
+	// the receiving side treats all frames as verified.
+	capabilities = nic::LINK_CAP_TX_CSUM | nic::LINK_CAP_RX_CSUM
+		| nic::LINK_CAP_TSO4 | nic::LINK_CAP_LOOPBACK;
+}
+
+async::result<void> LoopbackLink::receive(std::vector<ReceivedFrame> &frames) {
+	while (pending_.empty())
+		co_await doorbell_.async_wait();
+
+	for (auto &frame : pending_)
+		frames.push_back(std::move(frame));
+	pending_.clear();
+}
+
+async::result<void> LoopbackLink::send(const arch::dma_buffer_view payload,
+		nic::TransmitOffload) {
+	// The caller frees its buffer once we return.
+	arch::dma_buffer buffer { &pool_, payload.size() };
+	std::memcpy(buffer.data(), payload.data(), payload.size());
+	auto frame = buffer.subview(0);
+	pending_.push_back({ std::move(buffer), frame, true });
+	doorbell_.raise();
+	co_return;
+}
+
+} // namespace
+
+namespace nic::loopback {
+
+std::shared_ptr<nic::Link> makeShared() {
+	return std::make_shared<LoopbackLink>();
+}
+
+} // namespace nic::loopback
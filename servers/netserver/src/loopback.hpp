@@ -0,0 +1,8 @@
+#pragma once
+
+#include <netserver/nic.hpp>
+
+namespace nic::loopback {
+// Link that delivers every frame sent on it back to this host.
+std::shared_ptr<nic::Link> makeShared();
+} // namespace nic::loopback
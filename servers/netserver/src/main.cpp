@@ -3,12 +3,16 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <algorithm>
 #include <iostream>
 #include <memory>
 #include <queue>
+#include <sstream>
 #include <vector>
 
+#include <async/promise.hpp>
 #include <async/result.hpp>
+#include <frg/std_compat.hpp>
 #include <hel.h>
 #include <hel-syscalls.h>
 #include <helix/ipc.hpp>
@@ -17,9 +21,12 @@
 #include <protocols/svrctl/server.hpp>
 #include <protocols/fs/server.hpp>
 #include <sys/socket.h>
+#include <kerncfg.pb.h>
 #include "fs.bragi.hpp"
 
 #include "ip/ip4.hpp"
+#include "loopback.hpp"
+#include "worker.hpp"
 
 #include <netserver/nic.hpp>
 #include <nic/virtio/virtio.hpp>
@@ -27,6 +34,19 @@
 // Maps mbus IDs to device objects
 std::unordered_map<int64_t, std::shared_ptr<nic::Link>> baseDeviceMap;
 
+std::shared_ptr<nic::Link> loopbackDevice;
+
+void setupLoopback() {
+	loopbackDevice = nic::loopback::makeShared();
+	Worker::broadcast([device = loopbackDevice] {
+		// 127.0.0.0/8
+		ip4Router().addRoute({ { 0x7f000000, 8 }, device });
+		// inet 127.0.0.1/8
+		ip4().setLink({ 0x7f000001, 8 }, device);
+	});
+	nic::runDevice(loopbackDevice);
+}
+
 async::result<void> doBind(mbus::Entity base_entity, virtio_core::DiscoverMode discover_mode) {
 	protocols::hw::Device hwDevice(co_await base_entity.bind());
 	co_await hwDevice.enableBusmaster();
@@ -34,16 +54,24 @@ async::result<void> doBind(mbus::Entity base_entity, virtio_core::DiscoverMode d
 
 	auto device = nic::virtio::makeShared(std::move(transport));
 	if (baseDeviceMap.empty()) {
-		// default via 10.0.2.2 src 10.10.2.15
-		Ip4Router::Route wan { { 0, 0 }, device };
-		wan.gateway = 0x0a000202;
-		wan.source = 0x0a0a020f;
-		ip4Router().addRoute(std::move(wan));
-
-		// 10.0.2.0/24
-		ip4Router().addRoute({ { 0x0a000200, 24 }, device });
-		// inet 10.10.2.15/24
-		ip4().setLink({ 0x0a0a020f, 24 }, device);
+		// Every worker has its own routing table.
+		Worker::broadcast([device, loopback = loopbackDevice] {
+			// default via 10.0.2.2 src 10.10.2.15
+			Ip4Router::Route wan { { 0, 0 }, device };
+			wan.gateway = 0x0a000202;
+			wan.source = 0x0a0a020f;
+			ip4Router().addRoute(std::move(wan));
+
+			// 10.0.2.0/24
+			ip4Router().addRoute({ { 0x0a000200, 24 }, device });
+			// inet 10.10.2.15/24
+			ip4().setLink({ 0x0a0a020f, 24 }, device);
+
+			// Traffic to our own address does not leave the host.
+			Ip4Router::Route local { { 0x0a0a020f, 32 }, loopback };
+			local.source = 0x0a0a020f;
+			ip4Router().addRoute(std::move(local));
+		});
 	}
 	baseDeviceMap.insert({base_entity.getId(), device});
 	nic::runDevice(device);
@@ -118,8 +146,14 @@ async::detached serve(helix::UniqueLane lane) {
 				continue;
 			}
 
-			auto err = ip4().serveSocket(std::move(local_lane),
-					req.type(), req.protocol(), req.flags());
+			// The socket is served by the worker that owns it.
+			managarm::fs::Errors err;
+			co_await runOn(Worker::forSocket(req.type()),
+					[&] () -> async::result<void> {
+				err = ip4().serveSocket(std::move(local_lane),
+						req.type(), req.protocol(), req.flags());
+				co_return;
+			});
 			if (err != managarm::fs::Errors::SUCCESS) {
 				co_await sendError(err);
 				continue;
@@ -169,6 +203,71 @@ static constexpr protocols::svrctl::ControlOperations controlOps = {
 	.bind = bindDevice
 };
 
+struct CmdlineOptions {
+	// Number of threads that run the protocol stack (netserver.workers=<n>).
+	// TCP connections are distributed among them by their 4-tuple, other
+	// sockets by their local port. If zero (the default), the stack runs on
+	// the main thread, which always drives the NICs.
+	unsigned int numWorkerThreads = 0;
+	// Drop every n-th TCP segment on loopback links (netserver.loopback_loss=<n>).
+	// Used by the tcp_loopback_loss test of posix-tests.
+	unsigned int loopbackLoss = 0;
+};
+
+// Reads the options of netserver from the kernel command line.
+async::result<CmdlineOptions> getCmdlineOptions() {
+	auto root = co_await mbus::Instance::global().getRoot();
+
+	auto filter = mbus::Conjunction({
+		mbus::EqualsFilter("class", "kerncfg")
+	});
+
+	async::promise<helix::UniqueLane, frg::stl_allocator> promise;
+	auto future = promise.get_future();
+
+	auto handler = mbus::ObserverHandler{}
+	.withAttach([&promise] (mbus::Entity entity,
+			mbus::Properties properties) mutable -> async::detached {
+		promise.set_value(helix::UniqueLane(co_await entity.bind()));
+	});
+
+	co_await root.linkObserver(std::move(filter), std::move(handler));
+	auto lane = std::move(*(co_await future.get()));
+
+	managarm::kerncfg::CntRequest req;
+	req.set_req_type(managarm::kerncfg::CntReqType::GET_CMDLINE);
+
+	auto ser = req.SerializeAsString();
+	auto [offer, send_req, recv_resp, recv_cmdline] =
+		co_await helix_ng::exchangeMsgs(lane,
+			helix_ng::offer(
+				helix_ng::sendBuffer(ser.data(), ser.size()),
+				helix_ng::recvInline(),
+				helix_ng::recvInline()
+			)
+		);
+	HEL_CHECK(offer.error());
+	HEL_CHECK(send_req.error());
+	HEL_CHECK(recv_resp.error());
+	HEL_CHECK(recv_cmdline.error());
+
+	managarm::kerncfg::SvrResponse resp;
+	resp.ParseFromArray(recv_resp.data(), recv_resp.length());
+	assert(resp.error() == managarm::kerncfg::Error::SUCCESS);
+
+	CmdlineOptions options;
+	std::istringstream cmdline{std::string{reinterpret_cast<const char *>(recv_cmdline.data()),
+			recv_cmdline.length()}};
+	std::string token;
+	while(cmdline >> token) {
+		if(!token.compare(0, 18, "netserver.workers="))
+			options.numWorkerThreads = std::min(strtoul(token.c_str() + 18, nullptr, 10), 64ul);
+		else if(!token.compare(0, 24, "netserver.loopback_loss="))
+			options.loopbackLoss = strtoul(token.c_str() + 24, nullptr, 10);
+	}
+	co_return options;
+}
+
 // --------------------------------------------------------
 // main() function
 // --------------------------------------------------------
@@ -178,6 +277,19 @@ int main() {
 
 //	HEL_CHECK(helSetPriority(kHelThisThread, 3));
 
+	auto options = async::run(getCmdlineOptions(), helix::currentDispatcher);
+	if(options.numWorkerThreads)
+		printf("netserver: Running the protocol stack on %u threads\n", options.numWorkerThreads);
+	Worker::initialize(options.numWorkerThreads);
+	setupLoopback();
+	if(options.loopbackLoss) {
+		printf("netserver: Dropping one in %u TCP segments on loopback links\n",
+				options.loopbackLoss);
+		Worker::broadcast([n = options.loopbackLoss] {
+			ip4().setLoopbackLoss(n);
+		});
+	}
+
 	async::detach(protocols::svrctl::serveControl(&controlOps));
 	advertise();
 	async::run_forever(helix::currentDispatcher);
@@ -2,9 +2,11 @@
 
 #include <algorithm>
 #include <cstring>
+#include <memory>
 #include <arch/bit.hpp>
 #include "ip/ip4.hpp"
 #include "ip/arp.hpp"
+#include "worker.hpp"
 
 namespace nic {
 uint8_t &MacAddress::operator[](size_t idx) {
@@ -52,26 +54,51 @@ Link::AllocatedBuffer Link::allocateFrame(MacAddress to, EtherType type,
 }
 
 async::detached runDevice(std::shared_ptr<nic::Link> dev) {
-	using namespace arch;
+	std::vector<Link::ReceivedFrame> batch;
 	while(true) {
-		dma_buffer frameBuffer { dev->dmaPool(), 1514 };
-		co_await dev->receive(frameBuffer);
-		auto capsule = frameBuffer.subview(14);
-		auto data = reinterpret_cast<uint8_t*>(frameBuffer.data());
-		uint16_t ethertype = data[12] << 8 | data[13];
-		nic::MacAddress dstsrc[2];
-		std::memcpy(dstsrc, data, sizeof(dstsrc));
+		batch.clear();
+		co_await dev->receive(batch);
+
+		// Frames that are not passed on are freed here, which returns
+		// their buffers to the link's receive pool.
+		for (auto &[buffer, frame, checksumValid] : batch) {
+			if (frame.size() < 14)
+				continue;
+
+			auto capsule = frame.subview(14);
+			auto data = reinterpret_cast<uint8_t*>(frame.data());
+			uint16_t ethertype = data[12] << 8 | data[13];
+			nic::MacAddress dstsrc[2];
+			std::memcpy(dstsrc, data, sizeof(dstsrc));
 
-		switch (ethertype) {
-		case ETHER_TYPE_IP4:
-			ip4().feedPacket(dstsrc[0], dstsrc[1],
-				std::move(frameBuffer), capsule);
-			break;
-		case ETHER_TYPE_ARP:
-			neigh4().feedArp(dstsrc[0], capsule);
-			break;
-		default:
-			break;
+			switch (ethertype) {
+			case ETHER_TYPE_IP4:
+				// the buffer is handed over to the worker without copying
+				Worker::forIp4Packet(capsule).dispatch(
+					[dst = dstsrc[0], src = dstsrc[1], buffer = std::move(buffer),
+						capsule, checksumValid] () mutable {
+					ip4().feedPacket(dst, src, std::move(buffer),
+						capsule, checksumValid);
+				});
+				break;
+			case ETHER_TYPE_ARP: {
+				// each worker has its own neighbour table
+				if (Worker::numShards() == 1
+						&& &Worker::shard(0) == &Worker::current()) {
+					neigh4().feedArp(dstsrc[0], capsule);
+					break;
+				}
+				auto copy = std::make_shared<std::vector<char>>(
+					capsule.byte_data(), capsule.byte_data() + capsule.size());
+				Worker::broadcast([dst = dstsrc[0], copy] {
+					neigh4().feedArp(dst, arch::dma_buffer_view{
+						nullptr, copy->data(), copy->size()});
+				});
+				break;
+			}
+			default:
+				break;
+			}
 		}
 	}
 }
@@ -0,0 +1,236 @@
+#include <sys/socket.h>
+#include <future>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <async/result.hpp>
+#include <hel.h>
+#include <hel-syscalls.h>
+
+#include "worker.hpp"
+#include "ip/ip4.hpp"
+
+thread_local Worker *Worker::current_ = nullptr;
+
+namespace {
+	Worker mainWorker;
+
+	// Workers that own a protocol stack. Contains only mainWorker if no
+	// worker threads are started.
+	std::vector<std::unique_ptr<Worker>> workerThreads;
+	std::vector<Worker *> shards;
+
+	// Round-robin counter for new sockets. Only used on the main thread.
+	size_t nextSocketShard = 0;
+
+	// For each local TCP and UDP port, the index of the owning shard plus one
+	// (or zero if the port is not in use). Written by the shards when they
+	// bind sockets, read by the main thread when it steers incoming packets.
+	std::atomic<uint8_t> tcpPortOwners[65536];
+	std::atomic<uint8_t> udpPortOwners[65536];
+	// Like tcpPortOwners, but for ports that are pinned to a shard.
+	std::atomic<uint8_t> tcpPinnedPorts[65536];
+
+	std::atomic<uint8_t> *portOwners(IpProto proto) {
+		switch(proto) {
+		case IpProto::tcp: return tcpPortOwners;
+		case IpProto::udp: return udpPortOwners;
+		default: return nullptr;
+		}
+	}
+
+	size_t connectionShard(const TcpConnectionKey &key) {
+		uint64_t x = (uint64_t{key.local.ipAddress} << 32) | key.remote.ipAddress;
+		x ^= ((uint64_t{key.local.port} << 16) | key.remote.port) * 0x9E3779B97F4A7C15;
+		// Finalizer of splitmix64; mixes all bits of the 4-tuple into the low bits.
+		x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9;
+		x = (x ^ (x >> 27)) * 0x94D049BB133111EB;
+		x ^= x >> 31;
+		return x % shards.size();
+	}
+} // namespace
+
+void Worker::initialize(unsigned int numThreads) {
+	assert(!current_);
+	current_ = &mainWorker;
+	mainWorker.queue_ = helix::Dispatcher::global().acquire();
+
+	// We store shard indices in a uint8_t.
+	assert(numThreads < 256);
+	if(!numThreads) {
+		shards.push_back(&mainWorker);
+		return;
+	}
+
+	for(unsigned int i = 0; i < numThreads; i++) {
+		auto worker = std::make_unique<Worker>();
+		worker->index_ = i;
+		worker->start_();
+		shards.push_back(worker.get());
+		workerThreads.push_back(std::move(worker));
+	}
+}
+
+Worker &Worker::main() {
+	return mainWorker;
+}
+
+size_t Worker::numShards() {
+	return shards.size();
+}
+
+Worker &Worker::shard(size_t index) {
+	return *shards[index];
+}
+
+Worker &Worker::forSocket(int type) {
+	// Raw sockets receive all packets of a protocol, regardless of the port.
+	// They live on the first shard, which also handles all traffic
+	// that is not steered by port.
+	if(type == SOCK_RAW)
+		return *shards[0];
+	return *shards[nextSocketShard++ % shards.size()];
+}
+
+Worker &Worker::forIp4Packet(arch::dma_buffer_view packet) {
+	if(shards.size() == 1)
+		return *shards[0];
+
+	auto bytes = reinterpret_cast<const uint8_t *>(packet.data());
+	if(packet.size() < 20)
+		return *shards[0];
+	size_t ihl = (bytes[0] & 0xF) * 4;
+	uint16_t fragment = (bytes[6] << 8) | bytes[7];
+	auto proto = static_cast<IpProto>(bytes[9]);
+	auto owners = portOwners(proto);
+
+	// Only the first fragment carries the TCP or UDP header.
+	// Fragments are handled by the first shard.
+	if(!owners || ihl < 20 || (fragment & 0x3FFF) || packet.size() < ihl + 4)
+		return *shards[0];
+
+	// TCP and UDP both store the source port at offset 0
+	// and the destination port at offset 2.
+	uint16_t srcPort = (bytes[ihl] << 8) | bytes[ihl + 1];
+	uint16_t port = (bytes[ihl + 2] << 8) | bytes[ihl + 3];
+
+	if(proto == IpProto::tcp) {
+		if(packet.size() < ihl + 14)
+			return *shards[0];
+
+		auto pinned = tcpPinnedPorts[port].load(std::memory_order_relaxed);
+		if(pinned)
+			return *shards[pinned - 1];
+
+		// SYNs without ACK open new connections. They go to the worker of the
+		// listening socket, which hands the connection to forTcpConnection().
+		uint8_t flags = bytes[ihl + 13];
+		if((flags & 0x12) == 0x02) {
+			auto owner = owners[port].load(std::memory_order_relaxed);
+			if(owner)
+				return *shards[owner - 1];
+		}
+
+		auto load32 = [] (const uint8_t *p) -> uint32_t {
+			return (uint32_t{p[0]} << 24) | (uint32_t{p[1]} << 16) | (uint32_t{p[2]} << 8) | p[3];
+		};
+		TcpConnectionKey key{
+			.local = {load32(bytes + 16), port},
+			.remote = {load32(bytes + 12), srcPort}
+		};
+		return *shards[connectionShard(key)];
+	}
+
+	auto owner = owners[port].load(std::memory_order_relaxed);
+	if(owner)
+		return *shards[owner - 1];
+	// Nobody listens on that port. Spread the resulting
+	// port unreachable messages over all shards.
+	return *shards[port % shards.size()];
+}
+
+Worker &Worker::forTcpConnection(const TcpConnectionKey &key) {
+	if(shards.size() == 1)
+		return *shards[0];
+	return *shards[connectionShard(key)];
+}
+
+bool Worker::claimPort(IpProto proto, uint16_t port) {
+	auto owners = portOwners(proto);
+	assert(owners);
+	uint8_t self = current().index_ + 1;
+	uint8_t expected = 0;
+	if(owners[port].compare_exchange_strong(expected, self, std::memory_order_relaxed))
+		return true;
+	return expected == self;
+}
+
+void Worker::releasePort(IpProto proto, uint16_t port) {
+	auto owners = portOwners(proto);
+	assert(owners);
+	uint8_t self = current().index_ + 1;
+	assert(owners[port].load(std::memory_order_relaxed) == self);
+	owners[port].store(0, std::memory_order_relaxed);
+}
+
+bool Worker::pinTcpPort(uint16_t port) {
+	uint8_t self = current().index_ + 1;
+	uint8_t expected = 0;
+	if(tcpPinnedPorts[port].compare_exchange_strong(expected, self, std::memory_order_relaxed))
+		return true;
+	return expected == self;
+}
+
+void Worker::unpinTcpPort(uint16_t port) {
+	uint8_t self = current().index_ + 1;
+	assert(tcpPinnedPorts[port].load(std::memory_order_relaxed) == self);
+	tcpPinnedPorts[port].store(0, std::memory_order_relaxed);
+}
+
+void Worker::start_() {
+	std::promise<HelHandle> queue;
+	auto future = queue.get_future();
+	std::thread{[this, queue = std::move(queue)] () mutable {
+		current_ = this;
+		queue.set_value(helix::Dispatcher::global().acquire());
+		async::run_forever(helix::currentDispatcher);
+	}}.detach();
+	queue_ = future.get();
+}
+
+void Worker::post_(TaskBase *task) {
+	auto head = incoming_.load(std::memory_order_relaxed);
+	do {
+		task->next = head;
+	} while(!incoming_.compare_exchange_weak(head, task,
+			std::memory_order_acq_rel, std::memory_order_relaxed));
+
+	// Only submit a nop if none is pending already.
+	if(!notified_.exchange(true, std::memory_order_acq_rel))
+		HEL_CHECK(helSubmitAsyncNop(queue_,
+				reinterpret_cast<uintptr_t>(static_cast<helix::Context *>(this))));
+}
+
+void Worker::complete(helix::ElementHandle) {
+	// Clear the flag before draining. Tasks that are posted after the exchange
+	// below submit another nop, so none of them is missed.
+	notified_.store(false, std::memory_order_seq_cst);
+	auto head = incoming_.exchange(nullptr, std::memory_order_acq_rel);
+
+	// The stack is in LIFO order; run the tasks in the order that they were posted.
+	TaskBase *ordered = nullptr;
+	while(head) {
+		auto next = head->next;
+		head->next = ordered;
+		ordered = head;
+		head = next;
+	}
+
+	while(ordered) {
+		auto next = ordered->next;
+		ordered->run();
+		delete ordered;
+		ordered = next;
+	}
+}
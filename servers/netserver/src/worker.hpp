@@ -0,0 +1,154 @@
+#pragma once
+
+#include <arch/dma_structs.hpp>
+#include <async/oneshot-event.hpp>
+#include <async/result.hpp>
+#include <helix/ipc.hpp>
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <utility>
+
+enum class IpProto : uint16_t;
+struct TcpConnectionKey;
+
+// A thread that runs its own dispatcher. Each worker owns a complete instance
+// of the protocol stack (see ip4(), ip4Router() and neigh4()). TCP connections
+// are sharded among the workers by a hash of their 4-tuple; all other sockets
+// and incoming packets are sharded by their local port.
+//
+// The main thread is a worker as well. It drives the NICs and serves mbus and
+// svrctl requests. If no worker threads are started, it also runs the only
+// instance of the protocol stack.
+struct Worker : private helix::Context {
+	// Must be called on the main thread before any other function of Worker.
+	static void initialize(unsigned int numThreads);
+
+	// The worker that the calling thread belongs to.
+	static Worker &current() {
+		assert(current_);
+		return *current_;
+	}
+
+	static Worker &main();
+
+	// Workers that run a protocol stack.
+	static size_t numShards();
+	static Worker &shard(size_t index);
+
+	// Worker that a new socket of the given type is created on.
+	static Worker &forSocket(int type);
+
+	// Worker that handles an incoming IPv4 packet (without ethernet header).
+	static Worker &forIp4Packet(arch::dma_buffer_view packet);
+
+	// Worker that handles the segments of a TCP connection,
+	// unless its local port is pinned (see pinTcpPort()).
+	static Worker &forTcpConnection(const TcpConnectionKey &key);
+
+	// Reserves a local TCP or UDP port for the calling worker, so that incoming
+	// packets for that port are handled by it. For TCP, this only applies to
+	// SYNs that open new connections. Returns false if another worker
+	// already uses the port.
+	static bool claimPort(IpProto proto, uint16_t port);
+	static void releasePort(IpProto proto, uint16_t port);
+
+	// Steers all TCP segments for the local port to the calling worker. This is
+	// needed for connections whose 4-tuple hashes to another worker, i.e., if
+	// the socket was bound to a port explicitly. Returns false if another
+	// worker already pinned the port.
+	static bool pinTcpPort(uint16_t port);
+	static void unpinTcpPort(uint16_t port);
+
+	// Runs f on this worker. f may be move-only. Returns immediately
+	// (and runs f later) unless this is the calling thread's worker.
+	template<typename F>
+	void dispatch(F f) {
+		if(current_ == this) {
+			f();
+			return;
+		}
+		post_(new Task<F>{std::move(f)});
+	}
+
+	// Runs f on this worker after the caller returns, even if this is
+	// the calling thread's worker.
+	template<typename F>
+	void post(F f) {
+		post_(new Task<F>{std::move(f)});
+	}
+
+	// Runs f on every worker that owns a protocol stack.
+	template<typename F>
+	static void broadcast(F f) {
+		for(size_t i = 0; i < numShards(); i++)
+			shard(i).dispatch(f);
+	}
+
+private:
+	struct TaskBase {
+		virtual ~TaskBase() = default;
+		virtual void run() = 0;
+
+		TaskBase *next = nullptr;
+	};
+
+	template<typename F>
+	struct Task final : TaskBase {
+		Task(F f)
+		: f{std::move(f)} { }
+
+		void run() override {
+			f();
+		}
+
+		F f;
+	};
+
+	// Starts a thread that runs this worker.
+	void start_();
+
+	// Pushes a task onto the incoming stack and wakes up the worker if necessary.
+	void post_(TaskBase *task);
+
+	// Called on the worker's own thread after post_() submitted a nop.
+	void complete(helix::ElementHandle element) override;
+
+	static thread_local Worker *current_;
+
+	size_t index_ = 0;
+	// Queue of the worker's dispatcher. Other threads submit nops to it.
+	HelHandle queue_ = kHelNullHandle;
+
+	// Tasks that were posted by other threads, most recent first.
+	std::atomic<TaskBase *> incoming_{nullptr};
+	// Set while a nop is pending that will drain incoming_.
+	std::atomic<bool> notified_{false};
+};
+
+namespace worker_detail {
+	template<typename F>
+	async::result<void> runAndNotify(F &f, Worker *caller, async::oneshot_event *done) {
+		co_await f();
+		caller->dispatch([done] {
+			done->raise();
+		});
+	}
+} // namespace worker_detail
+
+// Runs the coroutine that f returns on the target worker and waits for it.
+// The caller resumes on its own worker.
+template<typename F>
+async::result<void> runOn(Worker &target, F f) {
+	auto &caller = Worker::current();
+	if(&target == &caller) {
+		co_await f();
+		co_return;
+	}
+
+	async::oneshot_event done;
+	target.dispatch([&f, caller = &caller, done = &done] {
+		async::detach(worker_detail::runAndNotify(f, caller, done));
+	});
+	co_await done.wait();
+}
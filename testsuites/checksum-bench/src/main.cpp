@@ -0,0 +1,170 @@
+#include <math.h>
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include "checksum.hpp"
+
+// Benchmarks the implementations of the Internet checksum that netserver uses.
+
+namespace {
+
+struct ThroughputBenchmark {
+	using clock = std::chrono::high_resolution_clock;
+
+	void launchRepetition() {
+		ref_ = clock::now();
+	}
+
+	bool isRepetitionDone() {
+		return elapsedNanos_() > 1'000'000'000;
+	}
+
+	void announceBytes(uint64_t bytes) {
+		auto mbPerSecond = bytes * 1000 / elapsedNanos_();
+		std::cout << "    " << mbPerSecond << " MB/s" << std::endl;
+		results_.push_back(mbPerSecond);
+	}
+
+	void finalizeStatistics() {
+		double avg = 0;
+		for(uint64_t n : results_)
+			avg += n;
+		avg /= results_.size();
+
+		double var = 0;
+		for(uint64_t n : results_)
+			var += (n - avg) * (n - avg);
+		var /= results_.size();
+
+		std::cout << "    avg: " << static_cast<uint64_t>(avg)
+				<< ", std: " << static_cast<uint64_t>(sqrt(var)) << std::endl;
+	}
+
+private:
+	uint64_t elapsedNanos_() {
+		return duration_cast<std::chrono::nanoseconds>(clock::now() - ref_).count();
+	}
+
+	std::vector<double> results_;
+	std::chrono::time_point<clock> ref_;
+};
+
+// Compares against the reference implementation, including unaligned buffers.
+bool verifyImplementation(const ChecksumImplementation &impl,
+		const std::vector<unsigned char> &buffer) {
+	auto &reference = checksumImplementations().back();
+	for(size_t offset = 0; offset < 8; offset++) {
+		for(size_t size = 0; size <= 1500; size += 2) {
+			auto p = buffer.data() + offset;
+			if(foldChecksumSum(impl.sum(p, size)) != foldChecksumSum(reference.sum(p, size))) {
+				std::cout << "checksum-bench: Implementation " << impl.name
+						<< " is broken (offset " << offset << ", size " << size << ")"
+						<< std::endl;
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+// Compares Checksum::adjust() against a full recomputation after rewriting
+// a 16-bit or a 32-bit field of random data.
+bool verifyAdjust(std::mt19937 &prng, const std::vector<unsigned char> &buffer) {
+	auto checksumOf = [] (const std::vector<unsigned char> &data) {
+		Checksum csum;
+		csum.update(data.data(), data.size());
+		return csum.finalize();
+	};
+	// All-zero and all-one words are the interesting cases of one's complement arithmetic.
+	auto randomWord = [&] () -> uint16_t {
+		switch(prng() % 4) {
+		case 0: return 0;
+		case 1: return 0xFFFF;
+		default: return prng();
+		}
+	};
+
+	for(int i = 0; i < 100'000; i++) {
+		size_t offset = prng() % 8;
+		size_t size = 20 + 2 * (prng() % 741);
+		std::vector<unsigned char> data(buffer.begin() + offset,
+				buffer.begin() + offset + size);
+		auto checksum = checksumOf(data);
+
+		// Fields are in network byte order at even offsets, like in IP and TCP headers.
+		auto at = 2 * (prng() % (size / 2));
+		uint16_t old16 = (data[at] << 8) | data[at + 1];
+		uint16_t new16 = randomWord();
+		data[at] = new16 >> 8;
+		data[at + 1] = new16;
+		if(Checksum::adjust(checksum, old16, new16) != checksumOf(data)) {
+			std::cout << "checksum-bench: Checksum::adjust() is broken for 16-bit fields"
+					<< " (" << old16 << " -> " << new16 << ")" << std::endl;
+			return false;
+		}
+		checksum = checksumOf(data);
+
+		at = 2 * (prng() % (size / 2 - 1));
+		uint32_t old32 = 0;
+		for(int k = 0; k < 4; k++)
+			old32 = (old32 << 8) | data[at + k];
+		uint32_t new32 = (uint32_t{randomWord()} << 16) | randomWord();
+		for(int k = 0; k < 4; k++)
+			data[at + k] = new32 >> (24 - 8 * k);
+		if(Checksum::adjust(checksum, old32, new32) != checksumOf(data)) {
+			std::cout << "checksum-bench: Checksum::adjust() is broken for 32-bit fields"
+					<< " (" << old32 << " -> " << new32 << ")" << std::endl;
+			return false;
+		}
+	}
+	return true;
+}
+
+void doChecksumBenchmark(const ChecksumImplementation &impl, size_t size,
+		const std::vector<unsigned char> &buffer) {
+	std::cout << "checksum (" << impl.name << ") over " << size << " bytes" << std::endl;
+
+	ThroughputBenchmark bench;
+	for(int k = 0; k < 5; ++k) {
+		uint64_t n = 0;
+		uint64_t sink = 0;
+		bench.launchRepetition();
+		while(!bench.isRepetitionDone()) {
+			for(int i = 0; i < 100; ++i) {
+				sink += impl.sum(buffer.data(), size);
+				++n;
+			}
+		}
+		asm volatile ("" : : "r"(sink));
+		bench.announceBytes(n * size);
+	}
+	bench.finalizeStatistics();
+}
+
+} // anonymous namespace
+
+int main() {
+	std::mt19937 prng;
+	std::vector<unsigned char> buffer(9000 + 8);
+	for(auto &byte : buffer)
+		byte = prng();
+
+	bool okay = verifyAdjust(prng, buffer);
+	for(auto &impl : checksumImplementations()) {
+		if(impl.isSupported && !impl.isSupported()) {
+			std::cout << "checksum-bench: Implementation " << impl.name
+					<< " is not supported" << std::endl;
+			continue;
+		}
+		if(!verifyImplementation(impl, buffer)) {
+			okay = false;
+			continue;
+		}
+
+		for(size_t size : {64, 576, 1500, 9000})
+			doChecksumBenchmark(impl, size, buffer);
+	}
+	return okay ? 0 : 1;
+}
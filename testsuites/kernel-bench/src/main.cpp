@@ -1,8 +1,11 @@
 #include <math.h>
+#include <string.h>
 
 #include <async/result.hpp>
 #include <async/algorithm.hpp>
+#include <fafnir/dsl.hpp>
 #include <helix/ipc.hpp>
+#include <protocols/kernlet/compiler.hpp>
 
 namespace {
 
@@ -245,6 +248,88 @@ async::result<void> doSendRecvBufferBenchmark(size_t size) {
 	bench.finalizeStatistics();
 }
 
+async::result<void> doKernletBenchmark() {
+	std::cout << "kernlet invocations (ring scan)" << std::endl;
+
+	co_await connectKernletCompiler();
+
+	// Same structure as a completion-reaping IRQ kernlet:
+	// scan the ring and trigger an event if entries are ready.
+	std::vector<uint8_t> kernlet_program;
+	fnr::emit_to(std::back_inserter(kernlet_program),
+		fnr::scope_push{} (
+			fnr::intrin{"__scan_ring", 2, 1} (
+				fnr::binding{0}, // Ring memory (bound to slot 0).
+				fnr::literal{0} // Offset of the HelKernletRing.
+			)
+		),
+		fnr::check_if{},
+			fnr::scope_get{0},
+		fnr::then{},
+			fnr::intrin{"__trigger_bitset", 2, 0} (
+				fnr::binding{1},
+				fnr::literal{1}
+			),
+			fnr::scope_push{} ( fnr::literal{1} ),
+		fnr::else_then{},
+			fnr::scope_push{} ( fnr::literal{2} ),
+		fnr::end{}
+	);
+
+	auto kernlet_object = co_await compile(kernlet_program.data(),
+			kernlet_program.size(), {BindType::memoryView, BindType::bitsetEvent});
+
+	// Set up a ring of 64 entries with 16 bytes each; 8 entries are ready.
+	HelHandle memory;
+	HEL_CHECK(helAllocateMemory(0x1000, 0, nullptr, &memory));
+	void *window;
+	HEL_CHECK(helMapMemory(memory, kHelNullHandle, nullptr, 0, 0x1000,
+			kHelMapProtRead | kHelMapProtWrite, &window));
+
+	HelKernletRing ring{};
+	ring.ringOffset = 0x100;
+	ring.entryShift = 4;
+	ring.sizeShift = 6;
+	ring.tagMask = 1;
+	ring.tagValue = 1;
+	ring.flags = kHelRingFlipTag;
+	memcpy(window, &ring, sizeof(HelKernletRing));
+	for(int i = 0; i < 8; ++i) {
+		uint32_t tag = 1;
+		memcpy(reinterpret_cast<char *>(window) + ring.ringOffset + (i << 4), &tag, 4);
+	}
+
+	HelHandle event;
+	HEL_CHECK(helCreateBitsetEvent(&event));
+
+	HelKernletData data[2];
+	data[0].handle = memory;
+	data[1].handle = event;
+	HelHandle bound;
+	HEL_CHECK(helBindKernlet(kernlet_object.getHandle(), data, 2, &bound));
+
+	std::vector<double> results;
+	for(int k = 0; k < 5; ++k) {
+		uint64_t cycles;
+		HEL_CHECK(helInvokeKernlet(bound, 100'000, &cycles));
+		auto perInvocation = cycles / 100'000.0;
+		std::cout << "    " << static_cast<uint64_t>(perInvocation)
+				<< " cycles per invocation" << std::endl;
+		results.push_back(perInvocation);
+	}
+
+	double avg = 0;
+	for(double n : results)
+		avg += n;
+	avg /= results.size();
+	std::cout << "    avg: " << static_cast<uint64_t>(avg) << " cycles" << std::endl;
+
+	HEL_CHECK(helCloseDescriptor(kHelThisUniverse, bound));
+	HEL_CHECK(helCloseDescriptor(kHelThisUniverse, event));
+	HEL_CHECK(helUnmapMemory(kHelNullHandle, window, 0x1000));
+	HEL_CHECK(helCloseDescriptor(kHelThisUniverse, memory));
+}
+
 } // anonymous namespace
 
 int main() {
@@ -262,4 +347,7 @@ int main() {
 	async::run(doSendRecvBufferBenchmark(16 * 1024), helix::currentDispatcher);
 	async::run(doSendRecvBufferBenchmark(64 * 1024), helix::currentDispatcher);
 	async::run(doSendRecvBufferBenchmark(1024 * 1024), helix::currentDispatcher);
+#ifdef __x86_64__ // kernletcc is only available on x86_64.
+	async::run(doKernletBenchmark(), helix::currentDispatcher);
+#endif
 }
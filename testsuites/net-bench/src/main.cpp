@@ -0,0 +1,375 @@
+#include <assert.h>
+#include <math.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <vector>
+
+// Measures the throughput of TCP and UDP and the rate at which TCP connections
+// are established over the loopback interface. Senders and receivers run in
+// separate processes; the receiver measures the rate and reports it to the
+// sender through a pipe.
+//
+// netserver only uses multiple threads if it is started with
+// netserver.workers=<n> on the kernel command line. The benchmark with parallel
+// TCP connections is meant to be compared with and without that option.
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+constexpr int numRepetitions = 5;
+constexpr auto repetitionDuration = std::chrono::seconds(1);
+
+constexpr uint16_t tcpPort = 5001;
+constexpr uint16_t udpPort = 5002;
+constexpr uint16_t acceptPort = 5003;
+constexpr uint16_t parallelTcpPort = 5004;
+
+constexpr int numParallelConnections = 4;
+
+constexpr size_t tcpChunkSize = 64 * 1024;
+// Fits into a single ethernet frame, like typical UDP payloads do.
+constexpr size_t udpDatagramSize = 1472;
+
+struct RateBenchmark {
+	// Rates are reported as items / scale per second.
+	RateBenchmark(const char *items, const char *unit, double scale)
+	: items_{items}, unit_{unit}, scale_{scale} { }
+
+	void announceRate(uint64_t count, Clock::duration elapsed) {
+		auto nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+		double rate = count / (nanos / 1e9) / scale_;
+		std::cout << "    " << count << " " << items_ << " in " << nanos / 1000 << " us, "
+				<< static_cast<uint64_t>(rate) << " " << unit_ << std::endl;
+		results_.push_back(rate);
+	}
+
+	void finalizeStatistics() {
+		double avg = 0;
+		for(double n : results_)
+			avg += n;
+		avg /= results_.size();
+
+		double var = 0;
+		for(double n : results_)
+			var += (n - avg) * (n - avg);
+		var /= results_.size();
+
+		std::cout << "    avg: " << static_cast<uint64_t>(avg) << " " << unit_
+				<< ", std: " << static_cast<uint64_t>(sqrt(var)) << " " << unit_ << std::endl;
+	}
+
+private:
+	const char *items_;
+	const char *unit_;
+	double scale_;
+	std::vector<double> results_;
+};
+
+RateBenchmark throughputBenchmark() {
+	return RateBenchmark{"bytes", "MiB/s", 1024 * 1024};
+}
+
+struct Report {
+	// Bytes or connections.
+	uint64_t count;
+	int64_t nanos;
+};
+
+sockaddr_in loopbackAddress(uint16_t port) {
+	sockaddr_in sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(port);
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	return sa;
+}
+
+void writeAll(int fd, const void *data, size_t size) {
+	auto p = reinterpret_cast<const char *>(data);
+	while(size) {
+		auto n = write(fd, p, size);
+		assert(n > 0);
+		p += n;
+		size -= n;
+	}
+}
+
+void readAll(int fd, void *data, size_t size) {
+	auto p = reinterpret_cast<char *>(data);
+	while(size) {
+		auto n = read(fd, p, size);
+		assert(n > 0);
+		p += n;
+		size -= n;
+	}
+}
+
+// Forks a receiver process that runs receive(report) and writes the report to a pipe.
+template<typename F>
+pid_t forkReceiver(int &reportFd, F receive) {
+	int fds[2];
+	int e = pipe(fds);
+	assert(!e);
+
+	auto pid = fork();
+	assert(pid >= 0);
+	if(!pid) {
+		close(fds[0]);
+		Report report{};
+		receive(report);
+		writeAll(fds[1], &report, sizeof(report));
+		_exit(0);
+	}
+
+	close(fds[1]);
+	reportFd = fds[0];
+	return pid;
+}
+
+Report collectReport(pid_t pid, int reportFd) {
+	Report report;
+	readAll(reportFd, &report, sizeof(report));
+	close(reportFd);
+
+	int status;
+	auto e = waitpid(pid, &status, 0);
+	assert(e == pid);
+	assert(WIFEXITED(status) && !WEXITSTATUS(status));
+	return report;
+}
+
+// Accepts a connection and reads from it until EOF.
+void receiveStream(int listenFd, std::vector<char> &buffer, Report &report) {
+	int fd = accept(listenFd, nullptr, nullptr);
+	assert(fd >= 0);
+
+	auto start = Clock::now();
+	while(true) {
+		auto n = read(fd, buffer.data(), buffer.size());
+		assert(n >= 0);
+		if(!n)
+			break;
+		report.count += n;
+	}
+	report.nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(
+			Clock::now() - start).count();
+	close(fd);
+}
+
+// Connects to sa and writes to the connection for one repetition.
+void sendStream(const sockaddr_in &sa, std::vector<char> &buffer) {
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	assert(fd >= 0);
+	int e = connect(fd, reinterpret_cast<const sockaddr *>(&sa), sizeof(sa));
+	assert(!e);
+
+	auto start = Clock::now();
+	while(Clock::now() - start < repetitionDuration)
+		writeAll(fd, buffer.data(), buffer.size());
+	close(fd);
+}
+
+void doTcpBenchmark() {
+	std::cout << "tcp throughput" << std::endl;
+
+	int listenFd = socket(AF_INET, SOCK_STREAM, 0);
+	assert(listenFd >= 0);
+	auto sa = loopbackAddress(tcpPort);
+	int e = bind(listenFd, reinterpret_cast<sockaddr *>(&sa), sizeof(sa));
+	assert(!e);
+	e = listen(listenFd, 1);
+	assert(!e);
+
+	std::vector<char> buffer(tcpChunkSize, 0x5A);
+	auto bench = throughputBenchmark();
+	for(int k = 0; k < numRepetitions; ++k) {
+		int reportFd;
+		auto pid = forkReceiver(reportFd, [&] (Report &report) {
+			receiveStream(listenFd, buffer, report);
+		});
+
+		sendStream(sa, buffer);
+
+		auto report = collectReport(pid, reportFd);
+		bench.announceRate(report.count, std::chrono::nanoseconds(report.nanos));
+	}
+	bench.finalizeStatistics();
+	close(listenFd);
+}
+
+void doParallelTcpBenchmark() {
+	std::cout << "tcp throughput (" << numParallelConnections << " connections)" << std::endl;
+
+	int listenFd = socket(AF_INET, SOCK_STREAM, 0);
+	assert(listenFd >= 0);
+	auto sa = loopbackAddress(parallelTcpPort);
+	int e = bind(listenFd, reinterpret_cast<sockaddr *>(&sa), sizeof(sa));
+	assert(!e);
+	e = listen(listenFd, numParallelConnections);
+	assert(!e);
+
+	std::vector<char> buffer(tcpChunkSize, 0x5A);
+	auto bench = throughputBenchmark();
+	for(int k = 0; k < numRepetitions; ++k) {
+		std::vector<std::pair<pid_t, int>> receivers;
+		for(int i = 0; i < numParallelConnections; ++i) {
+			int reportFd;
+			auto pid = forkReceiver(reportFd, [&] (Report &report) {
+				receiveStream(listenFd, buffer, report);
+			});
+			receivers.push_back({pid, reportFd});
+		}
+
+		std::vector<pid_t> senders;
+		for(int i = 0; i < numParallelConnections; ++i) {
+			auto pid = fork();
+			assert(pid >= 0);
+			if(!pid) {
+				sendStream(sa, buffer);
+				_exit(0);
+			}
+			senders.push_back(pid);
+		}
+
+		// The connections run concurrently; the slowest one determines the duration.
+		Report total{};
+		for(auto [pid, reportFd] : receivers) {
+			auto report = collectReport(pid, reportFd);
+			total.count += report.count;
+			total.nanos = std::max(total.nanos, report.nanos);
+		}
+		for(auto pid : senders) {
+			int status;
+			e = waitpid(pid, &status, 0);
+			assert(e == pid);
+			assert(WIFEXITED(status) && !WEXITSTATUS(status));
+		}
+
+		bench.announceRate(total.count, std::chrono::nanoseconds(total.nanos));
+	}
+	bench.finalizeStatistics();
+	close(listenFd);
+}
+
+void doUdpBenchmark() {
+	std::cout << "udp throughput" << std::endl;
+
+	// The loopback interface does not drop datagrams, so the receiver can rely on
+	// seeing the (shorter) datagram that ends each repetition.
+	int receiveFd = socket(AF_INET, SOCK_DGRAM, 0);
+	assert(receiveFd >= 0);
+	auto sa = loopbackAddress(udpPort);
+	int e = bind(receiveFd, reinterpret_cast<sockaddr *>(&sa), sizeof(sa));
+	assert(!e);
+
+	int fd = socket(AF_INET, SOCK_DGRAM, 0);
+	assert(fd >= 0);
+
+	std::vector<char> buffer(udpDatagramSize, 0x5A);
+	auto bench = throughputBenchmark();
+	for(int k = 0; k < numRepetitions; ++k) {
+		int reportFd;
+		auto pid = forkReceiver(reportFd, [&] (Report &report) {
+			auto start = Clock::now();
+			while(true) {
+				auto n = recv(receiveFd, buffer.data(), buffer.size(), 0);
+				assert(n > 0);
+				if(static_cast<size_t>(n) < udpDatagramSize)
+					break;
+				report.count += n;
+			}
+			report.nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(
+					Clock::now() - start).count();
+		});
+
+		auto start = Clock::now();
+		while(Clock::now() - start < repetitionDuration) {
+			auto n = sendto(fd, buffer.data(), buffer.size(), 0,
+					reinterpret_cast<sockaddr *>(&sa), sizeof(sa));
+			assert(n == static_cast<ssize_t>(buffer.size()));
+		}
+		auto n = sendto(fd, buffer.data(), 1, 0,
+				reinterpret_cast<sockaddr *>(&sa), sizeof(sa));
+		assert(n == 1);
+
+		auto report = collectReport(pid, reportFd);
+		bench.announceRate(report.count, std::chrono::nanoseconds(report.nanos));
+	}
+	bench.finalizeStatistics();
+	close(fd);
+	close(receiveFd);
+}
+
+void doAcceptBenchmark() {
+	std::cout << "tcp connection rate" << std::endl;
+
+	int listenFd = socket(AF_INET, SOCK_STREAM, 0);
+	assert(listenFd >= 0);
+	auto sa = loopbackAddress(acceptPort);
+	int e = bind(listenFd, reinterpret_cast<sockaddr *>(&sa), sizeof(sa));
+	assert(!e);
+	e = listen(listenFd, 128);
+	assert(!e);
+
+	RateBenchmark bench{"connections", "connections/s", 1};
+	for(int k = 0; k < numRepetitions; ++k) {
+		// The client closes each connection without sending data, except for the
+		// last one, which carries a single byte. Hence, the receiver also waits
+		// for the FIN of each connection.
+		int reportFd;
+		auto pid = forkReceiver(reportFd, [&] (Report &report) {
+			auto start = Clock::now();
+			while(true) {
+				int fd = accept(listenFd, nullptr, nullptr);
+				assert(fd >= 0);
+				char c;
+				auto n = read(fd, &c, 1);
+				assert(n >= 0);
+				close(fd);
+				if(n)
+					break;
+				report.count++;
+			}
+			report.nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(
+					Clock::now() - start).count();
+		});
+
+		auto start = Clock::now();
+		while(Clock::now() - start < repetitionDuration) {
+			int fd = socket(AF_INET, SOCK_STREAM, 0);
+			assert(fd >= 0);
+			e = connect(fd, reinterpret_cast<sockaddr *>(&sa), sizeof(sa));
+			assert(!e);
+			close(fd);
+		}
+
+		int fd = socket(AF_INET, SOCK_STREAM, 0);
+		assert(fd >= 0);
+		e = connect(fd, reinterpret_cast<sockaddr *>(&sa), sizeof(sa));
+		assert(!e);
+		writeAll(fd, "x", 1);
+		close(fd);
+
+		auto report = collectReport(pid, reportFd);
+		bench.announceRate(report.count, std::chrono::nanoseconds(report.nanos));
+	}
+	bench.finalizeStatistics();
+	close(listenFd);
+}
+
+} // anonymous namespace
+
+int main() {
+	doTcpBenchmark();
+	doParallelTcpBenchmark();
+	doUdpBenchmark();
+	doAcceptBenchmark();
+}
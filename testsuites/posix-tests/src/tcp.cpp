@@ -0,0 +1,83 @@
+#include <arpa/inet.h>
+#include <cassert>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "testsuite.hpp"
+
+namespace {
+	constexpr size_t transferSize = 1 << 20;
+
+	char patternAt(size_t offset) {
+		return static_cast<char>((offset * 7) ^ (offset >> 11));
+	}
+} // anonymous namespace
+
+// To exercise retransmission, boot with netserver.loopback_loss=<n> on the kernel
+// command line; netserver then drops every n-th TCP segment on the loopback link
+// (data segments, ACKs and FINs alike). Without it, this is a plain bulk transfer.
+DEFINE_TEST(tcp_loopback_loss, ([] {
+	sockaddr_in addr{};
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(5010);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	int listener = socket(AF_INET, SOCK_STREAM, 0);
+	assert_errno("socket", listener >= 0);
+	int e = bind(listener, reinterpret_cast<sockaddr *>(&addr), sizeof(addr));
+	assert_errno("bind", !e);
+	e = listen(listener, 1);
+	assert_errno("listen", !e);
+
+	pid_t pid = fork();
+	assert_errno("fork", pid >= 0);
+	if(!pid) {
+		close(listener);
+
+		int fd = socket(AF_INET, SOCK_STREAM, 0);
+		assert_errno("socket", fd >= 0);
+		e = connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr));
+		assert_errno("connect", !e);
+
+		char buffer[4096];
+		size_t progress = 0;
+		while(progress < transferSize) {
+			for(size_t i = 0; i < sizeof(buffer); i++)
+				buffer[i] = patternAt(progress + i);
+			ssize_t chunk = write(fd, buffer, sizeof(buffer));
+			assert_errno("write", chunk > 0);
+			progress += chunk;
+		}
+		close(fd);
+		_exit(0);
+	}
+
+	int conn = accept(listener, nullptr, nullptr);
+	assert_errno("accept", conn >= 0);
+
+	// All data must arrive in order, followed by EOF.
+	char buffer[4096];
+	size_t progress = 0;
+	while(true) {
+		ssize_t chunk = read(conn, buffer, sizeof(buffer));
+		assert_errno("read", chunk >= 0);
+		if(!chunk)
+			break;
+		for(ssize_t i = 0; i < chunk; i++)
+			assert(buffer[i] == patternAt(progress + i));
+		progress += chunk;
+	}
+	assert(progress == transferSize);
+
+	close(conn);
+	close(listener);
+
+	int status;
+	while(waitpid(pid, &status, 0) == -1) {
+		if(errno != EINTR)
+			assert_errno("waitpid", false);
+	}
+	assert(WIFEXITED(status) && !WEXITSTATUS(status));
+}))